@@ -0,0 +1,2650 @@
+
+// Benchmarks for the code in 'Common'.
+//
+// It times loading, saving, allocating, plotting, drawing, compositing,
+// converting, quantizing, scaling, building pyramids and streaming frames.
+// The bytes Example 4 presents per frame come from 'headless -c' instead.
+// This program doesn't need 'windows.h', so it runs on the build machines
+// as well:
+//
+//   g++ -O2 -std=c++11 -pthread main.cpp -o benchmark
+//   ./benchmark -o results.json
+//
+// Usage: benchmark [-m max megapixels] [-t min milliseconds per case]
+//                  [-i min iterations] [-j threads] [-g clock GHz]
+//                  [-r resource dir] [-d temp dir] [-o output file]
+//                  [filter]
+//
+// Only the cases whose name contains 'filter' are run, "convert/" or
+// "/2048x2048" for example. Synthetic images go from 512x512 up to
+// 8192x8192 (64 megapixels), '-m' leaves out the bigger ones.
+//
+// Every case is run once to warm up and then until it has had at least
+// '-t' milliseconds and '-i' iterations. Each iteration is timed on its
+// own, so besides the median (p50) we also get the 99th percentile (p99),
+// which is what shows page faults, the pool going to the operating system
+// and threads being late. The results are written as JSON:
+//
+//   ns_per_pixel   p50 divided by the number of pixels in one iteration
+//   mpix_per_s     pixels per iteration over p50, the fill rate
+//   gb_per_s       bytes read plus bytes written per iteration, over p50
+//   px_per_cycle   pixels per iteration over the clock cycles in p50
+//
+// The cycles come from the time stamp counter, measured against the clock
+// once at startup. On recent processors that counter ticks at the nominal
+// clock whatever the cores are really running at, so with turbo on a
+// pixel takes fewer real cycles than it says. '-g' gives the clock to use
+// instead, and is the only way to get px_per_cycle on anything but x86.
+//
+// Cases that have a SIMD path are run twice, once as the processor allows
+// ("simd") and once with 'SetCPUFeatureMask(0)' ("c"). Compositing calls
+// the first "avx2" and adds "sse41", with AVX2 masked out. The compression
+// cases also write "ratio", compressed size over uncompressed size.
+//
+// The scale cases run with 1, 2, 4 and so on threads up to '-j' ("pool-N"),
+// to show how well the tiled scaler (scale.h) spreads over the cores.
+//
+// The alloc/churn cases keep 64 DIBs of random sizes and depths alive and
+// replace one of them every iteration, so p50 and p99 are the latency of
+// a free and a create. They also write how much memory is resident on
+// top of what was before the case started: the highest seen
+// ("rss_peak_mb"), at the end ("rss_steady_mb") and once all 64 are freed
+// again ("rss_freed_mb"), which is what the pools hold on to. "live_mb" is
+// the size of the 64 DIBs at the end, for comparison.
+//
+// The startup cases time how long it takes before the first frame can be
+// drawn: every asset loaded in the display format and a few of them drawn,
+// once from separate bitmap files and once from a pack (bmppack.h). Both
+// read from the page cache, so this is parsing, converting and faulting
+// pages in, not the disk.
+//
+// The batchload cases load a directory full of small sprites with
+// 'LoadBitmapBatch' (bmpbatch.h): one file after the other with plain
+// reads ("sequential"), the same on the thread pool ("pool-N") and through
+// io_uring ("uring"). They also write "files_per_s" and the system calls
+// made per file, "syscalls_per_file". Like the startup cases they read
+// from the page cache.
+//
+// The bitfields cases unpack bitmaps with channel masks none of our
+// formats has (bitfields.h) to XRGB, a scanline at a time. Each layout
+// with an unpacker of its own is run with it ("kernel") and with the
+// table driven unpacker ("generic"), which is all the others get.
+//
+// The region cases decode a 1920x1080 viewport out of the middle of ever
+// bigger bitmap files (bmpregion.h), once pixel for pixel ("step-1") and
+// once every fourth pixel of a four times bigger rectangle ("step-4").
+// The time should stay the same however big the file gets. The files are
+// written a scanline at a time, so '-m' doesn't apply to them.
+//
+// The pyramid cases build every level of a pyramid (pyramid.h), with the
+// box and the Lanczos filter, timed per pixel of the image. The view cases
+// then draw the whole image at a sixth of its size: "direct" scales all of
+// it with the box filter, "pyramid" copies level 2 out of the pyramid and
+// scales that from a quarter down to a sixth.
+//
+// The framestream cases encode and decode 1080p frames for a viewer
+// (framestream.h), every one a change from the last in 1024 or 65536
+// random pixels. "encode" compares every tile, "encode-dirty" only those
+// in the dirty rectangles, which for pixels all over the frame is about
+// the same. "ratio" is the size of a frame in the stream over the size
+// of the frame.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "../Common/bitfields.h"
+#include "../Common/bmpbatch.h"
+#include "../Common/bmpcache.h"
+#include "../Common/bmpmap.h"
+#include "../Common/bmppack.h"
+#include "../Common/bmpregion.h"
+#include "../Common/bmpwrite.h"
+#include "../Common/composite.h"
+#include "../Common/dib.h"
+#include "../Common/convert.h"
+#include "../Common/dirty.h"
+#include "../Common/framestream.h"
+#include "../Common/plot.h"
+#include "../Common/pyramid.h"
+#include "../Common/quantize.h"
+#include "../Common/raster.h"
+#include "../Common/rle.h"
+#include "../Common/scale.h"
+#include "../Common/threadpool.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#define	BENCH_TEMP		"."
+#else
+#include <unistd.h>
+#define	BENCH_TEMP		"/tmp"
+#endif
+
+// Number of random pixels plotted per iteration of the plot cases.
+#define	PLOT_PIXELS		(1 << 20)
+
+// Batch size for the 'PutPixels' cases, the same as Example 4 uses.
+#define	PLOT_BATCH		64
+
+// Random spans and lines drawn per iteration of the raster cases.
+#define	RASTER_SHAPES	4096
+
+// Dirty rectangles passed to the frame encoder, as many as Example 4 has.
+#define	MAX_STREAM_RECTS	32
+
+typedef struct tagBENCHOPTIONS {
+	double			dMaxMP;
+	double			dMinMs;
+	int				cMinIterations;
+	int				cThreads;
+	double			dCyclesPerNs;	// 0 if we don't know the clock
+	const char*		lpszResources;
+	const char*		lpszTemp;
+	const char*		lpszOutput;
+	const char*		lpszFilter;
+} BENCHOPTIONS;
+
+typedef struct tagBENCHRESULT {
+	char			szName[96];
+	int				cx;
+	int				cy;
+	long long		cPixels;
+	long long		cbBytes;
+	int				cIterations;
+	double			dP50;
+	double			dP99;
+	double			dMin;
+	double			dMean;
+	double			dRatio;
+	long long		cFiles;			// For the cases that load files
+	double			dSyscalls;		// Per file
+	long long		cbLive;			// For the churn cases, bytes of DIBs alive
+	long long		cbPeakRSS;		// and resident bytes on top of what there was before
+	long long		cbSteadyRSS;
+	long long		cbFreedRSS;
+} BENCHRESULT;
+
+// One iteration of a case.
+typedef void (*LPBENCHPROC)(void* lpParam);
+
+static BENCHOPTIONS g_Options;
+static std::vector<BENCHRESULT> g_Results;
+static CThreadPool* g_lpPool;
+
+static double GetTimeNs()
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Bytes of the process that are in memory right now, 0 if we can't tell.
+static long long GetResidentBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+
+	if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return (long long)counters.WorkingSetSize;
+	}
+
+	return 0;
+#else
+	FILE* fp = fopen("/proc/self/statm", "r");
+	long long cPages = 0, cResident = 0;
+
+	if(!fp) {
+		return 0;
+	}
+
+	if(fscanf(fp, "%lld %lld", &cPages, &cResident) != 2) {
+		cResident = 0;
+	}
+
+	fclose(fp);
+
+	return cResident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Ticks of the time stamp counter per nanosecond, counted over a tenth of
+// a second. Returns 0 where there is no such counter.
+static double MeasureCyclesPerNs()
+{
+#ifdef CPU_X86
+	double dStart = GetTimeNs(), dEnd;
+	unsigned long long cStart = __rdtsc();
+
+	while((dEnd = GetTimeNs()) - dStart < 100e6) {
+	}
+
+	return (double)(__rdtsc() - cStart) / (dEnd - dStart);
+#else
+	return 0.0;
+#endif
+}
+
+// 'p' percent of the sorted samples are at or below the value returned,
+// nearest rank. With fewer than 100 samples p99 is simply the slowest.
+static double GetPercentile(const std::vector<double>& samples, double p)
+{
+	size_t i = (size_t)(p / 100.0 * samples.size() + 0.5);
+
+	if(i > 0) {
+		i--;
+	}
+
+	return samples[std::min(i, samples.size() - 1)];
+}
+
+static BOOL IsSelected(const char* lpszName)
+{
+	return !g_Options.lpszFilter || strstr(lpszName, g_Options.lpszFilter) != NULL;
+}
+
+// Times 'lpfnBench' and adds the result to the list. 'cPixels' and
+// 'cbBytes' are what one iteration processes. Returns FALSE if the case
+// isn't selected.
+static BOOL RunBenchmark(const char* lpszName, int cx, int cy, long long cPixels, long long cbBytes, LPBENCHPROC lpfnBench, void* lpParam)
+{
+	std::vector<double> samples;
+	BENCHRESULT result;
+	double dStart, dTotal = 0.0;
+
+	if(!IsSelected(lpszName)) {
+		return FALSE;
+	}
+
+	lpfnBench(lpParam);
+
+	dStart = GetTimeNs();
+
+	while((int)samples.size() < g_Options.cMinIterations || GetTimeNs() - dStart < g_Options.dMinMs * 1e6) {
+		double t0 = GetTimeNs();
+
+		lpfnBench(lpParam);
+		samples.push_back(GetTimeNs() - t0);
+		dTotal += samples.back();
+	}
+
+	std::sort(samples.begin(), samples.end());
+
+	ZeroMemory(&result, sizeof(result));
+	snprintf(result.szName, sizeof(result.szName), "%s", lpszName);
+	result.cx = cx;
+	result.cy = cy;
+	result.cPixels = cPixels;
+	result.cbBytes = cbBytes;
+	result.cIterations = (int)samples.size();
+	result.dP50 = GetPercentile(samples, 50.0);
+	result.dP99 = GetPercentile(samples, 99.0);
+	result.dMin = samples[0];
+	result.dMean = dTotal / samples.size();
+
+	g_Results.push_back(result);
+
+	fprintf(stderr, "%-44s %8d its  p50 %12.0f ns  p99 %12.0f ns  %8.3f ns/px  %7.2f GB/s", lpszName, result.cIterations, result.dP50, result.dP99, result.dP50 / cPixels, cbBytes / result.dP50);
+
+	if(g_Options.dCyclesPerNs > 0.0) {
+		fprintf(stderr, "  %7.3f px/cycle", cPixels / (result.dP50 * g_Options.dCyclesPerNs));
+	}
+
+	fprintf(stderr, "\n");
+
+	return TRUE;
+}
+
+static const char* GetFormatName(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return "INDEX8";
+	case DIBFMT_RGB555:	return "RGB555";
+	case DIBFMT_RGB565:	return "RGB565";
+	case DIBFMT_BGR24:	return "BGR24";
+	case DIBFMT_XRGB32:	return "XRGB32";
+	}
+
+	return "UNKNOWN";
+}
+
+static int GetFormatBpp(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return 8;
+	case DIBFMT_RGB555:	return 15;
+	case DIBFMT_RGB565:	return 16;
+	case DIBFMT_BGR24:	return 24;
+	case DIBFMT_XRGB32:	return 32;
+	}
+
+	return 0;
+}
+
+static long long GetSurfaceBytes(const DIBSURFACE* lpSurface)
+{
+	return (long long)lpSurface->cx * lpSurface->cy * GetDIBFormatBytes(lpSurface->iFormat);
+}
+
+// Fills a surface with something that looks like a photo to the code
+// under test: gradients with a bit of noise, so nothing is all zeroes
+// and no two scanlines are the same.
+static BOOL CreateTestSurface(LPDIBSURFACE lpSurface, int cx, int cy, int iFormat)
+{
+	DIBSURFACE xrgb;
+	unsigned uSeed = 12345;
+
+	if(!CreateDIBSurface(&xrgb, cx, cy, 32, DIBALLOC_NOZERO)) {
+		return FALSE;
+	}
+
+	for(int y = 0; y < cy; y++) {
+		DWORD* pRow = (DWORD*)(xrgb.pTop + (size_t)y * xrgb.iPitch);
+
+		for(int x = 0; x < cx; x++) {
+			uSeed = uSeed * 1103515245 + 12345;
+
+			BYTE r = (BYTE)(x * 255 / cx + (uSeed >> 28));
+			BYTE g = (BYTE)(y * 255 / cy + (uSeed >> 24 & 15));
+			BYTE b = (BYTE)((x ^ y) + (uSeed >> 20 & 15));
+
+			pRow[x] = (r << 16) | (g << 8) | b;
+		}
+	}
+
+	if(iFormat == DIBFMT_XRGB32) {
+		*lpSurface = xrgb;
+		return TRUE;
+	}
+
+	if(!CreateDIBSurface(lpSurface, cx, cy, GetFormatBpp(iFormat), DIBALLOC_NOZERO)) {
+		FreeDIBSurface(&xrgb);
+		return FALSE;
+	}
+
+	ConvertDIBSurface(lpSurface, &xrgb);
+	FreeDIBSurface(&xrgb);
+
+	return TRUE;
+}
+
+//
+// Loading and saving.
+//
+
+typedef struct tagLOADBENCH {
+	char			szFilename[512];
+	DIBSURFACE		dst;
+	DIBSURFACE		rle;
+} LOADBENCH;
+
+// The headers inside the mapping are only 2-byte aligned, so the format
+// is worked out from the copies the view keeps.
+static int GetViewFormat(const BITMAPVIEW* lpView)
+{
+	struct {
+		BITMAPINFOHEADER	bih;
+		DWORD				dwMasks[3];
+	} info;
+
+	info.bih = lpView->bih;
+	memcpy(info.dwMasks, lpView->dwMasks, sizeof(info.dwMasks));
+
+	return GetDIBFormat((const BITMAPINFO*)&info);
+}
+
+// Maps the file, converts it to XRGB one scanline at a time and unmaps it
+// again. After the first iteration the file is in the page cache, so this
+// measures parsing and converting, not the disk. RLE bitmaps are decoded
+// into an 8bpp surface first.
+static void LoadBench(void* lpParam)
+{
+	LOADBENCH* lpLoad = (LOADBENCH*)lpParam;
+	BITMAPVIEW view;
+	CONVERTPROCS procs;
+	DWORD palette[256];
+
+	if(!MapBitmapFile(lpLoad->szFilename, &view)) {
+		return;
+	}
+
+	ZeroMemory(palette, sizeof(palette));
+
+	for(int i = 0; i < view.iColors && i < 256; i++) {
+		palette[i] = (view.lpPalette[i].rgbRed << 16) | (view.lpPalette[i].rgbGreen << 8) | view.lpPalette[i].rgbBlue;
+	}
+
+	if(view.bih.biCompression == BI_RLE8 || view.bih.biCompression == BI_RLE4) {
+		if(DecodeRLEBitmap(&view, &lpLoad->rle) && GetConvertProcs(DIBFMT_XRGB32, DIBFMT_INDEX8, &procs)) {
+			for(int y = 0; y < view.cy; y++) {
+				ConvertScanline(&procs, lpLoad->dst.pTop + (size_t)y * lpLoad->dst.iPitch, lpLoad->rle.pTop + (size_t)y * lpLoad->rle.iPitch, view.cx, palette);
+			}
+		}
+	}
+	else if(GetConvertProcs(DIBFMT_XRGB32, GetViewFormat(&view), &procs)) {
+		for(int y = 0; y < view.cy; y++) {
+			ConvertScanline(&procs, lpLoad->dst.pTop + (size_t)y * lpLoad->dst.iPitch, GetViewScanline(&view, y), view.cx, palette);
+		}
+	}
+
+	UnmapBitmapFile(&view);
+}
+
+static void RunLoadBenchmark(const char* lpszName, const char* lpszFilename)
+{
+	LOADBENCH load;
+	BITMAPVIEW view;
+
+	snprintf(load.szFilename, sizeof(load.szFilename), "%s", lpszFilename);
+
+	if(!MapBitmapFile(lpszFilename, &view)) {
+		fprintf(stderr, "Error loading %s\n", lpszFilename);
+		return;
+	}
+
+	ZeroMemory(&load.rle, sizeof(load.rle));
+
+	if(!CreateDIBSurface(&load.dst, view.cx, view.cy, 32)) {
+		UnmapBitmapFile(&view);
+		return;
+	}
+
+	if((view.bih.biCompression == BI_RLE8 || view.bih.biCompression == BI_RLE4) && !CreateDIBSurface(&load.rle, view.cx, view.cy, 8)) {
+		FreeDIBSurface(&load.dst);
+		UnmapBitmapFile(&view);
+		return;
+	}
+
+	RunBenchmark(lpszName, view.cx, view.cy, (long long)view.cx * view.cy, (long long)view.cbFile + GetSurfaceBytes(&load.dst), LoadBench, &load);
+
+	UnmapBitmapFile(&view);
+	FreeDIBSurface(&load.dst);
+
+	if(load.rle.lpBmi) {
+		FreeDIBSurface(&load.rle);
+	}
+}
+
+typedef struct tagSAVEBENCH {
+	char			szFilename[512];
+	LPDIBSURFACE	lpSurface;
+} SAVEBENCH;
+
+static void SaveBench(void* lpParam)
+{
+	SAVEBENCH* lpSave = (SAVEBENCH*)lpParam;
+
+	WriteBitmapFile(lpSave->szFilename, lpSave->lpSurface->lpBmi, lpSave->lpSurface->pBits);
+}
+
+//
+// The bitmap cache.
+//
+
+#define	CACHE_COLD		0	// Flushed every time, so every load decodes
+#define	CACHE_IDENTITY	1	// Found by the identity of the file
+#define	CACHE_CONTENT	2	// Found by a hash of the contents
+
+typedef struct tagCACHEBENCH {
+	char			szFilename[512];
+	CBitmapCache*	lpCache;
+	int				iCase;
+} CACHEBENCH;
+
+static void CacheBench(void* lpParam)
+{
+	CACHEBENCH* lpBench = (CACHEBENCH*)lpParam;
+	const DIBSURFACE* lpSurface;
+
+	if(lpBench->iCase == CACHE_COLD) {
+		lpBench->lpCache->Flush();
+	}
+
+	if((lpSurface = LoadCachedBitmap(lpBench->lpCache, lpBench->szFilename, DIBFMT_XRGB32, lpBench->iCase == CACHE_CONTENT)) != NULL) {
+		lpBench->lpCache->Release(lpSurface);
+	}
+}
+
+//
+// Batches of small files.
+//
+
+// Sprites in the directory, and how big they are.
+#define	BATCH_FILES		4096
+#define	BATCH_SIZE		64
+
+typedef struct tagBATCHBENCH {
+	std::vector<LPCSTR>	lpszFiles;
+	CThreadPool*		lpPool;
+	DWORD				dwFlags;
+	BATCHSTATS			stats;			// Of the last iteration
+} BATCHBENCH;
+
+static void BatchLoaded(int, LPDIBSURFACE lpSurface, void*)
+{
+	if(lpSurface) {
+		FreeDIBSurface(lpSurface);
+	}
+}
+
+static void BatchBench(void* lpParam)
+{
+	BATCHBENCH* lpBatch = (BATCHBENCH*)lpParam;
+
+	LoadBitmapBatch(lpBatch->lpszFiles.data(), (int)lpBatch->lpszFiles.size(), DIBFMT_XRGB32, BatchLoaded, NULL, lpBatch->lpPool, lpBatch->dwFlags, &lpBatch->stats);
+}
+
+//
+// Startup: loading the assets for the first frame.
+//
+
+// Assets a program loads before its first frame, and how big they are.
+#define	STARTUP_ASSETS	1000
+#define	STARTUP_SIZE	128
+
+// Of those, the ones the first frame draws.
+#define	STARTUP_DRAWN	16
+
+typedef struct tagSTARTUPBENCH {
+	char						szPack[512];
+	std::vector<std::string>	files;
+	std::vector<std::string>	names;		// Of the files, and in the pack
+	DIBSURFACE					frame;		// 1920x1080, what the first frame is drawn on
+} STARTUPBENCH;
+
+static void DrawFirstFrame(STARTUPBENCH* lpStartup, const DIBSURFACE* lpAssets)
+{
+	for(int i = 0; i < STARTUP_DRAWN; i++) {
+		BlitDIB(&lpStartup->frame, (i % 8) * (STARTUP_SIZE + 8), (i / 8) * (STARTUP_SIZE + 8), &lpAssets[i * (STARTUP_ASSETS / STARTUP_DRAWN)], NULL);
+	}
+}
+
+// Every file mapped, parsed and converted to the display format.
+static void StartupBitmapBench(void* lpParam)
+{
+	STARTUPBENCH* lpStartup = (STARTUPBENCH*)lpParam;
+	std::vector<DIBSURFACE> assets(STARTUP_ASSETS);
+
+	for(int i = 0; i < STARTUP_ASSETS; i++) {
+		BITMAPVIEW view;
+
+		if(!MapBitmapFile(lpStartup->files[i].c_str(), &view)) {
+			return;
+		}
+
+		CreateViewDIBSurface(&view, &assets[i], DIBFMT_XRGB32);
+		UnmapBitmapFile(&view);
+	}
+
+	DrawFirstFrame(lpStartup, assets.data());
+
+	for(int i = 0; i < STARTUP_ASSETS; i++) {
+		FreeDIBSurface(&assets[i]);
+	}
+}
+
+// The pack mapped and every asset looked up by name.
+static void StartupPackBench(void* lpParam)
+{
+	STARTUPBENCH* lpStartup = (STARTUPBENCH*)lpParam;
+	std::vector<DIBSURFACE> assets(STARTUP_ASSETS);
+	SURFACEPACK pack;
+
+	if(!OpenSurfacePack(lpStartup->szPack, &pack)) {
+		return;
+	}
+
+	for(int i = 0; i < STARTUP_ASSETS; i++) {
+		GetPackSurface(&pack, FindPackSurface(&pack, lpStartup->names[i].c_str()), &assets[i]);
+	}
+
+	DrawFirstFrame(lpStartup, assets.data());
+	CloseSurfacePack(&pack);
+}
+
+//
+// Regions of big bitmaps.
+//
+
+// Source files for the region cases, all 24bpp and square.
+static const int g_iRegionSizes[] = { 4096, 16384, 32768 };
+
+#define	REGION_CX		1920
+#define	REGION_CY		1080
+
+typedef struct tagREGIONBENCH {
+	char			szFilename[512];
+	int				iStep;
+	DIBSURFACE		viewport;
+} REGIONBENCH;
+
+// Opens the file and decodes the viewport from its middle, like a viewer
+// that was just started would.
+static void RegionBench(void* lpParam)
+{
+	REGIONBENCH* lpRegion = (REGIONBENCH*)lpParam;
+	BITMAPREADER reader;
+	RECT rc;
+
+	if(!OpenBitmapReader(lpRegion->szFilename, &reader)) {
+		return;
+	}
+
+	rc.left = (reader.view.cx - REGION_CX * lpRegion->iStep) / 2;
+	rc.top = (reader.view.cy - REGION_CY * lpRegion->iStep) / 2;
+	rc.right = rc.left + REGION_CX * lpRegion->iStep;
+	rc.bottom = rc.top + REGION_CY * lpRegion->iStep;
+
+	ReadBitmapRegion(&reader, &rc, lpRegion->iStep, &lpRegion->viewport);
+	CloseBitmapReader(&reader);
+}
+
+//
+// RLE.
+//
+
+typedef struct tagRLEBENCH {
+	LPDIBSURFACE	lpSurface;
+	int				iBits;
+	BYTE*			pData;
+	size_t			cbData;
+	size_t			cbBound;
+	DIBSURFACE		dst;
+	char			szFilename[512];
+} RLEBENCH;
+
+static void RLEEncodeBench(void* lpParam)
+{
+	RLEBENCH* lpRLE = (RLEBENCH*)lpParam;
+
+	lpRLE->cbData = EncodeRLE(lpRLE->lpSurface, lpRLE->iBits, lpRLE->pData, lpRLE->cbBound);
+}
+
+static void RLEDecodeBench(void* lpParam)
+{
+	RLEBENCH* lpRLE = (RLEBENCH*)lpParam;
+	RLEDECODER decoder;
+
+	BeginRLEDecode(&decoder, &lpRLE->dst, lpRLE->iBits);
+	DecodeRLEChunk(&decoder, lpRLE->pData, lpRLE->cbData);
+	EndRLEDecode(&decoder);
+}
+
+static void RLESaveBench(void* lpParam)
+{
+	RLEBENCH* lpRLE = (RLEBENCH*)lpParam;
+
+	WriteRLEBitmapFile(lpRLE->szFilename, lpRLE->lpSurface, lpRLE->iBits, &lpRLE->cbData);
+}
+
+//
+// Allocation.
+//
+
+typedef struct tagALLOCBENCH {
+	int				cx;
+	int				cy;
+	int				iBpp;
+	DWORD			dwFlags;
+} ALLOCBENCH;
+
+// Creates a DIB, touches the first and last scanline like any user would,
+// and frees it again. Apart from the first one, every iteration is served
+// from the pool.
+static void AllocBench(void* lpParam)
+{
+	ALLOCBENCH* lpAlloc = (ALLOCBENCH*)lpParam;
+	LPBITMAPINFO lpBmi;
+	BYTE* pBits;
+
+	if((lpBmi = CreateDIB(lpAlloc->cx, lpAlloc->cy, lpAlloc->iBpp, pBits, lpAlloc->dwFlags)) == NULL) {
+		return;
+	}
+
+	pBits[0] = 1;
+	pBits[(size_t)DIB_STRIDE(lpAlloc->cx, lpAlloc->iBpp == 15 ? 16 : lpAlloc->iBpp) * lpAlloc->cy - 1] = 1;
+
+	FreeDIB(lpBmi);
+}
+
+// DIBs alive at any time in the churn cases, and iterations between two
+// looks at the resident set.
+#define	CHURN_LIVE		64
+#define	CHURN_SAMPLE	256
+
+typedef struct tagCHURNBENCH {
+	int				iMinSide;		// Sides are picked between these, evenly on a log scale
+	int				iMaxSide;
+	LPBITMAPINFO	lpBmi[CHURN_LIVE];
+	size_t			cbBits[CHURN_LIVE];
+	long long		cbLive;
+	DWORD			dwRandom;
+	int				cIterations;
+	long long		cbPeakRSS;
+	long long		cbRSS;			// At the last look
+} CHURNBENCH;
+
+static DWORD NextChurnRandom(CHURNBENCH* lpChurn)
+{
+	lpChurn->dwRandom = lpChurn->dwRandom * 1103515245 + 12345;
+	return lpChurn->dwRandom >> 8;
+}
+
+static int GetChurnSide(CHURNBENCH* lpChurn)
+{
+	double u = (NextChurnRandom(lpChurn) & 0xFFFF) / 65536.0;
+
+	return (int)(lpChurn->iMinSide * pow((double)lpChurn->iMaxSide / lpChurn->iMinSide, u));
+}
+
+// Replaces one of the live DIBs with a new one of a random size and
+// depth, and writes a byte to every page of it like drawing on it would.
+// The first time the page is fresh from the system, once the pools have
+// warmed up it mostly isn't. Every 'CHURN_SAMPLE' iterations this also
+// looks at the resident set, which costs a few microseconds but is far
+// enough apart not to move p50 or p99.
+static void ChurnBench(void* lpParam)
+{
+	static const int iDepths[] = { 8, 15, 16, 24, 32 };
+	CHURNBENCH* lpChurn = (CHURNBENCH*)lpParam;
+	int i = NextChurnRandom(lpChurn) % CHURN_LIVE;
+	int cx = GetChurnSide(lpChurn), cy = GetChurnSide(lpChurn);
+	int iBpp = iDepths[NextChurnRandom(lpChurn) % 5];
+	BYTE* pBits;
+
+	FreeDIB(lpChurn->lpBmi[i]);
+	lpChurn->cbLive -= lpChurn->cbBits[i];
+	lpChurn->lpBmi[i] = NULL;
+	lpChurn->cbBits[i] = 0;
+
+	if((lpChurn->lpBmi[i] = CreateDIB(cx, cy, iBpp, pBits)) != NULL) {
+		lpChurn->cbBits[i] = (size_t)DIB_STRIDE(cx, iBpp == 15 ? 16 : iBpp) * cy;
+		lpChurn->cbLive += lpChurn->cbBits[i];
+
+		for(size_t cb = 0; cb < lpChurn->cbBits[i]; cb += 4096) {
+			pBits[cb] = 1;
+		}
+	}
+
+	if(++lpChurn->cIterations % CHURN_SAMPLE == 0) {
+		lpChurn->cbRSS = GetResidentBytes();
+		lpChurn->cbPeakRSS = std::max(lpChurn->cbPeakRSS, lpChurn->cbRSS);
+	}
+}
+
+//
+// Plotting.
+//
+
+typedef struct tagPLOTBENCH {
+	LPDIBSURFACE	lpSurface;
+	int*			px;
+	int*			py;
+	DWORD*			pColors;
+} PLOTBENCH;
+
+// The 'PutPixel' Example 4 started out with: one call per pixel and a
+// switch on the bit count every time. Kept here as the baseline.
+static void PutPixelSwitch(int x, int y, BYTE r, BYTE g, BYTE b, int iBpp, int cx, void* pBits)
+{
+	int iOffset = cx * y + x;
+
+	switch(iBpp) {
+	case 8:
+		((BYTE*)pBits)[iOffset] = r;
+		break;
+
+	case 15:
+		((WORD*)pBits)[iOffset] = (WORD)(((r & 0xF8) << 7) | ((g & 0xF8) << 2) | b >> 3);
+		break;
+
+	case 16:
+		((WORD*)pBits)[iOffset] = (WORD)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | b >> 3);
+		break;
+
+	case 24:
+		((BYTE*)pBits)[iOffset * 3 + 0] = r;
+		((BYTE*)pBits)[iOffset * 3 + 1] = g;
+		((BYTE*)pBits)[iOffset * 3 + 2] = b;
+		break;
+
+	case 32:
+		((DWORD*)pBits)[iOffset] = (DWORD)((r << 16) | (g << 8) | b);
+		break;
+	}
+}
+
+static void PlotSwitchBench(void* lpParam)
+{
+	PLOTBENCH* lpPlot = (PLOTBENCH*)lpParam;
+	int iBpp = GetFormatBpp(lpPlot->lpSurface->iFormat);
+
+	for(int i = 0; i < PLOT_PIXELS; i++) {
+		DWORD c = lpPlot->pColors[i];
+		PutPixelSwitch(lpPlot->px[i], lpPlot->py[i], (BYTE)(c >> 16), (BYTE)(c >> 8), (BYTE)c, iBpp, lpPlot->lpSurface->cx, lpPlot->lpSurface->pBits);
+	}
+}
+
+template<class FORMAT>
+static void PlotSurfaceBench(void* lpParam)
+{
+	PLOTBENCH* lpPlot = (PLOTBENCH*)lpParam;
+	CSurface<FORMAT> surface(lpPlot->lpSurface);
+
+	for(int i = 0; i < PLOT_PIXELS; i++) {
+		DWORD c = lpPlot->pColors[i];
+		surface.PutPixel(lpPlot->px[i], lpPlot->py[i], (BYTE)(c >> 16), (BYTE)(c >> 8), (BYTE)c);
+	}
+}
+
+static void PlotBatchBench(void* lpParam)
+{
+	PLOTBENCH* lpPlot = (PLOTBENCH*)lpParam;
+
+	for(int i = 0; i < PLOT_PIXELS; i += PLOT_BATCH) {
+		PutDIBPixels(lpPlot->lpSurface, lpPlot->px + i, lpPlot->py + i, lpPlot->pColors + i, PLOT_BATCH);
+	}
+}
+
+static LPBENCHPROC GetPlotSurfaceProc(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return PlotSurfaceBench<PF_INDEX8>;
+	case DIBFMT_RGB555:	return PlotSurfaceBench<PF_RGB555>;
+	case DIBFMT_RGB565:	return PlotSurfaceBench<PF_RGB565>;
+	case DIBFMT_BGR24:	return PlotSurfaceBench<PF_BGR24>;
+	case DIBFMT_XRGB32:	return PlotSurfaceBench<PF_XRGB32>;
+	}
+
+	return NULL;
+}
+
+//
+// Drawing.
+//
+
+typedef struct tagRASTERBENCH {
+	LPDIBSURFACE	lpSurface;
+	LPDIBSURFACE	lpSrc;			// For the blits
+	int*			px0;			// Lines go from 'px0', 'py0' to 'px1', 'py1'
+	int*			py0;
+	int*			px1;
+	int*			py1;
+	int*			pxSpan;			// Spans from 'px0' up to 'pxSpan' on 'py0'
+	DWORD*			pColors;
+} RASTERBENCH;
+
+// Filling the whole surface the way it had to be done before raster.h.
+template<class FORMAT>
+static void FillPutPixelBench(void* lpParam)
+{
+	RASTERBENCH* lpRaster = (RASTERBENCH*)lpParam;
+	CSurface<FORMAT> surface(lpRaster->lpSurface);
+	DWORD c = lpRaster->pColors[0];
+
+	for(int y = 0; y < surface.Height(); y++) {
+		for(int x = 0; x < surface.Width(); x++) {
+			surface.PutPixel(x, y, (BYTE)(c >> 16), (BYTE)(c >> 8), (BYTE)c);
+		}
+	}
+}
+
+static LPBENCHPROC GetFillPutPixelProc(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return FillPutPixelBench<PF_INDEX8>;
+	case DIBFMT_RGB555:	return FillPutPixelBench<PF_RGB555>;
+	case DIBFMT_RGB565:	return FillPutPixelBench<PF_RGB565>;
+	case DIBFMT_BGR24:	return FillPutPixelBench<PF_BGR24>;
+	case DIBFMT_XRGB32:	return FillPutPixelBench<PF_XRGB32>;
+	}
+
+	return NULL;
+}
+
+static void FillBench(void* lpParam)
+{
+	RASTERBENCH* lpRaster = (RASTERBENCH*)lpParam;
+
+	FillDIBRect(lpRaster->lpSurface, 0, 0, lpRaster->lpSurface->cx, lpRaster->lpSurface->cy, lpRaster->pColors[0]);
+}
+
+static void SpanBench(void* lpParam)
+{
+	RASTERBENCH* lpRaster = (RASTERBENCH*)lpParam;
+
+	for(int i = 0; i < RASTER_SHAPES; i++) {
+		FillDIBSpan(lpRaster->lpSurface, lpRaster->px0[i], lpRaster->pxSpan[i], lpRaster->py0[i], lpRaster->pColors[i]);
+	}
+}
+
+static void LineBench(void* lpParam)
+{
+	RASTERBENCH* lpRaster = (RASTERBENCH*)lpParam;
+
+	for(int i = 0; i < RASTER_SHAPES; i++) {
+		DrawDIBLine(lpRaster->lpSurface, lpRaster->px0[i], lpRaster->py0[i], lpRaster->px1[i], lpRaster->py1[i], lpRaster->pColors[i]);
+	}
+}
+
+static void BlitBench(void* lpParam)
+{
+	RASTERBENCH* lpRaster = (RASTERBENCH*)lpParam;
+
+	BlitDIB(lpRaster->lpSurface, 0, 0, lpRaster->lpSrc, NULL);
+}
+
+static void ColorKeyBlitBench(void* lpParam)
+{
+	RASTERBENCH* lpRaster = (RASTERBENCH*)lpParam;
+
+	ColorKeyBlitDIB(lpRaster->lpSurface, 0, 0, lpRaster->lpSrc, NULL, 0);
+}
+
+//
+// Compositing.
+//
+
+// Layers composited per iteration of the multi-layer cases.
+#define	COMPOSITE_LAYERS	4
+
+typedef struct tagCOMPOSITEBENCH {
+	LPDIBSURFACE	lpDst;
+	LPDIBSURFACE	lpLayers;		// COMPOSITE_LAYERS of them, the first for the single layer cases
+	int				iMode;
+	CThreadPool*	lpPool;
+} COMPOSITEBENCH;
+
+static void CompositeBench(void* lpParam)
+{
+	COMPOSITEBENCH* lpComposite = (COMPOSITEBENCH*)lpParam;
+
+	CompositeDIB(lpComposite->lpDst, 0, 0, lpComposite->lpLayers, NULL, lpComposite->iMode, lpComposite->lpPool);
+}
+
+static void CompositeLayersBench(void* lpParam)
+{
+	COMPOSITEBENCH* lpComposite = (COMPOSITEBENCH*)lpParam;
+
+	for(int i = 0; i < COMPOSITE_LAYERS; i++) {
+		CompositeDIB(lpComposite->lpDst, 0, 0, &lpComposite->lpLayers[i], NULL, COMPOSITE_OVER, lpComposite->lpPool);
+	}
+}
+
+// A layer the way UI and sprites look: a third of it fully transparent,
+// a third fully opaque and a third in between, in bands that move from
+// layer to layer.
+static BOOL CreateLayerSurface(LPDIBSURFACE lpSurface, int cx, int cy, int iLayer)
+{
+	if(!CreateTestSurface(lpSurface, cx, cy, DIBFMT_XRGB32)) {
+		return FALSE;
+	}
+
+	for(int y = 0; y < cy; y++) {
+		DWORD* pRow = (DWORD*)(lpSurface->pTop + (size_t)y * lpSurface->iPitch);
+
+		for(int x = 0; x < cx; x++) {
+			int iBand = ((x + y + iLayer * 97) / 64) % 3;
+			DWORD a = iBand == 0 ? 0 : iBand == 1 ? 255 : (x * 7 + y * 3) & 0xFF;
+
+			pRow[x] = a << 24 | (pRow[x] & 0x00FFFFFF);
+		}
+	}
+
+	PremultiplyDIBSurface(lpSurface);
+	return TRUE;
+}
+
+//
+// Converting and scaling.
+//
+
+typedef struct tagCONVERTBENCH {
+	LPDIBSURFACE	lpDst;
+	LPDIBSURFACE	lpSrc;
+} CONVERTBENCH;
+
+static void ConvertBench(void* lpParam)
+{
+	CONVERTBENCH* lpConvert = (CONVERTBENCH*)lpParam;
+
+	ConvertDIBSurface(lpConvert->lpDst, lpConvert->lpSrc);
+}
+
+typedef struct tagBITFIELDSBENCH {
+	BITFIELDS		fields;
+	const BYTE*		pSrc;
+	int				iSrcPitch;
+	LPDIBSURFACE	lpDst;
+} BITFIELDSBENCH;
+
+static void BitfieldsBench(void* lpParam)
+{
+	BITFIELDSBENCH* lpBench = (BITFIELDSBENCH*)lpParam;
+	LPDIBSURFACE lpDst = lpBench->lpDst;
+
+	for(int y = 0; y < lpDst->cy; y++) {
+		UnpackBitfields(&lpBench->fields, (DWORD*)(lpDst->pBits + (size_t)y * lpDst->iPitch), lpBench->pSrc + (size_t)y * lpBench->iSrcPitch, lpDst->cx);
+	}
+}
+
+typedef struct tagQUANTBENCH {
+	QUANTIZER		quant;
+	LPDIBSURFACE	lpDst;
+	LPDIBSURFACE	lpSrc;
+	CThreadPool*	lpPool;
+} QUANTBENCH;
+
+static void QuantBuildBench(void* lpParam)
+{
+	QUANTBENCH* lpQuant = (QUANTBENCH*)lpParam;
+
+	BuildQuantizerColors(&lpQuant->quant, lpQuant->lpSrc, 256, lpQuant->lpPool);
+}
+
+// With the inverse table as it is after the first frame.
+static void QuantMapBench(void* lpParam)
+{
+	QUANTBENCH* lpQuant = (QUANTBENCH*)lpParam;
+
+	QuantizeDIBSurface(lpQuant->lpDst, lpQuant->lpSrc, &lpQuant->quant, FALSE, lpQuant->lpPool);
+}
+
+// Setting the colors again empties the inverse table, so this is what the
+// first frame with new colors costs.
+static void QuantMapColdBench(void* lpParam)
+{
+	QUANTBENCH* lpQuant = (QUANTBENCH*)lpParam;
+	DWORD dwColors[256];
+
+	memcpy(dwColors, lpQuant->quant.dwColors, sizeof(DWORD) * lpQuant->quant.cColors);
+	SetQuantizerColors(&lpQuant->quant, dwColors, lpQuant->quant.cColors);
+	QuantizeDIBSurface(lpQuant->lpDst, lpQuant->lpSrc, &lpQuant->quant, FALSE, lpQuant->lpPool);
+}
+
+static void QuantDitherBench(void* lpParam)
+{
+	QUANTBENCH* lpQuant = (QUANTBENCH*)lpParam;
+
+	QuantizeDIBSurface(lpQuant->lpDst, lpQuant->lpSrc, &lpQuant->quant, TRUE, lpQuant->lpPool);
+}
+
+typedef struct tagSCALEBENCH {
+	SCALEPLAN		plan;
+	LPDIBSURFACE	lpDst;
+	LPDIBSURFACE	lpSrc;
+	CThreadPool*	lpPool;
+} SCALEBENCH;
+
+static void ScaleBench(void* lpParam)
+{
+	SCALEBENCH* lpScale = (SCALEBENCH*)lpParam;
+
+	ScaleDIBSurface(&lpScale->plan, lpScale->lpDst, lpScale->lpSrc, lpScale->lpPool);
+}
+
+//
+// Pyramids.
+//
+
+typedef struct tagPYRAMIDBENCH {
+	PYRAMID			pyramid;
+	LPDIBSURFACE	lpSrc;
+	int				iFilter;
+	PYRAMIDVIEW		view;
+	DIBSURFACE		level;			// The part of the level the view needs
+	SCALEBENCH		scale;			// From that, or the whole image, to the window
+} PYRAMIDBENCH;
+
+static void PyramidBuildBench(void* lpParam)
+{
+	PYRAMIDBENCH* lpBench = (PYRAMIDBENCH*)lpParam;
+	PYRAMID pyramid;
+
+	if(BuildPyramid(&pyramid, lpBench->lpSrc, lpBench->iFilter, g_lpPool)) {
+		FreePyramid(&pyramid);
+	}
+}
+
+static void PyramidViewBench(void* lpParam)
+{
+	PYRAMIDBENCH* lpBench = (PYRAMIDBENCH*)lpParam;
+	RECT rc = { 0, 0, lpBench->lpSrc->cx, lpBench->lpSrc->cy };
+
+	FindPyramidView(&lpBench->pyramid, &rc, lpBench->scale.lpDst->cx, lpBench->scale.lpDst->cy, &lpBench->view);
+	DrawPyramidView(&lpBench->pyramid, &lpBench->view, &lpBench->level);
+	ScaleDIBSurface(&lpBench->scale.plan, lpBench->scale.lpDst, &lpBench->level, lpBench->scale.lpPool);
+}
+
+//
+// Frame streams.
+//
+
+// Two frames that differ in a number of random pixels, encoded or
+// decoded one after the other, so every frame is a change from the last.
+typedef struct tagSTREAMBENCH {
+	FRAMEENCODER	encoder;
+	FRAMEDECODER	decoder;
+	DIBSURFACE		frames[2];
+	RECT			rcDirty[2][MAX_STREAM_RECTS];	// What changed from the other frame
+	int				cDirty[2];
+	BOOL			bDirty;			// Pass the rectangles to the encoder
+	BYTE*			pDeltas[2];		// Each frame encoded after the other one, with its header
+	FRAMEHEADER		headers[2];		// The same headers, aligned
+	int				iNext;
+} STREAMBENCH;
+
+static void StreamEncodeBench(void* lpParam)
+{
+	STREAMBENCH* lpBench = (STREAMBENCH*)lpParam;
+	int i = lpBench->iNext;
+
+	EncodeFrame(&lpBench->encoder, &lpBench->frames[i], lpBench->bDirty ? lpBench->rcDirty[i] : NULL, lpBench->cDirty[i]);
+	lpBench->iNext = i ^ 1;
+}
+
+static void StreamDecodeBench(void* lpParam)
+{
+	STREAMBENCH* lpBench = (STREAMBENCH*)lpParam;
+	int i = lpBench->iNext;
+
+	DecodeFrame(&lpBench->decoder, &lpBench->headers[i], lpBench->pDeltas[i] + sizeof(FRAMEHEADER));
+	lpBench->iNext = i ^ 1;
+}
+
+//
+// The cases.
+//
+
+static const int g_iSizes[] = { 512, 2048, 8192 };
+
+static const int g_iFormats[] = { DIBFMT_INDEX8, DIBFMT_RGB555, DIBFMT_RGB565, DIBFMT_BGR24, DIBFMT_XRGB32 };
+
+static BOOL IsSizeSelected(int cx, int cy)
+{
+	return (double)cx * cy <= g_Options.dMaxMP * 1024.0 * 1024.0;
+}
+
+static void RunLoadSaveBenchmarks()
+{
+	char szName[96], szFilename[512];
+
+	snprintf(szFilename, sizeof(szFilename), "%s/pic24.bmp", g_Options.lpszResources);
+	RunLoadBenchmark("load/pic24.bmp", szFilename);
+
+	snprintf(szFilename, sizeof(szFilename), "%s/pic8.bmp", g_Options.lpszResources);
+	RunLoadBenchmark("load/pic8.bmp", szFilename);
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		for(int f = 0; f < (int)(sizeof(g_iFormats) / sizeof(g_iFormats[0])); f++) {
+			int iFormat = g_iFormats[f];
+			char szLoad[96];
+			SAVEBENCH save;
+			DIBSURFACE surface;
+
+			// 8bpp and 24bpp are what bitmaps on disk mostly are.
+			if(iFormat != DIBFMT_INDEX8 && iFormat != DIBFMT_BGR24 && iFormat != DIBFMT_XRGB32) {
+				continue;
+			}
+
+			snprintf(szName, sizeof(szName), "save/%s/%dx%d", GetFormatName(iFormat), cx, cy);
+			snprintf(szLoad, sizeof(szLoad), "load/%s/%dx%d", GetFormatName(iFormat), cx, cy);
+
+			if(!IsSelected(szName) && !IsSelected(szLoad)) {
+				continue;
+			}
+
+			if(!CreateTestSurface(&surface, cx, cy, iFormat)) {
+				fprintf(stderr, "Error creating a %dx%d %s surface\n", cx, cy, GetFormatName(iFormat));
+				continue;
+			}
+
+			snprintf(save.szFilename, sizeof(save.szFilename), "%s/benchmark-%s-%d.bmp", g_Options.lpszTemp, GetFormatName(iFormat), cx);
+			save.lpSurface = &surface;
+
+			RunBenchmark(szName, cx, cy, (long long)cx * cy, GetSurfaceBytes(&surface), SaveBench, &save);
+
+			// The load cases read what was just saved.
+			SaveBench(&save);
+			RunLoadBenchmark(szLoad, save.szFilename);
+
+			remove(save.szFilename);
+			FreeDIBSurface(&surface);
+		}
+	}
+}
+
+// Loads through the cache, converting to XRGB like the load cases do.
+static const char* g_lpszCacheCases[] = { "cold", "identity", "content" };
+
+static void RunCacheBenchmark(const char* lpszSource, const char* lpszFilename)
+{
+	CACHEBENCH bench;
+	BMPCACHESTATS stats;
+	BITMAPVIEW view;
+	char szName[96];
+
+	if(!MapBitmapFile(lpszFilename, &view)) {
+		fprintf(stderr, "Error loading %s\n", lpszFilename);
+		return;
+	}
+
+	// Room for twice the surface, so it stays in once it's loaded.
+	CBitmapCache cache((size_t)view.cx * view.cy * 4 * 2);
+
+	snprintf(bench.szFilename, sizeof(bench.szFilename), "%s", lpszFilename);
+	bench.lpCache = &cache;
+
+	for(int i = 0; i < 3; i++) {
+		bench.iCase = i;
+		snprintf(szName, sizeof(szName), "cache/%s/%s", lpszSource, g_lpszCacheCases[i]);
+		RunBenchmark(szName, view.cx, view.cy, (long long)view.cx * view.cy, (long long)view.cbFile, CacheBench, &bench);
+	}
+
+	cache.GetStats(&stats);
+
+	if(stats.cMisses) {
+		fprintf(stderr, "%-45s %lld hits, %lld misses, %lld evictions, %.1f MB peak\n", "", stats.cHits, stats.cMisses, stats.cEvictions, stats.cbPeak / 1048576.0);
+	}
+
+	UnmapBitmapFile(&view);
+}
+
+static void RunCacheBenchmarks()
+{
+	char szName[96], szFilename[512];
+
+	snprintf(szFilename, sizeof(szFilename), "%s/pic24.bmp", g_Options.lpszResources);
+	RunCacheBenchmark("pic24.bmp", szFilename);
+
+	snprintf(szFilename, sizeof(szFilename), "%s/pic8.bmp", g_Options.lpszResources);
+	RunCacheBenchmark("pic8.bmp", szFilename);
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+		BOOL bSelected = FALSE;
+		SAVEBENCH save;
+		DIBSURFACE surface;
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		for(int i = 0; i < 3; i++) {
+			snprintf(szName, sizeof(szName), "cache/%s/%dx%d/%s", GetFormatName(DIBFMT_BGR24), cx, cy, g_lpszCacheCases[i]);
+			bSelected |= IsSelected(szName);
+		}
+
+		if(!bSelected || !CreateTestSurface(&surface, cx, cy, DIBFMT_BGR24)) {
+			continue;
+		}
+
+		snprintf(save.szFilename, sizeof(save.szFilename), "%s/benchmark-cache-%d.bmp", g_Options.lpszTemp, cx);
+		save.lpSurface = &surface;
+		SaveBench(&save);
+
+		snprintf(szName, sizeof(szName), "%s/%dx%d", GetFormatName(DIBFMT_BGR24), cx, cy);
+		RunCacheBenchmark(szName, save.szFilename);
+
+		remove(save.szFilename);
+		FreeDIBSurface(&surface);
+	}
+}
+
+// Writes the assets as 24bpp bitmaps, the way they come from the artists,
+// and builds a pack of them in the display format.
+static void RunStartupBenchmarks()
+{
+	STARTUPBENCH* lpStartup = new STARTUPBENCH();
+	PACKBUILDER builder;
+	DIBSURFACE asset, display;
+	long long cbFiles = 0;
+	BOOL bReady = TRUE;
+	char szBitmaps[96], szPack[96];
+
+	snprintf(szBitmaps, sizeof(szBitmaps), "startup/bmp/%dx%dx%d", STARTUP_ASSETS, STARTUP_SIZE, STARTUP_SIZE);
+	snprintf(szPack, sizeof(szPack), "startup/pack/%dx%dx%d", STARTUP_ASSETS, STARTUP_SIZE, STARTUP_SIZE);
+
+	if((!IsSelected(szBitmaps) && !IsSelected(szPack)) || !CreateTestSurface(&asset, STARTUP_SIZE, STARTUP_SIZE, DIBFMT_BGR24)) {
+		delete lpStartup;
+		return;
+	}
+
+	snprintf(lpStartup->szPack, sizeof(lpStartup->szPack), "%s/benchmark-assets.pak", g_Options.lpszTemp);
+
+	if(!CreateDIBSurface(&display, STARTUP_SIZE, STARTUP_SIZE, 32) || !CreatePackBuilder(&builder, lpStartup->szPack)) {
+		FreeDIBSurface(&asset);
+		delete lpStartup;
+		return;
+	}
+
+	ConvertDIBSurface(&display, &asset);
+
+	for(int i = 0; i < STARTUP_ASSETS && bReady; i++) {
+		char szName[64], szFilename[512];
+
+		snprintf(szName, sizeof(szName), "benchmark-asset-%04d.bmp", i);
+		snprintf(szFilename, sizeof(szFilename), "%s/%s", g_Options.lpszTemp, szName);
+
+		lpStartup->files.push_back(szFilename);
+		lpStartup->names.push_back(szName);
+
+		bReady = WriteBitmapFile(szFilename, asset.lpBmi, asset.pBits) && AddPackSurface(&builder, szName, &display);
+		cbFiles += GetSurfaceBytes(&asset) + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+	}
+
+	bReady = FinishPackBuilder(&builder) && bReady;
+
+	if(bReady && CreateDIBSurface(&lpStartup->frame, 1920, 1080, 32)) {
+		long long cPixels = (long long)STARTUP_ASSETS * STARTUP_SIZE * STARTUP_SIZE;
+
+		RunBenchmark(szBitmaps, STARTUP_SIZE, STARTUP_SIZE, cPixels, cbFiles, StartupBitmapBench, lpStartup);
+		RunBenchmark(szPack, STARTUP_SIZE, STARTUP_SIZE, cPixels, (long long)STARTUP_DRAWN * STARTUP_SIZE * STARTUP_SIZE * 4, StartupPackBench, lpStartup);
+
+		FreeDIBSurface(&lpStartup->frame);
+	}
+	else {
+		fprintf(stderr, "Error writing the startup assets to %s\n", g_Options.lpszTemp);
+	}
+
+	for(size_t i = 0; i < lpStartup->files.size(); i++) {
+		remove(lpStartup->files[i].c_str());
+	}
+
+	remove(lpStartup->szPack);
+	FreeDIBSurface(&display);
+	FreeDIBSurface(&asset);
+	delete lpStartup;
+}
+
+static void RunBatchBenchmarks()
+{
+	std::vector<std::string> files;
+	BATCHBENCH batch;
+	DIBSURFACE sprite;
+	BOOL bReady = TRUE;
+	char szName[3][96];
+
+	snprintf(szName[0], sizeof(szName[0]), "batchload/%dx%dx%d/sequential", BATCH_FILES, BATCH_SIZE, BATCH_SIZE);
+	snprintf(szName[1], sizeof(szName[1]), "batchload/%dx%dx%d/pool-%d", BATCH_FILES, BATCH_SIZE, BATCH_SIZE, g_lpPool->Threads());
+	snprintf(szName[2], sizeof(szName[2]), "batchload/%dx%dx%d/uring", BATCH_FILES, BATCH_SIZE, BATCH_SIZE);
+
+	if((!IsSelected(szName[0]) && !IsSelected(szName[1]) && !IsSelected(szName[2])) || !CreateTestSurface(&sprite, BATCH_SIZE, BATCH_SIZE, DIBFMT_BGR24)) {
+		return;
+	}
+
+	for(int i = 0; i < BATCH_FILES && bReady; i++) {
+		char szFilename[512];
+
+		snprintf(szFilename, sizeof(szFilename), "%s/benchmark-sprite-%04d.bmp", g_Options.lpszTemp, i);
+		files.push_back(szFilename);
+
+		bReady = WriteBitmapFile(szFilename, sprite.lpBmi, sprite.pBits);
+	}
+
+	for(size_t i = 0; i < files.size(); i++) {
+		batch.lpszFiles.push_back(files[i].c_str());
+	}
+
+	if(bReady) {
+		long long cPixels = (long long)BATCH_FILES * BATCH_SIZE * BATCH_SIZE;
+		long long cbFiles = (long long)BATCH_FILES * (GetSurfaceBytes(&sprite) + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+
+		for(int i = 0; i < 3; i++) {
+			batch.lpPool = i == 1 ? g_lpPool : NULL;
+			batch.dwFlags = i == 2 ? 0 : BATCH_NOURING;
+
+			// Without io_uring that would be the same as sequential.
+			if(i == 2 && IsSelected(szName[i])) {
+				BatchBench(&batch);
+
+				if(!batch.stats.bRing) {
+					fprintf(stderr, "%-44s io_uring isn't available\n", szName[i]);
+					continue;
+				}
+			}
+
+			if(RunBenchmark(szName[i], BATCH_SIZE, BATCH_SIZE, cPixels, cbFiles, BatchBench, &batch)) {
+				g_Results.back().cFiles = BATCH_FILES;
+				g_Results.back().dSyscalls = (double)batch.stats.cSyscalls / BATCH_FILES;
+			}
+		}
+	}
+	else {
+		fprintf(stderr, "Error writing the sprites to %s\n", g_Options.lpszTemp);
+	}
+
+	for(size_t i = 0; i < files.size(); i++) {
+		remove(files[i].c_str());
+	}
+
+	FreeDIBSurface(&sprite);
+}
+
+// Writes a bottom-up 24bpp bitmap file of 'cx' by 'cy' pixels without
+// ever having all of it in memory: every scanline is made of scanlines of
+// a smaller test surface, shifted a little so no two of them are alike.
+static BOOL WriteBigBitmapFile(LPCSTR lpszFilename, int cx, int cy)
+{
+	BITMAPFILEHEADER bfh;
+	BITMAPINFOHEADER bih;
+	DIBSURFACE tile;
+	int iStride = DIB_STRIDE(cx, 24);
+	BOOL bResult = TRUE;
+	FILE* fp;
+
+	if(!CreateTestSurface(&tile, 1024, 1024, DIBFMT_BGR24)) {
+		return FALSE;
+	}
+
+	if((fp = fopen(lpszFilename, "wb")) == NULL) {
+		FreeDIBSurface(&tile);
+		return FALSE;
+	}
+
+	int cbTile = tile.cx * 3;
+	std::vector<BYTE> row(iStride + cbTile * 2);
+
+	ZeroMemory(&bfh, sizeof(bfh));
+	ZeroMemory(&bih, sizeof(bih));
+
+	// Files over 4 GB don't fit 'bfSize', nobody looks at it anyway.
+	unsigned long long cbFile = sizeof(bfh) + sizeof(bih) + (unsigned long long)iStride * cy;
+
+	bfh.bfType = (WORD)('M' << 8) | 'B';
+	bfh.bfSize = cbFile > 0xFFFFFFFF ? 0 : (DWORD)cbFile;
+	bfh.bfOffBits = sizeof(bfh) + sizeof(bih);
+
+	bih.biSize = sizeof(bih);
+	bih.biWidth = cx;
+	bih.biHeight = cy;
+	bih.biPlanes = 1;
+	bih.biBitCount = 24;
+	bih.biCompression = BI_RGB;
+
+	bResult = fwrite(&bfh, sizeof(bfh), 1, fp) == 1 && fwrite(&bih, sizeof(bih), 1, fp) == 1;
+
+	for(int y = 0; y < cy && bResult; y++) {
+		const BYTE* pTile = tile.pTop + (size_t)(y % tile.cy) * tile.iPitch;
+
+		for(int x = 0; x < iStride + cbTile; x += cbTile) {
+			memcpy(&row[x], pTile, cbTile);
+		}
+
+		bResult = fwrite(&row[(y / tile.cy) % tile.cx * 3], iStride, 1, fp) == 1;
+	}
+
+	bResult = fclose(fp) == 0 && bResult;
+	FreeDIBSurface(&tile);
+
+	return bResult;
+}
+
+static void RunRegionBenchmarks()
+{
+	REGIONBENCH region;
+
+	if(!CreateDIBSurface(&region.viewport, REGION_CX, REGION_CY, 32, DIBALLOC_NOZERO)) {
+		return;
+	}
+
+	for(int s = 0; s < (int)(sizeof(g_iRegionSizes) / sizeof(g_iRegionSizes[0])); s++) {
+		int cx = g_iRegionSizes[s], cy = g_iRegionSizes[s];
+		char szName[2][96];
+		BOOL bSelected = FALSE;
+
+		for(int i = 0; i < 2; i++) {
+			snprintf(szName[i], sizeof(szName[i]), "region/%s/%dx%d/%dx%d/step-%d", GetFormatName(DIBFMT_BGR24), cx, cy, REGION_CX, REGION_CY, i ? 4 : 1);
+			bSelected |= IsSelected(szName[i]);
+		}
+
+		if(!bSelected) {
+			continue;
+		}
+
+		snprintf(region.szFilename, sizeof(region.szFilename), "%s/benchmark-region-%d.bmp", g_Options.lpszTemp, cx);
+
+		if(!WriteBigBitmapFile(region.szFilename, cx, cy)) {
+			fprintf(stderr, "Error writing %s\n", region.szFilename);
+			remove(region.szFilename);
+			continue;
+		}
+
+		// The smaller files don't fill the viewport at every step.
+		for(int i = 0; i < 2; i++) {
+			region.iStep = i ? 4 : 1;
+
+			long long cPixels = (long long)std::min(REGION_CX, cx / region.iStep) * std::min(REGION_CY, cy / region.iStep);
+
+			RunBenchmark(szName[i], cx, cy, cPixels, cPixels * (3 * region.iStep + 4), RegionBench, &region);
+		}
+
+		remove(region.szFilename);
+	}
+
+	FreeDIBSurface(&region.viewport);
+}
+
+// Palettized artwork: flat blocks of color with a band of dithering every
+// so often, so the encoder has both runs and literals to deal with. RLE4
+// only gets the high nibble of each index.
+static BOOL CreateArtSurface(LPDIBSURFACE lpSurface, int cx, int cy)
+{
+	unsigned uSeed = 12345;
+
+	if(!CreateDIBSurface(lpSurface, cx, cy, 8, DIBALLOC_NOZERO)) {
+		return FALSE;
+	}
+
+	for(int y = 0; y < cy; y++) {
+		BYTE* pRow = lpSurface->pTop + (size_t)y * lpSurface->iPitch;
+
+		for(int x = 0; x < cx; x++) {
+			BYTE c = (BYTE)((((x >> 6) + (y >> 5) * 3) & 15) << 4);
+
+			if((y >> 5) % 8 == 7) {
+				uSeed = uSeed * 1103515245 + 12345;
+				c = (BYTE)(c ^ (uSeed >> 24 & 0x30));
+			}
+
+			pRow[x] = c;
+		}
+	}
+
+	return TRUE;
+}
+
+// Encodes, decodes, saves and loads 'lpSurface' with RLE8 and RLE4, and
+// saves it uncompressed to compare. 'ratio' is the size of the RLE pixel
+// data over the size of the uncompressed pixel data of the same bit depth.
+static void RunRLEBenchmark(const char* lpszSource, LPDIBSURFACE lpSurface)
+{
+	int cx = lpSurface->cx, cy = lpSurface->cy;
+	long long cPixels = (long long)cx * cy;
+	DIBSURFACE nibbles;
+	SAVEBENCH save;
+	char szName[96];
+
+	if(!CreateDIBSurface(&nibbles, cx, cy, 8, DIBALLOC_NOZERO)) {
+		return;
+	}
+
+	for(int y = 0; y < cy; y++) {
+		BYTE* pSrc = lpSurface->pTop + (size_t)y * lpSurface->iPitch;
+		BYTE* pDst = nibbles.pTop + (size_t)y * nibbles.iPitch;
+
+		for(int x = 0; x < cx; x++) {
+			pDst[x] = pSrc[x] >> 4;
+		}
+	}
+
+	snprintf(save.szFilename, sizeof(save.szFilename), "%s/benchmark-rle-%dx%d.bmp", g_Options.lpszTemp, cx, cy);
+	save.lpSurface = lpSurface;
+
+	snprintf(szName, sizeof(szName), "rle/save/bmp8/%s", lpszSource);
+	RunBenchmark(szName, cx, cy, cPixels, GetSurfaceBytes(lpSurface), SaveBench, &save);
+
+	for(int iBits = 8; iBits >= 4; iBits -= 4) {
+		RLEBENCH rle;
+		double dRatio;
+		long long cbRaw = (long long)DIB_STRIDE(cx, iBits) * cy;
+
+		rle.lpSurface = iBits == 8 ? lpSurface : &nibbles;
+		rle.iBits = iBits;
+		rle.cbBound = GetRLEBound(cx, cy);
+		rle.pData = (BYTE*)malloc(rle.cbBound);
+		snprintf(rle.szFilename, sizeof(rle.szFilename), "%s", save.szFilename);
+
+		if(!rle.pData || !CreateDIBSurface(&rle.dst, cx, cy, 8, DIBALLOC_NOZERO)) {
+			free(rle.pData);
+			continue;
+		}
+
+		RLEEncodeBench(&rle);
+		dRatio = (double)rle.cbData / cbRaw;
+
+		snprintf(szName, sizeof(szName), "rle/encode/rle%d/%s", iBits, lpszSource);
+
+		if(RunBenchmark(szName, cx, cy, cPixels, GetSurfaceBytes(rle.lpSurface) + (long long)rle.cbData, RLEEncodeBench, &rle)) {
+			g_Results.back().dRatio = dRatio;
+		}
+
+		snprintf(szName, sizeof(szName), "rle/decode/rle%d/%s", iBits, lpszSource);
+
+		if(RunBenchmark(szName, cx, cy, cPixels, (long long)rle.cbData + GetSurfaceBytes(&rle.dst), RLEDecodeBench, &rle)) {
+			g_Results.back().dRatio = dRatio;
+		}
+
+		snprintf(szName, sizeof(szName), "rle/save/rle%d/%s", iBits, lpszSource);
+
+		if(RunBenchmark(szName, cx, cy, cPixels, GetSurfaceBytes(rle.lpSurface), RLESaveBench, &rle)) {
+			g_Results.back().dRatio = dRatio;
+		}
+
+		// The load case reads what was just saved.
+		snprintf(szName, sizeof(szName), "rle/load/rle%d/%s", iBits, lpszSource);
+
+		if(IsSelected(szName)) {
+			RLESaveBench(&rle);
+			RunLoadBenchmark(szName, rle.szFilename);
+		}
+
+		free(rle.pData);
+		FreeDIBSurface(&rle.dst);
+	}
+
+	remove(save.szFilename);
+	FreeDIBSurface(&nibbles);
+}
+
+static void RunRLEBenchmarks()
+{
+	char szFilename[512];
+	BITMAPVIEW view;
+
+	snprintf(szFilename, sizeof(szFilename), "%s/pic8.bmp", g_Options.lpszResources);
+
+	if(MapBitmapFile(szFilename, &view) && view.bih.biBitCount == 8) {
+		DIBSURFACE surface;
+
+		if(CreateDIBSurface(&surface, view.cx, view.cy, 8, DIBALLOC_NOZERO)) {
+			for(int y = 0; y < view.cy; y++) {
+				memcpy(surface.pTop + (size_t)y * surface.iPitch, GetViewScanline(&view, y), view.cx);
+			}
+
+			RunRLEBenchmark("pic8.bmp", &surface);
+			FreeDIBSurface(&surface);
+		}
+
+		UnmapBitmapFile(&view);
+	}
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+		char szSource[32];
+		DIBSURFACE surface;
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		snprintf(szSource, sizeof(szSource), "art/%dx%d", cx, cy);
+
+		if(CreateArtSurface(&surface, cx, cy)) {
+			RunRLEBenchmark(szSource, &surface);
+			FreeDIBSurface(&surface);
+		}
+	}
+}
+
+static void RunAllocBenchmarks()
+{
+	static const int iSizes[] = { 64, 320, 1024, 4096 };
+	char szName[96];
+
+	for(int f = 0; f < (int)(sizeof(g_iFormats) / sizeof(g_iFormats[0])); f++) {
+		for(int s = 0; s < (int)(sizeof(iSizes) / sizeof(iSizes[0])); s++) {
+			ALLOCBENCH alloc = { iSizes[s], iSizes[s], GetFormatBpp(g_iFormats[f]), 0 };
+
+			// No bytes per second here. Big blocks come straight from the
+			// operating system already cleared, so there is nothing to count.
+			snprintf(szName, sizeof(szName), "alloc/%s/%dx%d/zero", GetFormatName(g_iFormats[f]), alloc.cx, alloc.cy);
+			RunBenchmark(szName, alloc.cx, alloc.cy, (long long)alloc.cx * alloc.cy, 0, AllocBench, &alloc);
+
+			alloc.dwFlags = DIBALLOC_NOZERO;
+			snprintf(szName, sizeof(szName), "alloc/%s/%dx%d/nozero", GetFormatName(g_iFormats[f]), alloc.cx, alloc.cy);
+			RunBenchmark(szName, alloc.cx, alloc.cy, (long long)alloc.cx * alloc.cy, 0, AllocBench, &alloc);
+		}
+	}
+}
+
+// Creates and destroys DIBs of every depth and of random sizes, small ones
+// from the heap, big ones from their own pages and both mixed, with
+// 'CHURN_LIVE' of them alive at a time. One iteration is one DIB
+// replaced, so p50 and p99 are the latency of a free and a create.
+static void RunChurnBenchmarks()
+{
+	static const struct {
+		const char*	lpszName;
+		int			iMinSide;
+		int			iMaxSide;
+	} mixes[] = {
+		{ "small", 16, 256 },
+		{ "large", 512, 2048 },
+		{ "mixed", 16, 2048 },
+	};
+	char szName[96];
+
+	for(int m = 0; m < (int)(sizeof(mixes) / sizeof(mixes[0])); m++) {
+		CHURNBENCH churn;
+
+		snprintf(szName, sizeof(szName), "alloc/churn/%s/%d-%d", mixes[m].lpszName, mixes[m].iMinSide, mixes[m].iMaxSide);
+
+		if(!IsSelected(szName)) {
+			continue;
+		}
+
+		ZeroMemory(&churn, sizeof(churn));
+		churn.iMinSide = mixes[m].iMinSide;
+		churn.iMaxSide = mixes[m].iMaxSide;
+		churn.dwRandom = 12345;
+
+		long long cbBefore = GetResidentBytes();
+
+		if(RunBenchmark(szName, 0, 0, 1, 0, ChurnBench, &churn)) {
+			BENCHRESULT* lpResult = &g_Results.back();
+
+			for(int i = 0; i < CHURN_LIVE; i++) {
+				FreeDIB(churn.lpBmi[i]);
+			}
+
+			// What the pools keep once everything is freed again.
+			lpResult->cbFreedRSS = GetResidentBytes() - cbBefore;
+			lpResult->cbLive = churn.cbLive;
+			lpResult->cbPeakRSS = churn.cbPeakRSS - cbBefore;
+			lpResult->cbSteadyRSS = churn.cbRSS - cbBefore;
+
+			fprintf(stderr, "%-44s RSS peak %.1f MB  steady %.1f MB  freed %.1f MB  live %.1f MB\n", "", lpResult->cbPeakRSS / 1048576.0, lpResult->cbSteadyRSS / 1048576.0, lpResult->cbFreedRSS / 1048576.0, lpResult->cbLive / 1048576.0);
+		}
+	}
+}
+
+static void RunPlotBenchmarks()
+{
+	PLOTBENCH plot;
+	char szName[96];
+	const int cx = 2048, cy = 2048;
+	unsigned uSeed = 1;
+
+	plot.px = new int[PLOT_PIXELS];
+	plot.py = new int[PLOT_PIXELS];
+	plot.pColors = new DWORD[PLOT_PIXELS];
+
+	for(int i = 0; i < PLOT_PIXELS; i++) {
+		uSeed = uSeed * 1103515245 + 12345;
+		plot.px[i] = (int)(uSeed >> 8) % cx;
+		uSeed = uSeed * 1103515245 + 12345;
+		plot.py[i] = (int)(uSeed >> 8) % cy;
+		uSeed = uSeed * 1103515245 + 12345;
+		plot.pColors[i] = uSeed >> 8;
+	}
+
+	for(int f = 0; f < (int)(sizeof(g_iFormats) / sizeof(g_iFormats[0])); f++) {
+		int iFormat = g_iFormats[f];
+		const char* lpszFormat = GetFormatName(iFormat);
+		DIBSURFACE surface;
+
+		if(!CreateDIBSurface(&surface, cx, cy, GetFormatBpp(iFormat))) {
+			continue;
+		}
+
+		plot.lpSurface = &surface;
+
+		// Every plotted pixel is written once, that is all the memory
+		// traffic there is.
+		long long cb = (long long)PLOT_PIXELS * GetDIBFormatBytes(iFormat);
+
+		snprintf(szName, sizeof(szName), "plot/%s/switch", lpszFormat);
+		RunBenchmark(szName, cx, cy, PLOT_PIXELS, cb, PlotSwitchBench, &plot);
+
+		snprintf(szName, sizeof(szName), "plot/%s/surface", lpszFormat);
+		RunBenchmark(szName, cx, cy, PLOT_PIXELS, cb, GetPlotSurfaceProc(iFormat), &plot);
+
+		snprintf(szName, sizeof(szName), "plot/%s/batch/simd", lpszFormat);
+		RunBenchmark(szName, cx, cy, PLOT_PIXELS, cb, PlotBatchBench, &plot);
+
+		SetCPUFeatureMask(0);
+		snprintf(szName, sizeof(szName), "plot/%s/batch/c", lpszFormat);
+		RunBenchmark(szName, cx, cy, PLOT_PIXELS, cb, PlotBatchBench, &plot);
+		SetCPUFeatureMask(0xFFFFFFFF);
+
+		FreeDIBSurface(&surface);
+	}
+
+	delete [] plot.px;
+	delete [] plot.py;
+	delete [] plot.pColors;
+}
+
+static void RunRasterBenchmarks()
+{
+	RASTERBENCH raster;
+	char szName[96];
+	const int cx = 2048, cy = 2048;
+	long long cSpanPixels = 0, cLinePixels = 0;
+	unsigned uSeed = 7;
+
+	raster.px0 = new int[RASTER_SHAPES];
+	raster.py0 = new int[RASTER_SHAPES];
+	raster.px1 = new int[RASTER_SHAPES];
+	raster.py1 = new int[RASTER_SHAPES];
+	raster.pxSpan = new int[RASTER_SHAPES];
+	raster.pColors = new DWORD[RASTER_SHAPES];
+
+	// Spans from 1 to 512 pixels long, and lines that are on the surface
+	// from end to end. Both use the same coordinates.
+	for(int i = 0; i < RASTER_SHAPES; i++) {
+		uSeed = uSeed * 1103515245 + 12345;
+		raster.px0[i] = (int)(uSeed >> 8) % cx;
+		uSeed = uSeed * 1103515245 + 12345;
+		raster.py0[i] = (int)(uSeed >> 8) % cy;
+		uSeed = uSeed * 1103515245 + 12345;
+		raster.px1[i] = (int)(uSeed >> 8) % cx;
+		uSeed = uSeed * 1103515245 + 12345;
+		raster.py1[i] = (int)(uSeed >> 8) % cy;
+		uSeed = uSeed * 1103515245 + 12345;
+		raster.pColors[i] = uSeed >> 8;
+
+		raster.pxSpan[i] = std::min(raster.px0[i] + 1 + (int)(uSeed >> 4) % 512, cx);
+
+		cSpanPixels += raster.pxSpan[i] - raster.px0[i];
+		cLinePixels += std::max(abs(raster.px1[i] - raster.px0[i]), abs(raster.py1[i] - raster.py0[i])) + 1;
+	}
+
+	for(int f = 0; f < (int)(sizeof(g_iFormats) / sizeof(g_iFormats[0])); f++) {
+		int iFormat = g_iFormats[f];
+		int iBytes = GetDIBFormatBytes(iFormat);
+		const char* lpszFormat = GetFormatName(iFormat);
+		DIBSURFACE surface, src;
+
+		snprintf(szName, sizeof(szName), "raster/%s/", lpszFormat);
+
+		if(!IsSelected(szName) || !CreateDIBSurface(&surface, cx, cy, GetFormatBpp(iFormat))) {
+			continue;
+		}
+
+		// The blits copy a 1024x1024 sprite, a third of which is the key.
+		if(!CreateTestSurface(&src, cx / 2, cy / 2, iFormat)) {
+			FreeDIBSurface(&surface);
+			continue;
+		}
+
+		for(int y = 0; y < src.cy; y++) {
+			memset(src.pTop + y * src.iPitch, 0, src.cx / 3 * iBytes);
+		}
+
+		raster.lpSurface = &surface;
+		raster.lpSrc = &src;
+
+		long long cbSurface = GetSurfaceBytes(&surface);
+		long long cbSprite = GetSurfaceBytes(&src);
+
+		snprintf(szName, sizeof(szName), "raster/%s/fill/putpixel", lpszFormat);
+		RunBenchmark(szName, cx, cy, (long long)cx * cy, cbSurface, GetFillPutPixelProc(iFormat), &raster);
+
+		for(int iPass = 0; iPass < 2; iPass++) {
+			const char* lpszPath = iPass ? "c" : "simd";
+
+			if(iPass) {
+				SetCPUFeatureMask(0);
+			}
+
+			snprintf(szName, sizeof(szName), "raster/%s/fill/%s", lpszFormat, lpszPath);
+			RunBenchmark(szName, cx, cy, (long long)cx * cy, cbSurface, FillBench, &raster);
+
+			snprintf(szName, sizeof(szName), "raster/%s/span/%s", lpszFormat, lpszPath);
+			RunBenchmark(szName, cx, cy, cSpanPixels, cSpanPixels * iBytes, SpanBench, &raster);
+
+			snprintf(szName, sizeof(szName), "raster/%s/colorkey/%s", lpszFormat, lpszPath);
+			RunBenchmark(szName, src.cx, src.cy, (long long)src.cx * src.cy, cbSprite * 3, ColorKeyBlitBench, &raster);
+		}
+
+		SetCPUFeatureMask(0xFFFFFFFF);
+
+		snprintf(szName, sizeof(szName), "raster/%s/line", lpszFormat);
+		RunBenchmark(szName, cx, cy, cLinePixels, cLinePixels * iBytes, LineBench, &raster);
+
+		snprintf(szName, sizeof(szName), "raster/%s/blit", lpszFormat);
+		RunBenchmark(szName, src.cx, src.cy, (long long)src.cx * src.cy, cbSprite * 2, BlitBench, &raster);
+
+		FreeDIBSurface(&src);
+		FreeDIBSurface(&surface);
+	}
+
+	delete [] raster.px0;
+	delete [] raster.py0;
+	delete [] raster.px1;
+	delete [] raster.py1;
+	delete [] raster.pxSpan;
+	delete [] raster.pColors;
+}
+
+static void RunCompositeBenchmarks()
+{
+	static const char* lpszModes[COMPOSITE_MODES] = { "over", "add", "multiply" };
+	static const int iSizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	static const struct { const char* lpszName; DWORD dwMask; } paths[] = {
+		{ "avx2", 0xFFFFFFFF }, { "sse41", CPU_SSE2 | CPU_SSSE3 | CPU_SSE41 }, { "c", 0 },
+	};
+	char szName[96];
+
+	for(int s = 0; s < (int)(sizeof(iSizes) / sizeof(iSizes[0])); s++) {
+		int cx = iSizes[s][0], cy = iSizes[s][1];
+		DIBSURFACE dst, layers[COMPOSITE_LAYERS];
+		COMPOSITEBENCH composite;
+		BOOL bSelected = FALSE;
+		int cLayers = 0;
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		for(int iMode = 0; iMode < COMPOSITE_MODES; iMode++) {
+			for(int p = 0; p < (int)(sizeof(paths) / sizeof(paths[0])); p++) {
+				snprintf(szName, sizeof(szName), "composite/%s/%dx%d/%s", lpszModes[iMode], cx, cy, paths[p].lpszName);
+				bSelected |= IsSelected(szName);
+			}
+		}
+
+		snprintf(szName, sizeof(szName), "composite/layers-%d/%dx%d/serial", COMPOSITE_LAYERS, cx, cy);
+		bSelected |= IsSelected(szName);
+		snprintf(szName, sizeof(szName), "composite/layers-%d/%dx%d/pool-%d", COMPOSITE_LAYERS, cx, cy, g_lpPool->Threads());
+		bSelected |= IsSelected(szName);
+
+		if(!bSelected || !CreateTestSurface(&dst, cx, cy, DIBFMT_XRGB32)) {
+			continue;
+		}
+
+		while(cLayers < COMPOSITE_LAYERS && CreateLayerSurface(&layers[cLayers], cx, cy, cLayers)) {
+			cLayers++;
+		}
+
+		composite.lpDst = &dst;
+		composite.lpLayers = layers;
+		composite.lpPool = NULL;
+
+		// Reads the layer and the destination, writes the destination.
+		long long cb = (long long)cx * cy * 4 * 3;
+
+		for(int iMode = 0; cLayers == COMPOSITE_LAYERS && iMode < COMPOSITE_MODES; iMode++) {
+			composite.iMode = iMode;
+
+			for(int p = 0; p < (int)(sizeof(paths) / sizeof(paths[0])); p++) {
+				SetCPUFeatureMask(paths[p].dwMask);
+				snprintf(szName, sizeof(szName), "composite/%s/%dx%d/%s", lpszModes[iMode], cx, cy, paths[p].lpszName);
+				RunBenchmark(szName, cx, cy, (long long)cx * cy, cb, CompositeBench, &composite);
+			}
+
+			SetCPUFeatureMask(0xFFFFFFFF);
+		}
+
+		// A whole frame: all layers over a background, on one thread and
+		// on the pool. Measured per layer pixel.
+		if(cLayers == COMPOSITE_LAYERS) {
+			snprintf(szName, sizeof(szName), "composite/layers-%d/%dx%d/serial", COMPOSITE_LAYERS, cx, cy);
+			RunBenchmark(szName, cx, cy, (long long)cx * cy * COMPOSITE_LAYERS, cb * COMPOSITE_LAYERS, CompositeLayersBench, &composite);
+
+			composite.lpPool = g_lpPool;
+			snprintf(szName, sizeof(szName), "composite/layers-%d/%dx%d/pool-%d", COMPOSITE_LAYERS, cx, cy, g_lpPool->Threads());
+			RunBenchmark(szName, cx, cy, (long long)cx * cy * COMPOSITE_LAYERS, cb * COMPOSITE_LAYERS, CompositeLayersBench, &composite);
+		}
+
+		while(cLayers > 0) {
+			FreeDIBSurface(&layers[--cLayers]);
+		}
+
+		FreeDIBSurface(&dst);
+	}
+}
+
+static void RunConvertBenchmarks()
+{
+	const int cFormats = (int)(sizeof(g_iFormats) / sizeof(g_iFormats[0]));
+	char szName[96];
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		// Every format to every other one, 20 pairs.
+		for(int p = 0; p < cFormats * cFormats; p++) {
+			int iSrcFormat = g_iFormats[p / cFormats], iDstFormat = g_iFormats[p % cFormats];
+			DIBSURFACE src, dst;
+			CONVERTBENCH convert = { &dst, &src };
+
+			if(iSrcFormat == iDstFormat) {
+				continue;
+			}
+
+			snprintf(szName, sizeof(szName), "convert/%s-%s/%dx%d/", GetFormatName(iSrcFormat), GetFormatName(iDstFormat), cx, cy);
+
+			if(!IsSelected(szName)) {
+				continue;
+			}
+
+			if(!CreateTestSurface(&src, cx, cy, iSrcFormat)) {
+				continue;
+			}
+
+			if(!CreateDIBSurface(&dst, cx, cy, GetFormatBpp(iDstFormat))) {
+				FreeDIBSurface(&src);
+				continue;
+			}
+
+			long long cb = GetSurfaceBytes(&src) + GetSurfaceBytes(&dst);
+			size_t cchName = strlen(szName);
+
+			snprintf(szName + cchName, sizeof(szName) - cchName, "simd");
+			RunBenchmark(szName, cx, cy, (long long)cx * cy, cb, ConvertBench, &convert);
+
+			SetCPUFeatureMask(0);
+			snprintf(szName + cchName, sizeof(szName) - cchName, "c");
+			RunBenchmark(szName, cx, cy, (long long)cx * cy, cb, ConvertBench, &convert);
+			SetCPUFeatureMask(0xFFFFFFFF);
+
+			FreeDIBSurface(&dst);
+			FreeDIBSurface(&src);
+		}
+	}
+}
+
+// Unpacking bitmaps with channel masks we can't draw in to XRGB, with the
+// layout's own unpacker ("kernel") and with the table driven one every
+// other layout goes through ("generic"). The last two only have the
+// latter.
+static void RunBitfieldsBenchmarks()
+{
+	static const struct {
+		const char*	lpszName;
+		DWORD		dwMasks[4];
+		int			iBpp;
+	} layouts[] = {
+		{ "A8B8G8R8", { 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000 }, 32 },
+		{ "R8G8B8A8", { 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF }, 32 },
+		{ "A2R10G10B10", { 0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000 }, 32 },
+		{ "A4R4G4B4", { 0x00000F00, 0x000000F0, 0x0000000F, 0x0000F000 }, 16 },
+		{ "A1R5G5B5", { 0x00007C00, 0x000003E0, 0x0000001F, 0x00008000 }, 16 },
+		{ "R5G5B5A1", { 0x0000F800, 0x000007C0, 0x0000003E, 0x00000001 }, 16 },
+		{ "X4R4G4B4", { 0x00000F00, 0x000000F0, 0x0000000F, 0 }, 16 },
+	};
+	char szName[2][96];
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		for(int l = 0; l < (int)(sizeof(layouts) / sizeof(layouts[0])); l++) {
+			BITFIELDSBENCH* lpBench = (BITFIELDSBENCH*)malloc(sizeof(BITFIELDSBENCH));
+			DIBSURFACE dst;
+			BOOL bSelected = FALSE;
+
+			if(!lpBench) {
+				continue;
+			}
+
+			AnalyzeBitfields(layouts[l].dwMasks, layouts[l].iBpp, &lpBench->fields);
+
+			for(int i = 0; i < 2; i++) {
+				snprintf(szName[i], sizeof(szName[i]), "bitfields/%s/%dx%d/%s", layouts[l].lpszName, cx, cy, i ? "generic" : "kernel");
+				bSelected |= IsSelected(szName[i]) && (i || lpBench->fields.iLayout != BITFIELDS_GENERIC);
+			}
+
+			lpBench->iSrcPitch = DIB_STRIDE(cx, layouts[l].iBpp);
+
+			BYTE* pSrc = bSelected ? (BYTE*)malloc((size_t)lpBench->iSrcPitch * cy) : NULL;
+
+			if(!pSrc || !CreateDIBSurface(&dst, cx, cy, 32)) {
+				free(pSrc);
+				free(lpBench);
+				continue;
+			}
+
+			// Noise, every channel value about as often.
+			DWORD dwSeed = 0x12345678;
+
+			for(size_t i = 0; i < (size_t)lpBench->iSrcPitch * cy; i++) {
+				dwSeed = dwSeed * 1664525 + 1013904223;
+				pSrc[i] = (BYTE)(dwSeed >> 24);
+			}
+
+			lpBench->pSrc = pSrc;
+			lpBench->lpDst = &dst;
+
+			long long cb = (long long)lpBench->iSrcPitch * cy + GetSurfaceBytes(&dst);
+
+			if(lpBench->fields.iLayout != BITFIELDS_GENERIC) {
+				RunBenchmark(szName[0], cx, cy, (long long)cx * cy, cb, BitfieldsBench, lpBench);
+			}
+
+			lpBench->fields.iLayout = BITFIELDS_GENERIC;
+			RunBenchmark(szName[1], cx, cy, (long long)cx * cy, cb, BitfieldsBench, lpBench);
+
+			FreeDIBSurface(&dst);
+			free(pSrc);
+			free(lpBench);
+		}
+	}
+}
+
+static void RunQuantizeBenchmarks()
+{
+	static const char* lpszCases[] = { "build", "map", "map-cold", "dither" };
+	static const LPBENCHPROC lpfnCases[] = { QuantBuildBench, QuantMapBench, QuantMapColdBench, QuantDitherBench };
+	char szName[96];
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+		BOOL bSelected = FALSE;
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		for(int i = 0; i < 4; i++) {
+			snprintf(szName, sizeof(szName), "quantize/%s/%dx%d", lpszCases[i], cx, cy);
+			bSelected |= IsSelected(szName);
+		}
+
+		DIBSURFACE src, dst;
+		QUANTBENCH quant;
+
+		if(!bSelected || !CreateTestSurface(&src, cx, cy, DIBFMT_XRGB32)) {
+			continue;
+		}
+
+		if(!CreateDIBSurface(&dst, cx, cy, 8)) {
+			FreeDIBSurface(&src);
+			continue;
+		}
+
+		if(!CreateQuantizer(&quant.quant, g_lpPool)) {
+			FreeDIBSurface(&dst);
+			FreeDIBSurface(&src);
+			continue;
+		}
+
+		quant.lpDst = &dst;
+		quant.lpSrc = &src;
+		quant.lpPool = g_lpPool;
+
+		// The mapping cases use the colors the first one leaves behind.
+		BuildQuantizerColors(&quant.quant, &src, 256, g_lpPool);
+
+		for(int i = 0; i < 4; i++) {
+			snprintf(szName, sizeof(szName), "quantize/%s/%dx%d", lpszCases[i], cx, cy);
+			RunBenchmark(szName, cx, cy, (long long)cx * cy, GetSurfaceBytes(&src) + (i ? GetSurfaceBytes(&dst) : 0), lpfnCases[i], &quant);
+		}
+
+		FreeQuantizer(&quant.quant);
+		FreeDIBSurface(&dst);
+		FreeDIBSurface(&src);
+	}
+}
+
+static void RunScaleBenchmarks()
+{
+	static const char* lpszModes[] = { "nearest", "bilinear", "box" };
+	static const int iFormats[] = { DIBFMT_BGR24, DIBFMT_XRGB32 };
+	std::vector<CThreadPool*> pools;
+	char szName[96];
+
+	// Every case is run with 1, 2, 4 and so on threads, up to as many as
+	// '-j' says, to see how far the scaler scales.
+	for(int cThreads = 1; ; cThreads *= 2) {
+		if(cThreads >= g_lpPool->Threads()) {
+			pools.push_back(g_lpPool);
+			break;
+		}
+
+		pools.push_back(new CThreadPool(cThreads));
+	}
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		for(int f = 0; f < (int)(sizeof(iFormats) / sizeof(iFormats[0])); f++) {
+			DIBSURFACE src;
+
+			BOOL bSelected = FALSE;
+
+			// Making the source takes a while at 64 megapixels, so only
+			// do that if any of its cases is going to run.
+			for(int i = 0; i < 6; i++) {
+				snprintf(szName, sizeof(szName), "scale/%s/%s/%dx%d-", GetFormatName(iFormats[f]), lpszModes[i % 3], cx, cy);
+				bSelected |= IsSelected(szName);
+			}
+
+			if(!bSelected || !CreateTestSurface(&src, cx, cy, iFormats[f])) {
+				continue;
+			}
+
+			// Down to a third, which is what showing a big image in a
+			// window does, and up to one and a half times.
+			for(int iDir = 0; iDir < 2; iDir++) {
+				int cxDst = iDir ? cx * 3 / 2 : cx / 3;
+				int cyDst = iDir ? cy * 3 / 2 : cy / 3;
+				DIBSURFACE dst;
+
+				if(iDir && !IsSizeSelected(cxDst, cyDst)) {
+					continue;
+				}
+
+				if(!CreateDIBSurface(&dst, cxDst, cyDst, GetFormatBpp(iFormats[f]))) {
+					continue;
+				}
+
+				for(int iMode = SCALE_NEAREST; iMode <= SCALE_BOX; iMode++) {
+					SCALEBENCH scale;
+
+					snprintf(szName, sizeof(szName), "scale/%s/%s/%dx%d-%dx%d", GetFormatName(iFormats[f]), lpszModes[iMode], cx, cy, cxDst, cyDst);
+
+					if(!IsSelected(szName) || !CreateScalePlan(&scale.plan, cx, cy, cxDst, cyDst, iMode, GetDIBFormatBytes(iFormats[f]))) {
+						continue;
+					}
+
+					scale.lpDst = &dst;
+					scale.lpSrc = &src;
+
+					size_t cchName = strlen(szName);
+
+					for(size_t i = 0; i < pools.size(); i++) {
+						scale.lpPool = pools[i];
+						snprintf(szName + cchName, sizeof(szName) - cchName, "/pool-%d", pools[i]->Threads());
+
+						// Measured per destination pixel, that's where the work is.
+						RunBenchmark(szName, cxDst, cyDst, (long long)cxDst * cyDst, GetSurfaceBytes(&src) + GetSurfaceBytes(&dst), ScaleBench, &scale);
+					}
+
+					FreeScalePlan(&scale.plan);
+				}
+
+				FreeDIBSurface(&dst);
+			}
+
+			FreeDIBSurface(&src);
+		}
+	}
+
+	for(size_t i = 0; i + 1 < pools.size(); i++) {
+		delete pools[i];
+	}
+}
+
+static void RunPyramidBenchmarks()
+{
+	static const char* lpszFilters[] = { "box", "lanczos" };
+	static const int iFormats[] = { DIBFMT_BGR24, DIBFMT_XRGB32 };
+	char szName[4][96];
+
+	for(int s = 0; s < (int)(sizeof(g_iSizes) / sizeof(g_iSizes[0])); s++) {
+		int cx = g_iSizes[s], cy = g_iSizes[s];
+		int cxDst = cx / 6, cyDst = cy / 6;
+
+		if(!IsSizeSelected(cx, cy)) {
+			continue;
+		}
+
+		for(int f = 0; f < (int)(sizeof(iFormats) / sizeof(iFormats[0])); f++) {
+			PYRAMIDBENCH bench;
+			DIBSURFACE src, dst;
+			BOOL bSelected = FALSE;
+
+			for(int i = 0; i < 2; i++) {
+				snprintf(szName[i], sizeof(szName[i]), "pyramid/%s/build-%s/%dx%d", GetFormatName(iFormats[f]), lpszFilters[i], cx, cy);
+				bSelected |= IsSelected(szName[i]);
+			}
+
+			snprintf(szName[2], sizeof(szName[2]), "pyramid/%s/view-direct/%dx%d-%dx%d", GetFormatName(iFormats[f]), cx, cy, cxDst, cyDst);
+			snprintf(szName[3], sizeof(szName[3]), "pyramid/%s/view-pyramid/%dx%d-%dx%d", GetFormatName(iFormats[f]), cx, cy, cxDst, cyDst);
+			bSelected |= IsSelected(szName[2]) || IsSelected(szName[3]);
+
+			if(!bSelected || !CreateTestSurface(&src, cx, cy, iFormats[f])) {
+				continue;
+			}
+
+			ZeroMemory(&bench, sizeof(bench));
+			bench.lpSrc = &src;
+
+			for(int i = 0; i < 2; i++) {
+				bench.iFilter = i ? PYRAMID_LANCZOS : PYRAMID_BOX;
+				RunBenchmark(szName[i], cx, cy, (long long)cx * cy, GetSurfaceBytes(&src) * 4 / 3, PyramidBuildBench, &bench);
+			}
+
+			if((!IsSelected(szName[2]) && !IsSelected(szName[3])) || !CreateDIBSurface(&dst, cxDst, cyDst, GetFormatBpp(iFormats[f]))) {
+				FreeDIBSurface(&src);
+				continue;
+			}
+
+			bench.scale.lpDst = &dst;
+			bench.scale.lpSrc = &src;
+			bench.scale.lpPool = g_lpPool;
+
+			// Everything to a sixth, the way 'ScaleDIBSurface' does it
+			// without a pyramid.
+			if(CreateScalePlan(&bench.scale.plan, cx, cy, cxDst, cyDst, SCALE_BOX, GetDIBFormatBytes(iFormats[f]))) {
+				RunBenchmark(szName[2], cxDst, cyDst, (long long)cxDst * cyDst, GetSurfaceBytes(&src) + GetSurfaceBytes(&dst), ScaleBench, &bench.scale);
+				FreeScalePlan(&bench.scale.plan);
+			}
+
+			// Level 2 is a quarter, the rest is less than a factor of two.
+			if(IsSelected(szName[3]) && BuildPyramid(&bench.pyramid, &src, PYRAMID_BOX, g_lpPool)) {
+				RECT rc = { 0, 0, cx, cy };
+
+				FindPyramidView(&bench.pyramid, &rc, cxDst, cyDst, &bench.view);
+
+				int cxLevel = bench.view.rcLevel.right - bench.view.rcLevel.left;
+				int cyLevel = bench.view.rcLevel.bottom - bench.view.rcLevel.top;
+
+				if(CreateDIBSurface(&bench.level, cxLevel, cyLevel, GetFormatBpp(iFormats[f]))) {
+					if(CreateScalePlan(&bench.scale.plan, cxLevel, cyLevel, cxDst, cyDst, SCALE_BOX, GetDIBFormatBytes(iFormats[f]))) {
+						RunBenchmark(szName[3], cxDst, cyDst, (long long)cxDst * cyDst, GetSurfaceBytes(&bench.level) * 2 + GetSurfaceBytes(&dst), PyramidViewBench, &bench);
+						FreeScalePlan(&bench.scale.plan);
+					}
+
+					FreeDIBSurface(&bench.level);
+				}
+
+				FreePyramid(&bench.pyramid);
+			}
+
+			FreeDIBSurface(&dst);
+			FreeDIBSurface(&src);
+		}
+	}
+}
+
+// A 1080p frame with as many changed pixels as Example 4 draws by
+// default, 16 batches of 64, and with 64 times that.
+static void RunStreamBenchmarks()
+{
+	static const int iChanges[] = { 1024, 65536 };
+	static const char* lpszCases[] = { "encode", "encode-dirty", "decode" };
+	const int cx = 1920, cy = 1080;
+	char szName[3][96];
+
+	if(!IsSizeSelected(cx, cy)) {
+		return;
+	}
+
+	for(int f = 0; f < (int)(sizeof(g_iFormats) / sizeof(g_iFormats[0])); f++) {
+		for(int c = 0; c < (int)(sizeof(iChanges) / sizeof(iChanges[0])); c++) {
+			STREAMBENCH* lpBench;
+			DIRTYREGION dirty;
+			BOOL bSelected = FALSE;
+
+			for(int i = 0; i < 3; i++) {
+				snprintf(szName[i], sizeof(szName[i]), "framestream/%s/%dx%d/%dpx/%s", GetFormatName(g_iFormats[f]), cx, cy, iChanges[c], lpszCases[i]);
+				bSelected |= IsSelected(szName[i]);
+			}
+
+			if(!bSelected || (lpBench = (STREAMBENCH*)calloc(1, sizeof(STREAMBENCH))) == NULL) {
+				continue;
+			}
+
+			if(!CreateTestSurface(&lpBench->frames[0], cx, cy, g_iFormats[f]) || !CreateTestSurface(&lpBench->frames[1], cx, cy, g_iFormats[f]) || !CreateDirtyRegion(&dirty, cx, cy)) {
+				FreeDIBSurface(&lpBench->frames[0]);
+				FreeDIBSurface(&lpBench->frames[1]);
+				free(lpBench);
+				continue;
+			}
+
+			LPDIBSURFACE lpFrame = &lpBench->frames[1];
+			int iBytes = GetDIBFormatBytes(g_iFormats[f]);
+			unsigned uSeed = 54321;
+
+			for(int i = 0; i < iChanges[c]; i++) {
+				uSeed = uSeed * 1103515245 + 12345;
+
+				int x = (uSeed >> 8) % cx;
+				uSeed = uSeed * 1103515245 + 12345;
+				int y = (uSeed >> 8) % cy;
+
+				for(int k = 0; k < iBytes; k++) {
+					lpFrame->pTop[(size_t)y * lpFrame->iPitch + x * iBytes + k] ^= 0x5A;
+				}
+
+				MarkDirtyPixel(&dirty, x, y);
+			}
+
+			// The same pixels changed going either way.
+			lpBench->cDirty[0] = lpBench->cDirty[1] = GetDirtyRects(&dirty, lpBench->rcDirty[0], MAX_STREAM_RECTS);
+			memcpy(lpBench->rcDirty[1], lpBench->rcDirty[0], sizeof(lpBench->rcDirty[0]));
+			FreeDirtyRegion(&dirty);
+
+			long long cbFrame = GetSurfaceBytes(lpFrame);
+			long long cbDirty = 0;
+
+			for(int i = 0; i < lpBench->cDirty[0]; i++) {
+				cbDirty += (long long)(lpBench->rcDirty[0][i].right - lpBench->rcDirty[0][i].left) * (lpBench->rcDirty[0][i].bottom - lpBench->rcDirty[0][i].top) * iBytes;
+			}
+
+			// 'pDeltas[i]' makes frame i out of the other one. Their size is
+			// the ratio of every case.
+			double dRatio = 0;
+
+			if(!CreateFrameEncoder(&lpBench->encoder, &lpBench->frames[0])) {
+				FreeFrameEncoder(&lpBench->encoder);
+				FreeDIBSurface(&lpBench->frames[0]);
+				FreeDIBSurface(&lpBench->frames[1]);
+				free(lpBench);
+				continue;
+			}
+
+			EncodeFrame(&lpBench->encoder, &lpBench->frames[0], NULL, 0);
+
+			for(int i = 1; i >= 0; i--) {
+				size_t cb = EncodeFrame(&lpBench->encoder, &lpBench->frames[i], NULL, 0);
+
+				if((lpBench->pDeltas[i] = (BYTE*)malloc(cb)) != NULL) {
+					memcpy(lpBench->pDeltas[i], lpBench->encoder.pData, cb);
+					memcpy(&lpBench->headers[i], lpBench->encoder.pData, sizeof(FRAMEHEADER));
+				}
+
+				dRatio += (double)cb / cbFrame / 2;
+			}
+
+			// Every case starts with frame 0 and goes on with frame 1.
+			for(int i = 0; i < 2; i++) {
+				lpBench->bDirty = i;
+				lpBench->iNext = 1;
+				EncodeFrame(&lpBench->encoder, &lpBench->frames[0], NULL, 0);
+
+				if(RunBenchmark(szName[i], cx, cy, (long long)cx * cy, i ? cbDirty * 2 : cbFrame * 2, StreamEncodeBench, lpBench)) {
+					g_Results.back().dRatio = dRatio;
+				}
+			}
+
+			// The decoder starts out black, the first frame is all of frame 0.
+			if(lpBench->pDeltas[0] && lpBench->pDeltas[1] && IsSelected(szName[2]) && CreateFrameDecoder(&lpBench->decoder, &lpBench->encoder.header)) {
+				FRAMEENCODER* lpFirst = (FRAMEENCODER*)malloc(sizeof(FRAMEENCODER));
+
+				if(lpFirst && CreateFrameEncoder(lpFirst, &lpBench->frames[0]) && EncodeFrame(lpFirst, &lpBench->frames[0], NULL, 0)) {
+					DecodeFrame(&lpBench->decoder, (LPFRAMEHEADER)lpFirst->pData, lpFirst->pData + sizeof(FRAMEHEADER));
+					lpBench->iNext = 1;
+
+					if(RunBenchmark(szName[2], cx, cy, (long long)cx * cy, (long long)lpBench->headers[1].cbData + cbDirty, StreamDecodeBench, lpBench)) {
+						g_Results.back().dRatio = dRatio;
+					}
+				}
+
+				if(lpFirst) {
+					FreeFrameEncoder(lpFirst);
+					free(lpFirst);
+				}
+
+				FreeFrameDecoder(&lpBench->decoder);
+			}
+
+			for(int i = 0; i < 2; i++) {
+				free(lpBench->pDeltas[i]);
+				FreeDIBSurface(&lpBench->frames[i]);
+			}
+
+			FreeFrameEncoder(&lpBench->encoder);
+			free(lpBench);
+		}
+	}
+}
+
+//
+// Output.
+//
+
+static void WriteJSONString(FILE* fp, const char* lpsz)
+{
+	fputc('"', fp);
+
+	for(; *lpsz; lpsz++) {
+		if(*lpsz == '"' || *lpsz == '\\') {
+			fputc('\\', fp);
+		}
+
+		fputc(*lpsz, fp);
+	}
+
+	fputc('"', fp);
+}
+
+static void WriteResults(FILE* fp)
+{
+	DWORD dwFeatures = GetCPUFeatures();
+
+	static const struct { DWORD dwFeature; const char* lpszName; } features[] = {
+		{ CPU_SSE2, "sse2" }, { CPU_SSSE3, "ssse3" }, { CPU_SSE41, "sse4.1" }, { CPU_AVX2, "avx2" },
+	};
+	const char* lpszSeparator = "";
+
+	fprintf(fp, "{\n  \"threads\": %d,\n  \"cycles_per_ns\": %.3f,\n  \"cpu_features\": [", g_lpPool->Threads(), g_Options.dCyclesPerNs);
+
+	for(int i = 0; i < (int)(sizeof(features) / sizeof(features[0])); i++) {
+		if(dwFeatures & features[i].dwFeature) {
+			fprintf(fp, "%s\"%s\"", lpszSeparator, features[i].lpszName);
+			lpszSeparator = ", ";
+		}
+	}
+
+	fprintf(fp, "],\n");
+	fprintf(fp, "  \"min_ms\": %g,\n  \"min_iterations\": %d,\n  \"results\": [\n", g_Options.dMinMs, g_Options.cMinIterations);
+
+	for(size_t i = 0; i < g_Results.size(); i++) {
+		const BENCHRESULT* r = &g_Results[i];
+
+		fprintf(fp, "    {\"name\": ");
+		WriteJSONString(fp, r->szName);
+		fprintf(fp, ", \"width\": %d, \"height\": %d, \"pixels\": %lld, \"bytes\": %lld, \"iterations\": %d, ", r->cx, r->cy, r->cPixels, r->cbBytes, r->cIterations);
+		fprintf(fp, "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"min_ns\": %.0f, \"mean_ns\": %.0f, ", r->dP50, r->dP99, r->dMin, r->dMean);
+
+		if(r->dRatio > 0.0) {
+			fprintf(fp, "\"ratio\": %.4f, ", r->dRatio);
+		}
+
+		if(g_Options.dCyclesPerNs > 0.0) {
+			fprintf(fp, "\"px_per_cycle\": %.4f, ", r->cPixels / (r->dP50 * g_Options.dCyclesPerNs));
+		}
+
+		if(r->cbPeakRSS > 0) {
+			fprintf(fp, "\"live_mb\": %.1f, \"rss_peak_mb\": %.1f, \"rss_steady_mb\": %.1f, \"rss_freed_mb\": %.1f, ", r->cbLive / 1048576.0, r->cbPeakRSS / 1048576.0, r->cbSteadyRSS / 1048576.0, r->cbFreedRSS / 1048576.0);
+		}
+
+		if(r->cFiles > 0) {
+			fprintf(fp, "\"files_per_s\": %.0f, \"syscalls_per_file\": %.3f, ", r->cFiles * 1e9 / r->dP50, r->dSyscalls);
+		}
+
+		fprintf(fp, "\"ns_per_pixel\": %.4f, \"mpix_per_s\": %.1f, \"gb_per_s\": %.3f}%s\n", r->dP50 / r->cPixels, r->cPixels * 1e3 / r->dP50, r->cbBytes / r->dP50, i + 1 < g_Results.size() ? "," : "");
+	}
+
+	fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+	g_Options.dMaxMP = 64.0;
+	g_Options.dMinMs = 200.0;
+	g_Options.cMinIterations = 10;
+	g_Options.cThreads = 0;
+	g_Options.dCyclesPerNs = 0.0;
+	g_Options.lpszResources = "../Resources";
+	g_Options.lpszTemp = BENCH_TEMP;
+	g_Options.lpszOutput = NULL;
+	g_Options.lpszFilter = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+			const char* lpszValue = argv[++i];
+
+			switch(argv[i - 1][1]) {
+			case 'm': g_Options.dMaxMP = atof(lpszValue); break;
+			case 't': g_Options.dMinMs = atof(lpszValue); break;
+			case 'i': g_Options.cMinIterations = atoi(lpszValue); break;
+			case 'j': g_Options.cThreads = atoi(lpszValue); break;
+			case 'g': g_Options.dCyclesPerNs = atof(lpszValue); break;
+			case 'r': g_Options.lpszResources = lpszValue; break;
+			case 'd': g_Options.lpszTemp = lpszValue; break;
+			case 'o': g_Options.lpszOutput = lpszValue; break;
+			default:
+				fprintf(stderr, "Unknown option %s\n", argv[i - 1]);
+				return 1;
+			}
+		}
+		else {
+			g_Options.lpszFilter = argv[i];
+		}
+	}
+
+	if(g_Options.cMinIterations < 1) {
+		g_Options.cMinIterations = 1;
+	}
+
+	if(g_Options.dCyclesPerNs <= 0.0) {
+		g_Options.dCyclesPerNs = MeasureCyclesPerNs();
+	}
+
+	g_lpPool = new CThreadPool(g_Options.cThreads);
+
+	RunLoadSaveBenchmarks();
+	RunCacheBenchmarks();
+	RunStartupBenchmarks();
+	RunBatchBenchmarks();
+	RunRegionBenchmarks();
+	RunRLEBenchmarks();
+	RunAllocBenchmarks();
+	RunChurnBenchmarks();
+	RunPlotBenchmarks();
+	RunRasterBenchmarks();
+	RunCompositeBenchmarks();
+	RunConvertBenchmarks();
+	RunBitfieldsBenchmarks();
+	RunQuantizeBenchmarks();
+	RunScaleBenchmarks();
+	RunPyramidBenchmarks();
+	RunStreamBenchmarks();
+
+	if(g_Options.lpszOutput) {
+		FILE* fp = fopen(g_Options.lpszOutput, "w");
+
+		if(!fp) {
+			fprintf(stderr, "Error creating %s\n", g_Options.lpszOutput);
+			delete g_lpPool;
+			return 1;
+		}
+
+		WriteResults(fp);
+		fclose(fp);
+	}
+	else {
+		WriteResults(stdout);
+	}
+
+	delete g_lpPool;
+
+	return 0;
+}
@@ -0,0 +1,1425 @@
+// Checks for the code in 'Common'.
+//
+// The benchmarks say how fast the code is, this program says whether it
+// still does what it should. Every check compares one of the headers with
+// a slower way of doing the same thing that is easy to get right. Like the
+// benchmarks it doesn't need 'windows.h', so it runs on the build machines:
+//
+//   g++ -O2 -std=c++11 -pthread main.cpp -o check
+//   ./check
+//
+// Usage: check [-r resource dir] [-n iterations] [-s seed] [filter]
+//
+// Only the checks whose name contains 'filter' are run. Every check prints
+// a line, and the exit code is 1 if any of them failed.
+//
+// The bmpmap checks map the bitmaps in 'Resources' (bmpmap.h) and compare
+// the view with a copy read the old way, the headers and the color table
+// with fread and every scanline copied into memory of our own. Then they
+// move the pixels of one into its color table, which has to be refused.
+//
+// The rle checks encode random bitmaps with 'EncodeRLE' and decode them
+// again, in chunks of random sizes, which must give back every pixel. Then
+// they fuzz the decoder: the encoded streams are mutated, cut off, or
+// replaced with random bytes, and decoded into surfaces of the wrong size.
+// Nothing can be checked about the pixels that come out, but the decoder
+// must never write outside the surface, not even into the padding at the
+// end of a scanline. Build with -fsanitize=address,undefined to catch the
+// rest. '-n' is the number of bitmaps each check tries, and '-s' seeds the
+// random numbers, so a failure can be run again.
+//
+// The bmppack check builds a pack (bmppack.h), then damages copies of it
+// in ways 'OpenSurfacePack' and 'CheckPackSurfaceInfo' have to notice.
+//
+// The dirty check marks random pixels and tiles of random regions
+// (dirty.h) and asks for fewer rectangles than they take. Every dirty tile
+// must still be in one of them.
+//
+// The bitfields checks unpack random pixels of every layout bitfields.h
+// knows, and of some it doesn't, from bitmaps with a V5 header. Those put
+// the pixels at offset 138, so every load is unaligned. They compare the
+// result with every channel taken out and widened to 8 bits one by one.
+// Then they write bitmaps with those masks (bmpwrite.h), once described
+// with BI_ALPHABITFIELDS and once with a V5 header, and map them again.
+// The masks, the alpha one too, and the pixels must come back unchanged.
+//
+// The scale checks scale random images up and down with the filtered
+// modes of scale.h, once with the SSE2 kernels and once without. Both must
+// give the same pixels, and every pixel must be within 1 of the weights of
+// the plan applied in floating point.
+//
+// The pyramid checks build pyramids (pyramid.h) of random images, down to
+// a single row, save them and open them again. Every tile must come back
+// with the same pixels and a BITMAPINFO of its own size.
+//
+// The framestream checks encode a few frames of random changes at every
+// depth (framestream.h), sometimes with the rectangles that changed and
+// sometimes without, and write them to a file. Reading the file back has
+// to give every frame byte for byte, and the end of the stream after the
+// last one.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../Common/bmpmap.h"
+#include "../Common/rle.h"
+#include "../Common/bmppack.h"
+#include "../Common/pyramid.h"
+#include "../Common/dirty.h"
+#include "../Common/bitfields.h"
+#include "../Common/bmpwrite.h"
+#include "../Common/scale.h"
+#include "../Common/framestream.h"
+
+#ifdef _WIN32
+#define	CHECK_TEMP		"."
+#else
+#define	CHECK_TEMP		"/tmp"
+#endif
+
+typedef struct tagCHECKOPTIONS {
+	const char*		lpszResources;
+	const char*		lpszFilter;
+	int				cIterations;	// Random bitmaps per check
+	DWORD			dwSeed;
+} CHECKOPTIONS;
+
+// One check, returns FALSE if it failed.
+typedef BOOL (*LPCHECKPROC)(void* lpParam);
+
+static CHECKOPTIONS g_Options;
+static std::string g_Messages;		// Why the check that runs failed
+static int g_cPassed;
+static int g_cFailed;
+
+static BOOL IsSelected(const char* lpszName)
+{
+	return !g_Options.lpszFilter || strstr(lpszName, g_Options.lpszFilter) != NULL;
+}
+
+// Notes why a check failed and returns FALSE, so a check can end with
+// 'return Fail(...)'. The notes are printed under the name of the check.
+static BOOL Fail(const char* lpszFormat, ...)
+{
+	char szMessage[512];
+	va_list args;
+
+	va_start(args, lpszFormat);
+	vsnprintf(szMessage, sizeof(szMessage), lpszFormat, args);
+	va_end(args);
+
+	g_Messages += "    ";
+	g_Messages += szMessage;
+	g_Messages += "\n";
+
+	return FALSE;
+}
+
+// Runs 'lpfnCheck' if it is selected and counts the result.
+static void RunCheck(const char* lpszName, LPCHECKPROC lpfnCheck, void* lpParam)
+{
+	if(!IsSelected(lpszName)) {
+		return;
+	}
+
+	g_Messages.clear();
+
+	BOOL bPassed = lpfnCheck(lpParam);
+
+	printf("%-44s %s\n%s", lpszName, bPassed ? "ok" : "FAILED", g_Messages.c_str());
+
+	if(bPassed) {
+		g_cPassed++;
+	}
+	else {
+		g_cFailed++;
+	}
+}
+
+//
+// Mapped bitmaps.
+//
+
+typedef struct tagCOPIEDBITMAP {
+	BITMAPFILEHEADER	bfh;
+	BITMAPINFOHEADER	bih;
+	RGBQUAD				palette[256];
+	int					iColors;
+	int					iStride;
+	std::vector<BYTE>	bits;		// Top row first
+} COPIEDBITMAP;
+
+// Reads an uncompressed bitmap with fread and copies its scanlines, top
+// row first, into 'lpBitmap'. This is all 'MapBitmapFile' saves us from.
+static BOOL ReadBitmapCopy(const char* lpszFilename, COPIEDBITMAP* lpBitmap)
+{
+	FILE* fp = fopen(lpszFilename, "rb");
+
+	if(!fp) {
+		return Fail("can't open %s", lpszFilename);
+	}
+
+	if(fread(&lpBitmap->bfh, sizeof(BITMAPFILEHEADER), 1, fp) != 1 || fread(&lpBitmap->bih, sizeof(BITMAPINFOHEADER), 1, fp) != 1) {
+		fclose(fp);
+		return Fail("can't read the headers of %s", lpszFilename);
+	}
+
+	const BITMAPINFOHEADER* pbih = &lpBitmap->bih;
+	int cy = pbih->biHeight < 0 ? -pbih->biHeight : pbih->biHeight;
+
+	if(pbih->biCompression != BI_RGB) {
+		fclose(fp);
+		return Fail("%s is compressed", lpszFilename);
+	}
+
+	lpBitmap->iColors = 0;
+
+	if(pbih->biBitCount <= 8) {
+		lpBitmap->iColors = pbih->biClrUsed ? (int)pbih->biClrUsed : 1 << pbih->biBitCount;
+
+		if(fseek(fp, sizeof(BITMAPFILEHEADER) + pbih->biSize, SEEK_SET) != 0 || fread(lpBitmap->palette, sizeof(RGBQUAD), lpBitmap->iColors, fp) != (size_t)lpBitmap->iColors) {
+			fclose(fp);
+			return Fail("can't read the color table of %s", lpszFilename);
+		}
+	}
+
+	lpBitmap->iStride = ((pbih->biWidth * pbih->biBitCount + 31) / 32) * 4;
+	lpBitmap->bits.resize((size_t)lpBitmap->iStride * cy);
+
+	for(int y = 0; y < cy; y++) {
+		int iRow = pbih->biHeight < 0 ? y : cy - 1 - y;
+
+		if(fseek(fp, lpBitmap->bfh.bfOffBits + (long)iRow * lpBitmap->iStride, SEEK_SET) != 0 || fread(&lpBitmap->bits[(size_t)y * lpBitmap->iStride], lpBitmap->iStride, 1, fp) != 1) {
+			fclose(fp);
+			return Fail("can't read scanline %d of %s", y, lpszFilename);
+		}
+	}
+
+	fclose(fp);
+
+	return TRUE;
+}
+
+static BOOL CheckBitmapView(void* lpParam)
+{
+	const char* lpszFilename = (const char*)lpParam;
+	COPIEDBITMAP copy;
+	BITMAPVIEW view;
+	BITMAPINFOHEADER bih;
+	BOOL bPassed = TRUE;
+
+	if(!ReadBitmapCopy(lpszFilename, &copy)) {
+		return FALSE;
+	}
+
+	if(!MapBitmapFile(lpszFilename, &view)) {
+		return Fail("can't map %s", lpszFilename);
+	}
+
+	// The headers the view copied out, and the one in the mapping. That one
+	// follows the 14 byte file header, so it is copied out byte by byte.
+	memcpy(&bih, (const BYTE*)view.lpBmi, sizeof(bih));
+
+	if(memcmp(&view.bfh, &copy.bfh, sizeof(BITMAPFILEHEADER)) != 0) {
+		bPassed = Fail("file header differs");
+	}
+
+	if(memcmp(&view.bih, &copy.bih, sizeof(BITMAPINFOHEADER)) != 0 || memcmp(&bih, &copy.bih, sizeof(BITMAPINFOHEADER)) != 0) {
+		bPassed = Fail("info header differs");
+	}
+
+	if(view.cx != copy.bih.biWidth || view.cy != (int)(copy.bih.biHeight < 0 ? -copy.bih.biHeight : copy.bih.biHeight) || view.bTopDown != (copy.bih.biHeight < 0)) {
+		bPassed = Fail("size is %dx%d%s, should be %dx%d", view.cx, view.cy, view.bTopDown ? " top-down" : "", (int)copy.bih.biWidth, (int)copy.bih.biHeight);
+	}
+
+	if(view.iStride != copy.iStride || view.cbBits != copy.bits.size()) {
+		bPassed = Fail("stride is %d and %zu bytes of pixels, should be %d and %zu", view.iStride, view.cbBits, copy.iStride, copy.bits.size());
+	}
+
+	if(view.iColors != copy.iColors || (copy.iColors && (!view.lpPalette || memcmp(view.lpPalette, copy.palette, copy.iColors * sizeof(RGBQUAD)) != 0))) {
+		bPassed = Fail("color table differs, %d colors, should be %d", view.iColors, copy.iColors);
+	}
+
+	if(view.iStride == copy.iStride && view.cy * copy.iStride == (int)copy.bits.size()) {
+		for(int y = 0; y < view.cy; y++) {
+			if(memcmp(GetViewScanline(&view, y), &copy.bits[(size_t)y * copy.iStride], copy.iStride) != 0) {
+				bPassed = Fail("scanline %d differs", y);
+				break;
+			}
+		}
+	}
+
+	UnmapBitmapFile(&view);
+
+	return bPassed;
+}
+
+// Moves the pixels of a bitmap in memory into its headers and its color
+// table, which 'ParseBitmapView' has to refuse.
+static BOOL CheckBitmapOffBits(void* lpParam)
+{
+	const char* lpszFilename = (const char*)lpParam;
+	std::vector<BYTE> data;
+	BITMAPFILEHEADER bfh;
+	BITMAPVIEW view;
+	BOOL bPassed = TRUE;
+	FILE* fp = fopen(lpszFilename, "rb");
+
+	if(!fp) {
+		return Fail("can't open %s", lpszFilename);
+	}
+
+	data.resize(1 << 20);
+	data.resize(fread(&data[0], 1, data.size(), fp));
+	fclose(fp);
+
+	if(!ParseBitmapView(&data[0], data.size(), &view)) {
+		return Fail("%s isn't accepted", lpszFilename);
+	}
+
+	memcpy(&bfh, &data[0], sizeof(bfh));
+
+	for(DWORD dwOffBits = 0; dwOffBits < bfh.bfOffBits; dwOffBits++) {
+		memcpy(&data[offsetof(BITMAPFILEHEADER, bfOffBits)], &dwOffBits, sizeof(DWORD));
+
+		if(ParseBitmapView(&data[0], data.size(), &view)) {
+			bPassed = Fail("pixels at %u are accepted, the color table ends at %u", (unsigned)dwOffBits, (unsigned)bfh.bfOffBits);
+			break;
+		}
+	}
+
+	return bPassed;
+}
+
+static void RunBitmapViewChecks()
+{
+	static const char* lpszFiles[] = { "pic24.bmp", "pic8.bmp" };
+	char szName[64], szFilename[512];
+
+	for(int i = 0; i < (int)(sizeof(lpszFiles) / sizeof(lpszFiles[0])); i++) {
+		snprintf(szName, sizeof(szName), "bmpmap/%s", lpszFiles[i]);
+		snprintf(szFilename, sizeof(szFilename), "%s/%s", g_Options.lpszResources, lpszFiles[i]);
+
+		RunCheck(szName, CheckBitmapView, szFilename);
+	}
+
+	snprintf(szFilename, sizeof(szFilename), "%s/pic8.bmp", g_Options.lpszResources);
+	RunCheck("bmpmap/offbits", CheckBitmapOffBits, szFilename);
+}
+
+//
+// RLE.
+//
+
+static DWORD g_dwRandom;
+
+// Xorshift, seeded from the options before every check, so each check
+// sees the same bitmaps whatever else runs.
+static DWORD Random()
+{
+	g_dwRandom ^= g_dwRandom << 13;
+	g_dwRandom ^= g_dwRandom >> 17;
+	g_dwRandom ^= g_dwRandom << 5;
+
+	return g_dwRandom;
+}
+
+static int RandomBelow(int n)
+{
+	return (int)(Random() % (DWORD)n);
+}
+
+// Fills an 8bpp surface with what bitmaps look like: runs of one color,
+// some longer than the 255 pixels a single code can hold, and stretches
+// of noise in between. For RLE4 the colors stay below 16.
+static void FillRandomSurface(LPDIBSURFACE lpSurface, int iBits)
+{
+	int iMask = iBits == 4 ? 15 : 255;
+
+	for(int y = 0; y < lpSurface->cy; y++) {
+		BYTE* pRow = lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch;
+		int x = 0;
+
+		while(x < lpSurface->cx) {
+			int cRun = RandomBelow(4) ? 1 + RandomBelow(8) : 1 + RandomBelow(400);
+			BOOL bNoise = RandomBelow(3) == 0;
+			BYTE bColor = (BYTE)(Random() & iMask);
+
+			for(; cRun && x < lpSurface->cx; cRun--, x++) {
+				pRow[x] = bNoise ? (BYTE)(Random() & iMask) : bColor;
+			}
+		}
+	}
+}
+
+// Fills the padding at the end of every scanline, the decoder must leave
+// it alone.
+#define RLE_GUARD	0xCD
+
+static void FillScanlinePadding(LPDIBSURFACE lpSurface)
+{
+	for(int y = 0; y < lpSurface->cy; y++) {
+		memset(lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch + lpSurface->cx, RLE_GUARD, lpSurface->iPitch - lpSurface->cx);
+	}
+}
+
+static BOOL CheckScanlinePadding(const DIBSURFACE* lpSurface)
+{
+	for(int y = 0; y < lpSurface->cy; y++) {
+		const BYTE* pRow = lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch;
+
+		for(int x = lpSurface->cx; x < lpSurface->iPitch; x++) {
+			if(pRow[x] != RLE_GUARD) {
+				return Fail("decoder wrote past the end of scanline %d of %dx%d", y, lpSurface->cx, lpSurface->cy);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+// Feeds 'cb' bytes to the decoder in chunks of random sizes, from single
+// bytes that split every code to the whole stream at once.
+static BOOL DecodeRandomChunks(LPRLEDECODER lpDecoder, const BYTE* pData, size_t cb)
+{
+	BOOL bMore = TRUE;
+
+	while(cb && bMore) {
+		size_t cbChunk = RandomBelow(4) ? 1 + RandomBelow(16) : cb;
+
+		if(cbChunk > cb) {
+			cbChunk = cb;
+		}
+
+		bMore = DecodeRLEChunk(lpDecoder, pData, cbChunk);
+		pData += cbChunk;
+		cb -= cbChunk;
+	}
+
+	return bMore;
+}
+
+static BOOL CheckRLERoundTrip(void* lpParam)
+{
+	int iBits = (int)(size_t)lpParam;
+	std::vector<BYTE> data;
+	BOOL bPassed = TRUE;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	for(int i = 0; i < g_Options.cIterations && bPassed; i++) {
+		DIBSURFACE src, dst;
+		RLEDECODER decoder;
+		int cx = 1 + RandomBelow(600);
+		int cy = 1 + RandomBelow(24);
+
+		if(!CreateDIBSurface(&src, cx, cy, 8) || !CreateDIBSurface(&dst, cx, cy, 8)) {
+			return Fail("can't create a %dx%d surface", cx, cy);
+		}
+
+		FillRandomSurface(&src, iBits);
+		FillScanlinePadding(&dst);
+		data.resize(GetRLEBound(cx, cy));
+
+		size_t cb = EncodeRLE(&src, iBits, &data[0], data.size());
+
+		if(cb == 0) {
+			bPassed = Fail("bitmap %d, %dx%d, didn't encode", i, cx, cy);
+		}
+		else
+		if(!BeginRLEDecode(&decoder, &dst, iBits)) {
+			bPassed = Fail("can't decode into a %dx%d surface", cx, cy);
+		}
+		else
+		if(DecodeRandomChunks(&decoder, &data[0], cb) || !EndRLEDecode(&decoder)) {
+			bPassed = Fail("bitmap %d, %dx%d, has no end of bitmap after %zu bytes", i, cx, cy, cb);
+		}
+		else
+		if(CheckScanlinePadding(&dst)) {
+			for(int y = 0; y < cy; y++) {
+				if(memcmp(src.pTop + (ptrdiff_t)y * src.iPitch, dst.pTop + (ptrdiff_t)y * dst.iPitch, cx) != 0) {
+					bPassed = Fail("bitmap %d, %dx%d, scanline %d differs after decoding", i, cx, cy, y);
+					break;
+				}
+			}
+		}
+		else {
+			bPassed = FALSE;
+		}
+
+		FreeDIBSurface(&src);
+		FreeDIBSurface(&dst);
+	}
+
+	return bPassed;
+}
+
+// Damages an encoded stream the ways files get damaged, and the ways
+// someone who wants to break the decoder would.
+static void MutateRLE(std::vector<BYTE>& data)
+{
+	int cEdits = 1 + RandomBelow(8);
+
+	for(int i = 0; i < cEdits; i++) {
+		size_t iAt = data.empty() ? 0 : RandomBelow((int)data.size());
+
+		switch(RandomBelow(6)) {
+		case 0:		// A random byte
+			if(!data.empty()) {
+				data[iAt] = (BYTE)Random();
+			}
+			break;
+		case 1:		// A flipped bit
+			if(!data.empty()) {
+				data[iAt] ^= (BYTE)(1 << RandomBelow(8));
+			}
+			break;
+		case 2:		// An escape with a random code and operands
+			{
+				BYTE code[4] = { 0, (BYTE)RandomBelow(4), (BYTE)Random(), (BYTE)Random() };
+				data.insert(data.begin() + iAt, code, code + 2 + RandomBelow(3));
+			}
+			break;
+		case 3:		// Bytes left out
+			data.erase(data.begin() + iAt, data.begin() + iAt + RandomBelow((int)(data.size() - iAt) + 1));
+			break;
+		case 4:		// Cut off
+			data.resize(iAt);
+			break;
+		default:	// Random garbage
+			for(int n = RandomBelow(64); n; n--) {
+				data.insert(data.begin() + iAt, (BYTE)Random());
+			}
+			break;
+		}
+	}
+}
+
+static BOOL CheckRLEFuzz(void* lpParam)
+{
+	int iBits = (int)(size_t)lpParam;
+	std::vector<BYTE> data;
+	BOOL bPassed = TRUE;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	for(int i = 0; i < g_Options.cIterations && bPassed; i++) {
+		DIBSURFACE src, dst;
+		RLEDECODER decoder;
+		int cx = 1 + RandomBelow(300);
+		int cy = 1 + RandomBelow(16);
+
+		if(!CreateDIBSurface(&src, cx, cy, 8)) {
+			return Fail("can't create a %dx%d surface", cx, cy);
+		}
+
+		// Start from a good stream most of the time, the decoder gets
+		// further into those before it hits the damage.
+		if(RandomBelow(8)) {
+			FillRandomSurface(&src, iBits);
+			data.resize(GetRLEBound(cx, cy));
+			data.resize(EncodeRLE(&src, iBits, &data[0], data.size()));
+			MutateRLE(data);
+		}
+		else {
+			data.resize(RandomBelow(1024));
+
+			for(size_t j = 0; j < data.size(); j++) {
+				data[j] = (BYTE)Random();
+			}
+		}
+
+		FreeDIBSurface(&src);
+
+		// Decode into a surface that may be smaller or bigger than the
+		// bitmap was.
+		if(RandomBelow(2)) {
+			cx = 1 + RandomBelow(300);
+			cy = 1 + RandomBelow(16);
+		}
+
+		if(!CreateDIBSurface(&dst, cx, cy, 8)) {
+			return Fail("can't create a %dx%d surface", cx, cy);
+		}
+
+		FillScanlinePadding(&dst);
+
+		if(!BeginRLEDecode(&decoder, &dst, iBits)) {
+			bPassed = Fail("can't decode into a %dx%d surface", cx, cy);
+		}
+		else {
+			DecodeRandomChunks(&decoder, data.empty() ? NULL : &data[0], data.size());
+			EndRLEDecode(&decoder);
+
+			if(!CheckScanlinePadding(&dst)) {
+				bPassed = Fail("bitmap %d, seed %u", i, g_Options.dwSeed);
+			}
+		}
+
+		FreeDIBSurface(&dst);
+	}
+
+	return bPassed;
+}
+
+static void RunRLEChecks()
+{
+	RunCheck("rle/round-trip-rle8", CheckRLERoundTrip, (void*)8);
+	RunCheck("rle/round-trip-rle4", CheckRLERoundTrip, (void*)4);
+	RunCheck("rle/fuzz-rle8", CheckRLEFuzz, (void*)8);
+	RunCheck("rle/fuzz-rle4", CheckRLEFuzz, (void*)4);
+}
+
+//
+// Packs.
+//
+
+static BOOL WriteBytes(const char* lpszFilename, const void* pData, size_t cb)
+{
+	FILE* fp = fopen(lpszFilename, "wb");
+	BOOL bResult = fp && fwrite(pData, 1, cb, fp) == cb;
+
+	if(fp && fclose(fp) != 0) {
+		bResult = FALSE;
+	}
+
+	return bResult;
+}
+
+static BOOL ReadBytes(const char* lpszFilename, std::vector<BYTE>& data)
+{
+	FILE* fp = fopen(lpszFilename, "rb");
+	BYTE buffer[4096];
+	size_t cb;
+
+	if(!fp) {
+		return FALSE;
+	}
+
+	data.clear();
+
+	while((cb = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		data.insert(data.end(), buffer, buffer + cb);
+	}
+
+	fclose(fp);
+
+	return TRUE;
+}
+
+// Opens 'lpszFilename' as a pack and checks the BITMAPINFO of every
+// surface. TRUE if all of it is accepted.
+static BOOL IsPackAccepted(const char* lpszFilename)
+{
+	SURFACEPACK pack;
+	BOOL bAccepted;
+
+	if(!OpenSurfacePack(lpszFilename, &pack)) {
+		return FALSE;
+	}
+
+	bAccepted = TRUE;
+
+	for(int i = 0; i < pack.cEntries; i++) {
+		if(!CheckPackSurfaceInfo(&pack, i)) {
+			bAccepted = FALSE;
+		}
+	}
+
+	CloseSurfacePack(&pack);
+
+	return bAccepted;
+}
+
+static BOOL CheckDamagedPack(void*)
+{
+	static const char* lpszNames[] = { "index8", "rgb565", "xrgb32" };
+	static const int iBpp[] = { 8, 16, 32 };
+	const char* lpszPack = CHECK_TEMP "/check.pak";
+	const char* lpszDamaged = CHECK_TEMP "/check-damaged.pak";
+	std::vector<BYTE> data, damaged;
+	PACKBUILDER builder;
+	PACKTRAILER trailer;
+	PACKENTRY entry;
+	BOOL bPassed = TRUE;
+
+	if(!CreatePackBuilder(&builder, lpszPack)) {
+		return Fail("can't create %s", lpszPack);
+	}
+
+	for(int i = 0; i < 3; i++) {
+		DIBSURFACE surface;
+
+		if(!CreateDIBSurface(&surface, 13 + i, 7, iBpp[i]) || !AddPackSurface(&builder, lpszNames[i], &surface)) {
+			FinishPackBuilder(&builder);
+			remove(lpszPack);
+			return Fail("can't add a %dbpp surface", iBpp[i]);
+		}
+
+		FreeDIBSurface(&surface);
+	}
+
+	if(!FinishPackBuilder(&builder) || !ReadBytes(lpszPack, data)) {
+		remove(lpszPack);
+		return Fail("can't write %s", lpszPack);
+	}
+
+	remove(lpszPack);
+
+	if(!WriteBytes(lpszDamaged, &data[0], data.size()) || !IsPackAccepted(lpszDamaged)) {
+		bPassed = Fail("the undamaged pack isn't accepted");
+	}
+
+	memcpy(&trailer, &data[data.size() - sizeof(trailer)], sizeof(trailer));
+
+	// A BITMAPINFO that doesn't agree with its entry, one field at a time.
+	// Each gets bit 15 flipped, which makes a bigger image out of the size.
+	static const size_t offFields[] = { offsetof(BITMAPINFOHEADER, biSize), offsetof(BITMAPINFOHEADER, biWidth), offsetof(BITMAPINFOHEADER, biHeight),
+		offsetof(BITMAPINFOHEADER, biBitCount), offsetof(BITMAPINFOHEADER, biCompression), offsetof(BITMAPINFOHEADER, biSizeImage) };
+
+	for(int i = 0; i < (int)trailer.cEntries; i++) {
+		memcpy(&entry, &data[trailer.offIndex + i * sizeof(PACKENTRY)], sizeof(entry));
+
+		for(int j = 0; j < (int)(sizeof(offFields) / sizeof(offFields[0])); j++) {
+			damaged = data;
+			damaged[entry.offInfo + offFields[j] + 1] ^= 0x80;
+
+			if(WriteBytes(lpszDamaged, &damaged[0], damaged.size()) && IsPackAccepted(lpszDamaged)) {
+				bPassed = Fail("BITMAPINFO of entry %d with field at offset %zu changed is accepted", i, offFields[j]);
+			}
+		}
+	}
+
+	// A pack smaller than a BITMAPINFO, with an entry that says it starts
+	// the file. That used to pass, 'cbFile - PACK_INFO_SIZE' wrapped
+	// around.
+	{
+		PACKHEADER header = { PACK_MAGIC, PACK_VERSION, PACK_PAGE, 0 };
+		const char szNames[8] = "a";
+
+		memcpy(&entry, &data[trailer.offIndex], sizeof(entry));
+		entry.offInfo = 0;
+		entry.offBits = 0;
+		entry.offName = 0;
+		entry.cchName = 1;
+		entry.cx = entry.cy = 1;
+		entry.iFormat = DIBFMT_XRGB32;
+		entry.iPitch = 4;
+		entry.cbBits = 4;
+
+		trailer.offNames = sizeof(header);
+		trailer.cbNames = 2;
+		trailer.offIndex = sizeof(header) + sizeof(szNames);
+		trailer.cEntries = 1;
+
+		damaged.resize(0);
+		damaged.insert(damaged.end(), (const BYTE*)&header, (const BYTE*)(&header + 1));
+		damaged.insert(damaged.end(), (const BYTE*)szNames, (const BYTE*)(szNames + sizeof(szNames)));
+		damaged.insert(damaged.end(), (const BYTE*)&entry, (const BYTE*)(&entry + 1));
+		damaged.insert(damaged.end(), (const BYTE*)&trailer, (const BYTE*)(&trailer + 1));
+
+		SURFACEPACK pack;
+
+		if(WriteBytes(lpszDamaged, &damaged[0], damaged.size()) && OpenSurfacePack(lpszDamaged, &pack)) {
+			CloseSurfacePack(&pack);
+			bPassed = Fail("a %zu byte pack is accepted", damaged.size());
+		}
+	}
+
+	remove(lpszDamaged);
+
+	return bPassed;
+}
+
+//
+// Dirty regions.
+//
+
+static BOOL CheckDirtyMerge(void*)
+{
+	static const int cMaxRects[] = { 1, 2, 8, 32, 1000 };
+	RECT rcDirty[1000];
+	BOOL bPassed = TRUE;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	for(int i = 0; i < g_Options.cIterations && bPassed; i++) {
+		DIRTYREGION region;
+		int cx = 1 + RandomBelow(700);
+		int cy = 1 + RandomBelow(500);
+		int cMax = cMaxRects[RandomBelow(5)];
+
+		if(!CreateDirtyRegion(&region, cx, cy)) {
+			return Fail("can't create a %dx%d region", cx, cy);
+		}
+
+		for(int n = RandomBelow(300); n; n--) {
+			if(RandomBelow(4)) {
+				MarkDirtyPixel(&region, RandomBelow(cx), RandomBelow(cy));
+			}
+			else {
+				int x = RandomBelow(cx), y = RandomBelow(cy);
+				MarkDirtyRect(&region, x, y, x + RandomBelow(100), y + RandomBelow(100));
+			}
+		}
+
+		int cRects = GetDirtyRects(&region, rcDirty, cMax);
+
+		if(cRects > cMax) {
+			bPassed = Fail("%dx%d region, %d rectangles for at most %d", cx, cy, cRects, cMax);
+		}
+
+		for(int ty = 0; ty < region.cyTiles && bPassed; ty++) {
+			for(int tx = 0; tx < region.cxTiles && bPassed; tx++) {
+				int x = tx << DIRTY_TILE_SHIFT, y = ty << DIRTY_TILE_SHIFT;
+				BOOL bCovered = FALSE;
+
+				if(!IsTileDirty(&region, tx, ty)) {
+					continue;
+				}
+
+				for(int r = 0; r < cRects && !bCovered; r++) {
+					bCovered = x >= rcDirty[r].left && x < rcDirty[r].right && y >= rcDirty[r].top && y < rcDirty[r].bottom;
+				}
+
+				if(!bCovered) {
+					bPassed = Fail("%dx%d region in %d rectangles, tile %d,%d isn't in any", cx, cy, cMax, tx, ty);
+				}
+			}
+		}
+
+		FreeDirtyRegion(&region);
+	}
+
+	return bPassed;
+}
+
+//
+// Bitfields.
+//
+
+typedef struct tagBITFIELDSCHECK {
+	DWORD			dwMasks[4];
+	int				iBpp;
+} BITFIELDSCHECK;
+
+// A channel of 'c' at 8 bits: its top 8 bits, or its bits repeated until
+// there are 8. 0 if the mask is.
+static DWORD GetBitfieldsChannel(DWORD c, DWORD dwMask)
+{
+	int iShift = 0, cBits = 0;
+	DWORD v, d = 0;
+
+	if(!dwMask) {
+		return 0;
+	}
+
+	while(!((dwMask >> iShift) & 1)) {
+		iShift++;
+	}
+
+	while(iShift + cBits < 32 && ((dwMask >> (iShift + cBits)) & 1)) {
+		cBits++;
+	}
+
+	v = (c & dwMask) >> iShift;
+
+	if(cBits >= 8) {
+		return v >> (cBits - 8);
+	}
+
+	for(int n = 8; n > 0; n -= cBits) {
+		d |= n >= cBits ? v << (n - cBits) : v >> (cBits - n);
+	}
+
+	return d & 0xFF;
+}
+
+static BOOL CheckBitfieldsV5(void* lpParam)
+{
+	const BITFIELDSCHECK* lpCheck = (const BITFIELDSCHECK*)lpParam;
+	const size_t cbHeaders = sizeof(BITMAPFILEHEADER) + 124;
+	LPBITFIELDS lpFields = (LPBITFIELDS)malloc(sizeof(BITFIELDS));
+	std::vector<BYTE> file;
+	std::vector<DWORD> xrgb;
+	BOOL bPassed = TRUE;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	if(!lpFields || !AnalyzeBitfields(lpCheck->dwMasks, lpCheck->iBpp, lpFields)) {
+		free(lpFields);
+		return Fail("masks aren't accepted");
+	}
+
+	for(int i = 0; i < g_Options.cIterations / 10 + 1 && bPassed; i++) {
+		int cx = 1 + RandomBelow(100), cy = 1 + RandomBelow(8);
+		int iStride = DIB_STRIDE(cx, lpCheck->iBpp);
+		BITMAPFILEHEADER bfh;
+		BITMAPINFOHEADER bih;
+		BITMAPVIEW view;
+
+		file.assign(cbHeaders + (size_t)iStride * cy, 0);
+
+		ZeroMemory(&bfh, sizeof(bfh));
+		bfh.bfType = ((WORD) ('M' << 8) | 'B');
+		bfh.bfSize = (DWORD)file.size();
+		bfh.bfOffBits = (DWORD)cbHeaders;
+
+		ZeroMemory(&bih, sizeof(bih));
+		bih.biSize = 124;
+		bih.biWidth = cx;
+		bih.biHeight = -cy;
+		bih.biPlanes = 1;
+		bih.biBitCount = (WORD)lpCheck->iBpp;
+		bih.biCompression = BI_BITFIELDS;
+
+		memcpy(&file[0], &bfh, sizeof(bfh));
+		memcpy(&file[sizeof(bfh)], &bih, sizeof(bih));
+		memcpy(&file[sizeof(bfh) + sizeof(bih)], lpCheck->dwMasks, sizeof(DWORD) * 4);
+
+		for(size_t j = cbHeaders; j < file.size(); j++) {
+			file[j] = (BYTE)Random();
+		}
+
+		if(!ParseBitmapView(&file[0], file.size(), &view)) {
+			bPassed = Fail("%dx%d V5 bitmap isn't accepted", cx, cy);
+			break;
+		}
+
+		xrgb.resize(cx);
+
+		for(int y = 0; y < cy && bPassed; y++) {
+			const BYTE* pRow = GetViewScanline(&view, y);
+
+			UnpackBitfields(lpFields, &xrgb[0], pRow, cx);
+
+			for(int x = 0; x < cx; x++) {
+				DWORD c = lpCheck->iBpp == 16 ? (DWORD)(pRow[2 * x] | (pRow[2 * x + 1] << 8)) : (DWORD)(pRow[4 * x] | (pRow[4 * x + 1] << 8) | (pRow[4 * x + 2] << 16) | ((DWORD)pRow[4 * x + 3] << 24));
+				DWORD dwExpected = (GetBitfieldsChannel(c, lpCheck->dwMasks[3]) << 24) | (GetBitfieldsChannel(c, lpCheck->dwMasks[0]) << 16) |
+					(GetBitfieldsChannel(c, lpCheck->dwMasks[1]) << 8) | GetBitfieldsChannel(c, lpCheck->dwMasks[2]);
+
+				if(xrgb[x] != dwExpected) {
+					bPassed = Fail("%dx%d pixel %d,%d is %08X, should be %08X", cx, cy, x, y, xrgb[x], dwExpected);
+					break;
+				}
+			}
+		}
+	}
+
+	free(lpFields);
+
+	return bPassed;
+}
+
+// Writes random pixels with 'WriteBitmapBits' and maps the file again.
+static BOOL CheckBitfieldsWrite(void* lpParam)
+{
+	const BITFIELDSCHECK* lpCheck = (const BITFIELDSCHECK*)lpParam;
+	const char* lpszFilename = CHECK_TEMP "/check.bmp";
+	const int cx = 37, cy = 5;
+	int iStride = DIB_STRIDE(cx, lpCheck->iBpp);
+	std::vector<BYTE> bits((size_t)iStride * cy);
+	BOOL bPassed = TRUE;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	for(size_t i = 0; i < bits.size(); i++) {
+		bits[i] = (BYTE)Random();
+	}
+
+	// With BI_ALPHABITFIELDS, and with a V5 header as far as the writer is
+	// concerned. Both pass all four masks.
+	for(int iSource = 0; iSource < 2 && bPassed; iSource++) {
+		BITMAPINFOHEADER bih;
+		BITMAPVIEW view;
+
+		ZeroMemory(&bih, sizeof(bih));
+		bih.biSize = iSource == 0 ? sizeof(BITMAPINFOHEADER) : 124;
+		bih.biWidth = cx;
+		bih.biHeight = -cy;
+		bih.biPlanes = 1;
+		bih.biBitCount = (WORD)lpCheck->iBpp;
+		bih.biCompression = iSource == 0 ? BI_ALPHABITFIELDS : BI_BITFIELDS;
+
+		if(!WriteBitmapBits(lpszFilename, &bih, lpCheck->dwMasks, NULL, 0, &bits[0])) {
+			bPassed = Fail("can't write %s", lpszFilename);
+			break;
+		}
+
+		if(!MapBitmapFile(lpszFilename, &view)) {
+			bPassed = Fail("can't map %s", lpszFilename);
+			break;
+		}
+
+		if(memcmp(view.dwMasks, lpCheck->dwMasks, sizeof(DWORD) * 4) != 0) {
+			bPassed = Fail("masks are %08X %08X %08X %08X", (unsigned)view.dwMasks[0], (unsigned)view.dwMasks[1], (unsigned)view.dwMasks[2], (unsigned)view.dwMasks[3]);
+		}
+
+		for(int y = 0; y < cy && bPassed; y++) {
+			if(memcmp(GetViewScanline(&view, y), &bits[(size_t)y * iStride], iStride) != 0) {
+				bPassed = Fail("scanline %d differs", y);
+			}
+		}
+
+		UnmapBitmapFile(&view);
+	}
+
+	remove(lpszFilename);
+
+	return bPassed;
+}
+
+static void RunBitfieldsChecks()
+{
+	static const BITFIELDSCHECK checks[] = {
+		{ { 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000 }, 32 },
+		{ { 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000 }, 32 },
+		{ { 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF }, 32 },
+		{ { 0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000 }, 32 },
+		{ { 0x00000F00, 0x000000F0, 0x0000000F, 0x0000F000 }, 16 },
+		{ { 0x00007C00, 0x000003E0, 0x0000001F, 0x00008000 }, 16 },
+		{ { 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 }, 32 },
+		{ { 0x0000000F, 0x000000F0, 0x00000F00, 0x00000000 }, 16 },
+	};
+	char szName[64];
+
+	for(int i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+		snprintf(szName, sizeof(szName), "bitfields/v5-%dbpp-%08X-%08X", checks[i].iBpp, (unsigned)checks[i].dwMasks[0], (unsigned)checks[i].dwMasks[3]);
+		RunCheck(szName, CheckBitfieldsV5, (void*)&checks[i]);
+	}
+
+	for(int i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+		snprintf(szName, sizeof(szName), "bitfields/write-%dbpp-%08X-%08X", checks[i].iBpp, (unsigned)checks[i].dwMasks[0], (unsigned)checks[i].dwMasks[3]);
+		RunCheck(szName, CheckBitfieldsWrite, (void*)&checks[i]);
+	}
+}
+
+//
+// Scaling.
+//
+
+typedef struct tagSCALECHECK {
+	int				cxSrc, cySrc;
+	int				cxDst, cyDst;
+	int				iMode;
+	int				iBpp;
+} SCALECHECK;
+
+// What 'lpPlan' makes of channel 'i' of destination pixel 'x', 'y', with
+// nothing rounded.
+static double GetScaledChannel(const SCALEPLAN* lpPlan, const DIBSURFACE* lpSrc, int x, int y, int i)
+{
+	const SCALETAPS* tx = &lpPlan->x.pTaps[x];
+	const SCALETAPS* ty = &lpPlan->y.pTaps[y];
+	int iBytes = GetDIBFormatBytes(lpSrc->iFormat);
+	double dSum = 0;
+
+	for(int ky = 0; ky < ty->cTaps; ky++) {
+		const BYTE* pRow = lpSrc->pTop + (ptrdiff_t)(ty->iFirst + ky) * lpSrc->iPitch;
+
+		for(int kx = 0; kx < tx->cTaps; kx++) {
+			dSum += (double)lpPlan->y.pWeights[ty->iWeights + ky] * lpPlan->x.pWeights[tx->iWeights + kx] * pRow[(tx->iFirst + kx) * iBytes + i];
+		}
+	}
+
+	return dSum / (1 << (2 * SCALE_BITS));
+}
+
+static BOOL CheckScaleFiltered(void* lpParam)
+{
+	const SCALECHECK* lpCheck = (const SCALECHECK*)lpParam;
+	DIBSURFACE src, dst[2];
+	SCALEPLAN plan;
+	BOOL bPassed = TRUE;
+	int iBytes = lpCheck->iBpp / 8;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	if(!CreateDIBSurface(&src, lpCheck->cxSrc, lpCheck->cySrc, lpCheck->iBpp)) {
+		return Fail("can't create a %dx%d surface", lpCheck->cxSrc, lpCheck->cySrc);
+	}
+
+	for(int y = 0; y < src.cy; y++) {
+		BYTE* pRow = src.pTop + (ptrdiff_t)y * src.iPitch;
+
+		for(int x = 0; x < src.cx * iBytes; x++) {
+			pRow[x] = (BYTE)Random();
+		}
+	}
+
+	// Without SSE2 first, then with whatever this processor has. The plan
+	// picks its kernels when it is made.
+	for(int i = 0; i < 2; i++) {
+		SetCPUFeatureMask(i ? 0xFFFFFFFF : 0);
+
+		if(!CreateDIBSurface(&dst[i], lpCheck->cxDst, lpCheck->cyDst, lpCheck->iBpp) || !CreateScalePlan(&plan, src.cx, src.cy, dst[i].cx, dst[i].cy, lpCheck->iMode, iBytes)) {
+			SetCPUFeatureMask(0xFFFFFFFF);
+			return Fail("can't create the plan");
+		}
+
+		if(!ScaleDIBSurface(&plan, &dst[i], &src, NULL)) {
+			bPassed = Fail("can't scale");
+		}
+
+		if(i == 0) {
+			FreeScalePlan(&plan);
+		}
+	}
+
+	for(int y = 0; y < dst[0].cy && bPassed; y++) {
+		const BYTE* pC = dst[0].pTop + (ptrdiff_t)y * dst[0].iPitch;
+		const BYTE* pSIMD = dst[1].pTop + (ptrdiff_t)y * dst[1].iPitch;
+
+		if(memcmp(pC, pSIMD, (size_t)dst[0].cx * iBytes) != 0) {
+			bPassed = Fail("scanline %d differs between the C and the SIMD kernels", y);
+			break;
+		}
+
+		for(int x = 0; x < dst[0].cx && bPassed; x++) {
+			for(int i = 0; i < iBytes; i++) {
+				double dExpected = i < 3 ? GetScaledChannel(&plan, &src, x, y, i) : 0;
+
+				if(fabs(pC[x * iBytes + i] - dExpected) > 1) {
+					bPassed = Fail("pixel %d,%d channel %d is %d, should be %.2f", x, y, i, pC[x * iBytes + i], dExpected);
+					break;
+				}
+			}
+		}
+	}
+
+	FreeScalePlan(&plan);
+	FreeDIBSurface(&dst[1]);
+	FreeDIBSurface(&dst[0]);
+	FreeDIBSurface(&src);
+
+	return bPassed;
+}
+
+static void RunScaleChecks()
+{
+	static const int iSizes[][4] = { { 37, 23, 100, 61 }, { 300, 200, 97, 53 }, { 129, 65, 400, 300 }, { 1000, 7, 3, 700 } };
+	static const char* lpszModes[] = { "nearest", "bilinear", "box" };
+	static SCALECHECK checks[4 * 2 * 2];
+	char szName[64];
+	int cChecks = 0;
+
+	for(int i = 0; i < 4; i++) {
+		for(int iMode = SCALE_BILINEAR; iMode <= SCALE_BOX; iMode++) {
+			for(int iBpp = 24; iBpp <= 32; iBpp += 8) {
+				SCALECHECK* lpCheck = &checks[cChecks++];
+
+				lpCheck->cxSrc = iSizes[i][0];
+				lpCheck->cySrc = iSizes[i][1];
+				lpCheck->cxDst = iSizes[i][2];
+				lpCheck->cyDst = iSizes[i][3];
+				lpCheck->iMode = iMode;
+				lpCheck->iBpp = iBpp;
+
+				snprintf(szName, sizeof(szName), "scale/%s/%dx%d-%dx%dx%d", lpszModes[iMode], lpCheck->cxSrc, lpCheck->cySrc, lpCheck->cxDst, lpCheck->cyDst, iBpp);
+				RunCheck(szName, CheckScaleFiltered, lpCheck);
+			}
+		}
+	}
+}
+
+//
+// Pyramids.
+//
+
+typedef struct tagPYRAMIDCHECK {
+	int				cx;
+	int				cy;
+	int				iBpp;
+} PYRAMIDCHECK;
+
+static BOOL CheckPyramidSaveOpen(void* lpParam)
+{
+	const PYRAMIDCHECK* lpCheck = (const PYRAMIDCHECK*)lpParam;
+	const char* lpszFilename = CHECK_TEMP "/check" PYRAMID_EXTENSION;
+	DIBSURFACE src;
+	PYRAMID built, opened;
+	BOOL bPassed = TRUE;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	if(!CreateDIBSurface(&src, lpCheck->cx, lpCheck->cy, lpCheck->iBpp)) {
+		return Fail("can't create a %dx%d surface", lpCheck->cx, lpCheck->cy);
+	}
+
+	for(int y = 0; y < src.cy; y++) {
+		BYTE* pRow = src.pTop + (ptrdiff_t)y * src.iPitch;
+
+		for(int x = 0; x < src.cx * GetDIBFormatBytes(src.iFormat); x++) {
+			pRow[x] = (BYTE)Random();
+		}
+	}
+
+	if(!BuildPyramid(&built, &src, PYRAMID_BOX, NULL)) {
+		FreeDIBSurface(&src);
+		return Fail("can't build the pyramid");
+	}
+
+	if(!SavePyramid(&built, lpszFilename) || !OpenPyramid(&opened, lpszFilename, src.cx, src.cy, src.iFormat)) {
+		bPassed = Fail("can't save and open the pyramid");
+	}
+	else {
+		for(int i = 0; i < opened.pack.cEntries && bPassed; i++) {
+			if(!CheckPackSurfaceInfo(&opened.pack, i)) {
+				bPassed = Fail("BITMAPINFO of tile %s doesn't match it", GetPackSurfaceName(&opened.pack, i));
+			}
+		}
+
+		for(int i = 1; i < built.cLevels && bPassed; i++) {
+			const PYRAMIDLEVEL* lpLevel = &built.levels[i];
+
+			for(int t = 0; t < lpLevel->cxTiles * lpLevel->cyTiles && bPassed; t++) {
+				const DIBSURFACE* lpBuilt = &lpLevel->lpTiles[t];
+				const DIBSURFACE* lpOpened = &opened.levels[i].lpTiles[t];
+				int cbRow = lpBuilt->cx * GetDIBFormatBytes(lpBuilt->iFormat);
+
+				for(int y = 0; y < lpBuilt->cy; y++) {
+					if(memcmp(lpBuilt->pTop + (ptrdiff_t)y * lpBuilt->iPitch, lpOpened->pTop + (ptrdiff_t)y * lpOpened->iPitch, cbRow) != 0) {
+						bPassed = Fail("level %d tile %d scanline %d differs", i, t, y);
+						break;
+					}
+				}
+			}
+		}
+
+		FreePyramid(&opened);
+	}
+
+	remove(lpszFilename);
+	FreePyramid(&built);
+	FreeDIBSurface(&src);
+
+	return bPassed;
+}
+
+static void RunPyramidChecks()
+{
+	static const PYRAMIDCHECK checks[] = {
+		{ 600, 1, 8 }, { 600, 1, 16 }, { 600, 1, 24 }, { 600, 1, 32 },
+		{ 700, 300, 8 }, { 700, 300, 16 }, { 700, 300, 24 }, { 700, 300, 32 },
+	};
+	char szName[64];
+
+	for(int i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+		snprintf(szName, sizeof(szName), "pyramid/%dx%dx%d", checks[i].cx, checks[i].cy, checks[i].iBpp);
+		RunCheck(szName, CheckPyramidSaveOpen, (void*)&checks[i]);
+	}
+}
+
+//
+// Frame streams.
+//
+
+#define	FRAMECHECK_FRAMES	8
+
+// Changes a few random rectangles of 'lpSurface': one color, noise, or a
+// single pixel. Returns their number, and the rectangles in 'rects'.
+static int ChangeRandomRects(LPDIBSURFACE lpSurface, int iBytes, RECT* rects, int cMax)
+{
+	int cRects = RandomBelow(cMax + 1);
+
+	for(int i = 0; i < cRects; i++) {
+		int iKind = RandomBelow(3);
+		int cx = iKind == 2 ? 1 : 1 + RandomBelow(48);
+		int cy = iKind == 2 ? 1 : 1 + RandomBelow(48);
+		int left = RandomBelow(lpSurface->cx);
+		int top = RandomBelow(lpSurface->cy);
+		DWORD dwColor = Random();
+
+		cx = left + cx > lpSurface->cx ? lpSurface->cx - left : cx;
+		cy = top + cy > lpSurface->cy ? lpSurface->cy - top : cy;
+
+		for(int y = top; y < top + cy; y++) {
+			BYTE* p = lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch + left * iBytes;
+
+			for(int x = 0; x < cx; x++) {
+				for(int b = 0; b < iBytes; b++) {
+					*p++ = (BYTE)(iKind == 0 ? dwColor >> (b * 8) : Random());
+				}
+			}
+		}
+
+		rects[i].left = left;
+		rects[i].top = top;
+		rects[i].right = left + cx;
+		rects[i].bottom = top + cy;
+	}
+
+	return cRects;
+}
+
+static BOOL CheckFrameStream(void* lpParam)
+{
+	int iBpp = (int)(size_t)lpParam;
+	const char* lpszFilename = CHECK_TEMP "/check.frames";
+	const int cx = 100, cy = 70;
+	std::vector<BYTE> frames[FRAMECHECK_FRAMES];
+	FRAMEENCODER encoder;
+	FRAMEDECODER decoder;
+	FRAMESTREAMHEADER header;
+	DIBSURFACE src;
+	RECT rects[16];
+	BOOL bPassed = TRUE;
+	FILE* fp;
+
+	g_dwRandom = g_Options.dwSeed;
+
+	if(!CreateDIBSurface(&src, cx, cy, iBpp)) {
+		return Fail("can't create a %dx%dx%d surface", cx, cy, iBpp);
+	}
+
+	int iBytes = GetDIBFormatBytes(src.iFormat);
+
+	if(iBpp == 8) {
+		for(int i = 0; i < 256; i++) {
+			DWORD dwColor = Random();
+
+			memcpy(&src.lpBmi->bmiColors[i], &dwColor, sizeof(RGBQUAD));
+		}
+	}
+
+	if(!CreateFrameEncoder(&encoder, &src)) {
+		FreeFrameEncoder(&encoder);
+		FreeDIBSurface(&src);
+		return Fail("encoder isn't created");
+	}
+
+	if((fp = fopen(lpszFilename, "wb")) == NULL) {
+		FreeFrameEncoder(&encoder);
+		FreeDIBSurface(&src);
+		return Fail("can't write %s", lpszFilename);
+	}
+
+	fwrite(&encoder.header, sizeof(FRAMESTREAMHEADER), 1, fp);
+
+	// The first frame changes everything, one in the middle nothing.
+	for(int i = 0; i < FRAMECHECK_FRAMES; i++) {
+		int cRects = 0;
+
+		if(i == 0) {
+			for(int y = 0; y < cy; y++) {
+				for(int x = 0; x < cx * iBytes; x++) {
+					src.pTop[(ptrdiff_t)y * src.iPitch + x] = (BYTE)Random();
+				}
+			}
+		}
+		else
+		if(i != FRAMECHECK_FRAMES / 2) {
+			cRects = ChangeRandomRects(&src, iBytes, rects, 16);
+		}
+
+		EncodeFrame(&encoder, &src, i == 0 || RandomBelow(2) ? NULL : rects, cRects);
+		fwrite(encoder.pData, 1, encoder.cbData, fp);
+
+		frames[i].resize((size_t)cx * cy * iBytes);
+
+		for(int y = 0; y < cy; y++) {
+			memcpy(&frames[i][(size_t)y * cx * iBytes], src.pTop + (ptrdiff_t)y * src.iPitch, (size_t)cx * iBytes);
+		}
+	}
+
+	FreeFrameEncoder(&encoder);
+	FreeDIBSurface(&src);
+
+	if(fclose(fp) != 0 || (fp = fopen(lpszFilename, "rb")) == NULL) {
+		remove(lpszFilename);
+		return Fail("can't write %s", lpszFilename);
+	}
+
+	if(!ReadFrameStreamHeader(fp, &header) || !CreateFrameDecoder(&decoder, &header)) {
+		fclose(fp);
+		remove(lpszFilename);
+		return Fail("stream header isn't accepted");
+	}
+
+	if(iBpp == 8 && memcmp(decoder.lpBmi->bmiColors, header.palette, sizeof(RGBQUAD) * 256) != 0) {
+		bPassed = Fail("color table differs");
+	}
+
+	for(int i = 0; i < FRAMECHECK_FRAMES && bPassed; i++) {
+		if(!ReadFrame(&decoder, fp)) {
+			bPassed = Fail("frame %d isn't accepted", i + 1);
+			break;
+		}
+
+		for(int y = 0; y < cy; y++) {
+			if(memcmp(decoder.surface.pTop + (ptrdiff_t)y * decoder.surface.iPitch, &frames[i][(size_t)y * cx * iBytes], (size_t)cx * iBytes) != 0) {
+				bPassed = Fail("frame %d scanline %d differs", i + 1, y);
+				break;
+			}
+		}
+	}
+
+	if(bPassed && (ReadFrame(&decoder, fp) || !decoder.bEnd)) {
+		bPassed = Fail("stream doesn't end after frame %d", FRAMECHECK_FRAMES);
+	}
+
+	FreeFrameDecoder(&decoder);
+	fclose(fp);
+	remove(lpszFilename);
+
+	return bPassed;
+}
+
+static void RunFrameStreamChecks()
+{
+	static const int iDepths[] = { 8, 16, 24, 32 };
+	char szName[64];
+
+	for(int i = 0; i < (int)(sizeof(iDepths) / sizeof(iDepths[0])); i++) {
+		snprintf(szName, sizeof(szName), "framestream/%dbpp", iDepths[i]);
+		RunCheck(szName, CheckFrameStream, (void*)(size_t)iDepths[i]);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	g_Options.lpszResources = "../Resources";
+	g_Options.lpszFilter = NULL;
+	g_Options.cIterations = 2000;
+	g_Options.dwSeed = 1;
+
+	for(int i = 1; i < argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+			const char* lpszValue = argv[++i];
+
+			switch(argv[i - 1][1]) {
+			case 'r': g_Options.lpszResources = lpszValue; break;
+			case 'n': g_Options.cIterations = atoi(lpszValue); break;
+			case 's': g_Options.dwSeed = (DWORD)strtoul(lpszValue, NULL, 0); break;
+			default:
+				fprintf(stderr, "Unknown option %s\n", argv[i - 1]);
+				return 1;
+			}
+		}
+		else {
+			g_Options.lpszFilter = argv[i];
+		}
+	}
+
+	// Xorshift never leaves zero.
+	if(g_Options.dwSeed == 0) {
+		g_Options.dwSeed = 1;
+	}
+
+	RunBitmapViewChecks();
+	RunRLEChecks();
+	RunCheck("bmppack/damaged", CheckDamagedPack, NULL);
+	RunCheck("dirty/merge", CheckDirtyMerge, NULL);
+	RunBitfieldsChecks();
+	RunScaleChecks();
+	RunPyramidChecks();
+	RunFrameStreamChecks();
+
+	printf("%d passed, %d failed\n", g_cPassed, g_cFailed);
+
+	return g_cFailed ? 1 : 0;
+}
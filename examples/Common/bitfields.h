@@ -0,0 +1,244 @@
+
+#ifndef BITFIELDS_H
+#define BITFIELDS_H
+
+// Pixels with arbitrary channel masks.
+//
+// A BI_BITFIELDS bitmap says with a mask per channel where in the 16 or 32
+// bit pixel red, green, blue and, with a V4 or V5 header, alpha are. The
+// formats we draw in only cover three sets of those, 555, 565 and
+// 0x00FF0000/0xFF00/0xFF. Anything else, 4444 from texture tools, RGBA
+// with the bytes the other way around, ten bits per channel from HDR
+// screenshots, is unpacked here to XRGB, with alpha in the top byte where
+// composite.h expects it, and converted on from there.
+//
+// The masks are looked at once: 'AnalyzeBitfields' works out shift and
+// width of every channel and checks whether the set is one of the common
+// layouts below. Those have an unpacker of their own that is little more
+// than a few shifts per pixel. Whatever else comes along goes through the
+// generic unpacker, which takes every channel out with its shift and mask
+// and scales it to 8 bits with a table.
+
+#include "dibtypes.h"
+
+#include <string.h>
+
+// Layouts with an unpacker of their own. Named after the bits from the
+// top down, like Direct3D does: A8R8G8B8 is B, G, R, A in memory.
+#define	BITFIELDS_GENERIC		0
+#define	BITFIELDS_A8R8G8B8		1		// XRGB with alpha, nothing to do
+#define	BITFIELDS_A8B8G8R8		2		// R, G, B, A in memory
+#define	BITFIELDS_R8G8B8A8		3		// A, B, G, R in memory
+#define	BITFIELDS_A2R10G10B10	4
+#define	BITFIELDS_A4R4G4B4		5
+#define	BITFIELDS_A1R5G5B5		6
+#define	BITFIELDS_LAYOUTS		7
+
+// Channel widths above this are cut down to it, the table stays small and
+// we only keep 8 bits anyway.
+#define	BITFIELDS_MAX_BITS		10
+
+typedef struct tagBITFIELDS {
+	int				iLayout;		// BITFIELDS_*
+	int				iBytes;			// Per pixel, 2 or 4
+	int				iShift[4];		// Red, green, blue and alpha
+	DWORD			dwMask[4];		// After shifting, 0 if the channel isn't there
+	BYTE			bScale[4][1 << BITFIELDS_MAX_BITS];	// Channel value to 8 bits
+} BITFIELDS, *LPBITFIELDS;
+
+static const struct {
+	DWORD			dwMasks[4];
+	int				iBpp;
+} g_BitfieldsLayouts[BITFIELDS_LAYOUTS] = {
+	{ { 0, 0, 0, 0 }, 0 },
+	{ { 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000 }, 32 },
+	{ { 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000 }, 32 },
+	{ { 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF }, 32 },
+	{ { 0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000 }, 32 },
+	{ { 0x00000F00, 0x000000F0, 0x0000000F, 0x0000F000 }, 16 },
+	{ { 0x00007C00, 0x000003E0, 0x0000001F, 0x00008000 }, 16 },
+};
+
+// Works out how to unpack pixels of 'iBpp' bits with the red, green, blue
+// and alpha masks in 'dwMasks'. A channel may be missing, its mask 0.
+// Returns FALSE if a mask has gaps or masks overlap.
+static inline BOOL AnalyzeBitfields(const DWORD* dwMasks, int iBpp, LPBITFIELDS lpFields)
+{
+	DWORD dwUsed = 0;
+
+	if(iBpp != 16 && iBpp != 32) {
+		return FALSE;
+	}
+
+	lpFields->iBytes = iBpp / 8;
+	lpFields->iLayout = BITFIELDS_GENERIC;
+
+	for(int i = 0; i < 4; i++) {
+		DWORD dwMask = dwMasks[i];
+		int iShift = 0, cBits = 0;
+
+		if(iBpp == 16 && (dwMask >> 16) != 0) {
+			return FALSE;
+		}
+
+		if(dwMask & dwUsed) {
+			return FALSE;
+		}
+
+		dwUsed |= dwMask;
+
+		if(dwMask) {
+			while(!(dwMask & 1)) {
+				dwMask >>= 1;
+				iShift++;
+			}
+
+			while(dwMask & 1) {
+				dwMask >>= 1;
+				cBits++;
+			}
+
+			// One run of bits, nothing above it.
+			if(dwMask) {
+				return FALSE;
+			}
+		}
+
+		// Only the top bits of wide channels count.
+		if(cBits > BITFIELDS_MAX_BITS) {
+			iShift += cBits - BITFIELDS_MAX_BITS;
+			cBits = BITFIELDS_MAX_BITS;
+		}
+
+		DWORD dwMax = cBits ? (1u << cBits) - 1 : 0;
+
+		lpFields->iShift[i] = iShift;
+		lpFields->dwMask[i] = dwMax;
+		lpFields->bScale[i][0] = 0;
+
+		// Narrow channels repeat their bits until 8 are filled, wide ones
+		// keep the top 8. Same as the unpackers below do with shifts, so a
+		// pixel comes out the same whichever way it goes.
+		for(DWORD v = 1; v <= dwMax; v++) {
+			DWORD d = 0;
+
+			for(int n = 8; n > 0; n -= cBits) {
+				d |= n >= cBits ? v << (n - cBits) : v >> (cBits - n);
+			}
+
+			lpFields->bScale[i][v] = (BYTE)d;
+		}
+	}
+
+	for(int i = 1; i < BITFIELDS_LAYOUTS; i++) {
+		if(g_BitfieldsLayouts[i].iBpp == iBpp && memcmp(g_BitfieldsLayouts[i].dwMasks, dwMasks, sizeof(DWORD) * 4) == 0) {
+			lpFields->iLayout = i;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// Unpackers, 'cx' pixels from 'pSrc' to XRGB with alpha in 'pDst'.
+//
+
+// The pixels of a mapped file are only as aligned as 'bfOffBits' makes
+// them, 138 with a V5 header, so they are loaded with 'memcpy'. That is a
+// plain load wherever unaligned ones are allowed.
+template<class PIXEL>
+static inline DWORD LoadBitfieldsPixel(const BYTE* pSrc, int x)
+{
+	PIXEL c;
+
+	memcpy(&c, pSrc + (size_t)x * sizeof(PIXEL), sizeof(PIXEL));
+	return c;
+}
+
+static inline void UnpackA8B8G8R8(DWORD* pDst, const BYTE* pSrc, int cx)
+{
+	for(int x = 0; x < cx; x++) {
+		DWORD c = LoadBitfieldsPixel<DWORD>(pSrc, x);
+
+		pDst[x] = (c & 0xFF00FF00) | ((c >> 16) & 0xFF) | ((c & 0xFF) << 16);
+	}
+}
+
+static inline void UnpackR8G8B8A8(DWORD* pDst, const BYTE* pSrc, int cx)
+{
+	for(int x = 0; x < cx; x++) {
+		DWORD c = LoadBitfieldsPixel<DWORD>(pSrc, x);
+
+		pDst[x] = (c >> 8) | (c << 24);
+	}
+}
+
+// Keeps the top 8 bits of every channel, and stretches the 2 alpha bits.
+static inline void UnpackA2R10G10B10(DWORD* pDst, const BYTE* pSrc, int cx)
+{
+	for(int x = 0; x < cx; x++) {
+		DWORD c = LoadBitfieldsPixel<DWORD>(pSrc, x);
+
+		pDst[x] = ((c >> 30) * 0x55000000) | ((c >> 6) & 0x00FF0000) | ((c >> 4) & 0x0000FF00) | ((c >> 2) & 0x000000FF);
+	}
+}
+
+// Every nibble doubled makes 0xF into 0xFF.
+static inline void UnpackA4R4G4B4(DWORD* pDst, const BYTE* pSrc, int cx)
+{
+	for(int x = 0; x < cx; x++) {
+		DWORD c = LoadBitfieldsPixel<WORD>(pSrc, x);
+		DWORD d = ((c & 0xF000) << 12) | ((c & 0x0F00) << 8) | ((c & 0x00F0) << 4) | (c & 0x000F);
+
+		pDst[x] = d * 0x11;
+	}
+}
+
+static inline void UnpackA1R5G5B5(DWORD* pDst, const BYTE* pSrc, int cx)
+{
+	for(int x = 0; x < cx; x++) {
+		DWORD c = LoadBitfieldsPixel<WORD>(pSrc, x);
+		DWORD d = ((c & 0x7C00) << 9) | ((c & 0x03E0) << 6) | ((c & 0x001F) << 3);
+
+		pDst[x] = ((0u - (c >> 15)) & 0xFF000000) | d | ((d >> 5) & 0x00070707);
+	}
+}
+
+template<class PIXEL>
+static inline void UnpackGeneric(const BITFIELDS* lpFields, DWORD* pDst, const BYTE* pSrc, int cx)
+{
+	for(int x = 0; x < cx; x++) {
+		DWORD c = LoadBitfieldsPixel<PIXEL>(pSrc, x);
+
+		pDst[x] =
+			(lpFields->bScale[3][(c >> lpFields->iShift[3]) & lpFields->dwMask[3]] << 24) |
+			(lpFields->bScale[0][(c >> lpFields->iShift[0]) & lpFields->dwMask[0]] << 16) |
+			(lpFields->bScale[1][(c >> lpFields->iShift[1]) & lpFields->dwMask[1]] << 8) |
+			lpFields->bScale[2][(c >> lpFields->iShift[2]) & lpFields->dwMask[2]];
+	}
+}
+
+// Unpacks a scanline of 'cx' pixels.
+static inline void UnpackBitfields(const BITFIELDS* lpFields, DWORD* pDst, const BYTE* pSrc, int cx)
+{
+	switch(lpFields->iLayout) {
+	case BITFIELDS_A8R8G8B8:	memcpy(pDst, pSrc, (size_t)cx * 4);	break;
+	case BITFIELDS_A8B8G8R8:	UnpackA8B8G8R8(pDst, pSrc, cx);		break;
+	case BITFIELDS_R8G8B8A8:	UnpackR8G8B8A8(pDst, pSrc, cx);		break;
+	case BITFIELDS_A2R10G10B10:	UnpackA2R10G10B10(pDst, pSrc, cx);	break;
+	case BITFIELDS_A4R4G4B4:	UnpackA4R4G4B4(pDst, pSrc, cx);		break;
+	case BITFIELDS_A1R5G5B5:	UnpackA1R5G5B5(pDst, pSrc, cx);		break;
+
+	default:
+		if(lpFields->iBytes == 2) {
+			UnpackGeneric<WORD>(lpFields, pDst, pSrc, cx);
+		}
+		else {
+			UnpackGeneric<DWORD>(lpFields, pDst, pSrc, cx);
+		}
+		break;
+	}
+}
+
+#endif // BITFIELDS_H
@@ -0,0 +1,632 @@
+
+#ifndef BMPBATCH_H
+#define BMPBATCH_H
+
+// Loading many small bitmap files at once.
+//
+// Loading a file the usual way takes four system calls, open, fstat, read
+// and close, and each one waits for the last. For a 16 KB sprite that
+// waiting is most of the time it takes, and with tens of thousands of them
+// it adds up. 'LoadBitmapBatch' keeps many files on the go instead.
+//
+// On Linux it uses io_uring. Every file is one chain of three requests:
+// open it into a slot of the ring's own file table, read it into a buffer
+// registered with the ring, and close it again. The chains of many files
+// are handed to the kernel with one system call, which also waits for the
+// ones before to complete. So there are no file descriptors, the buffers
+// aren't looked up and pinned again for every read, and it takes only a
+// fraction of a system call per file. Files are decoded as their chains
+// complete, while the kernel works on the next ones.
+//
+// Where io_uring isn't there, it is too old or it has been switched off,
+// the files are read on a thread pool instead, one file per task, with
+// plain positional reads. Windows always does that.
+//
+// Either way the decoded surfaces go to a callback as they come in, in no
+// particular order.
+
+#include "bmpcache.h"
+#include "bmpmap.h"
+#include "threadpool.h"
+
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(_WIN32)
+#include <linux/io_uring.h>
+#endif
+
+// io_uring is Linux only, and its headers have to be new enough to open
+// files into the ring's own table.
+#if defined(__linux__) && !defined(_WIN32) && defined(IORING_RSRC_REGISTER_SPARSE)
+#define	BMPBATCH_URING
+#endif
+
+#ifdef BMPBATCH_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#define	BATCH_QUEUE			32				// Files in flight at once
+#define	BATCH_BUFFER		(128 << 10)		// Bytes read per file in one go, bigger files take a second look
+
+// Flags for 'LoadBitmapBatch'.
+#define	BATCH_NOURING		0x0001			// Use the thread pool even if io_uring is there
+
+// Called for every file, 'iFile' being its index in the list. 'lpSurface'
+// is NULL if the file couldn't be loaded, otherwise it's the callback's
+// to keep or free with 'FreeDIBSurface'. The callback is only ever called
+// for one file at a time, but not necessarily on the thread that called
+// 'LoadBitmapBatch'.
+typedef void (*LPBATCHPROC)(int iFile, LPDIBSURFACE lpSurface, void* lpParam);
+
+typedef struct tagBATCHSTATS {
+	int					cLoaded;
+	int					cFailed;
+	long long			cSyscalls;		// System calls made, setting up the ring included
+	BOOL				bRing;			// Whether it was done with io_uring
+} BATCHSTATS, *LPBATCHSTATS;
+
+// Decodes a bitmap file that has been read into memory.
+static inline BOOL DecodeBatchFile(const BYTE* pData, size_t cbData, int iFormat, LPDIBSURFACE lpSurface)
+{
+	BITMAPVIEW view;
+
+	return ParseBitmapView(pData, cbData, &view) && CreateViewDIBSurface(&view, lpSurface, iFormat);
+}
+
+// Reads a whole file the plain way, into '*ppBuffer', which grows if it
+// has to. Returns the size of the file, or -1 if it can't be read.
+static inline long long ReadBatchFile(LPCSTR lpszFilename, BYTE** ppBuffer, size_t* pcbBuffer, long long* pcSyscalls)
+{
+	size_t cbFile, cbDone = 0;
+
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(lpszFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	LARGE_INTEGER liSize;
+
+	*pcSyscalls += 1;
+
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+
+	*pcSyscalls += 2;
+
+	if(!GetFileSizeEx(hFile, &liSize)) {
+		CloseHandle(hFile);
+		return -1;
+	}
+
+	cbFile = (size_t)liSize.QuadPart;
+#else
+	int hFile = open(lpszFilename, O_RDONLY);
+	struct stat st;
+
+	*pcSyscalls += 1;
+
+	if(hFile < 0) {
+		return -1;
+	}
+
+	*pcSyscalls += 2;
+
+	if(fstat(hFile, &st) != 0) {
+		close(hFile);
+		return -1;
+	}
+
+	cbFile = (size_t)st.st_size;
+#endif
+
+	if(cbFile > *pcbBuffer) {
+		BYTE* pBuffer = (BYTE*)realloc(*ppBuffer, cbFile);
+
+		if(!pBuffer) {
+#ifdef _WIN32
+			CloseHandle(hFile);
+#else
+			close(hFile);
+#endif
+			return -1;
+		}
+
+		*ppBuffer = pBuffer;
+		*pcbBuffer = cbFile;
+	}
+
+	while(cbDone < cbFile) {
+#ifdef _WIN32
+		OVERLAPPED ov;
+		DWORD cbChunk = cbFile - cbDone > 0x40000000 ? 0x40000000 : (DWORD)(cbFile - cbDone);
+		DWORD cbRead = 0;
+
+		ZeroMemory(&ov, sizeof(ov));
+		ov.Offset = (DWORD)cbDone;
+		ov.OffsetHigh = (DWORD)((unsigned long long)cbDone >> 32);
+
+		*pcSyscalls += 1;
+
+		if(!ReadFile(hFile, *ppBuffer + cbDone, cbChunk, &cbRead, &ov) || cbRead == 0) {
+			break;
+		}
+#else
+		ssize_t cbRead = pread(hFile, *ppBuffer + cbDone, cbFile - cbDone, (off_t)cbDone);
+
+		*pcSyscalls += 1;
+
+		if(cbRead <= 0) {
+			break;
+		}
+#endif
+
+		cbDone += cbRead;
+	}
+
+#ifdef _WIN32
+	CloseHandle(hFile);
+#else
+	close(hFile);
+#endif
+
+	return cbDone == cbFile ? (long long)cbFile : -1;
+}
+
+//
+// Thread pool.
+//
+
+typedef struct tagBATCHJOB {
+	const LPCSTR*		lpszFiles;
+	int					iFormat;
+	LPBATCHPROC			lpfnLoaded;
+	void*				lpParam;
+	std::mutex			lock;			// Around the callback and 'stats'
+	BATCHSTATS			stats;
+	BYTE**				ppBuffers;		// One per thread
+	size_t*				pcbBuffers;
+} BATCHJOB;
+
+static inline void BatchTask(int iTask, int iThread, void* lpParam)
+{
+	BATCHJOB* lpJob = (BATCHJOB*)lpParam;
+	long long cSyscalls = 0;
+	long long cbFile = ReadBatchFile(lpJob->lpszFiles[iTask], &lpJob->ppBuffers[iThread], &lpJob->pcbBuffers[iThread], &cSyscalls);
+	DIBSURFACE surface;
+	BOOL bLoaded = cbFile >= 0 && DecodeBatchFile(lpJob->ppBuffers[iThread], (size_t)cbFile, lpJob->iFormat, &surface);
+
+	std::lock_guard<std::mutex> lock(lpJob->lock);
+
+	lpJob->stats.cSyscalls += cSyscalls;
+	lpJob->stats.cLoaded += bLoaded ? 1 : 0;
+	lpJob->stats.cFailed += bLoaded ? 0 : 1;
+	lpJob->lpfnLoaded(iTask, bLoaded ? &surface : NULL, lpJob->lpParam);
+}
+
+static inline BOOL LoadBitmapBatchPool(const LPCSTR* lpszFiles, int cFiles, int iFormat, LPBATCHPROC lpfnLoaded, void* lpParam, CThreadPool* lpPool, LPBATCHSTATS lpStats)
+{
+	int cThreads = lpPool ? lpPool->Threads() : 1;
+	BATCHJOB* lpJob = new BATCHJOB();
+
+	lpJob->lpszFiles = lpszFiles;
+	lpJob->iFormat = iFormat;
+	lpJob->lpfnLoaded = lpfnLoaded;
+	lpJob->lpParam = lpParam;
+	lpJob->ppBuffers = (BYTE**)calloc(cThreads, sizeof(BYTE*));
+	lpJob->pcbBuffers = (size_t*)calloc(cThreads, sizeof(size_t));
+
+	if(!lpJob->ppBuffers || !lpJob->pcbBuffers) {
+		free(lpJob->ppBuffers);
+		free(lpJob->pcbBuffers);
+		delete lpJob;
+		return FALSE;
+	}
+
+	if(lpPool) {
+		lpPool->Run(cFiles, BatchTask, lpJob);
+	}
+	else {
+		for(int i = 0; i < cFiles; i++) {
+			BatchTask(i, 0, lpJob);
+		}
+	}
+
+	for(int i = 0; i < cThreads; i++) {
+		free(lpJob->ppBuffers[i]);
+	}
+
+	*lpStats = lpJob->stats;
+
+	free(lpJob->ppBuffers);
+	free(lpJob->pcbBuffers);
+	delete lpJob;
+
+	return TRUE;
+}
+
+//
+// io_uring.
+//
+
+#ifdef BMPBATCH_URING
+
+typedef struct tagBATCHRING {
+	int					hRing;
+	BYTE*				pSqRing;
+	BYTE*				pCqRing;		// The same as 'pSqRing' with IORING_FEAT_SINGLE_MMAP
+	size_t				cbSqRing;
+	size_t				cbCqRing;
+	struct io_uring_sqe* lpSqes;
+	size_t				cbSqes;
+	unsigned*			pSqTail;
+	unsigned*			pSqArray;
+	unsigned			uSqMask;
+	unsigned			uSqTail;		// Ours, published before 'io_uring_enter'
+	unsigned			cToSubmit;
+	unsigned			cInFlight;		// Taken by the kernel but not completed yet
+	unsigned*			pCqHead;
+	unsigned*			pCqTail;
+	unsigned			uCqMask;
+	struct io_uring_cqe* lpCqes;
+	long long			cSyscalls;
+} BATCHRING;
+
+// Per file in flight.
+typedef struct tagBATCHSLOT {
+	int					iFile;
+	int					cPending;		// Requests of its chain still to complete
+	int					iRead;			// Result of the read
+} BATCHSLOT;
+
+// Which request of a chain a completion is for, in the low bits of its
+// user data. The slot is in the others.
+#define	BATCH_OPEN			0
+#define	BATCH_READ			1
+#define	BATCH_CLOSE			2
+
+static inline int BatchRingCall(BATCHRING* lpRing, long lNumber, unsigned long a, unsigned long b, unsigned long c, unsigned long d)
+{
+	lpRing->cSyscalls++;
+	return (int)syscall(lNumber, a, b, c, d, 0UL, 0UL);
+}
+
+static inline void CloseBatchRing(BATCHRING* lpRing)
+{
+	if(lpRing->lpSqes) {
+		munmap(lpRing->lpSqes, lpRing->cbSqes);
+		lpRing->cSyscalls++;
+	}
+
+	if(lpRing->pCqRing && lpRing->pCqRing != lpRing->pSqRing) {
+		munmap(lpRing->pCqRing, lpRing->cbCqRing);
+		lpRing->cSyscalls++;
+	}
+
+	if(lpRing->pSqRing) {
+		munmap(lpRing->pSqRing, lpRing->cbSqRing);
+		lpRing->cSyscalls++;
+	}
+
+	if(lpRing->hRing > 0) {
+		close(lpRing->hRing);
+		lpRing->cSyscalls++;
+	}
+
+	lpRing->hRing = 0;
+	lpRing->pSqRing = lpRing->pCqRing = NULL;
+	lpRing->lpSqes = NULL;
+}
+
+// Sets up a ring for 'cSlots' files in flight, reading into 'pBuffers',
+// 'cbSlot' bytes for each. Returns FALSE if io_uring can't do what we
+// need here, which is opening and closing files in the ring's own table
+// (Linux 5.19 and up).
+static inline BOOL OpenBatchRing(BATCHRING* lpRing, BYTE* pBuffers, int cSlots, size_t cbSlot)
+{
+	struct io_uring_params params;
+	struct io_uring_rsrc_register files;
+	struct iovec iov;
+
+	ZeroMemory(lpRing, sizeof(BATCHRING));
+	ZeroMemory(&params, sizeof(params));
+
+	if((lpRing->hRing = BatchRingCall(lpRing, __NR_io_uring_setup, cSlots * 3, (unsigned long)&params, 0, 0)) < 0) {
+		lpRing->hRing = 0;
+		return FALSE;
+	}
+
+	lpRing->cbSqRing = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	lpRing->cbCqRing = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		lpRing->cbSqRing = lpRing->cbCqRing = lpRing->cbSqRing > lpRing->cbCqRing ? lpRing->cbSqRing : lpRing->cbCqRing;
+	}
+
+	lpRing->cSyscalls++;
+	lpRing->pSqRing = (BYTE*)mmap(NULL, lpRing->cbSqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, lpRing->hRing, IORING_OFF_SQ_RING);
+
+	if(lpRing->pSqRing == (BYTE*)MAP_FAILED) {
+		lpRing->pSqRing = NULL;
+		CloseBatchRing(lpRing);
+		return FALSE;
+	}
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		lpRing->pCqRing = lpRing->pSqRing;
+	}
+	else {
+		lpRing->cSyscalls++;
+		lpRing->pCqRing = (BYTE*)mmap(NULL, lpRing->cbCqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, lpRing->hRing, IORING_OFF_CQ_RING);
+
+		if(lpRing->pCqRing == (BYTE*)MAP_FAILED) {
+			lpRing->pCqRing = NULL;
+			CloseBatchRing(lpRing);
+			return FALSE;
+		}
+	}
+
+	lpRing->cbSqes = params.sq_entries * sizeof(struct io_uring_sqe);
+	lpRing->cSyscalls++;
+	lpRing->lpSqes = (struct io_uring_sqe*)mmap(NULL, lpRing->cbSqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, lpRing->hRing, IORING_OFF_SQES);
+
+	if(lpRing->lpSqes == (struct io_uring_sqe*)MAP_FAILED) {
+		lpRing->lpSqes = NULL;
+		CloseBatchRing(lpRing);
+		return FALSE;
+	}
+
+	lpRing->pSqTail = (unsigned*)(lpRing->pSqRing + params.sq_off.tail);
+	lpRing->pSqArray = (unsigned*)(lpRing->pSqRing + params.sq_off.array);
+	lpRing->uSqMask = *(unsigned*)(lpRing->pSqRing + params.sq_off.ring_mask);
+	lpRing->uSqTail = *lpRing->pSqTail;
+	lpRing->pCqHead = (unsigned*)(lpRing->pCqRing + params.cq_off.head);
+	lpRing->pCqTail = (unsigned*)(lpRing->pCqRing + params.cq_off.tail);
+	lpRing->uCqMask = *(unsigned*)(lpRing->pCqRing + params.cq_off.ring_mask);
+	lpRing->lpCqes = (struct io_uring_cqe*)(lpRing->pCqRing + params.cq_off.cqes);
+
+	// The buffers are pinned once, not looked up on every read.
+	iov.iov_base = pBuffers;
+	iov.iov_len = cbSlot * cSlots;
+
+	if(BatchRingCall(lpRing, __NR_io_uring_register, lpRing->hRing, IORING_REGISTER_BUFFERS, (unsigned long)&iov, 1) < 0) {
+		CloseBatchRing(lpRing);
+		return FALSE;
+	}
+
+	// An empty file table, one entry per slot. This fails on kernels that
+	// can't open into it either.
+	ZeroMemory(&files, sizeof(files));
+	files.nr = cSlots;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+
+	if(BatchRingCall(lpRing, __NR_io_uring_register, lpRing->hRing, IORING_REGISTER_FILES2, (unsigned long)&files, sizeof(files)) < 0) {
+		CloseBatchRing(lpRing);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static inline struct io_uring_sqe* GetBatchSqe(BATCHRING* lpRing)
+{
+	unsigned i = lpRing->uSqTail & lpRing->uSqMask;
+	struct io_uring_sqe* lpSqe = &lpRing->lpSqes[i];
+
+	ZeroMemory(lpSqe, sizeof(struct io_uring_sqe));
+	lpRing->pSqArray[i] = i;
+	lpRing->uSqTail++;
+	lpRing->cToSubmit++;
+
+	return lpSqe;
+}
+
+// Queues the chain for one file: open into the slot, read into its buffer
+// and close, the close even if the read fails.
+static inline void QueueBatchFile(BATCHRING* lpRing, LPCSTR lpszFilename, int iSlot, BYTE* pBuffer, size_t cbSlot)
+{
+	struct io_uring_sqe* lpSqe;
+
+	lpSqe = GetBatchSqe(lpRing);
+	lpSqe->opcode = IORING_OP_OPENAT;
+	lpSqe->fd = AT_FDCWD;
+	lpSqe->addr = (unsigned long long)(size_t)lpszFilename;
+	lpSqe->open_flags = O_RDONLY;
+	lpSqe->file_index = iSlot + 1;
+	lpSqe->flags = IOSQE_IO_LINK;
+	lpSqe->user_data = (iSlot << 2) | BATCH_OPEN;
+
+	// A read that comes back short would break an ordinary link, and for
+	// us that's the normal case.
+	lpSqe = GetBatchSqe(lpRing);
+	lpSqe->opcode = IORING_OP_READ_FIXED;
+	lpSqe->fd = iSlot;
+	lpSqe->addr = (unsigned long long)(size_t)pBuffer;
+	lpSqe->len = (unsigned)cbSlot;
+	lpSqe->buf_index = 0;
+	lpSqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	lpSqe->user_data = (iSlot << 2) | BATCH_READ;
+
+	lpSqe = GetBatchSqe(lpRing);
+	lpSqe->opcode = IORING_OP_CLOSE;
+	lpSqe->file_index = iSlot + 1;
+	lpSqe->user_data = (iSlot << 2) | BATCH_CLOSE;
+}
+
+static inline BOOL LoadBitmapBatchRing(const LPCSTR* lpszFiles, int cFiles, int iFormat, LPBATCHPROC lpfnLoaded, void* lpParam, LPBATCHSTATS lpStats)
+{
+	BATCHSLOT slots[BATCH_QUEUE];
+	int iFreeSlots[BATCH_QUEUE];
+	int cFree = BATCH_QUEUE;
+	int iNext = 0;
+	BATCHRING ring;
+	BYTE* pBuffers = (BYTE*)malloc((size_t)BATCH_BUFFER * BATCH_QUEUE);
+	BYTE* pLarge = NULL;
+	size_t cbLarge = 0;
+
+	if(!pBuffers) {
+		return FALSE;
+	}
+
+	if(!OpenBatchRing(&ring, pBuffers, BATCH_QUEUE, BATCH_BUFFER)) {
+		lpStats->cSyscalls += ring.cSyscalls;
+		free(pBuffers);
+		return FALSE;
+	}
+
+	for(int i = 0; i < BATCH_QUEUE; i++) {
+		iFreeSlots[i] = BATCH_QUEUE - 1 - i;
+		slots[i].cPending = 0;
+	}
+
+	while(iNext < cFiles || cFree < BATCH_QUEUE) {
+		// Fill every free slot, then hand all of it over and wait for at
+		// least one completion, in the same call.
+		while(cFree > 0 && iNext < cFiles) {
+			int iSlot = iFreeSlots[--cFree];
+
+			slots[iSlot].iFile = iNext;
+			slots[iSlot].cPending = 3;
+			slots[iSlot].iRead = -ECANCELED;
+
+			QueueBatchFile(&ring, lpszFiles[iNext++], iSlot, pBuffers + (size_t)iSlot * BATCH_BUFFER, BATCH_BUFFER);
+		}
+
+		__atomic_store_n(ring.pSqTail, ring.uSqTail, __ATOMIC_RELEASE);
+
+		int iSubmitted = BatchRingCall(&ring, __NR_io_uring_enter, ring.hRing, ring.cToSubmit, 1, IORING_ENTER_GETEVENTS);
+
+		if(iSubmitted < 0 && errno != EINTR) {
+			break;
+		}
+
+		if(iSubmitted > 0) {
+			ring.cToSubmit -= iSubmitted;
+			ring.cInFlight += iSubmitted;
+		}
+
+		unsigned uHead = *ring.pCqHead;
+		unsigned uTail = __atomic_load_n(ring.pCqTail, __ATOMIC_ACQUIRE);
+
+		for(; uHead != uTail; uHead++) {
+			const struct io_uring_cqe* lpCqe = &ring.lpCqes[uHead & ring.uCqMask];
+			BATCHSLOT* lpSlot = &slots[lpCqe->user_data >> 2];
+
+			ring.cInFlight--;
+
+			if((lpCqe->user_data & 3) == BATCH_READ) {
+				lpSlot->iRead = lpCqe->res;
+			}
+
+			if(--lpSlot->cPending > 0) {
+				continue;
+			}
+
+			// The whole chain is done. A file that filled the buffer may
+			// be bigger than it, those are read again the plain way.
+			const BYTE* pData = pBuffers + (size_t)(lpCqe->user_data >> 2) * BATCH_BUFFER;
+			long long cbData = lpSlot->iRead;
+			DIBSURFACE surface;
+
+			if(cbData == BATCH_BUFFER) {
+				cbData = ReadBatchFile(lpszFiles[lpSlot->iFile], &pLarge, &cbLarge, &lpStats->cSyscalls);
+				pData = pLarge;
+			}
+
+			BOOL bLoaded = cbData >= 0 && DecodeBatchFile(pData, (size_t)cbData, iFormat, &surface);
+
+			lpStats->cLoaded += bLoaded ? 1 : 0;
+			lpStats->cFailed += bLoaded ? 0 : 1;
+			lpfnLoaded(lpSlot->iFile, bLoaded ? &surface : NULL, lpParam);
+
+			iFreeSlots[cFree++] = (int)(lpCqe->user_data >> 2);
+		}
+
+		__atomic_store_n(ring.pCqHead, uHead, __ATOMIC_RELEASE);
+	}
+
+	// Only if the ring broke down half way: whatever wasn't done fails.
+	// The kernel may still be reading into the buffers though, so wait
+	// for everything it has taken before letting go of them. If even that
+	// fails they are left to it.
+	BOOL bResult = cFree == BATCH_QUEUE;
+	BOOL bDrained = TRUE;
+
+	while(ring.cInFlight > 0) {
+		if(BatchRingCall(&ring, __NR_io_uring_enter, ring.hRing, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			bDrained = FALSE;
+			break;
+		}
+
+		unsigned uHead = *ring.pCqHead;
+		unsigned uTail = __atomic_load_n(ring.pCqTail, __ATOMIC_ACQUIRE);
+
+		ring.cInFlight -= uTail - uHead;
+		__atomic_store_n(ring.pCqHead, uTail, __ATOMIC_RELEASE);
+	}
+
+	for(int i = 0; i < BATCH_QUEUE; i++) {
+		if(slots[i].cPending > 0) {
+			lpStats->cFailed++;
+			lpfnLoaded(slots[i].iFile, NULL, lpParam);
+		}
+	}
+
+	for(; iNext < cFiles; iNext++) {
+		lpStats->cFailed++;
+		lpfnLoaded(iNext, NULL, lpParam);
+	}
+
+	CloseBatchRing(&ring);
+	lpStats->cSyscalls += ring.cSyscalls;
+	lpStats->bRing = TRUE;
+
+	free(pLarge);
+
+	if(bDrained) {
+		free(pBuffers);
+	}
+
+	return bResult;
+}
+
+#endif // BMPBATCH_URING
+
+// Loads all the bitmap files in 'lpszFiles', converted to 'iFormat', or
+// as they are for DIBFMT_UNKNOWN, and calls 'lpfnLoaded' for each of them.
+// With io_uring the files are read and decoded on the calling thread and
+// 'lpPool' isn't used, the kernel does the waiting for us. Without it they
+// are spread over 'lpPool', or done one after the other if that is NULL. 'lpStats' may be NULL. Returns FALSE if it couldn't get
+// going at all, not if some of the files failed.
+static inline BOOL LoadBitmapBatch(const LPCSTR* lpszFiles, int cFiles, int iFormat, LPBATCHPROC lpfnLoaded, void* lpParam, CThreadPool* lpPool, DWORD dwFlags = 0, LPBATCHSTATS lpStats = NULL)
+{
+	BATCHSTATS stats;
+
+	ZeroMemory(&stats, sizeof(stats));
+
+	BOOL bResult = FALSE;
+
+#ifdef BMPBATCH_URING
+	if(!(dwFlags & BATCH_NOURING)) {
+		bResult = LoadBitmapBatchRing(lpszFiles, cFiles, iFormat, lpfnLoaded, lpParam, &stats);
+	}
+#endif
+
+	// Nothing has been called back if the ring couldn't be set up.
+	if(!bResult && !stats.bRing) {
+		bResult = LoadBitmapBatchPool(lpszFiles, cFiles, iFormat, lpfnLoaded, lpParam, lpPool, &stats);
+	}
+
+	if(lpStats) {
+		*lpStats = stats;
+	}
+
+	return bResult;
+}
+
+#endif // BMPBATCH_H
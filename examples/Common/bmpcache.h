@@ -0,0 +1,676 @@
+
+#ifndef BMPCACHE_H
+#define BMPCACHE_H
+
+// A cache of decoded bitmaps.
+//
+// Programs that show or process the same artwork over and over decode the
+// same files over and over: map them, unpack RLE, convert the pixels to
+// the format they work in. The cache below keeps the surfaces that come
+// out of that and hands out the same one to everybody who asks for the
+// same file in the same format, so after the first time a load is just a
+// lookup.
+//
+// Surfaces are found by a key, which is either
+//
+//   the identity of the file: where it lives on the disk, its size and
+//   when it was last written. Getting it is a single 'stat', nothing is
+//   read, but a copy of the file somewhere else is a different file.
+//
+//   a hash of the contents: the file has to be read (mapped) to get it,
+//   but the same image under any name or in any place is found.
+//
+// plus the format the surface was converted to and whatever else the
+// loader does differently, say the size it scales to.
+//
+// 'Acquire' returns the surface for a key and calls the loader if there
+// isn't one yet. When several threads ask for the same key at the same
+// time only one of them runs the loader, the others wait for it and get
+// the same surface. A surface is pinned until every 'Acquire' of it has
+// been matched by a 'Release'. Surfaces nobody holds are kept in least
+// recently used order and the oldest are freed as soon as all surfaces
+// together take more than the budget. Surfaces that are held can't be
+// freed, so while they are the cache can go over its budget; it comes
+// back under it as soon as they are released.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "dib.h"
+#include "bitfields.h"
+#include "bmpmap.h"
+#include "convert.h"
+#include "rle.h"
+
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+
+// Seeds for the two kinds of key, so a file's identity never looks like
+// the contents of another one.
+#define BMPCACHE_SEED_CONTENT	0x42434E54ULL	// 'BCNT'
+#define BMPCACHE_SEED_FILE		0x4246494CULL	// 'BFIL'
+
+typedef struct tagBMPCACHEKEY {
+	unsigned long long	uHash;		// Of the contents, or of the identity of the file
+	unsigned long long	cbFile;		// Size of the file
+	int					iFormat;	// DIBFMT_ the surface was converted to
+	DWORD				dwVariant;	// Anything else the loader does differently, 0 if nothing
+} BMPCACHEKEY, *LPBMPCACHEKEY;
+
+typedef struct tagBMPCACHESTATS {
+	long long	cHits;			// Found loaded
+	long long	cMisses;		// Loaded, the loader was called for these
+	long long	cWaits;			// Found while being loaded by another thread
+	long long	cFailures;		// The loader failed
+	long long	cEvictions;		// Freed to stay within the budget
+	int			cEntries;		// Surfaces in the cache now, held or not
+	int			cHeld;			// Of those, the ones somebody holds
+	size_t		cbUsed;			// Bytes all surfaces take together
+	size_t		cbPeak;			// Most that has ever been
+	size_t		cbBudget;
+} BMPCACHESTATS, *LPBMPCACHESTATS;
+
+// Makes the surface for a key, returns FALSE if it can't. The surface is
+// created by the loader and freed by the cache with 'FreeDIBSurface'.
+typedef BOOL (*LPBMPCACHELOADPROC)(LPDIBSURFACE lpSurface, const BMPCACHEKEY* lpKey, void* lpParam);
+
+//
+// Keys.
+//
+
+static inline unsigned long long RotateCacheHash(unsigned long long u, int n)
+{
+	return (u << n) | (u >> (64 - n));
+}
+
+static inline unsigned long long LoadCacheHash(const BYTE* p)
+{
+	unsigned long long u;
+
+	memcpy(&u, p, sizeof(u));
+	return u;
+}
+
+// A 64 bit hash of 'cb' bytes. Four independent lanes of multiply and
+// rotate, 32 bytes at a time, so it keeps up with memory; a multi
+// megabyte file is hashed in about the time it takes to read it.
+static inline unsigned long long HashCacheBytes(const BYTE* p, size_t cb, unsigned long long uSeed)
+{
+	const unsigned long long P1 = 0x9E3779B185EBCA87ULL;
+	const unsigned long long P2 = 0xC2B2AE3D27D4EB4FULL;
+	const unsigned long long P3 = 0x165667B19E3779F9ULL;
+	const BYTE* pEnd = p + cb;
+	unsigned long long h;
+
+	if(cb >= 32) {
+		unsigned long long v[4] = { uSeed + P1 + P2, uSeed + P2, uSeed, uSeed - P1 };
+
+		for(; pEnd - p >= 32; p += 32) {
+			for(int i = 0; i < 4; i++) {
+				v[i] = RotateCacheHash(v[i] + LoadCacheHash(p + i * 8) * P2, 31) * P1;
+			}
+		}
+
+		h = RotateCacheHash(v[0], 1) + RotateCacheHash(v[1], 7) + RotateCacheHash(v[2], 12) + RotateCacheHash(v[3], 18);
+
+		for(int i = 0; i < 4; i++) {
+			h = (h ^ (RotateCacheHash(v[i] * P2, 31) * P1)) * P1 + P3;
+		}
+	}
+	else {
+		h = uSeed + P3;
+	}
+
+	h += (unsigned long long)cb;
+
+	for(; pEnd - p >= 8; p += 8) {
+		h = RotateCacheHash(h ^ (RotateCacheHash(LoadCacheHash(p) * P2, 31) * P1), 27) * P1 + P3;
+	}
+
+	for(; p < pEnd; p++) {
+		h = RotateCacheHash(h ^ (*p * P3), 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+// Key for the contents of a bitmap file, mapped or read into memory.
+static inline void GetContentCacheKey(const BYTE* pData, size_t cbData, int iFormat, DWORD dwVariant, LPBMPCACHEKEY lpKey)
+{
+	lpKey->uHash = HashCacheBytes(pData, cbData, BMPCACHE_SEED_CONTENT);
+	lpKey->cbFile = cbData;
+	lpKey->iFormat = iFormat;
+	lpKey->dwVariant = dwVariant;
+}
+
+// Key for the identity of a file, without opening it. A file that is
+// rewritten gets a new key, unless it keeps its size and the write falls
+// in the same tick of the file system's clock (100ns on NTFS, 1ns on most
+// Linux file systems). Returns FALSE if the file isn't there.
+static inline BOOL GetFileCacheKey(LPCSTR lpszFilename, int iFormat, DWORD dwVariant, LPBMPCACHEKEY lpKey)
+{
+	unsigned long long uIdentity[4];
+
+#ifdef _WIN32
+	BY_HANDLE_FILE_INFORMATION info;
+	HANDLE hFile = CreateFileA(lpszFilename, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	if(!GetFileInformationByHandle(hFile, &info)) {
+		CloseHandle(hFile);
+		return FALSE;
+	}
+
+	CloseHandle(hFile);
+
+	uIdentity[0] = info.dwVolumeSerialNumber;
+	uIdentity[1] = (unsigned long long)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+	uIdentity[2] = (unsigned long long)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime;
+	uIdentity[3] = (unsigned long long)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+#else
+	struct stat st;
+
+	if(stat(lpszFilename, &st) != 0) {
+		return FALSE;
+	}
+
+	uIdentity[0] = (unsigned long long)st.st_dev;
+	uIdentity[1] = (unsigned long long)st.st_ino;
+#if defined(__APPLE__)
+	uIdentity[2] = (unsigned long long)st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#else
+	uIdentity[2] = (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#endif
+	uIdentity[3] = (unsigned long long)st.st_size;
+#endif
+
+	lpKey->uHash = HashCacheBytes((const BYTE*)uIdentity, sizeof(uIdentity), BMPCACHE_SEED_FILE);
+	lpKey->cbFile = uIdentity[3];
+	lpKey->iFormat = iFormat;
+	lpKey->dwVariant = dwVariant;
+
+	return TRUE;
+}
+
+struct BMPCACHEKEYHASH {
+	size_t operator()(const BMPCACHEKEY& key) const
+	{
+		return (size_t)(key.uHash ^ (unsigned long long)key.iFormat << 56 ^ (unsigned long long)key.dwVariant << 24);
+	}
+};
+
+struct BMPCACHEKEYEQUAL {
+	bool operator()(const BMPCACHEKEY& a, const BMPCACHEKEY& b) const
+	{
+		return a.uHash == b.uHash && a.cbFile == b.cbFile && a.iFormat == b.iFormat && a.dwVariant == b.dwVariant;
+	}
+};
+
+//
+// The cache.
+//
+
+#define BMPCACHE_LOADING	0
+#define BMPCACHE_READY		1
+#define BMPCACHE_FAILED		2
+
+typedef struct tagBMPCACHEENTRY {
+	DIBSURFACE					surface;	// First, so 'Release' can get from it to the entry
+	BMPCACHEKEY					key;
+	size_t						cb;
+	int							cRefs;
+	int							iState;
+
+	// Least recently used list, only entries nobody holds are on it.
+	struct tagBMPCACHEENTRY*	lpPrev;
+	struct tagBMPCACHEENTRY*	lpNext;
+} BMPCACHEENTRY, *LPBMPCACHEENTRY;
+
+class CBitmapCache {
+public:
+	CBitmapCache(size_t cbBudget)
+		: m_lpNewest(NULL), m_lpOldest(NULL), m_cHeld(0), m_stats()
+	{
+		m_stats.cbBudget = cbBudget;
+	}
+
+	// Every surface has to have been released by now.
+	~CBitmapCache()
+	{
+		for(auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+			FreeEntry(it->second);
+		}
+	}
+
+	// Returns the surface for 'lpKey', loading it with 'lpfnLoad' if it
+	// isn't in the cache. Returns NULL if the loader fails; the failure
+	// isn't remembered, the next 'Acquire' tries again. The surface must
+	// not be changed and has to be given back with 'Release'.
+	const DIBSURFACE* Acquire(const BMPCACHEKEY* lpKey, LPBMPCACHELOADPROC lpfnLoad, void* lpParam)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		auto it = m_entries.find(*lpKey);
+		LPBMPCACHEENTRY lpEntry;
+
+		if(it != m_entries.end()) {
+			lpEntry = it->second;
+			Hold(lpEntry);
+
+			if(lpEntry->iState == BMPCACHE_READY) {
+				m_stats.cHits++;
+				return &lpEntry->surface;
+			}
+
+			// Somebody else is loading it, wait for them.
+			m_stats.cWaits++;
+			m_loaded.wait(lock, [lpEntry] { return lpEntry->iState != BMPCACHE_LOADING; });
+
+			if(lpEntry->iState == BMPCACHE_FAILED) {
+				Unhold(lpEntry);
+				return NULL;
+			}
+
+			return &lpEntry->surface;
+		}
+
+		// We load it. The entry goes in first, so whoever asks for the
+		// same key in the meantime finds it and waits.
+		lpEntry = new BMPCACHEENTRY();
+		lpEntry->key = *lpKey;
+		lpEntry->iState = BMPCACHE_LOADING;
+		m_entries[*lpKey] = lpEntry;
+		Hold(lpEntry);
+		m_stats.cMisses++;
+
+		lock.unlock();
+		BOOL bLoaded = lpfnLoad(&lpEntry->surface, lpKey, lpParam);
+		lock.lock();
+
+		if(bLoaded) {
+			lpEntry->iState = BMPCACHE_READY;
+			lpEntry->cb = GetEntryBytes(&lpEntry->surface);
+			m_stats.cbUsed += lpEntry->cb;
+			m_stats.cbPeak = std::max(m_stats.cbPeak, m_stats.cbUsed);
+			Evict();
+		}
+		else {
+			lpEntry->iState = BMPCACHE_FAILED;
+			m_entries.erase(*lpKey);
+			m_stats.cFailures++;
+		}
+
+		lock.unlock();
+		m_loaded.notify_all();
+
+		if(!bLoaded) {
+			lock.lock();
+			Unhold(lpEntry);
+			return NULL;
+		}
+
+		return &lpEntry->surface;
+	}
+
+	// Gives back a surface 'Acquire' returned.
+	void Release(const DIBSURFACE* lpSurface)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		Unhold((LPBMPCACHEENTRY)lpSurface);
+		Evict();
+	}
+
+	// Frees every surface nobody holds.
+	void Flush()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		size_t cbBudget = m_stats.cbBudget;
+
+		m_stats.cbBudget = 0;
+		Evict();
+		m_stats.cbBudget = cbBudget;
+	}
+
+	void SetBudget(size_t cbBudget)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		m_stats.cbBudget = cbBudget;
+		Evict();
+	}
+
+	void GetStats(LPBMPCACHESTATS lpStats)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		*lpStats = m_stats;
+		lpStats->cEntries = (int)m_entries.size();
+		lpStats->cHeld = m_cHeld;
+	}
+
+private:
+	// The header, color table and scanlines.
+	static size_t GetEntryBytes(const DIBSURFACE* lpSurface)
+	{
+		return sizeof(BITMAPINFOHEADER) + sizeof(RGBQUAD) * 256 + (size_t)(lpSurface->iPitch < 0 ? -lpSurface->iPitch : lpSurface->iPitch) * lpSurface->cy;
+	}
+
+	static void FreeEntry(LPBMPCACHEENTRY lpEntry)
+	{
+		if(lpEntry->surface.lpBmi) {
+			FreeDIBSurface(&lpEntry->surface);
+		}
+
+		delete lpEntry;
+	}
+
+	void Unlink(LPBMPCACHEENTRY lpEntry)
+	{
+		(lpEntry->lpPrev ? lpEntry->lpPrev->lpNext : m_lpNewest) = lpEntry->lpNext;
+		(lpEntry->lpNext ? lpEntry->lpNext->lpPrev : m_lpOldest) = lpEntry->lpPrev;
+		lpEntry->lpPrev = lpEntry->lpNext = NULL;
+	}
+
+	// Takes a loaded entry off the list the first time it is held.
+	void Hold(LPBMPCACHEENTRY lpEntry)
+	{
+		if(lpEntry->cRefs++ == 0) {
+			if(lpEntry->iState == BMPCACHE_READY) {
+				Unlink(lpEntry);
+			}
+
+			m_cHeld++;
+		}
+	}
+
+	// Puts it in front of the list when the last holder lets go. Failed
+	// entries are already out of the map, the last one to let go of
+	// those deletes them.
+	void Unhold(LPBMPCACHEENTRY lpEntry)
+	{
+		if(--lpEntry->cRefs > 0) {
+			return;
+		}
+
+		m_cHeld--;
+
+		if(lpEntry->iState == BMPCACHE_FAILED) {
+			FreeEntry(lpEntry);
+			return;
+		}
+
+		lpEntry->lpPrev = NULL;
+		lpEntry->lpNext = m_lpNewest;
+		(m_lpNewest ? m_lpNewest->lpPrev : m_lpOldest) = lpEntry;
+		m_lpNewest = lpEntry;
+	}
+
+	// Frees the oldest entries nobody holds until we are within budget.
+	void Evict()
+	{
+		while(m_stats.cbUsed > m_stats.cbBudget && m_lpOldest) {
+			LPBMPCACHEENTRY lpEntry = m_lpOldest;
+
+			Unlink(lpEntry);
+			m_entries.erase(lpEntry->key);
+			m_stats.cbUsed -= lpEntry->cb;
+			m_stats.cEvictions++;
+			FreeEntry(lpEntry);
+		}
+	}
+
+	std::mutex				m_lock;
+	std::condition_variable	m_loaded;
+	std::unordered_map<BMPCACHEKEY, LPBMPCACHEENTRY, BMPCACHEKEYHASH, BMPCACHEKEYEQUAL>	m_entries;
+	LPBMPCACHEENTRY			m_lpNewest;
+	LPBMPCACHEENTRY			m_lpOldest;
+	int						m_cHeld;
+	BMPCACHESTATS			m_stats;
+};
+
+//
+// Loading bitmap files through the cache.
+//
+
+// The headers in the mapping are only 2-byte aligned, so the format is
+// worked out from the copies the view keeps.
+static inline int GetBitmapViewFormat(const BITMAPVIEW* lpView)
+{
+	struct {
+		BITMAPINFOHEADER	bih;
+		DWORD				dwMasks[3];
+	} info;
+
+	if(lpView->bih.biCompression == BI_RLE8 || lpView->bih.biCompression == BI_RLE4) {
+		return DIBFMT_INDEX8;
+	}
+
+	info.bih = lpView->bih;
+	memcpy(info.dwMasks, lpView->dwMasks, sizeof(info.dwMasks));
+
+	// The alpha mask doesn't change which format the pixels are in.
+	if(info.bih.biCompression == BI_ALPHABITFIELDS) {
+		info.bih.biCompression = BI_BITFIELDS;
+	}
+
+	return GetDIBFormat((const BITMAPINFO*)&info);
+}
+
+static inline int GetCacheFormatBpp(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return 8;
+	case DIBFMT_RGB555:	return 15;
+	case DIBFMT_RGB565:	return 16;
+	case DIBFMT_BGR24:	return 24;
+	case DIBFMT_XRGB32:	return 32;
+	}
+
+	return 0;
+}
+
+// Makes a copy of a surface with its own DIB, color table included.
+static inline BOOL CloneDIBSurface(LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc)
+{
+	if(!CreateDIBSurface(lpDst, lpSrc->cx, lpSrc->cy, GetCacheFormatBpp(lpSrc->iFormat), DIBALLOC_NOZERO)) {
+		return FALSE;
+	}
+
+	if(lpSrc->iFormat == DIBFMT_INDEX8) {
+		memcpy(lpDst->lpBmi->bmiColors, lpSrc->lpBmi->bmiColors, sizeof(RGBQUAD) * 256);
+		lpDst->lpBmi->bmiHeader.biClrUsed = lpSrc->lpBmi->bmiHeader.biClrUsed;
+	}
+
+	for(int y = 0; y < lpSrc->cy; y++) {
+		memcpy(lpDst->pTop + (size_t)y * lpDst->iPitch, lpSrc->pTop + (size_t)y * lpSrc->iPitch, (size_t)lpSrc->cx * GetDIBFormatBytes(lpSrc->iFormat));
+	}
+
+	return TRUE;
+}
+
+// Decodes a bitmap with channel masks none of our formats has, or with an
+// alpha mask on 16bpp, through bitfields.h. Without a format it becomes
+// 32bpp, which keeps the alpha in the top byte.
+static inline BOOL CreateBitfieldsDIBSurface(const BITMAPVIEW* lpView, LPDIBSURFACE lpSurface, int iFormat)
+{
+	LPBITFIELDS lpFields = (LPBITFIELDS)malloc(sizeof(BITFIELDS));
+	DWORD* pXRGB = (DWORD*)malloc((size_t)lpView->cx * sizeof(DWORD));
+	DWORD palette[256];
+	CONVERTPROCS procs;
+	BOOL bResult = FALSE;
+
+	if(iFormat == DIBFMT_UNKNOWN) {
+		iFormat = DIBFMT_XRGB32;
+	}
+
+	ZeroMemory(palette, sizeof(palette));
+
+	if(lpFields && pXRGB && AnalyzeBitfields(lpView->dwMasks, lpView->bih.biBitCount, lpFields) && GetConvertProcs(iFormat, DIBFMT_XRGB32, &procs) &&
+		CreateDIBSurface(lpSurface, lpView->cx, lpView->cy, GetCacheFormatBpp(iFormat), DIBALLOC_NOZERO)) {
+		for(int y = 0; y < lpView->cy; y++) {
+			BYTE* pDst = lpSurface->pTop + (size_t)y * lpSurface->iPitch;
+
+			// 32bpp is unpacked in place, the rest goes through a scanline of XRGB.
+			if(iFormat == DIBFMT_XRGB32) {
+				UnpackBitfields(lpFields, (DWORD*)pDst, GetViewScanline(lpView, y), lpView->cx);
+			}
+			else {
+				UnpackBitfields(lpFields, pXRGB, GetViewScanline(lpView, y), lpView->cx);
+				ConvertScanline(&procs, pDst, (const BYTE*)pXRGB, lpView->cx, palette);
+			}
+		}
+
+		bResult = TRUE;
+	}
+
+	free(pXRGB);
+	free(lpFields);
+
+	return bResult;
+}
+
+// Decodes a bitmap view into a new surface of format 'iFormat', or of the
+// format of the file if that is DIBFMT_UNKNOWN. 8bpp files keep their
+// color table, anything converted to 8bpp gets the gray one.
+static inline BOOL CreateViewDIBSurface(const BITMAPVIEW* lpView, LPDIBSURFACE lpSurface, int iFormat)
+{
+	int iSrcFormat = GetBitmapViewFormat(lpView);
+	CONVERTPROCS procs;
+	DWORD palette[256];
+
+	if(lpView->bih.biCompression == BI_BITFIELDS || lpView->bih.biCompression == BI_ALPHABITFIELDS) {
+		if(iSrcFormat == DIBFMT_UNKNOWN || (lpView->bih.biBitCount == 16 && lpView->dwMasks[3])) {
+			return CreateBitfieldsDIBSurface(lpView, lpSurface, iFormat);
+		}
+	}
+
+	if(iSrcFormat == DIBFMT_UNKNOWN) {
+		return FALSE;
+	}
+
+	if(iFormat == DIBFMT_UNKNOWN) {
+		iFormat = iSrcFormat;
+	}
+
+	// RLE is unpacked first and converted from there, if at all.
+	if(lpView->bih.biCompression == BI_RLE8 || lpView->bih.biCompression == BI_RLE4) {
+		DIBSURFACE rle;
+
+		if(!CreateRLEDIBSurface(lpView, &rle)) {
+			return FALSE;
+		}
+
+		if(iFormat == DIBFMT_INDEX8) {
+			*lpSurface = rle;
+			return TRUE;
+		}
+
+		BOOL bResult = CreateDIBSurface(lpSurface, rle.cx, rle.cy, GetCacheFormatBpp(iFormat), DIBALLOC_NOZERO);
+
+		if(bResult && !ConvertDIBSurface(lpSurface, &rle)) {
+			FreeDIBSurface(lpSurface);
+			bResult = FALSE;
+		}
+
+		FreeDIBSurface(&rle);
+		return bResult;
+	}
+
+	if(!GetConvertProcs(iFormat, iSrcFormat, &procs) || !CreateDIBSurface(lpSurface, lpView->cx, lpView->cy, GetCacheFormatBpp(iFormat), DIBALLOC_NOZERO)) {
+		return FALSE;
+	}
+
+	ZeroMemory(palette, sizeof(palette));
+
+	for(int i = 0; i < lpView->iColors && i < 256; i++) {
+		palette[i] = (lpView->lpPalette[i].rgbRed << 16) | (lpView->lpPalette[i].rgbGreen << 8) | lpView->lpPalette[i].rgbBlue;
+	}
+
+	if(iFormat == DIBFMT_INDEX8 && iSrcFormat == DIBFMT_INDEX8) {
+		LPBITMAPINFO lpBmi = lpSurface->lpBmi;
+
+		ZeroMemory(lpBmi->bmiColors, sizeof(RGBQUAD) * 256);
+		memcpy(lpBmi->bmiColors, lpView->lpPalette, sizeof(RGBQUAD) * lpView->iColors);
+		lpBmi->bmiHeader.biClrUsed = lpView->iColors;
+	}
+
+	for(int y = 0; y < lpView->cy; y++) {
+		ConvertScanline(&procs, lpSurface->pTop + (size_t)y * lpSurface->iPitch, GetViewScanline(lpView, y), lpView->cx, palette);
+	}
+
+	return TRUE;
+}
+
+typedef struct tagBMPCACHELOAD {
+	LPCSTR				lpszFilename;
+	const BITMAPVIEW*	lpView;			// Already mapped, or NULL to map the file
+} BMPCACHELOAD;
+
+static inline BOOL LoadCacheBitmapProc(LPDIBSURFACE lpSurface, const BMPCACHEKEY* lpKey, void* lpParam)
+{
+	BMPCACHELOAD* lpLoad = (BMPCACHELOAD*)lpParam;
+	BITMAPVIEW view;
+	BOOL bResult;
+
+	if(lpLoad->lpView) {
+		return CreateViewDIBSurface(lpLoad->lpView, lpSurface, lpKey->iFormat);
+	}
+
+	if(!MapBitmapFile(lpLoad->lpszFilename, &view)) {
+		return FALSE;
+	}
+
+	bResult = CreateViewDIBSurface(&view, lpSurface, lpKey->iFormat);
+	UnmapBitmapFile(&view);
+
+	return bResult;
+}
+
+// Loads a bitmap file as a surface of format 'iFormat' (DIBFMT_UNKNOWN
+// keeps the format of the file) through the cache. With 'bByContent' the
+// file is mapped and hashed to find it, otherwise it is found by its
+// identity and not opened at all when it is in the cache. Returns NULL if
+// the file can't be loaded. Give the surface back with 'Release'.
+static inline const DIBSURFACE* LoadCachedBitmap(CBitmapCache* lpCache, LPCSTR lpszFilename, int iFormat, BOOL bByContent)
+{
+	BMPCACHELOAD load;
+	BMPCACHEKEY key;
+	BITMAPVIEW view;
+	const DIBSURFACE* lpSurface;
+
+	load.lpszFilename = lpszFilename;
+	load.lpView = NULL;
+
+	if(!bByContent) {
+		if(!GetFileCacheKey(lpszFilename, iFormat, 0, &key)) {
+			return NULL;
+		}
+
+		return lpCache->Acquire(&key, LoadCacheBitmapProc, &load);
+	}
+
+	if(!MapBitmapFile(lpszFilename, &view)) {
+		return NULL;
+	}
+
+	GetContentCacheKey(view.pBase, view.cbFile, iFormat, 0, &key);
+	load.lpView = &view;
+
+	lpSurface = lpCache->Acquire(&key, LoadCacheBitmapProc, &load);
+	UnmapBitmapFile(&view);
+
+	return lpSurface;
+}
+
+#endif // BMPCACHE_H
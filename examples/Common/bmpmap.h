@@ -0,0 +1,337 @@
+
+#ifndef BMPMAP_H
+#define BMPMAP_H
+
+// Memory mapped bitmap files.
+//
+// 'LoadImage' with LR_CREATEDIBSECTION reads the whole file and copies the
+// pixels into a freshly allocated DIB section. When all we want to do is
+// look at the pixels (display them, convert them, hash them) that copy is
+// pure overhead. The functions below map the file into our address space
+// instead and hand back a read-only view on it. The headers are parsed and
+// checked once, the pixel data itself is never touched until somebody
+// actually reads it, and then the operating system pages it in for us.
+
+#include "dibtypes.h"
+
+#include <stddef.h>
+
+// BI_BITFIELDS with an alpha mask after the other three. 'wingdi.h' only
+// has it for Windows CE.
+#ifndef BI_ALPHABITFIELDS
+#define BI_ALPHABITFIELDS	6L
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+typedef struct tagBITMAPVIEW {
+	BITMAPFILEHEADER	bfh;		// Copy of the file header
+	BITMAPINFOHEADER	bih;		// Copy of the info header
+	const BITMAPINFO*	lpBmi;		// Info header + color table inside the mapping
+	const RGBQUAD*		lpPalette;	// Color table, NULL if there is none
+	int					iColors;	// Number of entries in the color table
+	DWORD				dwMasks[4];	// Red, green, blue and alpha mask
+	const BYTE*			pBits;		// First scanline as it is stored in the file
+	size_t				cbBits;		// Bytes of pixel data, compressed size for RLE
+	int					cx;			// Width in pixels
+	int					cy;			// Height in pixels (always positive)
+	int					iStride;	// Bytes per scanline, including the padding
+	BOOL				bTopDown;	// TRUE if the first stored scanline is the top one
+
+	// Mapping bookkeeping, don't touch.
+	const BYTE*			pBase;
+	size_t				cbFile;
+#ifdef _WIN32
+	HANDLE				hFile;
+	HANDLE				hMapping;
+#endif
+} BITMAPVIEW, *LPBITMAPVIEW;
+
+// Checks the headers of a bitmap and fills in the view, when only the
+// first 'cbData' bytes of a 'cbFile' byte file are in memory. The headers
+// and the color table have to be in those, the pixels only in the file.
+// 'pBits' is NULL when they aren't in memory. Nothing is copied except the
+// two headers and the masks. Returns FALSE if the data is not a bitmap we
+// understand or if any part of it would lie outside of the file.
+static inline BOOL ParseBitmapHeaders(const BYTE* pData, size_t cbData, size_t cbFile, LPBITMAPVIEW lpView)
+{
+	const size_t cbHeaders = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+
+	if(cbData < cbHeaders) {
+		return FALSE;
+	}
+
+	// The headers are copied out of the mapping because the info header
+	// lives at offset 14 in the file, which is not DWORD aligned.
+	memcpy(&lpView->bfh, pData, sizeof(BITMAPFILEHEADER));
+	memcpy(&lpView->bih, pData + sizeof(BITMAPFILEHEADER), sizeof(BITMAPINFOHEADER));
+
+	const BITMAPFILEHEADER* pbfh = &lpView->bfh;
+	const BITMAPINFOHEADER* pbih = &lpView->bih;
+
+	if(pbfh->bfType != ((WORD) ('M' << 8) | 'B')) {
+		return FALSE;
+	}
+
+	// Anything smaller than a BITMAPINFOHEADER is an old OS/2 core header,
+	// anything bigger (V4/V5) starts with the same fields so we can use it.
+	if(pbih->biSize < sizeof(BITMAPINFOHEADER) || pbih->biSize > cbData - sizeof(BITMAPFILEHEADER)) {
+		return FALSE;
+	}
+
+	if(pbih->biPlanes != 1 || pbih->biWidth <= 0 || pbih->biHeight == 0) {
+		return FALSE;
+	}
+
+	// Keep the sizes we work out from these from overflowing.
+	if(pbih->biWidth > (0x7FFFFFFF - 31) / 32 || pbih->biHeight < -0x7FFFFFFF) {
+		return FALSE;
+	}
+
+	switch(pbih->biBitCount) {
+	case 1: case 4: case 8: case 16: case 24: case 32:
+		break;
+
+	default:
+		return FALSE;
+	}
+
+	// Only uncompressed pixel data can be viewed in place. RLE compressed
+	// bitmaps are let through so they can be decoded, see rle.h, but they
+	// have no scanlines to look at. They are always bottom-up.
+	BOOL bRLE = pbih->biCompression == BI_RLE8 || pbih->biCompression == BI_RLE4;
+
+	if(bRLE) {
+		if(pbih->biBitCount != (pbih->biCompression == BI_RLE8 ? 8 : 4) || pbih->biHeight < 0) {
+			return FALSE;
+		}
+	}
+	else
+	if(pbih->biCompression != BI_RGB && pbih->biCompression != BI_BITFIELDS && pbih->biCompression != BI_ALPHABITFIELDS) {
+		return FALSE;
+	}
+
+	lpView->cx = pbih->biWidth;
+	lpView->cy = pbih->biHeight < 0 ? -pbih->biHeight : pbih->biHeight;
+	lpView->bTopDown = pbih->biHeight < 0;
+	lpView->iStride = DIB_STRIDE(lpView->cx, pbih->biBitCount);
+
+	const BYTE* pTable = pData + sizeof(BITMAPFILEHEADER) + pbih->biSize;
+	size_t cbTable = cbData - sizeof(BITMAPFILEHEADER) - pbih->biSize;
+
+	// Masks. With a plain BITMAPINFOHEADER they follow the header, with the
+	// bigger headers they are part of it: red, green and blue from V2 (52
+	// bytes) on, alpha as well from V3 (56 bytes) on, which includes V4 and
+	// V5. Without BI_BITFIELDS we fill in the masks Windows assumes for that
+	// depth.
+	ZeroMemory(lpView->dwMasks, sizeof(lpView->dwMasks));
+
+	if(pbih->biCompression == BI_BITFIELDS || pbih->biCompression == BI_ALPHABITFIELDS) {
+		size_t cMasks = pbih->biCompression == BI_ALPHABITFIELDS ? 4 : 3;
+
+		if(pbih->biBitCount != 16 && pbih->biBitCount != 32) {
+			return FALSE;
+		}
+
+		if(pbih->biSize >= sizeof(BITMAPINFOHEADER) + sizeof(DWORD) * 4) {
+			memcpy(lpView->dwMasks, pData + cbHeaders, sizeof(DWORD) * 4);
+		}
+		else
+		if(pbih->biSize >= sizeof(BITMAPINFOHEADER) + sizeof(DWORD) * 3 && cMasks == 3) {
+			memcpy(lpView->dwMasks, pData + cbHeaders, sizeof(DWORD) * 3);
+		}
+		else {
+			if(cbTable < sizeof(DWORD) * cMasks) {
+				return FALSE;
+			}
+
+			memcpy(lpView->dwMasks, pTable, sizeof(DWORD) * cMasks);
+			pTable += sizeof(DWORD) * cMasks;
+			cbTable -= sizeof(DWORD) * cMasks;
+		}
+	}
+	else
+	if(pbih->biBitCount == 16) {
+		lpView->dwMasks[0] = 0x00007C00;
+		lpView->dwMasks[1] = 0x000003E0;
+		lpView->dwMasks[2] = 0x0000001F;
+	}
+	else
+	if(pbih->biBitCount >= 24) {
+		lpView->dwMasks[0] = 0x00FF0000;
+		lpView->dwMasks[1] = 0x0000FF00;
+		lpView->dwMasks[2] = 0x000000FF;
+	}
+
+	// Color table. Only the indexed formats have one that matters, when
+	// 'biClrUsed' is zero the table is as big as the depth allows.
+	lpView->lpPalette = NULL;
+	lpView->iColors = 0;
+
+	if(pbih->biBitCount <= 8) {
+		DWORD dwColors = pbih->biClrUsed ? pbih->biClrUsed : (1u << pbih->biBitCount);
+
+		if(dwColors > (1u << pbih->biBitCount) || dwColors * sizeof(RGBQUAD) > cbTable) {
+			return FALSE;
+		}
+
+		lpView->lpPalette = (const RGBQUAD*)pTable;
+		lpView->iColors = (int)dwColors;
+	}
+
+	// And finally the pixels themselves, all scanlines must be inside the
+	// data and none of them inside the headers, masks or color table. We
+	// don't care about 'biSizeImage', lots of writers get it wrong.
+	size_t cbInfo = (size_t)(pTable - pData) + sizeof(RGBQUAD) * lpView->iColors;
+
+	if(pbfh->bfOffBits < cbInfo || pbfh->bfOffBits > cbFile) {
+		return FALSE;
+	}
+
+	if(bRLE) {
+		// Here 'biSizeImage' is the only thing that says how much data there
+		// is. If it's missing or too big we take what is in the file.
+		lpView->cbBits = cbFile - pbfh->bfOffBits;
+
+		if(pbih->biSizeImage && pbih->biSizeImage < lpView->cbBits) {
+			lpView->cbBits = pbih->biSizeImage;
+		}
+	}
+	else {
+		lpView->cbBits = (size_t)lpView->iStride * (size_t)lpView->cy;
+
+		if(lpView->cbBits > cbFile - pbfh->bfOffBits) {
+			return FALSE;
+		}
+	}
+
+	lpView->lpBmi = (const BITMAPINFO*)(pData + sizeof(BITMAPFILEHEADER));
+	lpView->pBits = pbfh->bfOffBits <= cbData ? pData + pbfh->bfOffBits : NULL;
+
+	return TRUE;
+}
+
+// Checks the headers of a bitmap that lives in memory, all 'cbData' bytes
+// of it, and fills in the view.
+static inline BOOL ParseBitmapView(const BYTE* pData, size_t cbData, LPBITMAPVIEW lpView)
+{
+	return ParseBitmapHeaders(pData, cbData, cbData, lpView);
+}
+
+// Returns a pointer to scanline 'y' of the image, where 'y' = 0 is always
+// the top of the image regardless of how the file stores its scanlines.
+// Compressed bitmaps don't have scanlines, for those this returns NULL.
+static inline const BYTE* GetViewScanline(const BITMAPVIEW* lpView, int y)
+{
+	if(lpView->bih.biCompression == BI_RLE8 || lpView->bih.biCompression == BI_RLE4) {
+		return NULL;
+	}
+
+	if(!lpView->bTopDown) {
+		y = lpView->cy - 1 - y;
+	}
+
+	return lpView->pBits + (size_t)y * lpView->iStride;
+}
+
+// Unmaps a view created by 'MapBitmapFile'. It is safe to call this on a
+// view that failed to map.
+static inline void UnmapBitmapFile(LPBITMAPVIEW lpView)
+{
+#ifdef _WIN32
+	if(lpView->pBase) {
+		UnmapViewOfFile(lpView->pBase);
+	}
+
+	if(lpView->hMapping) {
+		CloseHandle(lpView->hMapping);
+	}
+
+	if(lpView->hFile && lpView->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(lpView->hFile);
+	}
+#else
+	if(lpView->pBase) {
+		munmap((void*)lpView->pBase, lpView->cbFile);
+	}
+#endif
+
+	ZeroMemory(lpView, sizeof(BITMAPVIEW));
+}
+
+// Maps a bitmap file read-only and fills in the view. The view stays valid
+// until 'UnmapBitmapFile' is called. Returns FALSE if the file could not be
+// mapped or is not a bitmap we can view in place.
+static inline BOOL MapBitmapFile(LPCSTR lpszFilename, LPBITMAPVIEW lpView)
+{
+	ZeroMemory(lpView, sizeof(BITMAPVIEW));
+
+#ifdef _WIN32
+	lpView->hFile = CreateFileA(lpszFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if(lpView->hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	lpView->cbFile = (size_t)GetFileSize(lpView->hFile, NULL);
+
+	if(lpView->cbFile == 0 || lpView->cbFile == (size_t)INVALID_FILE_SIZE) {
+		UnmapBitmapFile(lpView);
+		return FALSE;
+	}
+
+	if((lpView->hMapping = CreateFileMapping(lpView->hFile, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL) {
+		UnmapBitmapFile(lpView);
+		return FALSE;
+	}
+
+	if((lpView->pBase = (const BYTE*)MapViewOfFile(lpView->hMapping, FILE_MAP_READ, 0, 0, 0)) == NULL) {
+		UnmapBitmapFile(lpView);
+		return FALSE;
+	}
+#else
+	int hFile = open(lpszFilename, O_RDONLY);
+	struct stat st;
+
+	if(hFile < 0) {
+		return FALSE;
+	}
+
+	if(fstat(hFile, &st) != 0 || st.st_size <= 0) {
+		close(hFile);
+		return FALSE;
+	}
+
+	lpView->cbFile = (size_t)st.st_size;
+
+	void* pBase = mmap(NULL, lpView->cbFile, PROT_READ, MAP_PRIVATE, hFile, 0);
+
+	// The mapping keeps its own reference to the file.
+	close(hFile);
+
+	if(pBase == MAP_FAILED) {
+		ZeroMemory(lpView, sizeof(BITMAPVIEW));
+		return FALSE;
+	}
+
+	lpView->pBase = (const BYTE*)pBase;
+
+	// Most readers walk the scanlines front to back, let the kernel read
+	// ahead for us.
+	madvise(pBase, lpView->cbFile, MADV_SEQUENTIAL);
+#endif
+
+	if(!ParseBitmapView(lpView->pBase, lpView->cbFile, lpView)) {
+		UnmapBitmapFile(lpView);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#endif // BMPMAP_H
@@ -0,0 +1,541 @@
+
+#ifndef BMPPACK_H
+#define BMPPACK_H
+
+// Packs of surfaces.
+//
+// Loading a bitmap file means parsing its headers, building a BITMAPINFO
+// for it and converting every pixel into the format we draw in. For one
+// file that is nothing, for the thousands of assets a program needs before
+// it can show its first frame it is most of the startup time. A pack does
+// that work once, when it is built: it is a single file holding any number
+// of surfaces exactly the way 'CreateDIB' lays them out in memory, color
+// table or masks and all, plus an index to find them by name.
+//
+//   [ PACKHEADER | BITMAPINFO | pad | bits | pad | BITMAPINFO | ... ]
+//   [ names | PACKENTRY for each surface, sorted by name | PACKTRAILER ]
+//
+// Every BITMAPINFO starts on a 64 byte boundary and every surface's bits
+// on a page boundary, so once the pack is mapped a surface is a pointer
+// into the mapping; nothing is read, parsed or copied to open it. The
+// pages of a surface are only read from the disk when it is drawn for the
+// first time. The index is at the end so the builder can write the file
+// front to back in one go, the trailer tells where it is.
+//
+// The pack is mapped copy-on-write: the surfaces can be drawn on like any
+// other, a page somebody writes to gets a private copy and the file is
+// never changed.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "bmpwrite.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define PACK_MAGIC			0x4B415042	// 'BPAK'
+#define PACK_VERSION		1
+#define PACK_PAGE			4096		// Bits are aligned to this
+#define PACK_INFO_ALIGN		64			// And BITMAPINFOs to this
+
+// Room for the biggest BITMAPINFO 'CreateDIB' makes: 256 colors.
+#define PACK_INFO_SIZE		(sizeof(BITMAPINFOHEADER) + sizeof(RGBQUAD) * 256)
+
+#define PACK_ALIGN_UP(n, a)	(((n) + (a) - 1) & ~(unsigned long long)((a) - 1))
+
+typedef struct tagPACKHEADER {
+	DWORD				dwMagic;		// PACK_MAGIC
+	DWORD				dwVersion;		// PACK_VERSION
+	DWORD				dwPage;			// PACK_PAGE
+	DWORD				dwReserved;
+} PACKHEADER;
+
+typedef struct tagPACKENTRY {
+	unsigned long long	offInfo;		// BITMAPINFO, top-down like CreateDIB makes it
+	unsigned long long	offBits;		// First pixel of the top scanline
+	unsigned long long	cbBits;
+	DWORD				offName;		// Into the names, which are zero terminated
+	DWORD				cchName;
+	int					cx;
+	int					cy;
+	int					iFormat;		// DIBFMT_
+	int					iPitch;
+} PACKENTRY, *LPPACKENTRY;
+
+typedef struct tagPACKTRAILER {
+	unsigned long long	offIndex;		// PACKENTRY[cEntries]
+	unsigned long long	offNames;
+	unsigned long long	cbNames;
+	DWORD				cEntries;
+	DWORD				dwMagic;		// PACK_MAGIC again, the last thing in the file
+} PACKTRAILER;
+
+typedef struct tagSURFACEPACK {
+	BYTE*				pBase;
+	size_t				cbFile;
+	const PACKENTRY*	lpEntries;
+	const char*			lpszNames;
+	int					cEntries;
+#ifdef _WIN32
+	HANDLE				hFile;
+	HANDLE				hMapping;
+#endif
+} SURFACEPACK, *LPSURFACEPACK;
+
+//
+// Reading.
+//
+
+static inline void CloseSurfacePack(LPSURFACEPACK lpPack)
+{
+#ifdef _WIN32
+	if(lpPack->pBase) {
+		UnmapViewOfFile(lpPack->pBase);
+	}
+
+	if(lpPack->hMapping) {
+		CloseHandle(lpPack->hMapping);
+	}
+
+	if(lpPack->hFile && lpPack->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(lpPack->hFile);
+	}
+#else
+	if(lpPack->pBase) {
+		munmap(lpPack->pBase, lpPack->cbFile);
+	}
+#endif
+
+	ZeroMemory(lpPack, sizeof(SURFACEPACK));
+}
+
+// Checks that the trailer, index and names lie inside the file and that
+// every entry is a surface we can hand out. Only the index and names are
+// read, not the surfaces.
+static inline BOOL CheckSurfacePack(LPSURFACEPACK lpPack)
+{
+	const PACKHEADER* lpHeader = (const PACKHEADER*)lpPack->pBase;
+	PACKTRAILER trailer;
+	unsigned long long cbFile = lpPack->cbFile;
+
+	if(cbFile < sizeof(PACKHEADER) + sizeof(PACKTRAILER) || lpHeader->dwMagic != PACK_MAGIC || lpHeader->dwVersion != PACK_VERSION || lpHeader->dwPage != PACK_PAGE) {
+		return FALSE;
+	}
+
+	memcpy(&trailer, lpPack->pBase + cbFile - sizeof(PACKTRAILER), sizeof(PACKTRAILER));
+
+	if(trailer.dwMagic != PACK_MAGIC || trailer.offIndex % 8 != 0 || trailer.offIndex > cbFile || (cbFile - trailer.offIndex) / sizeof(PACKENTRY) < trailer.cEntries ||
+		trailer.offNames > cbFile || cbFile - trailer.offNames < trailer.cbNames || trailer.cEntries > 0x7FFFFFFF) {
+		return FALSE;
+	}
+
+	lpPack->lpEntries = (const PACKENTRY*)(lpPack->pBase + trailer.offIndex);
+	lpPack->lpszNames = (const char*)(lpPack->pBase + trailer.offNames);
+	lpPack->cEntries = (int)trailer.cEntries;
+
+	for(int i = 0; i < lpPack->cEntries; i++) {
+		const PACKENTRY* lpEntry = &lpPack->lpEntries[i];
+		int iBytes = GetDIBFormatBytes(lpEntry->iFormat);
+
+		if(iBytes == 0 || lpEntry->cx <= 0 || lpEntry->cy <= 0 || lpEntry->iPitch < (long long)lpEntry->cx * iBytes || lpEntry->cbBits < (unsigned long long)lpEntry->iPitch * lpEntry->cy) {
+			return FALSE;
+		}
+
+		if(lpEntry->offInfo % PACK_INFO_ALIGN != 0 || cbFile < PACK_INFO_SIZE || lpEntry->offInfo > cbFile - PACK_INFO_SIZE || lpEntry->offBits % PACK_PAGE != 0 || lpEntry->offBits > cbFile || cbFile - lpEntry->offBits < lpEntry->cbBits) {
+			return FALSE;
+		}
+
+		// Names are zero terminated, and sorted so we can search them.
+		if((unsigned long long)lpEntry->offName + lpEntry->cchName >= trailer.cbNames || lpPack->lpszNames[lpEntry->offName + lpEntry->cchName] != 0) {
+			return FALSE;
+		}
+
+		if(i > 0 && strcmp(lpPack->lpszNames + lpEntry[-1].offName, lpPack->lpszNames + lpEntry->offName) >= 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+// Maps a pack and checks its index. The surfaces stay valid until
+// 'CloseSurfacePack'. Returns FALSE if the file can't be mapped or isn't
+// a pack of this version.
+static inline BOOL OpenSurfacePack(LPCSTR lpszFilename, LPSURFACEPACK lpPack)
+{
+	ZeroMemory(lpPack, sizeof(SURFACEPACK));
+
+#ifdef _WIN32
+	LARGE_INTEGER llSize;
+
+	lpPack->hFile = CreateFileA(lpszFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+
+	if(lpPack->hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	if(!GetFileSizeEx(lpPack->hFile, &llSize) || llSize.QuadPart == 0 || (unsigned long long)llSize.QuadPart > (size_t)-1) {
+		CloseSurfacePack(lpPack);
+		return FALSE;
+	}
+
+	lpPack->cbFile = (size_t)llSize.QuadPart;
+
+	// Copy-on-write, see above.
+	if((lpPack->hMapping = CreateFileMapping(lpPack->hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL)) == NULL) {
+		CloseSurfacePack(lpPack);
+		return FALSE;
+	}
+
+	if((lpPack->pBase = (BYTE*)MapViewOfFile(lpPack->hMapping, FILE_MAP_COPY, 0, 0, 0)) == NULL) {
+		CloseSurfacePack(lpPack);
+		return FALSE;
+	}
+#else
+	int hFile = open(lpszFilename, O_RDONLY);
+	struct stat st;
+
+	if(hFile < 0) {
+		return FALSE;
+	}
+
+	if(fstat(hFile, &st) != 0 || st.st_size <= 0) {
+		close(hFile);
+		return FALSE;
+	}
+
+	lpPack->cbFile = (size_t)st.st_size;
+
+	// Copy-on-write, see above. MAP_PRIVATE with PROT_WRITE doesn't need
+	// the file to be writable.
+	void* pBase = mmap(NULL, lpPack->cbFile, PROT_READ | PROT_WRITE, MAP_PRIVATE, hFile, 0);
+
+	close(hFile);
+
+	if(pBase == MAP_FAILED) {
+		ZeroMemory(lpPack, sizeof(SURFACEPACK));
+		return FALSE;
+	}
+
+	lpPack->pBase = (BYTE*)pBase;
+
+	// Surfaces are looked at in whatever order the program needs them.
+	madvise(pBase, lpPack->cbFile, MADV_RANDOM);
+#endif
+
+	if(!CheckSurfacePack(lpPack)) {
+		CloseSurfacePack(lpPack);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static inline LPCSTR GetPackSurfaceName(const SURFACEPACK* lpPack, int iEntry)
+{
+	return lpPack->lpszNames + lpPack->lpEntries[iEntry].offName;
+}
+
+// Returns the entry for a name, or -1 if there is none. A binary search
+// of the index, which touches about log2(entries) names.
+static inline int FindPackSurface(const SURFACEPACK* lpPack, LPCSTR lpszName)
+{
+	int iFirst = 0, iLast = lpPack->cEntries - 1;
+
+	while(iFirst <= iLast) {
+		int iMiddle = iFirst + (iLast - iFirst) / 2;
+		int iOrder = strcmp(lpszName, GetPackSurfaceName(lpPack, iMiddle));
+
+		if(iOrder == 0) {
+			return iMiddle;
+		}
+
+		if(iOrder < 0) {
+			iLast = iMiddle - 1;
+		}
+		else {
+			iFirst = iMiddle + 1;
+		}
+	}
+
+	return -1;
+}
+
+// Sets up a surface on an entry of the pack. It points into the mapping,
+// so it must not be freed and is gone after 'CloseSurfacePack'. All of it
+// comes from the index: the BITMAPINFO has a page of its own, and reading
+// it for every surface a program looks up would fault in a page each. So
+// 'lpBmi' isn't checked, call 'CheckPackSurfaceInfo' before handing it to
+// GDI.
+static inline BOOL GetPackSurface(const SURFACEPACK* lpPack, int iEntry, LPDIBSURFACE lpSurface)
+{
+	const PACKENTRY* lpEntry;
+
+	ZeroMemory(lpSurface, sizeof(DIBSURFACE));
+
+	if(iEntry < 0 || iEntry >= lpPack->cEntries) {
+		return FALSE;
+	}
+
+	lpEntry = &lpPack->lpEntries[iEntry];
+
+	lpSurface->lpBmi = (LPBITMAPINFO)(lpPack->pBase + lpEntry->offInfo);
+	lpSurface->pBits = lpPack->pBase + lpEntry->offBits;
+	lpSurface->pTop = lpSurface->pBits;
+	lpSurface->iPitch = lpEntry->iPitch;
+	lpSurface->cx = lpEntry->cx;
+	lpSurface->cy = lpEntry->cy;
+	lpSurface->iFormat = lpEntry->iFormat;
+
+	return TRUE;
+}
+
+// Checks that the BITMAPINFO of an entry describes the pixels the index
+// says are there: uncompressed, top-down, the size and format of the
+// entry, and scanlines of exactly its pitch. 'SetDIBitsToDevice' and the
+// like go by the BITMAPINFO alone, a damaged pack must not have them read
+// past the bits.
+static inline BOOL CheckPackSurfaceInfo(const SURFACEPACK* lpPack, int iEntry)
+{
+	const PACKENTRY* lpEntry;
+	const BITMAPINFO* lpBmi;
+	const BITMAPINFOHEADER* lpbih;
+
+	if(iEntry < 0 || iEntry >= lpPack->cEntries) {
+		return FALSE;
+	}
+
+	lpEntry = &lpPack->lpEntries[iEntry];
+	lpBmi = (const BITMAPINFO*)(lpPack->pBase + lpEntry->offInfo);
+	lpbih = &lpBmi->bmiHeader;
+
+	if(lpbih->biSize != sizeof(BITMAPINFOHEADER) || lpbih->biWidth != lpEntry->cx || lpbih->biHeight != -lpEntry->cy || lpbih->biPlanes != 1) {
+		return FALSE;
+	}
+
+	if(lpbih->biCompression != BI_RGB && !(lpbih->biCompression == BI_BITFIELDS && (lpbih->biBitCount == 16 || lpbih->biBitCount == 32))) {
+		return FALSE;
+	}
+
+	return GetDIBFormat(lpBmi) == lpEntry->iFormat && DIB_STRIDE(lpEntry->cx, lpbih->biBitCount) == lpEntry->iPitch &&
+		lpbih->biSizeImage <= lpEntry->cbBits && lpbih->biClrUsed <= 256;
+}
+
+// Asks the system to start reading a surface's pages now, ahead of the
+// first time it is drawn. Windows pages them in on that first touch.
+static inline void PrefetchPackSurface(const SURFACEPACK* lpPack, int iEntry)
+{
+#ifndef _WIN32
+	const PACKENTRY* lpEntry = &lpPack->lpEntries[iEntry];
+
+	madvise(lpPack->pBase + lpEntry->offBits, lpEntry->cbBits, MADV_WILLNEED);
+#else
+	(void)lpPack;
+	(void)iEntry;
+#endif
+}
+
+//
+// Building.
+//
+
+typedef struct tagPACKBUILDER {
+	BITMAPGATHER*				lpGather;
+	unsigned long long			offNext;	// Bytes written so far
+	std::vector<PACKENTRY>		entries;
+	std::vector<std::string>	names;		// In the order they were added
+} PACKBUILDER, *LPPACKBUILDER;
+
+// Zeros to pad with, a page at most.
+static inline const BYTE* GetPackZeros()
+{
+	static BYTE zeros[PACK_PAGE];
+	return zeros;
+}
+
+static inline BOOL PadPack(LPPACKBUILDER lpBuilder, unsigned long long uAlign)
+{
+	size_t cb = (size_t)(PACK_ALIGN_UP(lpBuilder->offNext, uAlign) - lpBuilder->offNext);
+
+	lpBuilder->offNext += cb;
+
+	return cb == 0 || GatherAdd(lpBuilder->lpGather, GetPackZeros(), cb);
+}
+
+// Creates the file and writes the header. Add the surfaces with
+// 'AddPackSurface' and finish with 'FinishPackBuilder'.
+static inline BOOL CreatePackBuilder(LPPACKBUILDER lpBuilder, LPCSTR lpszFilename)
+{
+	static const PACKHEADER header = { PACK_MAGIC, PACK_VERSION, PACK_PAGE, 0 };
+
+	lpBuilder->entries.clear();
+	lpBuilder->names.clear();
+
+	if((lpBuilder->lpGather = (BITMAPGATHER*)malloc(sizeof(BITMAPGATHER))) == NULL) {
+		return FALSE;
+	}
+
+	if(!GatherOpen(lpBuilder->lpGather, lpszFilename, 1 << 20)) {
+		free(lpBuilder->lpGather);
+		lpBuilder->lpGather = NULL;
+		return FALSE;
+	}
+
+	lpBuilder->offNext = sizeof(header);
+
+	return GatherAdd(lpBuilder->lpGather, &header, sizeof(header));
+}
+
+// Writes a surface to the pack, with its scanlines packed the way
+// 'CreateDIB' would (DWORD aligned, top-down) no matter how the surface
+// has them. The surface can be freed as soon as this returns.
+static inline BOOL AddPackSurface(LPPACKBUILDER lpBuilder, LPCSTR lpszName, const DIBSURFACE* lpSurface)
+{
+	const BITMAPINFOHEADER* lpbih = &lpSurface->lpBmi->bmiHeader;
+	BYTE info[PACK_INFO_SIZE];
+	PACKENTRY entry;
+	int iBytes = GetDIBFormatBytes(lpSurface->iFormat);
+	int iStride = DIB_STRIDE(lpSurface->cx, lpbih->biBitCount);
+	size_t cbInfo = sizeof(BITMAPINFOHEADER);
+
+	if(iBytes == 0) {
+		return FALSE;
+	}
+
+	// Masks for 16 and 32bpp, the color table for 8bpp.
+	if(lpbih->biCompression == BI_BITFIELDS) {
+		cbInfo += sizeof(DWORD) * 3;
+	}
+	else
+	if(lpbih->biBitCount <= 8) {
+		cbInfo += sizeof(RGBQUAD) * 256;
+	}
+
+	// Our copy of the BITMAPINFO is always top-down and describes only the
+	// pixels, whatever the surface was made from. The surface can be part
+	// of a bigger DIB, a tile of a pyramid level for one, so the size
+	// comes from the surface and not from its BITMAPINFO.
+	ZeroMemory(info, sizeof(info));
+	memcpy(info, lpSurface->lpBmi, cbInfo);
+	((LPBITMAPINFOHEADER)info)->biWidth = lpSurface->cx;
+	((LPBITMAPINFOHEADER)info)->biHeight = -lpSurface->cy;
+	((LPBITMAPINFOHEADER)info)->biSizeImage = (DWORD)((size_t)iStride * lpSurface->cy);
+
+	ZeroMemory(&entry, sizeof(entry));
+	entry.cx = lpSurface->cx;
+	entry.cy = lpSurface->cy;
+	entry.iFormat = lpSurface->iFormat;
+	entry.iPitch = iStride;
+	entry.cbBits = (unsigned long long)iStride * lpSurface->cy;
+
+	if(!PadPack(lpBuilder, PACK_INFO_ALIGN)) {
+		return FALSE;
+	}
+
+	entry.offInfo = lpBuilder->offNext;
+	lpBuilder->offNext += sizeof(info);
+
+	if(!GatherAdd(lpBuilder->lpGather, info, sizeof(info)) || !PadPack(lpBuilder, PACK_PAGE)) {
+		return FALSE;
+	}
+
+	entry.offBits = lpBuilder->offNext;
+	lpBuilder->offNext += entry.cbBits;
+
+	// Whole surface in one piece if the rows are already laid out the way
+	// we want them, otherwise row by row with the padding cleared.
+	if(lpSurface->iPitch == iStride) {
+		if(!GatherAdd(lpBuilder->lpGather, lpSurface->pTop, (size_t)entry.cbBits)) {
+			return FALSE;
+		}
+	}
+	else {
+		int cbRow = lpSurface->cx * iBytes;
+
+		for(int y = 0; y < lpSurface->cy; y++) {
+			if(!GatherAdd(lpBuilder->lpGather, lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch, cbRow) || !GatherAdd(lpBuilder->lpGather, GetPackZeros(), iStride - cbRow)) {
+				return FALSE;
+			}
+		}
+	}
+
+	// The gather points at 'info' and the caller's pixels, neither of
+	// which is around after we return.
+	if(!GatherFlush(lpBuilder->lpGather)) {
+		return FALSE;
+	}
+
+	lpBuilder->entries.push_back(entry);
+	lpBuilder->names.push_back(lpszName);
+
+	return TRUE;
+}
+
+// Writes the names, the index and the trailer and closes the file.
+// Returns FALSE if anything couldn't be written or two surfaces have the
+// same name; the file is useless then.
+static inline BOOL FinishPackBuilder(LPPACKBUILDER lpBuilder)
+{
+	std::vector<int> order(lpBuilder->entries.size());
+	std::vector<char> names;
+	PACKTRAILER trailer;
+	BOOL bResult = TRUE;
+
+	for(size_t i = 0; i < order.size(); i++) {
+		order[i] = (int)i;
+	}
+
+	std::sort(order.begin(), order.end(), [lpBuilder](int a, int b) { return lpBuilder->names[a] < lpBuilder->names[b]; });
+
+	for(size_t i = 0; i < order.size(); i++) {
+		PACKENTRY* lpEntry = &lpBuilder->entries[order[i]];
+		const std::string& strName = lpBuilder->names[order[i]];
+
+		if(i > 0 && strName == lpBuilder->names[order[i - 1]]) {
+			bResult = FALSE;
+		}
+
+		lpEntry->offName = (DWORD)names.size();
+		lpEntry->cchName = (DWORD)strName.size();
+		names.insert(names.end(), strName.c_str(), strName.c_str() + strName.size() + 1);
+	}
+
+	std::vector<PACKENTRY> index(order.size());
+
+	for(size_t i = 0; i < order.size(); i++) {
+		index[i] = lpBuilder->entries[order[i]];
+	}
+
+	trailer.offNames = lpBuilder->offNext;
+	trailer.cbNames = names.size();
+	lpBuilder->offNext += names.size();
+
+	bResult = bResult && GatherAdd(lpBuilder->lpGather, names.data(), names.size()) && PadPack(lpBuilder, 8);
+
+	trailer.offIndex = lpBuilder->offNext;
+	trailer.cEntries = (DWORD)index.size();
+	trailer.dwMagic = PACK_MAGIC;
+
+	bResult = bResult && GatherAdd(lpBuilder->lpGather, index.data(), sizeof(PACKENTRY) * index.size()) && GatherAdd(lpBuilder->lpGather, &trailer, sizeof(trailer));
+
+	if(!GatherClose(lpBuilder->lpGather)) {
+		bResult = FALSE;
+	}
+
+	free(lpBuilder->lpGather);
+	lpBuilder->lpGather = NULL;
+
+	return bResult;
+}
+
+#endif // BMPPACK_H
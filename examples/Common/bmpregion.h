@@ -0,0 +1,314 @@
+
+#ifndef BMPREGION_H
+#define BMPREGION_H
+
+// Decoding part of a bitmap file.
+//
+// Maps and scans run to several gigapixels, far more than fits in memory,
+// and only a window full of them is ever on the screen. Mapping the file
+// (bmpmap.h) would at least not copy it, but converting it still touches
+// every page of it. The reader below does it the other way around: it
+// reads the headers once, and after that every 'ReadBitmapRegion' works
+// out where in the file the pixels of a rectangle are and reads just
+// those, one scanline at a time. How long that takes depends on how big
+// the rectangle is, not on how big the file is.
+//
+// Optionally only every n-th pixel of every n-th scanline is decoded, a
+// quick way to get an overview of a huge image at a fraction of the size.
+// The pixels are picked, not averaged, so the amount read doesn't grow
+// with n squared.
+//
+// Only uncompressed bitmaps can be read like this, RLE has to be decoded
+// from the start to find a scanline in the middle.
+
+#include "bmpcache.h"
+#include "bmpmap.h"
+#include "convert.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Bytes read from the start of the file for the headers. That's enough for
+// the biggest header, the masks and a full color table.
+#define	BMPREGION_HEADERS	4096
+
+typedef struct tagBITMAPREADER {
+	BITMAPVIEW			view;			// The headers, 'pBits' is not valid
+	int					iFormat;		// Format of the pixels in the file, DIBFMT_*
+	int					iBytes;			// Bytes per pixel in the file
+	DWORD				palette[256];	// Color table as XRGB, for 8bpp files
+
+	BYTE*				pHeaders;		// 'lpBmi' and 'lpPalette' point in here
+	BYTE*				pScratch;		// A scanline as read, and one with every n-th pixel
+	size_t				cbScratch;
+#ifdef _WIN32
+	HANDLE				hFile;
+#else
+	int					hFile;
+#endif
+} BITMAPREADER, *LPBITMAPREADER;
+
+// Reads 'cb' bytes at 'offset' in the file. The file position isn't used,
+// so there is nothing to seek.
+static inline BOOL ReadBitmapBytes(LPBITMAPREADER lpReader, unsigned long long offset, BYTE* pDst, size_t cb)
+{
+#ifdef _WIN32
+	while(cb > 0) {
+		OVERLAPPED ov;
+		DWORD cbChunk = cb > 0x40000000 ? 0x40000000 : (DWORD)cb;
+		DWORD cbRead = 0;
+
+		ZeroMemory(&ov, sizeof(ov));
+		ov.Offset = (DWORD)offset;
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+
+		if(!ReadFile(lpReader->hFile, pDst, cbChunk, &cbRead, &ov) || cbRead == 0) {
+			return FALSE;
+		}
+
+		pDst += cbRead;
+		offset += cbRead;
+		cb -= cbRead;
+	}
+#else
+	while(cb > 0) {
+		ssize_t cbRead = pread(lpReader->hFile, pDst, cb, (off_t)offset);
+
+		if(cbRead <= 0) {
+			return FALSE;
+		}
+
+		pDst += cbRead;
+		offset += cbRead;
+		cb -= cbRead;
+	}
+#endif
+
+	return TRUE;
+}
+
+// Closes a reader opened by 'OpenBitmapReader'. It is safe to call this on
+// a reader that failed to open.
+static inline void CloseBitmapReader(LPBITMAPREADER lpReader)
+{
+#ifdef _WIN32
+	if(lpReader->hFile && lpReader->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(lpReader->hFile);
+	}
+#else
+	if(lpReader->hFile > 0) {
+		close(lpReader->hFile);
+	}
+#endif
+
+	free(lpReader->pHeaders);
+	free(lpReader->pScratch);
+
+	ZeroMemory(lpReader, sizeof(BITMAPREADER));
+}
+
+// Opens a bitmap file and reads its headers, none of the pixels. Returns
+// FALSE if the file can't be read or it isn't a bitmap the reader can take
+// apart: anything but 8bpp with a color table, 16, 24 or 32bpp, and RLE.
+static inline BOOL OpenBitmapReader(LPCSTR lpszFilename, LPBITMAPREADER lpReader)
+{
+	unsigned long long cbFile;
+	size_t cbHeaders;
+
+	ZeroMemory(lpReader, sizeof(BITMAPREADER));
+
+#ifdef _WIN32
+	LARGE_INTEGER liSize;
+
+	// Reads are all over the place, there is no point in reading ahead.
+	lpReader->hFile = CreateFileA(lpszFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+
+	if(lpReader->hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	if(!GetFileSizeEx(lpReader->hFile, &liSize)) {
+		CloseBitmapReader(lpReader);
+		return FALSE;
+	}
+
+	cbFile = (unsigned long long)liSize.QuadPart;
+#else
+	struct stat st;
+
+	if((lpReader->hFile = open(lpszFilename, O_RDONLY)) < 0) {
+		lpReader->hFile = 0;
+		return FALSE;
+	}
+
+	if(fstat(lpReader->hFile, &st) != 0) {
+		CloseBitmapReader(lpReader);
+		return FALSE;
+	}
+
+	cbFile = (unsigned long long)st.st_size;
+
+	// Reads are all over the place, read ahead would mostly fetch pixels
+	// to the right of the rectangle that nobody asked for.
+	posix_fadvise(lpReader->hFile, 0, 0, POSIX_FADV_RANDOM);
+#endif
+
+	cbHeaders = cbFile < BMPREGION_HEADERS ? (size_t)cbFile : BMPREGION_HEADERS;
+
+	if((lpReader->pHeaders = (BYTE*)malloc(cbHeaders)) == NULL || !ReadBitmapBytes(lpReader, 0, lpReader->pHeaders, cbHeaders)) {
+		CloseBitmapReader(lpReader);
+		return FALSE;
+	}
+
+	if(!ParseBitmapHeaders(lpReader->pHeaders, cbHeaders, (size_t)cbFile, &lpReader->view)) {
+		CloseBitmapReader(lpReader);
+		return FALSE;
+	}
+
+	lpReader->view.pBits = NULL;
+
+	// The same formats the rest of the code draws in, so every scanline
+	// can go through the converters.
+	if(lpReader->view.bih.biCompression == BI_RLE8 || lpReader->view.bih.biCompression == BI_RLE4 || (lpReader->iFormat = GetBitmapViewFormat(&lpReader->view)) == DIBFMT_UNKNOWN) {
+		CloseBitmapReader(lpReader);
+		return FALSE;
+	}
+
+	lpReader->iBytes = GetDIBFormatBytes(lpReader->iFormat);
+
+	for(int i = 0; i < lpReader->view.iColors && i < 256; i++) {
+		lpReader->palette[i] = (lpReader->view.lpPalette[i].rgbRed << 16) | (lpReader->view.lpPalette[i].rgbGreen << 8) | lpReader->view.lpPalette[i].rgbBlue;
+	}
+
+	return TRUE;
+}
+
+// Copies every 'iStep'-th pixel of a scanline.
+static inline void PickBitmapPixels(BYTE* pDst, const BYTE* pSrc, int cx, int iStep, int iBytes)
+{
+	switch(iBytes) {
+	case 1:
+		for(int x = 0; x < cx; x++) {
+			pDst[x] = pSrc[(size_t)x * iStep];
+		}
+		break;
+
+	case 2:
+		for(int x = 0; x < cx; x++) {
+			((WORD*)pDst)[x] = *(const WORD*)(pSrc + (size_t)x * iStep * 2);
+		}
+		break;
+
+	case 3:
+		for(int x = 0; x < cx; x++, pDst += 3) {
+			const BYTE* p = pSrc + (size_t)x * iStep * 3;
+
+			pDst[0] = p[0];
+			pDst[1] = p[1];
+			pDst[2] = p[2];
+		}
+		break;
+
+	case 4:
+		for(int x = 0; x < cx; x++) {
+			((DWORD*)pDst)[x] = *(const DWORD*)(pSrc + (size_t)x * iStep * 4);
+		}
+		break;
+	}
+}
+
+// Decodes the part of the bitmap in 'lprcSrc', or all of it for NULL, into
+// the top left corner of 'lpDst'. The rectangle is in pixels from the top
+// left of the image, whichever way up the file stores it, and is clipped
+// to the image. With 'iStep' above 1 only every 'iStep'-th pixel of every
+// 'iStep'-th scanline is decoded, so the rectangle comes out that many
+// times smaller. Whatever doesn't fit on 'lpDst' is left out. 'lpDst' can
+// be of any format, it gets the color table of an 8bpp file when it is
+// 8bpp too. Returns FALSE if the file can't be read.
+static inline BOOL ReadBitmapRegion(LPBITMAPREADER lpReader, const RECT* lprcSrc, int iStep, LPDIBSURFACE lpDst)
+{
+	const BITMAPVIEW* lpView = &lpReader->view;
+	int left = 0, top = 0, right = lpView->cx, bottom = lpView->cy;
+	CONVERTPROCS procs;
+
+	if(lprcSrc) {
+		if(lprcSrc->left > left) left = (int)lprcSrc->left;
+		if(lprcSrc->top > top) top = (int)lprcSrc->top;
+		if(lprcSrc->right < right) right = (int)lprcSrc->right;
+		if(lprcSrc->bottom < bottom) bottom = (int)lprcSrc->bottom;
+	}
+
+	if(iStep < 1) {
+		iStep = 1;
+	}
+
+	if(left >= right || top >= bottom) {
+		return TRUE;
+	}
+
+	int cx = (right - left + iStep - 1) / iStep;
+	int cy = (bottom - top + iStep - 1) / iStep;
+
+	if(cx > lpDst->cx) cx = lpDst->cx;
+	if(cy > lpDst->cy) cy = lpDst->cy;
+
+	if(!GetConvertProcs(lpDst->iFormat, lpReader->iFormat, &procs)) {
+		return FALSE;
+	}
+
+	if(lpDst->iFormat == DIBFMT_INDEX8 && lpReader->iFormat == DIBFMT_INDEX8) {
+		LPBITMAPINFO lpBmi = lpDst->lpBmi;
+
+		ZeroMemory(lpBmi->bmiColors, sizeof(RGBQUAD) * 256);
+		memcpy(lpBmi->bmiColors, lpView->lpPalette, sizeof(RGBQUAD) * lpView->iColors);
+		lpBmi->bmiHeader.biClrUsed = lpView->iColors;
+	}
+
+	// What one scanline of the rectangle takes in the file, and the same
+	// with only the pixels we want.
+	size_t cbSpan = (size_t)((cx - 1) * iStep + 1) * lpReader->iBytes;
+	size_t cbPicked = (size_t)cx * lpReader->iBytes;
+
+	if(cbSpan + cbPicked > lpReader->cbScratch) {
+		BYTE* pScratch = (BYTE*)realloc(lpReader->pScratch, cbSpan + cbPicked);
+
+		if(!pScratch) {
+			return FALSE;
+		}
+
+		lpReader->pScratch = pScratch;
+		lpReader->cbScratch = cbSpan + cbPicked;
+	}
+
+	BYTE* pSpan = lpReader->pScratch;
+	BYTE* pPicked = lpReader->pScratch + cbSpan;
+	unsigned long long offBits = lpView->bfh.bfOffBits + (unsigned long long)left * lpReader->iBytes;
+
+	// Scanlines are read in the order they are in the file, bottom-up
+	// files from the bottom of the rectangle up. Whatever the disk or the
+	// cache reads ahead may then still come in handy.
+	for(int i = 0; i < cy; i++) {
+		int yDst = lpView->bTopDown ? i : cy - 1 - i;
+		int y = top + yDst * iStep;
+		int yFile = lpView->bTopDown ? y : lpView->cy - 1 - y;
+		const BYTE* pSrc = pSpan;
+
+		if(!ReadBitmapBytes(lpReader, offBits + (unsigned long long)yFile * lpView->iStride, pSpan, cbSpan)) {
+			return FALSE;
+		}
+
+		if(iStep > 1) {
+			PickBitmapPixels(pPicked, pSpan, cx, iStep, lpReader->iBytes);
+			pSrc = pPicked;
+		}
+
+		ConvertScanline(&procs, lpDst->pTop + (ptrdiff_t)yDst * lpDst->iPitch, pSrc, cx, lpReader->palette);
+	}
+
+	return TRUE;
+}
+
+#endif // BMPREGION_H
@@ -0,0 +1,469 @@
+
+#ifndef BMPWRITE_H
+#define BMPWRITE_H
+
+// Writing bitmap files.
+//
+// A bitmap file is nothing more than a file header, an info header, the
+// masks or the color table and then the scanlines, each padded up to a
+// DWORD. Instead of writing each of those parts with its own call we
+// gather them up and hand them to the operating system in one go: one
+// 'writev' on POSIX systems and one 'WriteFile' of a coalesced buffer on
+// Windows. Images that are too big to keep in memory can be written in
+// bands; a callback is asked to produce a number of scanlines at a time
+// and only one band is ever resident.
+
+#include "dibtypes.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#endif
+
+// Biggest possible header block: file header, info header, three masks
+// and a full 256 entry color table. A BITMAPV4HEADER with its four masks
+// inside is a lot smaller than that.
+#define BMP_MAX_HEADER	(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + sizeof(DWORD) * 3 + sizeof(RGBQUAD) * 256)
+
+#ifndef BI_ALPHABITFIELDS
+#define BI_ALPHABITFIELDS	6L
+#endif
+
+// A BITMAPV4HEADER is a BITMAPINFOHEADER followed by the four masks, the
+// color space, its end points and gamma, 108 bytes in all. We only ever
+// fill in the masks and say the color space is sRGB.
+#define BMP_V4_HEADER	108
+#define BMP_V4_SRGB		0x73524742		// 'sRGB'
+
+// Number of pieces we gather up before we go to the operating system.
+#ifndef _WIN32
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define BMP_MAX_GATHER	IOV_MAX
+#else
+#define BMP_MAX_GATHER	1024
+#endif
+#else
+#define BMP_MAX_GATHER	1024
+#endif
+
+// Called by 'WriteBitmapBands' to produce scanlines 'y' up to 'y + cRows'
+// of the image, where 'y' = 0 is the top of the image. The first of those
+// scanlines goes at 'pBand', the next one 'iStride' bytes further. The
+// padding at the end of each scanline is cleared for you. Return FALSE to
+// abort the write.
+typedef BOOL (*LPBITMAPBANDPROC)(int y, int cRows, BYTE* pBand, int iStride, void* lpParam);
+
+typedef struct tagBITMAPGATHER {
+#ifdef _WIN32
+	HANDLE			hFile;
+	BYTE*			pBuffer;		// Coalescing buffer
+	size_t			cbBuffer;
+#else
+	int				hFile;
+#endif
+	struct {
+		const void*	p;
+		size_t		cb;
+	}				seg[BMP_MAX_GATHER];
+	int				cSegs;
+	size_t			cbPending;
+	BOOL			bError;
+} BITMAPGATHER, *LPBITMAPGATHER;
+
+// Sends everything that has been gathered so far to the file.
+static inline BOOL GatherFlush(LPBITMAPGATHER lpGather)
+{
+	if(lpGather->bError) {
+		return FALSE;
+	}
+
+	if(lpGather->cSegs == 0) {
+		return TRUE;
+	}
+
+#ifdef _WIN32
+	// Windows has no gathering write for buffered files, so we coalesce
+	// the pieces into one big buffer and write that instead.
+	size_t cbDone = 0;
+	DWORD dwWritten;
+
+	for(int i = 0; i < lpGather->cSegs; i++) {
+		const BYTE* p = (const BYTE*)lpGather->seg[i].p;
+		size_t cb = lpGather->seg[i].cb;
+
+		while(cb) {
+			size_t cbCopy = lpGather->cbBuffer - cbDone;
+
+			if(cbCopy > cb) {
+				cbCopy = cb;
+			}
+
+			CopyMemory(lpGather->pBuffer + cbDone, p, cbCopy);
+			cbDone += cbCopy;
+			p += cbCopy;
+			cb -= cbCopy;
+
+			if(cbDone == lpGather->cbBuffer) {
+				if(!WriteFile(lpGather->hFile, lpGather->pBuffer, (DWORD)cbDone, &dwWritten, NULL) || dwWritten != cbDone) {
+					lpGather->bError = TRUE;
+					return FALSE;
+				}
+
+				cbDone = 0;
+			}
+		}
+	}
+
+	if(cbDone) {
+		if(!WriteFile(lpGather->hFile, lpGather->pBuffer, (DWORD)cbDone, &dwWritten, NULL) || dwWritten != cbDone) {
+			lpGather->bError = TRUE;
+			return FALSE;
+		}
+	}
+#else
+	struct iovec iov[BMP_MAX_GATHER];
+	int iFirst = 0;
+
+	for(int i = 0; i < lpGather->cSegs; i++) {
+		iov[i].iov_base = (void*)lpGather->seg[i].p;
+		iov[i].iov_len = lpGather->seg[i].cb;
+	}
+
+	// 'writev' may write less than we asked for, in that case we skip what
+	// did get written and go again.
+	while(iFirst < lpGather->cSegs) {
+		ssize_t cbWritten = writev(lpGather->hFile, iov + iFirst, lpGather->cSegs - iFirst);
+
+		if(cbWritten < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			lpGather->bError = TRUE;
+			return FALSE;
+		}
+
+		while(iFirst < lpGather->cSegs && (size_t)cbWritten >= iov[iFirst].iov_len) {
+			cbWritten -= iov[iFirst].iov_len;
+			iFirst++;
+		}
+
+		if(iFirst < lpGather->cSegs) {
+			iov[iFirst].iov_base = (BYTE*)iov[iFirst].iov_base + cbWritten;
+			iov[iFirst].iov_len -= cbWritten;
+		}
+	}
+#endif
+
+	lpGather->cSegs = 0;
+	lpGather->cbPending = 0;
+
+	return TRUE;
+}
+
+// Adds a piece of memory to the gather list. The memory must stay valid
+// until the next 'GatherFlush'.
+static inline BOOL GatherAdd(LPBITMAPGATHER lpGather, const void* p, size_t cb)
+{
+	if(lpGather->cSegs == BMP_MAX_GATHER && !GatherFlush(lpGather)) {
+		return FALSE;
+	}
+
+	lpGather->seg[lpGather->cSegs].p = p;
+	lpGather->seg[lpGather->cSegs].cb = cb;
+	lpGather->cSegs++;
+	lpGather->cbPending += cb;
+
+	return TRUE;
+}
+
+static inline BOOL GatherOpen(LPBITMAPGATHER lpGather, LPCSTR lpszFilename, size_t cbBuffer)
+{
+	lpGather->cSegs = 0;
+	lpGather->cbPending = 0;
+	lpGather->bError = FALSE;
+
+#ifdef _WIN32
+	if((lpGather->pBuffer = (BYTE*)malloc(cbBuffer)) == NULL) {
+		return FALSE;
+	}
+
+	lpGather->cbBuffer = cbBuffer;
+	lpGather->hFile = CreateFileA(lpszFilename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if(lpGather->hFile == INVALID_HANDLE_VALUE) {
+		free(lpGather->pBuffer);
+		return FALSE;
+	}
+#else
+	// 'writev' gathers straight from the caller's memory, no buffer needed.
+	(void)cbBuffer;
+
+	if((lpGather->hFile = open(lpszFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return FALSE;
+	}
+#endif
+
+	return TRUE;
+}
+
+static inline BOOL GatherClose(LPBITMAPGATHER lpGather)
+{
+	BOOL bResult = GatherFlush(lpGather);
+
+#ifdef _WIN32
+	CloseHandle(lpGather->hFile);
+	free(lpGather->pBuffer);
+#else
+	if(close(lpGather->hFile) != 0) {
+		bResult = FALSE;
+	}
+#endif
+
+	return bResult;
+}
+
+// Builds the file header, info header, masks and color table for a bitmap
+// file in 'pHeader', which must be at least BMP_MAX_HEADER bytes. The
+// sizes in both headers are filled in correctly, padding included. For
+// BI_RLE8 and BI_RLE4 'biSizeImage' must already hold the compressed size.
+// 'lpMasks' holds four masks, the last one alpha, for BI_ALPHABITFIELDS
+// and for a BITMAPV4HEADER or bigger ('biSize' of 56 and up), three for
+// other BI_BITFIELDS. With an alpha mask the file gets a BITMAPV4HEADER,
+// otherwise a plain BITMAPINFOHEADER. Returns the number of header bytes,
+// or 0 if the format can't be saved.
+static inline DWORD BuildBitmapHeader(BYTE* pHeader, const BITMAPINFOHEADER* lpbih, const DWORD* lpMasks, const RGBQUAD* lpPalette, int iColors)
+{
+	BITMAPFILEHEADER bh;
+	BITMAPINFOHEADER bih = *lpbih;
+	int cy = bih.biHeight < 0 ? -bih.biHeight : bih.biHeight;
+	DWORD dwOffset;
+
+	if(bih.biWidth <= 0 || cy == 0) {
+		return 0;
+	}
+
+	// Unless there is alpha we write a plain BITMAPINFOHEADER, so the masks
+	// (if any) go right behind it.
+	bih.biSize = sizeof(BITMAPINFOHEADER);
+	dwOffset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+
+	if(bih.biCompression == BI_RLE8 || bih.biCompression == BI_RLE4) {
+		if(bih.biBitCount != (bih.biCompression == BI_RLE8 ? 8 : 4) || bih.biHeight < 0) {
+			return 0;
+		}
+	}
+	else {
+		bih.biSizeImage = (DWORD)DIB_STRIDE(bih.biWidth, bih.biBitCount) * cy;
+	}
+
+	if(bih.biCompression == BI_BITFIELDS || bih.biCompression == BI_ALPHABITFIELDS) {
+		BOOL bAlpha = bih.biCompression == BI_ALPHABITFIELDS || lpbih->biSize >= sizeof(BITMAPINFOHEADER) + sizeof(DWORD) * 4;
+
+		if(!lpMasks) {
+			return 0;
+		}
+
+		// Few readers know BI_ALPHABITFIELDS, everyone knows a BITMAPV4HEADER
+		// with BI_BITFIELDS, so that is where the alpha mask goes.
+		if(bAlpha && lpMasks[3]) {
+			DWORD dwColorSpace = BMP_V4_SRGB;
+
+			ZeroMemory(pHeader + dwOffset, BMP_V4_HEADER - sizeof(BITMAPINFOHEADER));
+			CopyMemory(pHeader + dwOffset, lpMasks, sizeof(DWORD) * 4);
+			CopyMemory(pHeader + dwOffset + sizeof(DWORD) * 4, &dwColorSpace, sizeof(DWORD));
+			dwOffset += BMP_V4_HEADER - sizeof(BITMAPINFOHEADER);
+			bih.biSize = BMP_V4_HEADER;
+		}
+		else {
+			CopyMemory(pHeader + dwOffset, lpMasks, sizeof(DWORD) * 3);
+			dwOffset += sizeof(DWORD) * 3;
+		}
+
+		bih.biCompression = BI_BITFIELDS;
+	}
+	else
+	if(bih.biCompression != BI_RGB && bih.biCompression != BI_RLE8 && bih.biCompression != BI_RLE4) {
+		return 0;
+	}
+
+	if(bih.biBitCount <= 8) {
+		if(!lpPalette || iColors <= 0 || iColors > (1 << bih.biBitCount)) {
+			return 0;
+		}
+
+		CopyMemory(pHeader + dwOffset, lpPalette, sizeof(RGBQUAD) * iColors);
+		dwOffset += sizeof(RGBQUAD) * iColors;
+		bih.biClrUsed = iColors;
+	}
+	else {
+		bih.biClrUsed = 0;
+	}
+
+	bh.bfType = ((WORD) ('M' << 8) | 'B');
+	bh.bfOffBits = dwOffset;
+	bh.bfSize = dwOffset + bih.biSizeImage;
+	bh.bfReserved1 = 0;
+	bh.bfReserved2 = 0;
+
+	CopyMemory(pHeader, &bh, sizeof(BITMAPFILEHEADER));
+	CopyMemory(pHeader + sizeof(BITMAPFILEHEADER), &bih, sizeof(BITMAPINFOHEADER));
+
+	return dwOffset;
+}
+
+// Writes a DIB that is completely in memory to a bitmap file. 'pBits'
+// holds the scanlines the way the header describes them: DWORD padded,
+// bottom-up for a positive 'biHeight' and top-down for a negative one.
+// For an RLE compressed DIB it holds 'biSizeImage' bytes of RLE data.
+// The headers and all the pixels go out in a single gathered write.
+static inline BOOL WriteBitmapBits(LPCSTR lpszFilename, const BITMAPINFOHEADER* lpbih, const DWORD* lpMasks, const RGBQUAD* lpPalette, int iColors, const void* pBits)
+{
+	BYTE header[BMP_MAX_HEADER];
+	BITMAPGATHER* lpGather;
+	DWORD dwHeader;
+	BOOL bResult;
+
+	if((dwHeader = BuildBitmapHeader(header, lpbih, lpMasks, lpPalette, iColors)) == 0) {
+		return FALSE;
+	}
+
+	// The gather list is a bit big for the stack.
+	if((lpGather = (BITMAPGATHER*)malloc(sizeof(BITMAPGATHER))) == NULL) {
+		return FALSE;
+	}
+
+	if(!GatherOpen(lpGather, lpszFilename, 1 << 20)) {
+		free(lpGather);
+		return FALSE;
+	}
+
+	if(lpbih->biCompression == BI_RLE8 || lpbih->biCompression == BI_RLE4) {
+		bResult = GatherAdd(lpGather, header, dwHeader) && GatherAdd(lpGather, pBits, lpbih->biSizeImage);
+	}
+	else {
+		bResult = GatherAdd(lpGather, header, dwHeader) && GatherAdd(lpGather, pBits, (size_t)DIB_STRIDE(lpbih->biWidth, lpbih->biBitCount) * (lpbih->biHeight < 0 ? -lpbih->biHeight : lpbih->biHeight));
+	}
+
+	// Closing flushes, so it has to happen even if adding failed.
+	if(!GatherClose(lpGather)) {
+		bResult = FALSE;
+	}
+
+	free(lpGather);
+
+	return bResult;
+}
+
+// Same as 'WriteBitmapBits' but for a DIB the way 'CreateDIB' builds them,
+// with the masks or the color table in 'bmiColors'.
+static inline BOOL WriteBitmapFile(LPCSTR lpszFilename, const BITMAPINFO* lpBmi, const void* pBits)
+{
+	const BITMAPINFOHEADER* lpbih = &lpBmi->bmiHeader;
+	int iColors = 0;
+
+	if(lpbih->biBitCount <= 8) {
+		iColors = lpbih->biClrUsed ? (int)lpbih->biClrUsed : (1 << lpbih->biBitCount);
+	}
+
+	return WriteBitmapBits(lpszFilename, lpbih, (const DWORD*)lpBmi->bmiColors, lpBmi->bmiColors, iColors, pBits);
+}
+
+// Writes a bitmap file band by band. The header describes the image that
+// will be written, 'lpfnBand' is called to produce 'cBandRows' scanlines
+// at a time. The scanlines are stored in the order the sign of 'biHeight'
+// asks for; for a bottom-up file the bands are requested from the bottom
+// of the image upwards and the scanlines of each band are gathered in
+// reverse, so the callback always fills its band top to bottom.
+static inline BOOL WriteBitmapBands(LPCSTR lpszFilename, const BITMAPINFOHEADER* lpbih, const DWORD* lpMasks, const RGBQUAD* lpPalette, int iColors, int cBandRows, LPBITMAPBANDPROC lpfnBand, void* lpParam)
+{
+	BYTE header[BMP_MAX_HEADER];
+	BITMAPGATHER* lpGather;
+	BYTE* pBand;
+	DWORD dwHeader;
+	BOOL bTopDown = lpbih->biHeight < 0;
+	int cy = bTopDown ? -lpbih->biHeight : lpbih->biHeight;
+	int iStride = DIB_STRIDE(lpbih->biWidth, lpbih->biBitCount);
+	int iUsed = (lpbih->biWidth * lpbih->biBitCount + 7) >> 3;
+	BOOL bResult = TRUE;
+
+	if((dwHeader = BuildBitmapHeader(header, lpbih, lpMasks, lpPalette, iColors)) == 0) {
+		return FALSE;
+	}
+
+	if(cBandRows <= 0 || cBandRows > cy) {
+		cBandRows = cy;
+	}
+
+	if((pBand = (BYTE*)malloc((size_t)iStride * cBandRows)) == NULL) {
+		return FALSE;
+	}
+
+	if((lpGather = (BITMAPGATHER*)malloc(sizeof(BITMAPGATHER))) == NULL) {
+		free(pBand);
+		return FALSE;
+	}
+
+	if(!GatherOpen(lpGather, lpszFilename, (size_t)iStride * cBandRows)) {
+		free(lpGather);
+		free(pBand);
+		return FALSE;
+	}
+
+	bResult = GatherAdd(lpGather, header, dwHeader);
+
+	for(int iBand = 0; bResult && iBand * cBandRows < cy; iBand++) {
+		int cRows = cy - iBand * cBandRows;
+		int y;
+
+		if(cRows > cBandRows) {
+			cRows = cBandRows;
+		}
+
+		// For a bottom-up file the first band in the file is the bottom one.
+		y = bTopDown ? iBand * cBandRows : cy - iBand * cBandRows - cRows;
+
+		if(!lpfnBand(y, cRows, pBand, iStride, lpParam)) {
+			bResult = FALSE;
+			break;
+		}
+
+		// Clear the padding, callers tend to forget about it and we don't
+		// want to write whatever happens to be in the buffer.
+		if(iUsed != iStride) {
+			for(int i = 0; i < cRows; i++) {
+				ZeroMemory(pBand + (size_t)i * iStride + iUsed, iStride - iUsed);
+			}
+		}
+
+		if(bTopDown) {
+			bResult = GatherAdd(lpGather, pBand, (size_t)iStride * cRows);
+		}
+		else {
+			for(int i = cRows - 1; bResult && i >= 0; i--) {
+				bResult = GatherAdd(lpGather, pBand + (size_t)i * iStride, iStride);
+			}
+		}
+
+		// The band buffer is reused for the next band, so everything has to
+		// be out of the door before we continue.
+		bResult = bResult && GatherFlush(lpGather);
+	}
+
+	if(!GatherClose(lpGather)) {
+		bResult = FALSE;
+	}
+
+	free(lpGather);
+	free(pBand);
+
+	return bResult;
+}
+
+#endif // BMPWRITE_H
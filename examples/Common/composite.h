@@ -0,0 +1,405 @@
+
+#ifndef COMPOSITE_H
+#define COMPOSITE_H
+
+// Compositing 32bpp surfaces with alpha.
+//
+// A 32bpp DIB made with DIBALLOC_ALPHA keeps alpha in its highest byte.
+// The colors are premultiplied: every channel has already been multiplied
+// by alpha, so no channel is ever bigger than alpha. That is the form GDI's
+// 'AlphaBlend' wants as well, and it makes the blend modes below simple:
+// 's' and 'd' are a channel of the source and destination, 'sa' and 'da'
+// their alpha, and alpha itself is blended with the same formula.
+//
+//   COMPOSITE_OVER       d = s + d * (255 - sa) / 255
+//   COMPOSITE_ADD        d = min(s + d, 255)
+//   COMPOSITE_MULTIPLY   d = (s * d + s * (255 - da) + d * (255 - sa)) / 255
+//
+// Every division by 255 is rounded to the nearest integer, exactly: for
+// 0 <= x <= 65025 that is ((x + 128) * 257) >> 16, which SIMD code can
+// do with a single 'mulhi'. The SIMD kernels and the C version give the
+// same result to the bit.
+//
+// The kernels widen the channels to 16 bits, four pixels at a time with
+// SSE4.1 or eight with AVX2. Sources are often sprites and UI, mostly
+// fully transparent or fully opaque, so source-over checks for that first
+// and then skips the pixels or copies them without any arithmetic.
+//
+// 'CompositeDIB' blends a rectangle of one surface onto another at any
+// position, clipped against both the same way 'Blit' is, and can spread
+// the rows over a thread pool.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "cpu.h"
+#include "raster.h"
+#include "threadpool.h"
+
+#define COMPOSITE_OVER		0
+#define COMPOSITE_ADD		1
+#define COMPOSITE_MULTIPLY	2
+#define COMPOSITE_MODES		3
+
+#define COMPOSITE_BAND		32		// Rows per task
+
+typedef void (*LPCOMPOSITEPROC)(DWORD* pDst, const DWORD* pSrc, int n);
+
+// 'x' / 255 rounded, for 'x' up to 255 * 255.
+static inline DWORD Div255(DWORD x)
+{
+	return ((x + 128) * 257) >> 16;
+}
+
+static inline void CompositeOver_C(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	for(int i = 0; i < n; i++) {
+		DWORD s = pSrc[i];
+		DWORD ia = 255 - (s >> 24);
+
+		if(ia == 0) {
+			pDst[i] = s;
+			continue;
+		}
+
+		if(s == 0) {
+			continue;
+		}
+
+		DWORD d = pDst[i], c = 0;
+
+		for(int k = 0; k < 32; k += 8) {
+			DWORD v = (s >> k & 0xFF) + Div255((d >> k & 0xFF) * ia);
+
+			c |= (v > 255 ? 255 : v) << k;
+		}
+
+		pDst[i] = c;
+	}
+}
+
+static inline void CompositeAdd_C(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	for(int i = 0; i < n; i++) {
+		DWORD s = pSrc[i], d = pDst[i], c = 0;
+
+		for(int k = 0; k < 32; k += 8) {
+			DWORD v = (s >> k & 0xFF) + (d >> k & 0xFF);
+
+			c |= (v > 255 ? 255 : v) << k;
+		}
+
+		pDst[i] = c;
+	}
+}
+
+static inline void CompositeMultiply_C(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	for(int i = 0; i < n; i++) {
+		DWORD s = pSrc[i], d = pDst[i], c = 0;
+		DWORD isa = 255 - (s >> 24), ida = 255 - (d >> 24);
+
+		for(int k = 0; k < 32; k += 8) {
+			DWORD sc = s >> k & 0xFF, dc = d >> k & 0xFF;
+
+			c |= Div255(sc * dc + sc * ida + dc * isa) << k;
+		}
+
+		pDst[i] = c;
+	}
+}
+
+#ifdef CPU_X86
+
+// Divides every 16 bit lane by 255, rounded.
+CPU_TARGET("sse4.1") static inline __m128i Div255_SSE41(__m128i x)
+{
+	return _mm_mulhi_epu16(_mm_add_epi16(x, _mm_set1_epi16(128)), _mm_set1_epi16(257));
+}
+
+// The alpha of every pixel in all four of its lanes.
+CPU_TARGET("sse4.1") static inline __m128i GetAlpha_SSE41(__m128i x)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+CPU_TARGET("sse4.1") static void CompositeOver_SSE41(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	__m128i max = _mm_set1_epi16(255);
+	int i = 0;
+
+	for(; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(pSrc + i));
+
+		// A source that is all zero leaves the destination as it is, an
+		// opaque one replaces it.
+		if(_mm_testz_si128(s, s)) {
+			continue;
+		}
+
+		if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha), alpha)) == 0xFFFF) {
+			_mm_storeu_si128((__m128i*)(pDst + i), s);
+			continue;
+		}
+
+		__m128i d = _mm_loadu_si128((const __m128i*)(pDst + i));
+		__m128i s0 = _mm_unpacklo_epi8(s, zero), s1 = _mm_unpackhi_epi8(s, zero);
+		__m128i d0 = _mm_unpacklo_epi8(d, zero), d1 = _mm_unpackhi_epi8(d, zero);
+
+		d0 = _mm_add_epi16(s0, Div255_SSE41(_mm_mullo_epi16(d0, _mm_sub_epi16(max, GetAlpha_SSE41(s0)))));
+		d1 = _mm_add_epi16(s1, Div255_SSE41(_mm_mullo_epi16(d1, _mm_sub_epi16(max, GetAlpha_SSE41(s1)))));
+
+		_mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(d0, d1));
+	}
+
+	CompositeOver_C(pDst + i, pSrc + i, n - i);
+}
+
+CPU_TARGET("sse4.1") static void CompositeAdd_SSE41(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	int i = 0;
+
+	for(; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(pSrc + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(pDst + i));
+
+		_mm_storeu_si128((__m128i*)(pDst + i), _mm_adds_epu8(s, d));
+	}
+
+	CompositeAdd_C(pDst + i, pSrc + i, n - i);
+}
+
+CPU_TARGET("sse4.1") static inline __m128i Multiply_SSE41(__m128i s, __m128i d, __m128i max)
+{
+	__m128i x = _mm_mullo_epi16(s, d);
+
+	x = _mm_add_epi16(x, _mm_mullo_epi16(s, _mm_sub_epi16(max, GetAlpha_SSE41(d))));
+	x = _mm_add_epi16(x, _mm_mullo_epi16(d, _mm_sub_epi16(max, GetAlpha_SSE41(s))));
+
+	return Div255_SSE41(x);
+}
+
+CPU_TARGET("sse4.1") static void CompositeMultiply_SSE41(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i max = _mm_set1_epi16(255);
+	int i = 0;
+
+	for(; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(pSrc + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(pDst + i));
+		__m128i d0 = Multiply_SSE41(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), max);
+		__m128i d1 = Multiply_SSE41(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), max);
+
+		_mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(d0, d1));
+	}
+
+	CompositeMultiply_C(pDst + i, pSrc + i, n - i);
+}
+
+// The same eight pixels at a time. Unpacking and packing work within each
+// 128 bit half, so the pixels come out in the order they went in.
+CPU_TARGET("avx2") static inline __m256i Div255_AVX2(__m256i x)
+{
+	return _mm256_mulhi_epu16(_mm256_add_epi16(x, _mm256_set1_epi16(128)), _mm256_set1_epi16(257));
+}
+
+CPU_TARGET("avx2") static inline __m256i GetAlpha_AVX2(__m256i x)
+{
+	return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+CPU_TARGET("avx2") static void CompositeOver_AVX2(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	__m256i max = _mm256_set1_epi16(255);
+	int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(pSrc + i));
+
+		if(_mm256_testz_si256(s, s)) {
+			continue;
+		}
+
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, alpha), alpha)) == -1) {
+			_mm256_storeu_si256((__m256i*)(pDst + i), s);
+			continue;
+		}
+
+		__m256i d = _mm256_loadu_si256((const __m256i*)(pDst + i));
+		__m256i s0 = _mm256_unpacklo_epi8(s, zero), s1 = _mm256_unpackhi_epi8(s, zero);
+		__m256i d0 = _mm256_unpacklo_epi8(d, zero), d1 = _mm256_unpackhi_epi8(d, zero);
+
+		d0 = _mm256_add_epi16(s0, Div255_AVX2(_mm256_mullo_epi16(d0, _mm256_sub_epi16(max, GetAlpha_AVX2(s0)))));
+		d1 = _mm256_add_epi16(s1, Div255_AVX2(_mm256_mullo_epi16(d1, _mm256_sub_epi16(max, GetAlpha_AVX2(s1)))));
+
+		_mm256_storeu_si256((__m256i*)(pDst + i), _mm256_packus_epi16(d0, d1));
+	}
+
+	CompositeOver_SSE41(pDst + i, pSrc + i, n - i);
+}
+
+CPU_TARGET("avx2") static void CompositeAdd_AVX2(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(pSrc + i));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(pDst + i));
+
+		_mm256_storeu_si256((__m256i*)(pDst + i), _mm256_adds_epu8(s, d));
+	}
+
+	CompositeAdd_SSE41(pDst + i, pSrc + i, n - i);
+}
+
+CPU_TARGET("avx2") static inline __m256i Multiply_AVX2(__m256i s, __m256i d, __m256i max)
+{
+	__m256i x = _mm256_mullo_epi16(s, d);
+
+	x = _mm256_add_epi16(x, _mm256_mullo_epi16(s, _mm256_sub_epi16(max, GetAlpha_AVX2(d))));
+	x = _mm256_add_epi16(x, _mm256_mullo_epi16(d, _mm256_sub_epi16(max, GetAlpha_AVX2(s))));
+
+	return Div255_AVX2(x);
+}
+
+CPU_TARGET("avx2") static void CompositeMultiply_AVX2(DWORD* pDst, const DWORD* pSrc, int n)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i max = _mm256_set1_epi16(255);
+	int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(pSrc + i));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(pDst + i));
+		__m256i d0 = Multiply_AVX2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), max);
+		__m256i d1 = Multiply_AVX2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), max);
+
+		_mm256_storeu_si256((__m256i*)(pDst + i), _mm256_packus_epi16(d0, d1));
+	}
+
+	CompositeMultiply_SSE41(pDst + i, pSrc + i, n - i);
+}
+
+#endif // CPU_X86
+
+// The kernel for a blend mode that runs best with 'dwFeatures'.
+static inline LPCOMPOSITEPROC GetCompositeProc(int iMode, DWORD dwFeatures)
+{
+	static const LPCOMPOSITEPROC lpfnC[COMPOSITE_MODES] = { CompositeOver_C, CompositeAdd_C, CompositeMultiply_C };
+
+	if(iMode < 0 || iMode >= COMPOSITE_MODES) {
+		return NULL;
+	}
+
+#ifdef CPU_X86
+	static const LPCOMPOSITEPROC lpfnSSE41[COMPOSITE_MODES] = { CompositeOver_SSE41, CompositeAdd_SSE41, CompositeMultiply_SSE41 };
+	static const LPCOMPOSITEPROC lpfnAVX2[COMPOSITE_MODES] = { CompositeOver_AVX2, CompositeAdd_AVX2, CompositeMultiply_AVX2 };
+
+	// The AVX2 kernels finish their rows with the SSE4.1 ones.
+	if((dwFeatures & (CPU_AVX2 | CPU_SSE41)) == (CPU_AVX2 | CPU_SSE41)) {
+		return lpfnAVX2[iMode];
+	}
+
+	if(dwFeatures & CPU_SSE41) {
+		return lpfnSSE41[iMode];
+	}
+#endif
+
+	return lpfnC[iMode];
+}
+
+typedef struct tagCOMPOSITEJOB {
+	LPCOMPOSITEPROC	lpfnComposite;
+	BYTE*			pDst;			// First pixel of the destination
+	int				iDstPitch;
+	const BYTE*		pSrc;			// First pixel of the source
+	int				iSrcPitch;
+	int				cx;
+	int				cy;
+} COMPOSITEJOB;
+
+static inline void CompositeTask(int iTask, int, void* lpParam)
+{
+	const COMPOSITEJOB* lpJob = (const COMPOSITEJOB*)lpParam;
+	int yEnd = (iTask + 1) * COMPOSITE_BAND < lpJob->cy ? (iTask + 1) * COMPOSITE_BAND : lpJob->cy;
+
+	for(int y = iTask * COMPOSITE_BAND; y < yEnd; y++) {
+		lpJob->lpfnComposite((DWORD*)(lpJob->pDst + (ptrdiff_t)y * lpJob->iDstPitch), (const DWORD*)(lpJob->pSrc + (ptrdiff_t)y * lpJob->iSrcPitch), lpJob->cx);
+	}
+}
+
+// Blends 'lprcSrc' of 'lpSrc', all of it if NULL, onto 'lpDst' at 'x', 'y'
+// with one of the COMPOSITE_ modes. Both must be 32bpp and the source must
+// be premultiplied. The rows are spread over 'lpPool', or done on the
+// calling thread if it is NULL. Returns FALSE if the formats or the mode
+// are wrong.
+static inline BOOL CompositeDIB(LPDIBSURFACE lpDst, int x, int y, const DIBSURFACE* lpSrc, const RECT* lprcSrc, int iMode, CThreadPool* lpPool = NULL)
+{
+	COMPOSITEJOB job;
+	RECT rc;
+
+	if(lpDst->iFormat != DIBFMT_XRGB32 || lpSrc->iFormat != DIBFMT_XRGB32) {
+		return FALSE;
+	}
+
+	if((job.lpfnComposite = GetCompositeProc(iMode, GetCPUFeatures())) == NULL) {
+		return FALSE;
+	}
+
+	if(!ClipBlit(lpDst, &x, &y, lpSrc, lprcSrc, &rc)) {
+		return TRUE;
+	}
+
+	job.pDst = lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch + x * 4;
+	job.iDstPitch = lpDst->iPitch;
+	job.pSrc = lpSrc->pTop + (ptrdiff_t)rc.top * lpSrc->iPitch + rc.left * 4;
+	job.iSrcPitch = lpSrc->iPitch;
+	job.cx = rc.right - rc.left;
+	job.cy = rc.bottom - rc.top;
+
+	int cTasks = (job.cy + COMPOSITE_BAND - 1) / COMPOSITE_BAND;
+
+	if(lpPool) {
+		lpPool->Run(cTasks, CompositeTask, &job);
+	}
+	else {
+		for(int i = 0; i < cTasks; i++) {
+			CompositeTask(i, 0, &job);
+		}
+	}
+
+	if(lpDst->lpDirty) {
+		MarkDirtyRect(lpDst->lpDirty, x, y, x + job.cx, y + job.cy);
+	}
+
+	return TRUE;
+}
+
+// Turns a 32bpp surface with straight alpha, as most image files store
+// it, into premultiplied alpha.
+static inline BOOL PremultiplyDIBSurface(LPDIBSURFACE lpSurface)
+{
+	if(lpSurface->iFormat != DIBFMT_XRGB32) {
+		return FALSE;
+	}
+
+	for(int y = 0; y < lpSurface->cy; y++) {
+		DWORD* pRow = (DWORD*)(lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch);
+
+		for(int x = 0; x < lpSurface->cx; x++) {
+			DWORD c = pRow[x], a = c >> 24;
+
+			if(a != 255) {
+				pRow[x] = a << 24 | Div255((c >> 16 & 0xFF) * a) << 16 | Div255((c >> 8 & 0xFF) * a) << 8 | Div255((c & 0xFF) * a);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+#endif // COMPOSITE_H
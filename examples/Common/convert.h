@@ -0,0 +1,511 @@
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+// Converting DIB surfaces from one pixel format to another.
+//
+// Every conversion goes through 32bpp XRGB. Each format has a kernel that
+// turns a scanline into XRGB and one that turns XRGB back into that
+// format. Converting to or from 32bpp is a single kernel, any other pair
+// runs both kernels over a small XRGB buffer that stays in the first
+// level cache. That way we only need eight kernels per instruction set to
+// cover every pair of formats 'CreateDIB' can make.
+//
+// The kernels come in a plain C version and, where it pays off, SSE2,
+// SSSE3 and AVX2 versions. 'GetConvertProcs' picks the fastest one the
+// processor can run.
+//
+// Converting to 8bpp maps each color onto the grayscale color table that
+// 'CreateDIB' builds. Converting from 8bpp looks every index up in the
+// color table of the source.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "cpu.h"
+
+#include <string.h>
+
+// Converts 'cx' pixels from 'pSrc' to 'pDst'. 'lpPalette' is the color
+// table of the source as 256 XRGB values, it is only used for 8bpp.
+typedef void (*LPCONVERTPROC)(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette);
+
+// Number of pixels converted at a time when going through XRGB.
+#define CONVERT_CHUNK	256
+
+//
+// Plain C kernels.
+//
+
+template<class FORMAT>
+void ConvertToXRGB_C(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD*)
+{
+	DWORD* p = (DWORD*)pDst;
+
+	for(int x = 0; x < cx; x++) {
+		p[x] = FORMAT::ToXRGB(FORMAT::Load(pSrc, x));
+	}
+}
+
+template<>
+inline void ConvertToXRGB_C<PF_INDEX8>(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	DWORD* p = (DWORD*)pDst;
+
+	for(int x = 0; x < cx; x++) {
+		p[x] = lpPalette[pSrc[x]];
+	}
+}
+
+template<class FORMAT>
+void ConvertFromXRGB_C(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD*)
+{
+	const DWORD* p = (const DWORD*)pSrc;
+
+	for(int x = 0; x < cx; x++) {
+		FORMAT::Store(pDst, x, FORMAT::FromXRGB(p[x]));
+	}
+}
+
+#ifdef CPU_X86
+
+//
+// SSE2 kernels.
+//
+
+// 565 and 555 to XRGB, four pixels in 'p' (one per DWORD, zero extended).
+// Same bit tricks as 'ToXRGB' in the format traits.
+CPU_TARGET("sse2") static inline __m128i Expand565_SSE2(__m128i p)
+{
+	__m128i r = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xF800)), 8), _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xE000)), 3));
+	__m128i g = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x07E0)), 5), _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x0600)), 1));
+	__m128i b = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x001F)), 3), _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x001C)), 2));
+
+	return _mm_or_si128(r, _mm_or_si128(g, b));
+}
+
+CPU_TARGET("sse2") static inline __m128i Expand555_SSE2(__m128i p)
+{
+	__m128i r = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x7C00)), 9), _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x7000)), 4));
+	__m128i g = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x03E0)), 6), _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x0380)), 1));
+	__m128i b = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x001F)), 3), _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x001C)), 2));
+
+	return _mm_or_si128(r, _mm_or_si128(g, b));
+}
+
+// XRGB to 565 and 555, four pixels. The result is in the low WORD of each
+// DWORD, sign extended so '_mm_packs_epi32' doesn't saturate it.
+CPU_TARGET("sse2") static inline __m128i Pack565_SSE2(__m128i p)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F));
+
+	return _mm_srai_epi32(_mm_slli_epi32(_mm_or_si128(r, _mm_or_si128(g, b)), 16), 16);
+}
+
+CPU_TARGET("sse2") static inline __m128i Pack555_SSE2(__m128i p)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(p, 9), _mm_set1_epi32(0x7C00));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(p, 6), _mm_set1_epi32(0x03E0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F));
+
+	return _mm_or_si128(r, _mm_or_si128(g, b));
+}
+
+template<class FORMAT>
+CPU_TARGET("sse2") void Convert16ToXRGB_SSE2(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+
+	for(; x + 8 <= cx; x += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i*)(pSrc + x * 2));
+		__m128i lo = _mm_unpacklo_epi16(p, zero);
+		__m128i hi = _mm_unpackhi_epi16(p, zero);
+
+		if(FORMAT::FORMAT == DIBFMT_RGB565) {
+			lo = Expand565_SSE2(lo);
+			hi = Expand565_SSE2(hi);
+		}
+		else {
+			lo = Expand555_SSE2(lo);
+			hi = Expand555_SSE2(hi);
+		}
+
+		_mm_storeu_si128((__m128i*)(pDst + x * 4), lo);
+		_mm_storeu_si128((__m128i*)(pDst + x * 4 + 16), hi);
+	}
+
+	ConvertToXRGB_C<FORMAT>(pDst + x * 4, pSrc + x * 2, cx - x, lpPalette);
+}
+
+template<class FORMAT>
+CPU_TARGET("sse2") void ConvertXRGBTo16_SSE2(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	int x = 0;
+
+	for(; x + 8 <= cx; x += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i*)(pSrc + x * 4));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(pSrc + x * 4 + 16));
+
+		if(FORMAT::FORMAT == DIBFMT_RGB565) {
+			lo = Pack565_SSE2(lo);
+			hi = Pack565_SSE2(hi);
+		}
+		else {
+			lo = Pack555_SSE2(lo);
+			hi = Pack555_SSE2(hi);
+		}
+
+		_mm_storeu_si128((__m128i*)(pDst + x * 2), _mm_packs_epi32(lo, hi));
+	}
+
+	ConvertFromXRGB_C<FORMAT>(pDst + x * 2, pSrc + x * 4, cx - x, lpPalette);
+}
+
+// XRGB to the grayscale index: (77 r + 150 g + 29 b) >> 8, sixteen pixels
+// at a time using 'pmaddwd' on the red/blue and green/unused WORD pairs.
+CPU_TARGET("sse2") static inline __m128i Luma_SSE2(__m128i p)
+{
+	const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+	__m128i rb = _mm_madd_epi16(_mm_and_si128(p, mask), _mm_set1_epi32((77 << 16) | 29));
+	__m128i g = _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(p, 8), mask), _mm_set1_epi32(150));
+
+	return _mm_srli_epi32(_mm_add_epi32(rb, g), 8);
+}
+
+CPU_TARGET("sse2") static void ConvertXRGBTo8_SSE2(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	int x = 0;
+
+	for(; x + 16 <= cx; x += 16) {
+		const __m128i* p = (const __m128i*)(pSrc + x * 4);
+		__m128i a = _mm_packs_epi32(Luma_SSE2(_mm_loadu_si128(p + 0)), Luma_SSE2(_mm_loadu_si128(p + 1)));
+		__m128i b = _mm_packs_epi32(Luma_SSE2(_mm_loadu_si128(p + 2)), Luma_SSE2(_mm_loadu_si128(p + 3)));
+
+		_mm_storeu_si128((__m128i*)(pDst + x), _mm_packus_epi16(a, b));
+	}
+
+	ConvertFromXRGB_C<PF_INDEX8>(pDst + x, pSrc + x * 4, cx - x, lpPalette);
+}
+
+//
+// SSSE3 kernels. 24bpp needs byte shuffles, which SSE2 doesn't have.
+//
+
+CPU_TARGET("ssse3") static void Convert24ToXRGB_SSSE3(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	int x = 0;
+
+	// Sixteen pixels are exactly three loads of source data.
+	for(; x + 16 <= cx; x += 16) {
+		const __m128i* s = (const __m128i*)(pSrc + x * 3);
+		__m128i* d = (__m128i*)(pDst + x * 4);
+		__m128i a = _mm_loadu_si128(s + 0);
+		__m128i b = _mm_loadu_si128(s + 1);
+		__m128i c = _mm_loadu_si128(s + 2);
+
+		_mm_storeu_si128(d + 0, _mm_shuffle_epi8(a, shuffle));
+		_mm_storeu_si128(d + 1, _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), shuffle));
+		_mm_storeu_si128(d + 2, _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), shuffle));
+		_mm_storeu_si128(d + 3, _mm_shuffle_epi8(_mm_srli_si128(c, 4), shuffle));
+	}
+
+	ConvertToXRGB_C<PF_BGR24>(pDst + x * 4, pSrc + x * 3, cx - x, lpPalette);
+}
+
+CPU_TARGET("ssse3") static void ConvertXRGBTo24_SSSE3(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	int x = 0;
+
+	for(; x + 16 <= cx; x += 16) {
+		const __m128i* s = (const __m128i*)(pSrc + x * 4);
+		__m128i* d = (__m128i*)(pDst + x * 3);
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128(s + 0), shuffle);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128(s + 1), shuffle);
+		__m128i c = _mm_shuffle_epi8(_mm_loadu_si128(s + 2), shuffle);
+		__m128i e = _mm_shuffle_epi8(_mm_loadu_si128(s + 3), shuffle);
+
+		// Each register now holds 12 bytes, glue them into three.
+		_mm_storeu_si128(d + 0, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128(d + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128(d + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(e, 4)));
+	}
+
+	ConvertFromXRGB_C<PF_BGR24>(pDst + x * 3, pSrc + x * 4, cx - x, lpPalette);
+}
+
+//
+// AVX2 kernels.
+//
+
+template<class FORMAT>
+CPU_TARGET("avx2") void Convert16ToXRGB_AVX2(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	int x = 0;
+
+	for(; x + 8 <= cx; x += 8) {
+		__m256i p = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(pSrc + x * 2)));
+		__m256i r, g, b;
+
+		if(FORMAT::FORMAT == DIBFMT_RGB565) {
+			r = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xF800)), 8), _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xE000)), 3));
+			g = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x07E0)), 5), _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x0600)), 1));
+		}
+		else {
+			r = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x7C00)), 9), _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x7000)), 4));
+			g = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x03E0)), 6), _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x0380)), 1));
+		}
+
+		b = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x001F)), 3), _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x001C)), 2));
+
+		_mm256_storeu_si256((__m256i*)(pDst + x * 4), _mm256_or_si256(r, _mm256_or_si256(g, b)));
+	}
+
+	ConvertToXRGB_C<FORMAT>(pDst + x * 4, pSrc + x * 2, cx - x, lpPalette);
+}
+
+template<class FORMAT>
+CPU_TARGET("avx2") void ConvertXRGBTo16_AVX2(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	int x = 0;
+
+	for(; x + 16 <= cx; x += 16) {
+		__m256i v[2];
+
+		for(int i = 0; i < 2; i++) {
+			__m256i p = _mm256_loadu_si256((const __m256i*)(pSrc + x * 4 + i * 32));
+			__m256i r, g, b;
+
+			if(FORMAT::FORMAT == DIBFMT_RGB565) {
+				r = _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xF800));
+				g = _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07E0));
+			}
+			else {
+				r = _mm256_and_si256(_mm256_srli_epi32(p, 9), _mm256_set1_epi32(0x7C00));
+				g = _mm256_and_si256(_mm256_srli_epi32(p, 6), _mm256_set1_epi32(0x03E0));
+			}
+
+			b = _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x001F));
+			v[i] = _mm256_srai_epi32(_mm256_slli_epi32(_mm256_or_si256(r, _mm256_or_si256(g, b)), 16), 16);
+		}
+
+		// The pack works per 128 bit lane, put the quadwords back in order.
+		_mm256_storeu_si256((__m256i*)(pDst + x * 2), _mm256_permute4x64_epi64(_mm256_packs_epi32(v[0], v[1]), 0xD8));
+	}
+
+	ConvertFromXRGB_C<FORMAT>(pDst + x * 2, pSrc + x * 4, cx - x, lpPalette);
+}
+
+CPU_TARGET("avx2") static void Convert24ToXRGB_AVX2(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+											 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	int x = 0;
+
+	// Eight pixels are 24 bytes, but we load 32 of them. Stop early enough
+	// not to read past the end of the scanline.
+	for(; x + 11 <= cx; x += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i*)(pSrc + x * 3));
+
+		p = _mm256_permutevar8x32_epi32(p, spread);
+		_mm256_storeu_si256((__m256i*)(pDst + x * 4), _mm256_shuffle_epi8(p, shuffle));
+	}
+
+	ConvertToXRGB_C<PF_BGR24>(pDst + x * 4, pSrc + x * 3, cx - x, lpPalette);
+}
+
+// Palette expansion is a table lookup, which is exactly what a gather is.
+CPU_TARGET("avx2") static void Convert8ToXRGB_AVX2(BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	int x = 0;
+
+	for(; x + 8 <= cx; x += 8) {
+		__m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pSrc + x)));
+
+		_mm256_storeu_si256((__m256i*)(pDst + x * 4), _mm256_i32gather_epi32((const int*)lpPalette, i, 4));
+	}
+
+	ConvertToXRGB_C<PF_INDEX8>(pDst + x * 4, pSrc + x, cx - x, lpPalette);
+}
+
+#endif // CPU_X86
+
+//
+// Kernel selection.
+//
+
+typedef struct tagCONVERTPROCS {
+	LPCONVERTPROC	lpfnToXRGB;		// Source format to XRGB, NULL if the source is XRGB
+	LPCONVERTPROC	lpfnFromXRGB;	// XRGB to destination format, NULL if the destination is XRGB
+	int				iSrcBytes;		// Bytes per source pixel
+	int				iDstBytes;		// Bytes per destination pixel
+	BOOL			bCopy;			// Same format on both sides
+} CONVERTPROCS, *LPCONVERTPROCS;
+
+static inline LPCONVERTPROC GetToXRGBProc(int iFormat, DWORD dwFeatures)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_AVX2) return Convert8ToXRGB_AVX2;
+#endif
+		return ConvertToXRGB_C<PF_INDEX8>;
+
+	case DIBFMT_RGB555:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_AVX2) return Convert16ToXRGB_AVX2<PF_RGB555>;
+		if(dwFeatures & CPU_SSE2) return Convert16ToXRGB_SSE2<PF_RGB555>;
+#endif
+		return ConvertToXRGB_C<PF_RGB555>;
+
+	case DIBFMT_RGB565:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_AVX2) return Convert16ToXRGB_AVX2<PF_RGB565>;
+		if(dwFeatures & CPU_SSE2) return Convert16ToXRGB_SSE2<PF_RGB565>;
+#endif
+		return ConvertToXRGB_C<PF_RGB565>;
+
+	case DIBFMT_BGR24:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_AVX2)  return Convert24ToXRGB_AVX2;
+		if(dwFeatures & CPU_SSSE3) return Convert24ToXRGB_SSSE3;
+#endif
+		return ConvertToXRGB_C<PF_BGR24>;
+	}
+
+	return NULL;
+}
+
+static inline LPCONVERTPROC GetFromXRGBProc(int iFormat, DWORD dwFeatures)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_SSE2) return ConvertXRGBTo8_SSE2;
+#endif
+		return ConvertFromXRGB_C<PF_INDEX8>;
+
+	case DIBFMT_RGB555:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_AVX2) return ConvertXRGBTo16_AVX2<PF_RGB555>;
+		if(dwFeatures & CPU_SSE2) return ConvertXRGBTo16_SSE2<PF_RGB555>;
+#endif
+		return ConvertFromXRGB_C<PF_RGB555>;
+
+	case DIBFMT_RGB565:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_AVX2) return ConvertXRGBTo16_AVX2<PF_RGB565>;
+		if(dwFeatures & CPU_SSE2) return ConvertXRGBTo16_SSE2<PF_RGB565>;
+#endif
+		return ConvertFromXRGB_C<PF_RGB565>;
+
+	case DIBFMT_BGR24:
+#ifdef CPU_X86
+		if(dwFeatures & CPU_SSSE3) return ConvertXRGBTo24_SSSE3;
+#endif
+		return ConvertFromXRGB_C<PF_BGR24>;
+	}
+
+	return NULL;
+}
+
+// Picks the kernels for converting 'iSrcFormat' to 'iDstFormat' on this
+// processor. Returns FALSE for a format we don't know.
+static inline BOOL GetConvertProcs(int iDstFormat, int iSrcFormat, LPCONVERTPROCS lpProcs)
+{
+	DWORD dwFeatures = GetCPUFeatures();
+
+	lpProcs->iSrcBytes = GetDIBFormatBytes(iSrcFormat);
+	lpProcs->iDstBytes = GetDIBFormatBytes(iDstFormat);
+
+	if(!lpProcs->iSrcBytes || !lpProcs->iDstBytes) {
+		return FALSE;
+	}
+
+	lpProcs->lpfnToXRGB = GetToXRGBProc(iSrcFormat, dwFeatures);
+	lpProcs->lpfnFromXRGB = GetFromXRGBProc(iDstFormat, dwFeatures);
+	lpProcs->bCopy = iSrcFormat == iDstFormat;
+
+	return TRUE;
+}
+
+// Converts one scanline of 'cx' pixels.
+static inline void ConvertScanline(const CONVERTPROCS* lpProcs, BYTE* pDst, const BYTE* pSrc, int cx, const DWORD* lpPalette)
+{
+	// Same format on both sides, nothing to convert. For 8bpp that means
+	// the indices are copied as they are.
+	if(lpProcs->bCopy) {
+		memcpy(pDst, pSrc, (size_t)cx * lpProcs->iSrcBytes);
+		return;
+	}
+
+	if(!lpProcs->lpfnToXRGB) {
+		lpProcs->lpfnFromXRGB(pDst, pSrc, cx, lpPalette);
+		return;
+	}
+
+	if(!lpProcs->lpfnFromXRGB) {
+		lpProcs->lpfnToXRGB(pDst, pSrc, cx, lpPalette);
+		return;
+	}
+
+	// Neither side is XRGB, go through a small buffer in chunks.
+	DWORD buffer[CONVERT_CHUNK];
+
+	for(int x = 0; x < cx; x += CONVERT_CHUNK) {
+		int n = cx - x < CONVERT_CHUNK ? cx - x : CONVERT_CHUNK;
+
+		lpProcs->lpfnToXRGB((BYTE*)buffer, pSrc + x * lpProcs->iSrcBytes, n, lpPalette);
+		lpProcs->lpfnFromXRGB(pDst + x * lpProcs->iDstBytes, (const BYTE*)buffer, n, lpPalette);
+	}
+}
+
+// Turns the color table of an 8bpp DIB into XRGB values the kernels can
+// use directly. Entries past 'biClrUsed' are black.
+static inline void GetXRGBPalette(const BITMAPINFO* lpBmi, DWORD* lpPalette)
+{
+	int iColors = lpBmi->bmiHeader.biClrUsed ? (int)lpBmi->bmiHeader.biClrUsed : 256;
+
+	for(int i = 0; i < 256; i++) {
+		if(i < iColors) {
+			const RGBQUAD* q = &lpBmi->bmiColors[i];
+			lpPalette[i] = (q->rgbRed << 16) | (q->rgbGreen << 8) | q->rgbBlue;
+		}
+		else {
+			lpPalette[i] = 0;
+		}
+	}
+}
+
+// Converts the pixels of one surface into another of the same size. The
+// surfaces can be in any format and either one can be top-down or
+// bottom-up; the image is never flipped.
+static inline BOOL ConvertDIBSurface(LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc)
+{
+	CONVERTPROCS procs;
+	DWORD palette[256];
+
+	if(lpDst->cx != lpSrc->cx || lpDst->cy != lpSrc->cy) {
+		return FALSE;
+	}
+
+	if(!GetConvertProcs(lpDst->iFormat, lpSrc->iFormat, &procs)) {
+		return FALSE;
+	}
+
+	if(lpSrc->iFormat == DIBFMT_INDEX8) {
+		GetXRGBPalette(lpSrc->lpBmi, palette);
+	}
+
+	for(int y = 0; y < lpSrc->cy; y++) {
+		ConvertScanline(&procs, lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch, lpSrc->pTop + (ptrdiff_t)y * lpSrc->iPitch, lpSrc->cx, palette);
+	}
+
+	return TRUE;
+}
+
+#endif // CONVERT_H
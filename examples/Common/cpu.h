@@ -0,0 +1,95 @@
+
+#ifndef CPU_H
+#define CPU_H
+
+// Runtime CPU feature detection.
+//
+// The SIMD kernels in these headers are compiled into every program, but
+// which of them can actually run depends on the processor we end up on.
+// 'GetCPUFeatures' asks the processor once and the callers pick their
+// kernels from that. On compilers other than Visual C++ every SIMD
+// function is marked with CPU_TARGET, so the rest of the program does not
+// have to be compiled for that instruction set.
+
+#include "dibtypes.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CPU_X86
+#endif
+
+#define CPU_SSE2	0x00000001
+#define CPU_SSSE3	0x00000002
+#define CPU_SSE41	0x00000004
+#define CPU_AVX2	0x00000008
+
+#ifdef CPU_X86
+
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <smmintrin.h>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CPU_TARGET(x)
+#else
+#define CPU_TARGET(x)	__attribute__((target(x)))
+#endif
+
+#endif // CPU_X86
+
+// The features that may be used. Lowering this is handy for comparing a
+// kernel with its fallback; see 'SetCPUFeatureMask'.
+static inline DWORD* CPUFeatureMask()
+{
+	static DWORD dwMask = 0xFFFFFFFF;
+	return &dwMask;
+}
+
+static inline DWORD DetectCPUFeatures()
+{
+	DWORD dwFeatures = 0;
+
+#if defined(CPU_X86) && defined(_MSC_VER)
+	int regs[4];
+
+	__cpuid(regs, 1);
+
+	if(regs[3] & (1 << 26)) dwFeatures |= CPU_SSE2;
+	if(regs[2] & (1 << 9))  dwFeatures |= CPU_SSSE3;
+	if(regs[2] & (1 << 19)) dwFeatures |= CPU_SSE41;
+
+	// AVX2 also needs the operating system to save the YMM registers.
+	if((regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(regs, 7, 0);
+
+		if(regs[1] & (1 << 5)) dwFeatures |= CPU_AVX2;
+	}
+#elif defined(CPU_X86)
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("sse2"))   dwFeatures |= CPU_SSE2;
+	if(__builtin_cpu_supports("ssse3"))  dwFeatures |= CPU_SSSE3;
+	if(__builtin_cpu_supports("sse4.1")) dwFeatures |= CPU_SSE41;
+	if(__builtin_cpu_supports("avx2"))   dwFeatures |= CPU_AVX2;
+#endif
+
+	return dwFeatures;
+}
+
+// Returns the CPU_ flags of the features this processor has and we are
+// allowed to use.
+static inline DWORD GetCPUFeatures()
+{
+	static DWORD dwFeatures = DetectCPUFeatures();
+	return dwFeatures & *CPUFeatureMask();
+}
+
+// Restricts the features 'GetCPUFeatures' reports. Code that has already
+// picked its kernels keeps them, so set this before anything is created.
+static inline void SetCPUFeatureMask(DWORD dwMask)
+{
+	*CPUFeatureMask() = dwMask;
+}
+
+#endif // CPU_H
@@ -0,0 +1,477 @@
+
+#ifndef DIB_H
+#define DIB_H
+
+// Creating DIBs.
+//
+// A DIB is a BITMAPINFO, followed by a color table or color masks, and the
+// bits of the surface. Instead of allocating those separately we put them
+// in a single block of memory:
+//
+//   [ DIBBLOCK | BITMAPINFO + colors or masks | pad | scanline 0 | ... ]
+//
+// The header and the scanlines each start on a 64 byte boundary, so the
+// first pixel of the surface is aligned for any SIMD instruction we use
+// and never shares a cache line with the header. One allocation also
+// means there is nothing to clean up halfway when it fails, and one free
+// gets rid of everything.
+//
+// Programs that make and destroy scratch surfaces all the time would
+// spend a lot of that time in the heap and, for big surfaces, in the
+// kernel mapping and zeroing fresh pages. So blocks aren't given back
+// straight away. Every thread keeps a pool of free blocks sorted by size
+// class, four classes for every power of two, and the next DIB of about
+// the same size gets one of those. A block goes back to the pool of the
+// thread that frees it. The pools keep at most DIBPOOL_MAX_BYTES each,
+// anything beyond that is really freed.
+//
+// Big surfaces can ask for huge pages with DIBALLOC_HUGEPAGES. On Windows
+// that needs the "Lock pages in memory" privilege, on Linux huge pages
+// that were set aside or transparent huge pages. When none of that is
+// available we quietly use normal pages.
+
+#include "dibtypes.h"
+#include "surface.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define DIBALLOC_NOZERO		0x00000001	// Don't clear the bits, they are overwritten anyway
+#define DIBALLOC_CACHELINE	0x00000002	// Pad scanlines to 64 bytes (CreateDIBSurface only)
+#define DIBALLOC_HUGEPAGES	0x00000004	// Use huge pages for big surfaces
+#define DIBALLOC_ALPHA		0x00000008	// 32bpp: the highest byte is alpha, see composite.h
+
+#define DIB_ALIGN			64
+#define DIB_ALIGN_UP(n)		(((n) + DIB_ALIGN - 1) & ~(size_t)(DIB_ALIGN - 1))
+
+// Blocks this big or bigger get their own pages from the system instead
+// of coming from the heap.
+#define DIB_PAGES_MIN		(1 << 20)
+
+// Huge pages are only worth it from this size on.
+#define DIB_HUGEPAGES_MIN	(2 << 20)
+
+// The pools only keep blocks up to this size, in this many size classes,
+// and never more than this many bytes per thread.
+#define DIBPOOL_MAX_BLOCK	(64 << 20)
+#define DIBPOOL_CLASSES		80
+#define DIBPOOL_MAX_BYTES	(64 << 20)
+
+// How the memory of a block was allocated.
+#define DIBMEM_HEAP			0
+#define DIBMEM_PAGES		1
+#define DIBMEM_HUGEPAGES	2
+
+#define DIBBLOCK_MAGIC		0x42494444	// 'DDIB'
+
+typedef struct tagDIBBLOCK {
+	DWORD				dwMagic;
+	DWORD				dwMemory;	// DIBMEM_ value
+	int					iClass;		// Size class, -1 if the block is too big to pool
+	size_t				cbBlock;	// Size of the whole block
+	struct tagDIBBLOCK*	lpNext;		// Next free block in the pool
+} DIBBLOCK, *LPDIBBLOCK;
+
+// Works out the size class of a block of 'cb' bytes and the number of
+// bytes blocks of that class have. Classes are 256 bytes and then four
+// for every power of two: 320, 384, 448, 512, 640 and so on.
+static inline int GetDIBSizeClass(size_t cb, size_t* lpcbClass)
+{
+	size_t n = cb - 1;
+	int iBit = 0;
+
+	if(cb <= 256) {
+		*lpcbClass = 256;
+		return 0;
+	}
+
+	if(cb > DIBPOOL_MAX_BLOCK) {
+		*lpcbClass = cb;
+		return -1;
+	}
+
+	while(n >> (iBit + 1)) {
+		iBit++;
+	}
+
+	int iQuarter = (int)((n >> (iBit - 2)) & 3);
+
+	*lpcbClass = (size_t)(4 + iQuarter + 1) << (iBit - 2);
+	return (iBit - 8) * 4 + iQuarter + 1;
+}
+
+static inline void* AllocDIBPages(size_t cb, BOOL bHuge, DWORD* lpdwMemory)
+{
+	void* pBlock;
+
+#ifdef _WIN32
+	if(bHuge) {
+		SIZE_T cbLarge = GetLargePageMinimum();
+
+		if(cbLarge && (pBlock = VirtualAlloc(NULL, (cb + cbLarge - 1) & ~(cbLarge - 1), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE)) != NULL) {
+			*lpdwMemory = DIBMEM_HUGEPAGES;
+			return pBlock;
+		}
+	}
+
+	pBlock = VirtualAlloc(NULL, cb, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+	if(bHuge && (pBlock = mmap(NULL, cb, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED) {
+		*lpdwMemory = DIBMEM_HUGEPAGES;
+		return pBlock;
+	}
+#endif
+
+	if((pBlock = mmap(NULL, cb, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		return NULL;
+	}
+
+#ifdef MADV_HUGEPAGE
+	// No huge pages set aside, maybe the kernel can give us transparent
+	// ones.
+	if(bHuge) {
+		madvise(pBlock, cb, MADV_HUGEPAGE);
+	}
+#endif
+#endif
+
+	*lpdwMemory = DIBMEM_PAGES;
+	return pBlock;
+}
+
+static inline LPDIBBLOCK AllocDIBBlock(size_t cb, int iClass, BOOL bHuge)
+{
+	LPDIBBLOCK lpBlock;
+	DWORD dwMemory = DIBMEM_HEAP;
+
+	if(cb >= DIB_PAGES_MIN) {
+		// Huge pages come in whole numbers only.
+		if(bHuge && cb >= DIB_HUGEPAGES_MIN) {
+			cb = (cb + DIB_HUGEPAGES_MIN - 1) & ~(size_t)(DIB_HUGEPAGES_MIN - 1);
+		}
+		else {
+			bHuge = FALSE;
+		}
+
+		lpBlock = (LPDIBBLOCK)AllocDIBPages(cb, bHuge, &dwMemory);
+	}
+	else {
+#ifdef _WIN32
+		lpBlock = (LPDIBBLOCK)_aligned_malloc(cb, DIB_ALIGN);
+#else
+		if(posix_memalign((void**)&lpBlock, DIB_ALIGN, cb) != 0) {
+			lpBlock = NULL;
+		}
+#endif
+	}
+
+	if(lpBlock) {
+		lpBlock->dwMagic = DIBBLOCK_MAGIC;
+		lpBlock->dwMemory = dwMemory;
+		lpBlock->iClass = iClass;
+		lpBlock->cbBlock = cb;
+		lpBlock->lpNext = NULL;
+	}
+
+	return lpBlock;
+}
+
+static inline void FreeDIBBlock(LPDIBBLOCK lpBlock)
+{
+	if(lpBlock->dwMemory == DIBMEM_HEAP) {
+#ifdef _WIN32
+		_aligned_free(lpBlock);
+#else
+		free(lpBlock);
+#endif
+		return;
+	}
+
+#ifdef _WIN32
+	VirtualFree(lpBlock, 0, MEM_RELEASE);
+#else
+	munmap(lpBlock, lpBlock->cbBlock);
+#endif
+}
+
+// The free blocks of one thread. It gives everything back when the thread
+// ends.
+struct DIBPOOL {
+	LPDIBBLOCK	lpFree[DIBPOOL_CLASSES];
+	size_t		cbFree;
+
+	DIBPOOL()
+		: cbFree(0)
+	{
+		ZeroMemory(lpFree, sizeof(lpFree));
+	}
+
+	~DIBPOOL()
+	{
+		for(int i = 0; i < DIBPOOL_CLASSES; i++) {
+			while(lpFree[i]) {
+				LPDIBBLOCK lpBlock = lpFree[i];
+				lpFree[i] = lpBlock->lpNext;
+				FreeDIBBlock(lpBlock);
+			}
+		}
+	}
+};
+
+static inline DIBPOOL* GetDIBPool()
+{
+	static thread_local DIBPOOL pool;
+	return &pool;
+}
+
+// Makes a DIB with scanlines of 'iPitch' bytes, which must at least be
+// the DWORD stride. Returns the BITMAPINFO, which is also where the
+// block is freed from.
+static inline LPBITMAPINFO AllocDIB(int cx, int cy, int iBpp, DWORD dwFlags, int iPitch, BYTE* &pBits)
+{
+	LPDIBBLOCK lpBlock;
+	LPBITMAPINFO lpBmi;
+	size_t cbBmi;
+	size_t cbClass;
+	BOOL bFresh = FALSE;
+
+	pBits = NULL;
+
+	if(cx <= 0 || cy <= 0) {
+		return NULL;
+	}
+
+	// Calculate the size of the bitmap info header.
+	switch(iBpp) {
+	case 8:		// 8 bpp
+		cbBmi = sizeof(BITMAPINFO) + sizeof(RGBQUAD) * 256;
+		break;
+
+	case 15:	// 15/16 bpp
+	case 16:
+	case 32:	// 32 bpp
+		cbBmi = sizeof(BITMAPINFO) + sizeof(DWORD) * 4;
+		break;
+
+	case 24:	// 24 bpp
+		cbBmi = sizeof(BITMAPINFO);
+		break;
+
+	default:
+		return NULL;
+	}
+
+	size_t cbBits = (size_t)iPitch * cy;
+	size_t cbHeader = DIB_ALIGN_UP(sizeof(DIBBLOCK)) + DIB_ALIGN_UP(cbBmi);
+	int iClass = GetDIBSizeClass(cbHeader + cbBits, &cbClass);
+
+	// A block of the right size class from our pool, or a new one.
+	DIBPOOL* lpPool = GetDIBPool();
+
+	if(iClass >= 0 && (lpBlock = lpPool->lpFree[iClass]) != NULL) {
+		lpPool->lpFree[iClass] = lpBlock->lpNext;
+		lpPool->cbFree -= lpBlock->cbBlock;
+	}
+	else {
+		if((lpBlock = AllocDIBBlock(cbClass, iClass, (dwFlags & DIBALLOC_HUGEPAGES) != 0)) == NULL) {
+			return NULL;
+		}
+
+		// Pages straight from the system are zero already.
+		bFresh = lpBlock->dwMemory != DIBMEM_HEAP;
+	}
+
+	lpBmi = (LPBITMAPINFO)((BYTE*)lpBlock + DIB_ALIGN_UP(sizeof(DIBBLOCK)));
+	pBits = (BYTE*)lpBlock + cbHeader;
+
+	ZeroMemory(lpBmi, cbBmi);
+
+	if(!bFresh && !(dwFlags & DIBALLOC_NOZERO)) {
+		ZeroMemory(pBits, cbBits);
+	}
+
+	// Initialize bitmap info header
+	lpBmi->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	lpBmi->bmiHeader.biWidth = cx;
+	lpBmi->bmiHeader.biHeight = -(signed)cy;		// <-- NEGATIVE MEANS TOP DOWN!!!
+	lpBmi->bmiHeader.biPlanes = 1;
+	lpBmi->bmiHeader.biSizeImage = 0;
+	lpBmi->bmiHeader.biXPelsPerMeter = 0;
+	lpBmi->bmiHeader.biYPelsPerMeter = 0;
+	lpBmi->bmiHeader.biClrUsed = 0;
+	lpBmi->bmiHeader.biClrImportant = 0;
+	lpBmi->bmiHeader.biCompression = BI_RGB;
+
+	// After initializing the bitmap info header we need to store some
+	// more information depending on the bpp of the bitmap.
+	switch(iBpp) {
+	case 8:
+		{
+			// For the 8bpp DIB we will create a simple grayscale palette.
+			for(int i = 0; i < 256; i++) {
+				lpBmi->bmiColors[i].rgbRed      = (BYTE)i;
+				lpBmi->bmiColors[i].rgbGreen    = (BYTE)i;
+				lpBmi->bmiColors[i].rgbBlue     = (BYTE)i;
+				lpBmi->bmiColors[i].rgbReserved = (BYTE)0;
+			}
+
+			// Set the bpp for this DIB to 8bpp.
+			lpBmi->bmiHeader.biBitCount = 8;
+		}
+		break;
+
+	case 15:
+		{
+			// This is where we will tell the DIB what bits represent what
+			// data. This may look confusing at first but the representation
+			// of the RGB data can be different on different devices. For
+			// example you can have for Hicolor a 565 format. Meaning 5 bits
+			// for red, 6 bits for green and 5 bits for blue or better stated
+			// like RGB. But, the pixel data can also be the other way around,
+			// for example BGR meaning, 5 bits for blue, 6 bits for green and
+			// 5 bits for red. This piece of information will tell the bitmap
+			// info header how the pixel data will be stored. In this case in
+			// RGB format in 555 because this is a 15bpp DIB so the highest
+			// bit (bit 15) will not be used.
+			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
+
+			pBmi[0] = 0x00007C00;	// Red mask
+			pBmi[1] = 0x000003E0;	// Green mask
+			pBmi[2] = 0x0000001F;	// Blue mask
+			pBmi[3] = 0x00000000;	// Not used
+
+			// 15bpp DIB also use 16 bits to store a pixel.
+			lpBmi->bmiHeader.biBitCount = 16;
+			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
+		}
+		break;
+
+	case 16:
+		{
+			// Take a look at the remarks written by 15bpp. For this format
+			// it's the same thing, except in this case the mask's will be
+			// different because our format will be 565 (RGB).
+			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
+
+			pBmi[0] = 0x0000F800;	// Red mask
+			pBmi[1] = 0x000007E0;	// Green mask
+			pBmi[2] = 0x0000001F;	// Blue mask
+			pBmi[3] = 0x00000000;	// Not used
+
+			lpBmi->bmiHeader.biBitCount = 16;
+			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
+		}
+		break;
+
+	case 24:
+		{
+			// This is a 1:1 situation. There is no need to set any extra
+			// information.
+			lpBmi->bmiHeader.biBitCount = 24;
+		}
+		break;
+
+	case 32:
+		{
+			// This may speak for it's self. In this case where using 32bpp.
+			// The format will be ARGB. the Alpha (A) portion of the format
+			// is only used when asked for with DIBALLOC_ALPHA, and then
+			// holds premultiplied alpha. The other mask's tell us where the
+			// bytes for the R, G and B data will be stored in the DWORD.
+			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
+
+			pBmi[0] = 0x00FF0000;	// Red mask
+			pBmi[1] = 0x0000FF00;	// Green mask
+			pBmi[2] = 0x000000FF;	// Blue mask
+			pBmi[3] = dwFlags & DIBALLOC_ALPHA ? 0xFF000000 : 0x00000000;	// Alpha mask
+
+			lpBmi->bmiHeader.biBitCount = 32;
+			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
+		}
+		break;
+	}
+
+	return lpBmi;
+}
+
+// Creates a top-down DIB of 'cx' by 'cy' pixels. 'iBpp' is 8, 15, 16, 24
+// or 32; 15 makes a 16bpp DIB in 555 format. Returns NULL if there is
+// not enough memory. Free it with 'FreeDIB', that also frees 'pBits'.
+static inline LPBITMAPINFO CreateDIB(int cx, int cy, int iBpp, BYTE* &pBits, DWORD dwFlags = 0)
+{
+	// Windows expects the scanlines of a DIB to be exactly the DWORD
+	// stride apart, so we can't pad them any further here.
+	return AllocDIB(cx, cy, iBpp, dwFlags & ~DIBALLOC_CACHELINE, DIB_STRIDE(cx, iBpp == 15 ? 16 : iBpp), pBits);
+}
+
+static inline void FreeDIB(LPBITMAPINFO lpBmi)
+{
+	LPDIBBLOCK lpBlock;
+	DIBPOOL* lpPool;
+
+	if(!lpBmi) {
+		return;
+	}
+
+	lpBlock = (LPDIBBLOCK)((BYTE*)lpBmi - DIB_ALIGN_UP(sizeof(DIBBLOCK)));
+	lpPool = GetDIBPool();
+
+	// Not one of ours.
+	if(lpBlock->dwMagic != DIBBLOCK_MAGIC) {
+		return;
+	}
+
+	if(lpBlock->iClass < 0 || lpPool->cbFree + lpBlock->cbBlock > DIBPOOL_MAX_BYTES) {
+		FreeDIBBlock(lpBlock);
+		return;
+	}
+
+	lpBlock->lpNext = lpPool->lpFree[lpBlock->iClass];
+	lpPool->lpFree[lpBlock->iClass] = lpBlock;
+	lpPool->cbFree += lpBlock->cbBlock;
+}
+
+// Creates a DIB and sets up a surface for it in one go. This is the one
+// to use for scratch surfaces that are never handed to GDI, those can
+// have their scanlines padded to whole cache lines with
+// DIBALLOC_CACHELINE, so no two rows ever share one.
+static inline BOOL CreateDIBSurface(LPDIBSURFACE lpSurface, int cx, int cy, int iBpp, DWORD dwFlags = 0)
+{
+	LPBITMAPINFO lpBmi;
+	BYTE* pBits;
+	int iPitch = DIB_STRIDE(cx, iBpp == 15 ? 16 : iBpp);
+
+	ZeroMemory(lpSurface, sizeof(DIBSURFACE));
+
+	if(dwFlags & DIBALLOC_CACHELINE) {
+		iPitch = (int)DIB_ALIGN_UP(iPitch);
+	}
+
+	if((lpBmi = AllocDIB(cx, cy, iBpp, dwFlags, iPitch, pBits)) == NULL) {
+		return FALSE;
+	}
+
+	if(!InitDIBSurface(lpSurface, lpBmi, pBits)) {
+		FreeDIB(lpBmi);
+		return FALSE;
+	}
+
+	// Our DIBs are top-down, so the pitch is positive.
+	lpSurface->iPitch = iPitch;
+	return TRUE;
+}
+
+static inline void FreeDIBSurface(LPDIBSURFACE lpSurface)
+{
+	FreeDIB(lpSurface->lpBmi);
+	ZeroMemory(lpSurface, sizeof(DIBSURFACE));
+}
+
+#endif // DIB_H
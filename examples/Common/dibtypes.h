@@ -0,0 +1,95 @@
+
+#ifndef DIBTYPES_H
+#define DIBTYPES_H
+
+// The headers in this directory only need the handful of types and
+// structures that describe a DIB. On Windows we simply take them from
+// 'windows.h'. On other platforms (our Linux build and perf hosts) we
+// declare the same structures ourselves, with the exact same layout as
+// they have in 'wingdi.h', so the code using them does not have to know
+// the difference.
+
+#ifdef _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <windows.h>
+
+#else
+
+#include <string.h>
+
+typedef unsigned char	BYTE;
+typedef unsigned short	WORD;
+typedef unsigned int	DWORD;
+typedef int				LONG;
+typedef int				BOOL;
+typedef const char*		LPCSTR;
+
+#ifndef TRUE
+#define TRUE	1
+#define FALSE	0
+#endif
+
+#define BI_RGB			0L
+#define BI_RLE8			1L
+#define BI_RLE4			2L
+#define BI_BITFIELDS	3L
+
+#define ZeroMemory(p, n)	memset((p), 0, (n))
+#define CopyMemory(d, s, n)	memcpy((d), (s), (n))
+
+// The file header is the only structure that is not naturally aligned,
+// 'wingdi.h' packs it on 2 bytes as well.
+#pragma pack(push, 2)
+typedef struct tagBITMAPFILEHEADER {
+	WORD	bfType;
+	DWORD	bfSize;
+	WORD	bfReserved1;
+	WORD	bfReserved2;
+	DWORD	bfOffBits;
+} BITMAPFILEHEADER, *LPBITMAPFILEHEADER;
+#pragma pack(pop)
+
+typedef struct tagBITMAPINFOHEADER {
+	DWORD	biSize;
+	LONG	biWidth;
+	LONG	biHeight;
+	WORD	biPlanes;
+	WORD	biBitCount;
+	DWORD	biCompression;
+	DWORD	biSizeImage;
+	LONG	biXPelsPerMeter;
+	LONG	biYPelsPerMeter;
+	DWORD	biClrUsed;
+	DWORD	biClrImportant;
+} BITMAPINFOHEADER, *LPBITMAPINFOHEADER;
+
+typedef struct tagRGBQUAD {
+	BYTE	rgbBlue;
+	BYTE	rgbGreen;
+	BYTE	rgbRed;
+	BYTE	rgbReserved;
+} RGBQUAD;
+
+typedef struct tagBITMAPINFO {
+	BITMAPINFOHEADER	bmiHeader;
+	RGBQUAD				bmiColors[1];
+} BITMAPINFO, *LPBITMAPINFO;
+
+typedef struct tagRECT {
+	LONG	left;
+	LONG	top;
+	LONG	right;
+	LONG	bottom;
+} RECT, *LPRECT;
+
+#endif // _WIN32
+
+// The number of bytes in one scanline of a DIB. Scanlines are always
+// padded up to a DWORD boundary, no matter what the bit depth is.
+#define DIB_STRIDE(cx, bpp)	((((cx) * (bpp) + 31) & ~31) >> 3)
+
+#endif // DIBTYPES_H
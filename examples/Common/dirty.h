@@ -0,0 +1,430 @@
+
+#ifndef DIRTY_H
+#define DIRTY_H
+
+// Keeping track of what changed on a surface.
+//
+// Copying a whole surface to the screen because one pixel changed is a
+// waste; most of the time only a few small areas of it have been drawn
+// on. A dirty region remembers those areas so only they are presented.
+//
+// The surface is divided in tiles of 16 x 16 pixels and the region keeps
+// one bit for each of them. Marking a pixel dirty is a shift and an OR,
+// cheap enough to do for every pixel that is drawn, and no matter how
+// often the same area is drawn on it never takes more memory. When it is
+// time to present, 'GetDirtyRects' turns the bits into as few rectangles
+// as it can: neighbouring tiles on a row become one rectangle and rows
+// with the same rectangles are merged.
+//
+// A presenter only takes so many rectangles. When there are more, the
+// two rectangles that cost the least to put together are merged, again
+// and again, until they fit. The cost is the area their bounding
+// rectangle adds that isn't dirty, so nearby rectangles on the same row
+// go first and rows are only put together once each is down to one. A
+// single rectangle around everything would present the whole frame as
+// soon as two far corners of it changed.
+
+#include "dibtypes.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DIRTY_TILE_SHIFT	4
+#define DIRTY_TILE_SIZE		(1 << DIRTY_TILE_SHIFT)
+
+typedef struct tagDIRTYREGION {
+	DWORD*	pBits;		// One bit per tile, 'cWords' DWORDs per row of tiles
+	int		cWords;
+	int		cxTiles;
+	int		cyTiles;
+	int		cx;
+	int		cy;
+	BOOL	bDirty;		// Anything marked since the last 'ClearDirtyRegion'
+	BYTE*	pMerge;		// Scratch space for 'MergeDirtyRects', made when first needed
+} DIRTYREGION, *LPDIRTYREGION;
+
+static inline void FreeDirtyRegion(LPDIRTYREGION lpRegion)
+{
+	free(lpRegion->pBits);
+	free(lpRegion->pMerge);
+	ZeroMemory(lpRegion, sizeof(DIRTYREGION));
+}
+
+static inline BOOL CreateDirtyRegion(LPDIRTYREGION lpRegion, int cx, int cy)
+{
+	ZeroMemory(lpRegion, sizeof(DIRTYREGION));
+
+	lpRegion->cx = cx;
+	lpRegion->cy = cy;
+	lpRegion->cxTiles = (cx + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SHIFT;
+	lpRegion->cyTiles = (cy + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SHIFT;
+	lpRegion->cWords = (lpRegion->cxTiles + 31) >> 5;
+
+	if((lpRegion->pBits = (DWORD*)calloc(lpRegion->cWords * lpRegion->cyTiles, sizeof(DWORD))) == NULL) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static inline void ClearDirtyRegion(LPDIRTYREGION lpRegion)
+{
+	if(lpRegion->bDirty) {
+		ZeroMemory(lpRegion->pBits, lpRegion->cWords * lpRegion->cyTiles * sizeof(DWORD));
+		lpRegion->bDirty = FALSE;
+	}
+}
+
+// Marks one pixel, which must be on the surface.
+static inline void MarkDirtyPixel(LPDIRTYREGION lpRegion, int x, int y)
+{
+	int tx = x >> DIRTY_TILE_SHIFT;
+
+	lpRegion->pBits[(y >> DIRTY_TILE_SHIFT) * lpRegion->cWords + (tx >> 5)] |= 1u << (tx & 31);
+	lpRegion->bDirty = TRUE;
+}
+
+// Marks a rectangle, right and bottom exclusive like a RECT. It is
+// clipped to the surface.
+static inline void MarkDirtyRect(LPDIRTYREGION lpRegion, int left, int top, int right, int bottom)
+{
+	if(left < 0) left = 0;
+	if(top < 0) top = 0;
+	if(right > lpRegion->cx) right = lpRegion->cx;
+	if(bottom > lpRegion->cy) bottom = lpRegion->cy;
+
+	if(left >= right || top >= bottom) {
+		return;
+	}
+
+	int tx0 = left >> DIRTY_TILE_SHIFT;
+	int tx1 = (right - 1) >> DIRTY_TILE_SHIFT;
+
+	for(int ty = top >> DIRTY_TILE_SHIFT; ty <= (bottom - 1) >> DIRTY_TILE_SHIFT; ty++) {
+		DWORD* pRow = lpRegion->pBits + ty * lpRegion->cWords;
+
+		for(int tx = tx0; tx <= tx1; tx++) {
+			pRow[tx >> 5] |= 1u << (tx & 31);
+		}
+	}
+
+	lpRegion->bDirty = TRUE;
+}
+
+static inline void MarkAllDirty(LPDIRTYREGION lpRegion)
+{
+	MarkDirtyRect(lpRegion, 0, 0, lpRegion->cx, lpRegion->cy);
+}
+
+// Marks everything that is marked in 'lpSrc' as well, which must be a
+// region of the same size.
+static inline void AddDirtyRegion(LPDIRTYREGION lpDst, const DIRTYREGION* lpSrc)
+{
+	if(!lpSrc->bDirty) {
+		return;
+	}
+
+	for(int i = 0; i < lpDst->cWords * lpDst->cyTiles; i++) {
+		lpDst->pBits[i] |= lpSrc->pBits[i];
+	}
+
+	lpDst->bDirty = TRUE;
+}
+
+static inline BOOL IsTileDirty(const DIRTYREGION* lpRegion, int tx, int ty)
+{
+	return (lpRegion->pBits[ty * lpRegion->cWords + (tx >> 5)] >> (tx & 31)) & 1;
+}
+
+// Puts the dirty area in rectangles that cover exactly the dirty tiles and
+// returns how many it used, or -1 if that takes more than 'cMaxRects'.
+static inline int GetExactDirtyRects(const DIRTYREGION* lpRegion, RECT* lpRects, int cMaxRects)
+{
+	int cRects = 0;
+	int iPrevious = 0;		// First rectangle made from the previous row of tiles
+	int cPrevious = 0;
+
+	for(int ty = 0; ty < lpRegion->cyTiles; ty++) {
+		int iFirst = cRects;
+		int cRow = 0;
+		int tx = 0;
+
+		while(tx < lpRegion->cxTiles) {
+			if(!IsTileDirty(lpRegion, tx, ty)) {
+				tx++;
+				continue;
+			}
+
+			int tx0 = tx;
+
+			while(tx < lpRegion->cxTiles && IsTileDirty(lpRegion, tx, ty)) {
+				tx++;
+			}
+
+			RECT rc;
+
+			rc.left = tx0 << DIRTY_TILE_SHIFT;
+			rc.top = ty << DIRTY_TILE_SHIFT;
+			rc.right = tx << DIRTY_TILE_SHIFT;
+			rc.bottom = (ty + 1) << DIRTY_TILE_SHIFT;
+
+			if(rc.right > lpRegion->cx) rc.right = lpRegion->cx;
+			if(rc.bottom > lpRegion->cy) rc.bottom = lpRegion->cy;
+
+			if(cRects == cMaxRects) {
+				return -1;
+			}
+
+			lpRects[cRects++] = rc;
+			cRow++;
+		}
+
+		// If this row has exactly the same rectangles as the one above it,
+		// and that one ends right where this one starts, grow those down.
+		if(cRow && cRow == cPrevious && lpRects[iPrevious].bottom == (ty << DIRTY_TILE_SHIFT)) {
+			BOOL bSame = TRUE;
+
+			for(int i = 0; i < cRow && bSame; i++) {
+				bSame = lpRects[iPrevious + i].left == lpRects[iFirst + i].left && lpRects[iPrevious + i].right == lpRects[iFirst + i].right;
+			}
+
+			if(bSame) {
+				for(int i = 0; i < cRow; i++) {
+					lpRects[iPrevious + i].bottom = lpRects[iFirst + i].bottom;
+				}
+
+				cRects = iFirst;
+				continue;
+			}
+		}
+
+		if(cRow) {
+			iPrevious = iFirst;
+			cPrevious = cRow;
+		}
+		else {
+			cPrevious = 0;
+		}
+	}
+
+	return cRects;
+}
+
+//
+// Merging rectangles.
+//
+
+// The area the bounding rectangle of 'a' and 'b' has on top of theirs.
+static inline long long GetDirtyMergeCost(const RECT* a, const RECT* b)
+{
+	long long cx = (a->right > b->right ? a->right : b->right) - (a->left < b->left ? a->left : b->left);
+	long long cy = (a->bottom > b->bottom ? a->bottom : b->bottom) - (a->top < b->top ? a->top : b->top);
+
+	return cx * cy - (long long)(a->right - a->left) * (a->bottom - a->top) - (long long)(b->right - b->left) * (b->bottom - b->top);
+}
+
+// The rectangles being merged are kept in a list in the order they were
+// found, top to bottom and left to right, and each is merged only with
+// the next one in it. Which pair goes next comes from a heap of the
+// rectangles by the cost of merging them with the one after them.
+typedef struct tagDIRTYMERGE {
+	RECT*		lpRects;
+	int*		pNext;			// -1 for the last one
+	int*		pPrev;			// -1 for the first one
+	int*		pHeap;
+	int*		pPos;			// Where each rectangle is in 'pHeap', -1 if it isn't
+	long long*	pCost;			// Of merging with 'pNext'
+	int			cHeap;
+} DIRTYMERGE;
+
+static inline void SwapDirtyHeap(DIRTYMERGE* lpMerge, int i, int j)
+{
+	int a = lpMerge->pHeap[i], b = lpMerge->pHeap[j];
+
+	lpMerge->pHeap[i] = b;
+	lpMerge->pHeap[j] = a;
+	lpMerge->pPos[b] = i;
+	lpMerge->pPos[a] = j;
+}
+
+// Moves entry 'i' of the heap up or down to where its cost puts it.
+static inline void FixDirtyHeap(DIRTYMERGE* lpMerge, int i)
+{
+	const long long* pCost = lpMerge->pCost;
+	const int* pHeap = lpMerge->pHeap;
+
+	while(i > 0 && pCost[pHeap[i]] < pCost[pHeap[(i - 1) / 2]]) {
+		SwapDirtyHeap(lpMerge, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for(;;) {
+		int iSmallest = i;
+
+		for(int iChild = 2 * i + 1; iChild <= 2 * i + 2 && iChild < lpMerge->cHeap; iChild++) {
+			if(pCost[pHeap[iChild]] < pCost[pHeap[iSmallest]]) {
+				iSmallest = iChild;
+			}
+		}
+
+		if(iSmallest == i) {
+			break;
+		}
+
+		SwapDirtyHeap(lpMerge, i, iSmallest);
+		i = iSmallest;
+	}
+}
+
+static inline void RemoveDirtyHeap(DIRTYMERGE* lpMerge, int iRect)
+{
+	int i = lpMerge->pPos[iRect];
+
+	if(i < 0) {
+		return;
+	}
+
+	SwapDirtyHeap(lpMerge, i, --lpMerge->cHeap);
+	lpMerge->pPos[iRect] = -1;
+
+	if(i < lpMerge->cHeap) {
+		FixDirtyHeap(lpMerge, i);
+	}
+}
+
+// Works out the cost of merging 'iRect' with the one after it, and puts
+// it in the heap or moves it to its new place there.
+static inline void UpdateDirtyHeap(DIRTYMERGE* lpMerge, int iRect)
+{
+	int iNext = lpMerge->pNext[iRect];
+
+	if(iNext < 0) {
+		RemoveDirtyHeap(lpMerge, iRect);
+		return;
+	}
+
+	lpMerge->pCost[iRect] = GetDirtyMergeCost(&lpMerge->lpRects[iRect], &lpMerge->lpRects[iNext]);
+
+	if(lpMerge->pPos[iRect] < 0) {
+		lpMerge->pHeap[lpMerge->cHeap] = iRect;
+		lpMerge->pPos[iRect] = lpMerge->cHeap++;
+	}
+
+	FixDirtyHeap(lpMerge, lpMerge->pPos[iRect]);
+}
+
+// Merges the 'cRects' rectangles of 'lpMerge' down to 'cMaxRects' of
+// them and copies those to 'lpRects'. Returns how many there are.
+static inline int MergeDirtyRects(DIRTYMERGE* lpMerge, int cRects, RECT* lpRects, int cMaxRects)
+{
+	int cLeft = cRects;
+
+	lpMerge->cHeap = 0;
+
+	for(int i = 0; i < cRects; i++) {
+		lpMerge->pNext[i] = i + 1 < cRects ? i + 1 : -1;
+		lpMerge->pPrev[i] = i - 1;
+		lpMerge->pPos[i] = -1;
+	}
+
+	for(int i = 0; i < cRects; i++) {
+		UpdateDirtyHeap(lpMerge, i);
+	}
+
+	// The first rectangle is never the one merged away, the list always
+	// starts with it.
+	while(cLeft > cMaxRects) {
+		int i = lpMerge->pHeap[0];
+		int j = lpMerge->pNext[i];
+		RECT* a = &lpMerge->lpRects[i];
+		const RECT* b = &lpMerge->lpRects[j];
+
+		if(b->left < a->left) a->left = b->left;
+		if(b->top < a->top) a->top = b->top;
+		if(b->right > a->right) a->right = b->right;
+		if(b->bottom > a->bottom) a->bottom = b->bottom;
+
+		RemoveDirtyHeap(lpMerge, j);
+
+		lpMerge->pNext[i] = lpMerge->pNext[j];
+
+		if(lpMerge->pNext[j] >= 0) {
+			lpMerge->pPrev[lpMerge->pNext[j]] = i;
+		}
+
+		UpdateDirtyHeap(lpMerge, i);
+
+		if(lpMerge->pPrev[i] >= 0) {
+			UpdateDirtyHeap(lpMerge, lpMerge->pPrev[i]);
+		}
+
+		cLeft--;
+	}
+
+	cRects = 0;
+
+	for(int i = 0; i >= 0; i = lpMerge->pNext[i]) {
+		lpRects[cRects++] = lpMerge->lpRects[i];
+	}
+
+	return cRects;
+}
+
+// Puts the dirty area in at most 'cMaxRects' rectangles and returns how
+// many it used. When the dirty tiles take more rectangles than that, the
+// cheapest ones to put together are merged, see above. The scratch space
+// for that is made the first time, if it can't be, everything goes in a
+// single rectangle around all of it.
+static inline int GetDirtyRects(LPDIRTYREGION lpRegion, RECT* lpRects, int cMaxRects)
+{
+	int cTiles = lpRegion->cxTiles * lpRegion->cyTiles;
+	DIRTYMERGE merge;
+	int cRects;
+
+	if(!lpRegion->bDirty || cMaxRects <= 0) {
+		return 0;
+	}
+
+	if((cRects = GetExactDirtyRects(lpRegion, lpRects, cMaxRects)) >= 0) {
+		return cRects;
+	}
+
+	// There are never more rectangles than dirty tiles.
+	if(!lpRegion->pMerge) {
+		lpRegion->pMerge = (BYTE*)malloc((size_t)cTiles * (sizeof(RECT) + sizeof(long long) + sizeof(int) * 4));
+	}
+
+	if(!lpRegion->pMerge) {
+		RECT rcBounds = { 0x7FFFFFFF, 0x7FFFFFFF, 0, 0 };
+
+		for(int ty = 0; ty < lpRegion->cyTiles; ty++) {
+			for(int tx = 0; tx < lpRegion->cxTiles; tx++) {
+				if(IsTileDirty(lpRegion, tx, ty)) {
+					if((tx << DIRTY_TILE_SHIFT) < rcBounds.left) rcBounds.left = tx << DIRTY_TILE_SHIFT;
+					if((ty << DIRTY_TILE_SHIFT) < rcBounds.top) rcBounds.top = ty << DIRTY_TILE_SHIFT;
+					if(((tx + 1) << DIRTY_TILE_SHIFT) > rcBounds.right) rcBounds.right = (tx + 1) << DIRTY_TILE_SHIFT;
+					if(((ty + 1) << DIRTY_TILE_SHIFT) > rcBounds.bottom) rcBounds.bottom = (ty + 1) << DIRTY_TILE_SHIFT;
+				}
+			}
+		}
+
+		if(rcBounds.right > lpRegion->cx) rcBounds.right = lpRegion->cx;
+		if(rcBounds.bottom > lpRegion->cy) rcBounds.bottom = lpRegion->cy;
+
+		lpRects[0] = rcBounds;
+		return 1;
+	}
+
+	merge.lpRects = (RECT*)lpRegion->pMerge;
+	merge.pCost = (long long*)(merge.lpRects + cTiles);
+	merge.pNext = (int*)(merge.pCost + cTiles);
+	merge.pPrev = merge.pNext + cTiles;
+	merge.pHeap = merge.pPrev + cTiles;
+	merge.pPos = merge.pHeap + cTiles;
+
+	cRects = GetExactDirtyRects(lpRegion, merge.lpRects, cTiles);
+
+	return MergeDirtyRects(&merge, cRects, lpRects, cMaxRects);
+}
+
+#endif // DIRTY_H
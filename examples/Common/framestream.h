@@ -0,0 +1,788 @@
+
+#ifndef FRAMESTREAM_H
+#define FRAMESTREAM_H
+
+// Streaming frames to a viewer on another machine.
+//
+// Sending the whole DIB every frame is a waste when only a few pixels of
+// it changed, which for a render loop like Example 4's is most of the
+// time. The encoder keeps a copy of the frame it sent last and cuts every
+// new frame up in tiles of 32 x 32 pixels. A tile that is the same as
+// last time is left out. Finding out takes one SIMD compare per 16 or 32
+// bytes, and tiles outside the dirty rectangles a presenter is given
+// aren't even looked at. A tile that did change is coded pixel by pixel,
+// against the same tile in the last frame, as a string of codes:
+//
+//   0x00 + n    n + 1 pixels (up to 64) are the same as in the last frame
+//   0x40 + n    n + 1 pixels (up to 64) of the one color that follows
+//   0x80 + n    n + 1 pixels (up to 128) stored as they are
+//
+// The codes run from the top left of the tile to the bottom right, one
+// row after the other, and pixels after the last code didn't change. A
+// tile the codes would make bigger is stored as it is instead.
+//
+// A stream starts with a FRAMESTREAMHEADER: the size and depth of the
+// frames and, at 8bpp, the color table. Every frame after that is a
+// FRAMEHEADER followed by its tiles, each a FRAMETILE and its data. A
+// frame without any changes is only the header.
+//
+// The decoder keeps the frame in a DIB made by 'CreateDIB', so a viewer
+// can hand it to GDI as it is. It starts out black, like the encoder's
+// copy, which is why a stream has to be read from the start. Like the RLE
+// decoder it doesn't trust anything in the stream: tiles outside the
+// frame and codes that run past the end of a tile are errors.
+//
+// Outside Windows, 'ConnectFrameStream' and 'AcceptFrameStream' open a
+// TCP connection as a FILE to write a stream to or read one from.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "dib.h"
+#include "cpu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <signal.h>
+#endif
+
+#define	FRAMESTREAM_MAGIC		0x4D525346	// 'FSRM'
+#define	FRAMESTREAM_FRAME		0x4D415246	// 'FRAM'
+
+#define	FRAMESTREAM_TILE_SHIFT	5
+#define	FRAMESTREAM_TILE_SIZE	(1 << FRAMESTREAM_TILE_SHIFT)
+#define	FRAMESTREAM_TILE_PIXELS	(FRAMESTREAM_TILE_SIZE * FRAMESTREAM_TILE_SIZE)
+
+#define	FRAMECODE_SKIP			0x00
+#define	FRAMECODE_RUN			0x40
+#define	FRAMECODE_LITERAL		0x80
+
+// Set in 'dwSize' of a tile that is stored as it is, row after row.
+#define	FRAMETILE_RAW			0x80000000
+
+typedef struct tagFRAMESTREAMHEADER {
+	DWORD			dwMagic;
+	LONG			cx;
+	LONG			cy;
+	LONG			iBpp;			// As 'CreateDIB' takes it, 15 is 555
+	RGBQUAD			palette[256];	// Only used at 8bpp
+} FRAMESTREAMHEADER, *LPFRAMESTREAMHEADER;
+
+typedef struct tagFRAMEHEADER {
+	DWORD			dwMagic;
+	DWORD			dwFrame;		// Counting from 1
+	DWORD			cTiles;
+	DWORD			cbData;			// Of all the tiles that follow
+} FRAMEHEADER, *LPFRAMEHEADER;
+
+typedef struct tagFRAMETILE {
+	WORD			tx;
+	WORD			ty;
+	DWORD			dwSize;			// Bytes of data, with FRAMETILE_RAW
+} FRAMETILE, *LPFRAMETILE;
+
+//
+// Comparing tiles.
+//
+
+// Returns TRUE if 'cy' rows of 'cb' bytes are the same at 'pA' and 'pB'.
+typedef BOOL (*LPTILEEQUALPROC)(const BYTE* pA, int iPitchA, const BYTE* pB, int iPitchB, int cb, int cy);
+
+static inline BOOL TileEqual_C(const BYTE* pA, int iPitchA, const BYTE* pB, int iPitchB, int cb, int cy)
+{
+	for(int y = 0; y < cy; y++, pA += iPitchA, pB += iPitchB) {
+		if(memcmp(pA, pB, cb) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+#ifdef CPU_X86
+
+// The differences of a whole row are ORed together and tested once.
+CPU_TARGET("sse2") static BOOL TileEqual_SSE2(const BYTE* pA, int iPitchA, const BYTE* pB, int iPitchB, int cb, int cy)
+{
+	int cbVector = cb & ~15;
+
+	for(int y = 0; y < cy; y++, pA += iPitchA, pB += iPitchB) {
+		__m128i diff = _mm_setzero_si128();
+
+		for(int i = 0; i < cbVector; i += 16) {
+			diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(pA + i)), _mm_loadu_si128((const __m128i*)(pB + i))));
+		}
+
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF || memcmp(pA + cbVector, pB + cbVector, cb - cbVector) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+CPU_TARGET("avx2") static BOOL TileEqual_AVX2(const BYTE* pA, int iPitchA, const BYTE* pB, int iPitchB, int cb, int cy)
+{
+	int cbVector = cb & ~31;
+
+	for(int y = 0; y < cy; y++, pA += iPitchA, pB += iPitchB) {
+		__m256i diff = _mm256_setzero_si256();
+
+		for(int i = 0; i < cbVector; i += 32) {
+			diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pA + i)), _mm256_loadu_si256((const __m256i*)(pB + i))));
+		}
+
+		if(!_mm256_testz_si256(diff, diff) || memcmp(pA + cbVector, pB + cbVector, cb - cbVector) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+#endif // CPU_X86
+
+static inline LPTILEEQUALPROC GetTileEqualProc(DWORD dwFeatures)
+{
+#ifdef CPU_X86
+	if(dwFeatures & CPU_AVX2) return TileEqual_AVX2;
+	if(dwFeatures & CPU_SSE2) return TileEqual_SSE2;
+#endif
+	return TileEqual_C;
+}
+
+//
+// Tiles as a string of pixels.
+//
+
+static inline int CountTrailingZeros(DWORD dw)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, dw);
+	return (int)i;
+#else
+	return __builtin_ctz(dw);
+#endif
+}
+
+template<int BYTES>
+static inline DWORD LoadTilePixel(const BYTE* p)
+{
+	switch(BYTES) {
+	case 1:	return p[0];
+	case 2:	return *(const WORD*)p;
+	case 3:	return p[0] | (p[1] << 8) | (p[2] << 16);
+	}
+
+	return *(const DWORD*)p;
+}
+
+// Codes the pixels of a tile, 'cx' by 'cy' at 'pNew', against the same
+// tile in the last frame at 'pOld'. Runs and literals stop at the end of
+// a row, pixels that didn't change go on into the next ones, and those
+// after the last change aren't coded at all. Pixels are copied to the
+// stream as they are in the DIB. Returns the number of bytes written to
+// 'pDst', which is never more than 2 per byte of pixels.
+template<int BYTES>
+static inline size_t EncodeTilePixels(const BYTE* pNew, int iNewPitch, const BYTE* pOld, int iOldPitch, int cx, int cy, BYTE* pDst)
+{
+	BYTE* p = pDst;
+	int cSkip = 0;
+
+	for(int y = 0; y < cy; y++, pNew += iNewPitch, pOld += iOldPitch) {
+		int x = 0;
+
+		// Most rows of a tile that changed didn't.
+		if(memcmp(pNew, pOld, cx * BYTES) == 0) {
+			cSkip += cx;
+			continue;
+		}
+
+		// A bit for every pixel that changed, to find the next one fast.
+		DWORD dwChanged = 0;
+
+		for(int i = 0; i < cx; i++) {
+			dwChanged |= (DWORD)(LoadTilePixel<BYTES>(pNew + i * BYTES) != LoadTilePixel<BYTES>(pOld + i * BYTES)) << i;
+		}
+
+		while(x < cx) {
+			DWORD dwNext = dwChanged >> x;
+
+			if(!dwNext) {
+				cSkip += cx - x;
+				break;
+			}
+
+			int cSame = CountTrailingZeros(dwNext);
+
+			cSkip += cSame;
+			x += cSame;
+
+			for(; cSkip > 0; cSkip -= 64) {
+				*p++ = (BYTE)(FRAMECODE_SKIP | ((cSkip < 64 ? cSkip : 64) - 1));
+			}
+
+			cSkip = 0;
+
+			DWORD c = LoadTilePixel<BYTES>(pNew + x * BYTES);
+			int j = x + 1;
+
+			while(j < cx && j - x < 64 && LoadTilePixel<BYTES>(pNew + j * BYTES) == c) {
+				j++;
+			}
+
+			if(j - x > 1) {
+				*p++ = (BYTE)(FRAMECODE_RUN | (j - x - 1));
+				memcpy(p, pNew + x * BYTES, BYTES);
+				p += BYTES;
+			}
+			else {
+				// Up to the next pixel that didn't change, or the next
+				// two that are the same.
+				while(j < cx && j - x < 128 && ((dwChanged >> j) & 1) &&
+					(j + 1 == cx || LoadTilePixel<BYTES>(pNew + (j + 1) * BYTES) != LoadTilePixel<BYTES>(pNew + j * BYTES))) {
+					j++;
+				}
+
+				*p++ = (BYTE)(FRAMECODE_LITERAL | (j - x - 1));
+				memcpy(p, pNew + x * BYTES, (size_t)(j - x) * BYTES);
+				p += (j - x) * BYTES;
+			}
+
+			x = j;
+		}
+	}
+
+	return p - pDst;
+}
+
+static inline size_t EncodeTile(const BYTE* pNew, int iNewPitch, const BYTE* pOld, int iOldPitch, int iBytes, int cx, int cy, BYTE* pDst)
+{
+	switch(iBytes) {
+	case 1:	return EncodeTilePixels<1>(pNew, iNewPitch, pOld, iOldPitch, cx, cy, pDst);
+	case 2:	return EncodeTilePixels<2>(pNew, iNewPitch, pOld, iOldPitch, cx, cy, pDst);
+	case 3:	return EncodeTilePixels<3>(pNew, iNewPitch, pOld, iOldPitch, cx, cy, pDst);
+	}
+
+	return EncodeTilePixels<4>(pNew, iNewPitch, pOld, iOldPitch, cx, cy, pDst);
+}
+
+// Applies the 'cb' bytes of codes at 'pSrc' to a tile of 'cx' by 'cy'
+// pixels at 'pDst'. Returns FALSE if the codes go past the end of the
+// tile.
+static inline BOOL DecodeTile(BYTE* pDst, int iPitch, int cx, int cy, int iBytes, const BYTE* pSrc, size_t cb)
+{
+	const BYTE* pEnd = pSrc + cb;
+	BYTE* pRow = pDst;
+	int n = cx * cy;
+	int i = 0, x = 0;
+
+	while(pSrc < pEnd) {
+		BYTE bCode = *pSrc++;
+		int c = (bCode & (bCode & FRAMECODE_LITERAL ? 0x7F : 0x3F)) + 1;
+
+		if(c > n - i) {
+			return FALSE;
+		}
+
+		i += c;
+
+		if(!(bCode & (FRAMECODE_LITERAL | FRAMECODE_RUN))) {
+			x = i % cx;
+			pRow = pDst + (size_t)(i / cx) * iPitch;
+			continue;
+		}
+
+		BOOL bLiteral = (bCode & FRAMECODE_LITERAL) != 0;
+
+		if(pEnd - pSrc < (bLiteral ? c : 1) * iBytes) {
+			return FALSE;
+		}
+
+		// A row of the tile at a time.
+		while(c) {
+			int m = c < cx - x ? c : cx - x;
+			BYTE* p = pRow + x * iBytes;
+
+			if(bLiteral) {
+				memcpy(p, pSrc, (size_t)m * iBytes);
+				pSrc += m * iBytes;
+			}
+			else {
+				for(int k = 0; k < m; k++, p += iBytes) {
+					memcpy(p, pSrc, iBytes);
+				}
+			}
+
+			c -= m;
+			x += m;
+
+			if(x == cx) {
+				x = 0;
+				pRow += iPitch;
+			}
+		}
+
+		if(!bLiteral) {
+			pSrc += iBytes;
+		}
+	}
+
+	return TRUE;
+}
+
+static inline int GetFrameStreamBpp(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return 8;
+	case DIBFMT_RGB555:	return 15;
+	case DIBFMT_RGB565:	return 16;
+	case DIBFMT_BGR24:	return 24;
+	case DIBFMT_XRGB32:	return 32;
+	}
+
+	return 0;
+}
+
+//
+// Encoder.
+//
+
+typedef struct tagFRAMEENCODER {
+	DIBSURFACE		last;			// The frame as the viewer has it
+	int				iBytes;
+	int				cxTiles;
+	int				cyTiles;
+	BYTE*			pCompare;		// One per tile, TRUE if it may have changed
+	LPTILEEQUALPROC	lpfnEqual;
+	DWORD			dwFrame;
+	BYTE*			pData;			// The frame 'EncodeFrame' encoded last
+	size_t			cbData;
+	size_t			cbAlloc;
+	FRAMESTREAMHEADER	header;
+} FRAMEENCODER, *LPFRAMEENCODER;
+
+static inline void FreeFrameEncoder(LPFRAMEENCODER lpEncoder)
+{
+	FreeDIBSurface(&lpEncoder->last);
+	free(lpEncoder->pCompare);
+	free(lpEncoder->pData);
+
+	lpEncoder->pCompare = NULL;
+	lpEncoder->pData = NULL;
+}
+
+// Sets up an encoder for frames like 'lpSurface', and the stream header
+// in 'header'. It has to be freed with 'FreeFrameEncoder', even if this
+// fails.
+static inline BOOL CreateFrameEncoder(LPFRAMEENCODER lpEncoder, const DIBSURFACE* lpSurface)
+{
+	int iBpp = GetFrameStreamBpp(lpSurface->iFormat);
+
+	ZeroMemory(&lpEncoder->last, sizeof(DIBSURFACE));
+	lpEncoder->pCompare = NULL;
+	lpEncoder->pData = NULL;
+
+	if(!iBpp || lpSurface->cx <= 0 || lpSurface->cy <= 0 || lpSurface->cx > (0xFFFF << FRAMESTREAM_TILE_SHIFT) || lpSurface->cy > (0xFFFF << FRAMESTREAM_TILE_SHIFT)) {
+		return FALSE;
+	}
+
+	// Black, like the decoder starts out.
+	if(!CreateDIBSurface(&lpEncoder->last, lpSurface->cx, lpSurface->cy, iBpp, DIBALLOC_CACHELINE)) {
+		return FALSE;
+	}
+
+	lpEncoder->iBytes = GetDIBFormatBytes(lpSurface->iFormat);
+	lpEncoder->cxTiles = (lpSurface->cx + FRAMESTREAM_TILE_SIZE - 1) >> FRAMESTREAM_TILE_SHIFT;
+	lpEncoder->cyTiles = (lpSurface->cy + FRAMESTREAM_TILE_SIZE - 1) >> FRAMESTREAM_TILE_SHIFT;
+	lpEncoder->lpfnEqual = GetTileEqualProc(GetCPUFeatures());
+	lpEncoder->dwFrame = 0;
+	lpEncoder->cbData = 0;
+
+	// Every tile stored as it is, and room for the codes of one more
+	// before we find out they are too long.
+	lpEncoder->cbAlloc = sizeof(FRAMEHEADER) + (size_t)lpEncoder->cxTiles * lpEncoder->cyTiles * sizeof(FRAMETILE) + (size_t)lpSurface->cx * lpSurface->cy * lpEncoder->iBytes + FRAMESTREAM_TILE_PIXELS * 4 * 2;
+
+	if((lpEncoder->pCompare = (BYTE*)malloc((size_t)lpEncoder->cxTiles * lpEncoder->cyTiles)) == NULL) {
+		return FALSE;
+	}
+
+	if((lpEncoder->pData = (BYTE*)malloc(lpEncoder->cbAlloc)) == NULL) {
+		return FALSE;
+	}
+
+	ZeroMemory(&lpEncoder->header, sizeof(FRAMESTREAMHEADER));
+	lpEncoder->header.dwMagic = FRAMESTREAM_MAGIC;
+	lpEncoder->header.cx = lpSurface->cx;
+	lpEncoder->header.cy = lpSurface->cy;
+	lpEncoder->header.iBpp = iBpp;
+
+	if(lpSurface->iFormat == DIBFMT_INDEX8) {
+		int iColors = lpSurface->lpBmi->bmiHeader.biClrUsed ? lpSurface->lpBmi->bmiHeader.biClrUsed : 256;
+
+		memcpy(lpEncoder->header.palette, lpSurface->lpBmi->bmiColors, sizeof(RGBQUAD) * (iColors < 256 ? iColors : 256));
+	}
+
+	return TRUE;
+}
+
+// Encodes 'lpSurface', which has to be the size and format the encoder
+// was made for, as the next frame. 'lpRects' are the 'cRects' parts of it
+// that may have changed since the last one, NULL if any of it may have.
+// The frame ends up in 'pData', and its size, which is also returned, in
+// 'cbData'.
+static inline size_t EncodeFrame(LPFRAMEENCODER lpEncoder, const DIBSURFACE* lpSurface, const RECT* lpRects, int cRects)
+{
+	LPDIBSURFACE lpLast = &lpEncoder->last;
+	LPFRAMEHEADER lpHeader = (LPFRAMEHEADER)lpEncoder->pData;
+	BYTE* p = lpEncoder->pData + sizeof(FRAMEHEADER);
+	int iBytes = lpEncoder->iBytes;
+	DWORD cTiles = 0;
+
+	if(!lpRects) {
+		memset(lpEncoder->pCompare, TRUE, (size_t)lpEncoder->cxTiles * lpEncoder->cyTiles);
+	}
+	else {
+		ZeroMemory(lpEncoder->pCompare, (size_t)lpEncoder->cxTiles * lpEncoder->cyTiles);
+
+		for(int i = 0; i < cRects; i++) {
+			int left = lpRects[i].left > 0 ? lpRects[i].left : 0;
+			int top = lpRects[i].top > 0 ? lpRects[i].top : 0;
+			int right = lpRects[i].right < lpSurface->cx ? lpRects[i].right : lpSurface->cx;
+			int bottom = lpRects[i].bottom < lpSurface->cy ? lpRects[i].bottom : lpSurface->cy;
+
+			if(left >= right || top >= bottom) {
+				continue;
+			}
+
+			for(int ty = top >> FRAMESTREAM_TILE_SHIFT; ty <= (bottom - 1) >> FRAMESTREAM_TILE_SHIFT; ty++) {
+				memset(lpEncoder->pCompare + ty * lpEncoder->cxTiles + (left >> FRAMESTREAM_TILE_SHIFT), TRUE, ((right - 1) >> FRAMESTREAM_TILE_SHIFT) - (left >> FRAMESTREAM_TILE_SHIFT) + 1);
+			}
+		}
+	}
+
+	for(int ty = 0; ty < lpEncoder->cyTiles; ty++) {
+		int top = ty << FRAMESTREAM_TILE_SHIFT;
+		int cy = lpSurface->cy - top < FRAMESTREAM_TILE_SIZE ? lpSurface->cy - top : FRAMESTREAM_TILE_SIZE;
+
+		for(int tx = 0; tx < lpEncoder->cxTiles; tx++) {
+			int left = tx << FRAMESTREAM_TILE_SHIFT;
+			int cx = lpSurface->cx - left < FRAMESTREAM_TILE_SIZE ? lpSurface->cx - left : FRAMESTREAM_TILE_SIZE;
+			const BYTE* pNew = lpSurface->pTop + (size_t)top * lpSurface->iPitch + left * iBytes;
+			BYTE* pOld = lpLast->pTop + (size_t)top * lpLast->iPitch + left * iBytes;
+
+			if(!lpEncoder->pCompare[ty * lpEncoder->cxTiles + tx] || lpEncoder->lpfnEqual(pNew, lpSurface->iPitch, pOld, lpLast->iPitch, cx * iBytes, cy)) {
+				continue;
+			}
+
+			FRAMETILE tile;
+			BYTE* pTileData = p + sizeof(FRAMETILE);
+			size_t cbRaw = (size_t)cx * cy * iBytes;
+
+			size_t cb = EncodeTile(pNew, lpSurface->iPitch, pOld, lpLast->iPitch, iBytes, cx, cy, pTileData);
+
+			if(cb >= cbRaw) {
+				for(int y = 0; y < cy; y++) {
+					memcpy(pTileData + (size_t)y * cx * iBytes, pNew + (size_t)y * lpSurface->iPitch, (size_t)cx * iBytes);
+				}
+
+				cb = cbRaw | FRAMETILE_RAW;
+			}
+
+			// Tiles follow each other without padding.
+			tile.tx = (WORD)tx;
+			tile.ty = (WORD)ty;
+			tile.dwSize = (DWORD)cb;
+			memcpy(p, &tile, sizeof(FRAMETILE));
+			p = pTileData + (cb & ~FRAMETILE_RAW);
+			cTiles++;
+
+			for(int y = 0; y < cy; y++) {
+				memcpy(pOld + (size_t)y * lpLast->iPitch, pNew + (size_t)y * lpSurface->iPitch, (size_t)cx * iBytes);
+			}
+		}
+	}
+
+	lpHeader->dwMagic = FRAMESTREAM_FRAME;
+	lpHeader->dwFrame = ++lpEncoder->dwFrame;
+	lpHeader->cTiles = cTiles;
+	lpHeader->cbData = (DWORD)(p - lpEncoder->pData - sizeof(FRAMEHEADER));
+
+	lpEncoder->cbData = p - lpEncoder->pData;
+	return lpEncoder->cbData;
+}
+
+//
+// Decoder.
+//
+
+typedef struct tagFRAMEDECODER {
+	LPBITMAPINFO	lpBmi;			// The frame, from 'CreateDIB'
+	BYTE*			pBits;
+	DIBSURFACE		surface;		// The same as a surface
+	int				iBytes;
+	DWORD			dwFrame;		// Last frame decoded
+	BYTE*			pData;			// Frames read by 'ReadFrame'
+	size_t			cbAlloc;
+	BOOL			bEnd;			// The stream ended between two frames
+} FRAMEDECODER, *LPFRAMEDECODER;
+
+static inline void FreeFrameDecoder(LPFRAMEDECODER lpDecoder)
+{
+	FreeDIB(lpDecoder->lpBmi);
+	free(lpDecoder->pData);
+
+	lpDecoder->lpBmi = NULL;
+	lpDecoder->pData = NULL;
+}
+
+// Makes the DIB for the frames of a stream that starts with 'lpHeader'.
+static inline BOOL CreateFrameDecoder(LPFRAMEDECODER lpDecoder, const FRAMESTREAMHEADER* lpHeader)
+{
+	ZeroMemory(lpDecoder, sizeof(FRAMEDECODER));
+
+	if(lpHeader->dwMagic != FRAMESTREAM_MAGIC || lpHeader->cx <= 0 || lpHeader->cy <= 0 || lpHeader->cx > (0xFFFF << FRAMESTREAM_TILE_SHIFT) || lpHeader->cy > (0xFFFF << FRAMESTREAM_TILE_SHIFT)) {
+		return FALSE;
+	}
+
+	switch(lpHeader->iBpp) {
+	case 8: case 15: case 16: case 24: case 32:
+		break;
+
+	default:
+		return FALSE;
+	}
+
+	if((lpDecoder->lpBmi = CreateDIB(lpHeader->cx, lpHeader->cy, lpHeader->iBpp, lpDecoder->pBits)) == NULL) {
+		return FALSE;
+	}
+
+	if(lpHeader->iBpp == 8) {
+		memcpy(lpDecoder->lpBmi->bmiColors, lpHeader->palette, sizeof(RGBQUAD) * 256);
+	}
+
+	if(!InitDIBSurface(&lpDecoder->surface, lpDecoder->lpBmi, lpDecoder->pBits)) {
+		FreeFrameDecoder(lpDecoder);
+		return FALSE;
+	}
+
+	lpDecoder->iBytes = GetDIBFormatBytes(lpDecoder->surface.iFormat);
+	return TRUE;
+}
+
+// Applies a frame, 'lpHeader' and the 'cbData' bytes of tiles at 'pData'
+// after it, to the DIB. Returns FALSE if it is damaged; the tiles before
+// the damage have been applied by then.
+static inline BOOL DecodeFrame(LPFRAMEDECODER lpDecoder, const FRAMEHEADER* lpHeader, const BYTE* pData)
+{
+	LPDIBSURFACE lpSurface = &lpDecoder->surface;
+	const BYTE* pEnd = pData + lpHeader->cbData;
+	int iBytes = lpDecoder->iBytes;
+
+	if(lpHeader->dwMagic != FRAMESTREAM_FRAME) {
+		return FALSE;
+	}
+
+	for(DWORD i = 0; i < lpHeader->cTiles; i++) {
+		FRAMETILE tile;
+
+		if((size_t)(pEnd - pData) < sizeof(FRAMETILE)) {
+			return FALSE;
+		}
+
+		memcpy(&tile, pData, sizeof(FRAMETILE));
+		pData += sizeof(FRAMETILE);
+
+		int left = tile.tx << FRAMESTREAM_TILE_SHIFT;
+		int top = tile.ty << FRAMESTREAM_TILE_SHIFT;
+		size_t cb = tile.dwSize & ~FRAMETILE_RAW;
+
+		if(left >= lpSurface->cx || top >= lpSurface->cy || (size_t)(pEnd - pData) < cb) {
+			return FALSE;
+		}
+
+		int cx = lpSurface->cx - left < FRAMESTREAM_TILE_SIZE ? lpSurface->cx - left : FRAMESTREAM_TILE_SIZE;
+		int cy = lpSurface->cy - top < FRAMESTREAM_TILE_SIZE ? lpSurface->cy - top : FRAMESTREAM_TILE_SIZE;
+		BYTE* pDst = lpSurface->pTop + (size_t)top * lpSurface->iPitch + left * iBytes;
+
+		if(tile.dwSize & FRAMETILE_RAW) {
+			if(cb != (size_t)cx * cy * iBytes) {
+				return FALSE;
+			}
+
+			for(int y = 0; y < cy; y++) {
+				memcpy(pDst + (size_t)y * lpSurface->iPitch, pData + (size_t)y * cx * iBytes, (size_t)cx * iBytes);
+			}
+		}
+		else {
+			if(!DecodeTile(pDst, lpSurface->iPitch, cx, cy, iBytes, pData, cb)) {
+				return FALSE;
+			}
+		}
+
+		pData += cb;
+	}
+
+	lpDecoder->dwFrame = lpHeader->dwFrame;
+	return TRUE;
+}
+
+//
+// Reading streams.
+//
+
+static inline BOOL ReadFrameStreamHeader(FILE* pFile, LPFRAMESTREAMHEADER lpHeader)
+{
+	return fread(lpHeader, sizeof(FRAMESTREAMHEADER), 1, pFile) == 1 && lpHeader->dwMagic == FRAMESTREAM_MAGIC;
+}
+
+// Reads the next frame from 'pFile' into 'pData', its header into
+// 'lpHeader', without decoding it. Returns FALSE at the end of the stream
+// and if the frame is damaged. Only a stream that ends right after a
+// whole frame sets 'bEnd'; one that is cut off in the middle of a frame
+// hits the end of the file as well, but that frame is damaged.
+static inline BOOL ReadFrameData(LPFRAMEDECODER lpDecoder, FILE* pFile, LPFRAMEHEADER lpHeader)
+{
+	size_t cbHeader = fread(lpHeader, 1, sizeof(FRAMEHEADER), pFile);
+
+	lpDecoder->bEnd = cbHeader == 0 && feof(pFile);
+
+	if(cbHeader != sizeof(FRAMEHEADER) || lpHeader->dwMagic != FRAMESTREAM_FRAME) {
+		return FALSE;
+	}
+
+	// Nothing bigger than every tile stored as it is.
+	size_t cbMax = (size_t)((lpDecoder->surface.cx + FRAMESTREAM_TILE_SIZE - 1) >> FRAMESTREAM_TILE_SHIFT) * ((lpDecoder->surface.cy + FRAMESTREAM_TILE_SIZE - 1) >> FRAMESTREAM_TILE_SHIFT) * sizeof(FRAMETILE) + (size_t)lpDecoder->surface.cx * lpDecoder->surface.cy * lpDecoder->iBytes;
+
+	if(lpHeader->cbData > cbMax) {
+		return FALSE;
+	}
+
+	if(lpHeader->cbData > lpDecoder->cbAlloc) {
+		BYTE* pData = (BYTE*)realloc(lpDecoder->pData, lpHeader->cbData);
+
+		if(!pData) {
+			return FALSE;
+		}
+
+		lpDecoder->pData = pData;
+		lpDecoder->cbAlloc = lpHeader->cbData;
+	}
+
+	return lpHeader->cbData == 0 || fread(lpDecoder->pData, lpHeader->cbData, 1, pFile) == 1;
+}
+
+// Reads the next frame and decodes it. Returns FALSE at the end of the
+// stream, when 'bEnd' is set, or if the frame is damaged.
+static inline BOOL ReadFrame(LPFRAMEDECODER lpDecoder, FILE* pFile)
+{
+	FRAMEHEADER header;
+
+	return ReadFrameData(lpDecoder, pFile, &header) && DecodeFrame(lpDecoder, &header, lpDecoder->pData);
+}
+
+//
+// TCP connections.
+//
+
+#ifndef _WIN32
+
+// Connects to a viewer listening on 'lpszHost' and 'lpszPort'. Returns
+// NULL if nobody is.
+//
+// Writing to a connection the viewer has closed raises SIGPIPE, and that
+// kills the process before the write can fail. The stream is written
+// through a FILE, so there is no 'send' to pass MSG_NOSIGNAL to, and the
+// signal is ignored for the whole process instead: a closed viewer then
+// shows up as a failed 'fwrite', which the presenter reports.
+static inline FILE* ConnectFrameStream(LPCSTR lpszHost, LPCSTR lpszPort)
+{
+	struct addrinfo hints, *lpResult;
+	int fd = -1;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	ZeroMemory(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if(getaddrinfo(lpszHost, lpszPort, &hints, &lpResult) != 0) {
+		return NULL;
+	}
+
+	for(struct addrinfo* lpAddr = lpResult; lpAddr && fd < 0; lpAddr = lpAddr->ai_next) {
+		if((fd = socket(lpAddr->ai_family, lpAddr->ai_socktype, lpAddr->ai_protocol)) >= 0 && connect(fd, lpAddr->ai_addr, lpAddr->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(lpResult);
+
+	if(fd < 0) {
+		return NULL;
+	}
+
+	// Every frame is flushed as soon as it is encoded, don't let it wait
+	// for more.
+	int iNoDelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+
+	FILE* pFile = fdopen(fd, "wb");
+
+	if(!pFile) {
+		close(fd);
+	}
+
+	return pFile;
+}
+
+// Waits for a stream to connect to 'lpszPort' and returns the connection.
+static inline FILE* AcceptFrameStream(LPCSTR lpszPort)
+{
+	struct sockaddr_in addr;
+	int fdListen, fd, iReuse = 1;
+
+	if((fdListen = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return NULL;
+	}
+
+	setsockopt(fdListen, SOL_SOCKET, SO_REUSEADDR, &iReuse, sizeof(iReuse));
+
+	ZeroMemory(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)atoi(lpszPort));
+
+	if(bind(fdListen, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fdListen, 1) != 0) {
+		close(fdListen);
+		return NULL;
+	}
+
+	fd = accept(fdListen, NULL, NULL);
+	close(fdListen);
+
+	if(fd < 0) {
+		return NULL;
+	}
+
+	FILE* pFile = fdopen(fd, "rb");
+
+	if(!pFile) {
+		close(fd);
+	}
+
+	return pFile;
+}
+
+#endif // _WIN32
+
+#endif // FRAMESTREAM_H
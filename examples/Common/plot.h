@@ -0,0 +1,214 @@
+
+#ifndef PLOT_H
+#define PLOT_H
+
+// Plotting many pixels at once.
+//
+// 'CSurface::PutPixel' is fine for a pixel here and there, but particle
+// systems and plots write millions of them per frame. 'PutPixels' takes
+// them in three separate arrays, one with the x-coordinates, one with the
+// y-coordinates and one with the colors as XRGB. Laid out like that the
+// work can be done for eight pixels at a time with AVX2: clipping them
+// against the surface, working out where they go in memory and packing
+// their colors into the format of the surface. There is no instruction
+// to write eight pixels to eight different addresses in AVX2, so they are
+// then written one by one, straight from the registers. Pixels that were
+// clipped are written to a scratch pixel instead of being skipped, which
+// costs less than branching on every one of them.
+//
+// Pixels outside the surface are skipped, and if the surface has a dirty
+// region every pixel that is drawn is marked in it.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "cpu.h"
+
+template<class FORMAT>
+static inline int PutPixels_C(LPDIBSURFACE lpSurface, const int* px, const int* py, const DWORD* pColors, int cPixels)
+{
+	BYTE* pTop = lpSurface->pTop;
+	int iPitch = lpSurface->iPitch;
+	unsigned cx = (unsigned)lpSurface->cx;
+	unsigned cy = (unsigned)lpSurface->cy;
+	LPDIRTYREGION lpDirty = lpSurface->lpDirty;
+	int cDrawn = 0;
+
+	for(int i = 0; i < cPixels; i++) {
+		// Negative coordinates become very big ones, so this clips on all
+		// four sides.
+		if((unsigned)px[i] >= cx || (unsigned)py[i] >= cy) {
+			continue;
+		}
+
+		FORMAT::Store(pTop + (ptrdiff_t)py[i] * iPitch, px[i], FORMAT::FromXRGB(pColors[i]));
+
+		if(lpDirty) {
+			MarkDirtyPixel(lpDirty, px[i], py[i]);
+		}
+
+		cDrawn++;
+	}
+
+	return cDrawn;
+}
+
+#ifdef CPU_X86
+
+static inline int CountBits(unsigned uMask)
+{
+	int c = 0;
+
+	for(; uMask; uMask &= uMask - 1) {
+		c++;
+	}
+
+	return c;
+}
+
+// Packs eight XRGB colors into the format of the surface, each in the
+// low bits of its own DWORD.
+template<class FORMAT>
+CPU_TARGET("avx2") static inline __m256i PackPixels_AVX2(__m256i c);
+
+template<>
+CPU_TARGET("avx2") inline __m256i PackPixels_AVX2<PF_INDEX8>(__m256i c)
+{
+	__m256i mask = _mm256_set1_epi32(0xFF);
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(c, 16), mask);
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(c, 8), mask);
+	__m256i b = _mm256_and_si256(c, mask);
+
+	r = _mm256_mullo_epi32(r, _mm256_set1_epi32(77));
+	g = _mm256_mullo_epi32(g, _mm256_set1_epi32(150));
+	b = _mm256_mullo_epi32(b, _mm256_set1_epi32(29));
+
+	return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(r, g), b), 8);
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i PackPixels_AVX2<PF_RGB555>(__m256i c)
+{
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(c, 9), _mm256_set1_epi32(0x7C00));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(c, 6), _mm256_set1_epi32(0x03E0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(c, 3), _mm256_set1_epi32(0x001F));
+
+	return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i PackPixels_AVX2<PF_RGB565>(__m256i c)
+{
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(c, 8), _mm256_set1_epi32(0xF800));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(c, 5), _mm256_set1_epi32(0x07E0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(c, 3), _mm256_set1_epi32(0x001F));
+
+	return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i PackPixels_AVX2<PF_BGR24>(__m256i c)
+{
+	return _mm256_and_si256(c, _mm256_set1_epi32(0x00FFFFFF));
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i PackPixels_AVX2<PF_XRGB32>(__m256i c)
+{
+	return _mm256_and_si256(c, _mm256_set1_epi32(0x00FFFFFF));
+}
+
+// Writes four of them, straight from the registers.
+template<class FORMAT>
+CPU_TARGET("avx2") static inline void StorePixels_AVX2(unsigned uMask, BYTE* pTop, BYTE* pSink, __m128i offsets, __m128i pixels)
+{
+	typedef typename FORMAT::PIXEL PIXEL;
+
+	FORMAT::Store((uMask & 1 ? pTop : pSink) + _mm_cvtsi128_si32(offsets), 0, (PIXEL)_mm_cvtsi128_si32(pixels));
+	FORMAT::Store((uMask & 2 ? pTop : pSink) + _mm_extract_epi32(offsets, 1), 0, (PIXEL)_mm_extract_epi32(pixels, 1));
+	FORMAT::Store((uMask & 4 ? pTop : pSink) + _mm_extract_epi32(offsets, 2), 0, (PIXEL)_mm_extract_epi32(pixels, 2));
+	FORMAT::Store((uMask & 8 ? pTop : pSink) + _mm_extract_epi32(offsets, 3), 0, (PIXEL)_mm_extract_epi32(pixels, 3));
+}
+
+template<class FORMAT>
+CPU_TARGET("avx2") static int PutPixels_AVX2(LPDIBSURFACE lpSurface, const int* px, const int* py, const DWORD* pColors, int cPixels)
+{
+	BYTE* pTop = lpSurface->pTop;
+	LPDIRTYREGION lpDirty = lpSurface->lpDirty;
+	BYTE sink[4];
+	int cDrawn = 0;
+	int i = 0;
+
+	// Comparing unsigned numbers is done by flipping the sign bit and
+	// comparing them signed, AVX2 only has the latter.
+	__m256i sign = _mm256_set1_epi32((int)0x80000000);
+	__m256i cx = _mm256_xor_si256(_mm256_set1_epi32(lpSurface->cx), sign);
+	__m256i cy = _mm256_xor_si256(_mm256_set1_epi32(lpSurface->cy), sign);
+	__m256i pitch = _mm256_set1_epi32(lpSurface->iPitch);
+	__m256i bytes = _mm256_set1_epi32(FORMAT::BYTES);
+
+	for(; i + 8 <= cPixels; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(px + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*)(py + i));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(pColors + i));
+
+		__m256i inside = _mm256_and_si256(_mm256_cmpgt_epi32(cx, _mm256_xor_si256(x, sign)), _mm256_cmpgt_epi32(cy, _mm256_xor_si256(y, sign)));
+		unsigned uMask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(inside));
+
+		if(!uMask) {
+			continue;
+		}
+
+		// Pixels that were clipped get offset 0 and are written to 'sink'
+		// instead of the surface, so all eight can be written without
+		// deciding anything per pixel.
+		__m256i offsets = _mm256_and_si256(inside, _mm256_add_epi32(_mm256_mullo_epi32(y, pitch), _mm256_mullo_epi32(x, bytes)));
+		__m256i pixels = PackPixels_AVX2<FORMAT>(c);
+
+		StorePixels_AVX2<FORMAT>(uMask, pTop, sink, _mm256_castsi256_si128(offsets), _mm256_castsi256_si128(pixels));
+		StorePixels_AVX2<FORMAT>(uMask >> 4, pTop, sink, _mm256_extracti128_si256(offsets, 1), _mm256_extracti128_si256(pixels, 1));
+
+		if(lpDirty) {
+			for(int j = 0; j < 8; j++) {
+				if((uMask >> j) & 1) {
+					MarkDirtyPixel(lpDirty, px[i + j], py[i + j]);
+				}
+			}
+		}
+
+		cDrawn += CountBits(uMask);
+	}
+
+	return cDrawn + PutPixels_C<FORMAT>(lpSurface, px + i, py + i, pColors + i, cPixels - i);
+}
+
+#endif // CPU_X86
+
+// Draws 'cPixels' pixels at ('px[i]', 'py[i]') with color 'pColors[i]',
+// given as XRGB. Returns how many of them were on the surface.
+template<class FORMAT>
+static inline int PutPixels(LPDIBSURFACE lpSurface, const int* px, const int* py, const DWORD* pColors, int cPixels)
+{
+#ifdef CPU_X86
+	if(GetCPUFeatures() & CPU_AVX2) {
+		return PutPixels_AVX2<FORMAT>(lpSurface, px, py, pColors, cPixels);
+	}
+#endif
+
+	return PutPixels_C<FORMAT>(lpSurface, px, py, pColors, cPixels);
+}
+
+// The same for a surface of which the format is only known at runtime.
+static inline int PutDIBPixels(LPDIBSURFACE lpSurface, const int* px, const int* py, const DWORD* pColors, int cPixels)
+{
+	switch(lpSurface->iFormat) {
+	case DIBFMT_INDEX8:	return PutPixels<PF_INDEX8>(lpSurface, px, py, pColors, cPixels);
+	case DIBFMT_RGB555:	return PutPixels<PF_RGB555>(lpSurface, px, py, pColors, cPixels);
+	case DIBFMT_RGB565:	return PutPixels<PF_RGB565>(lpSurface, px, py, pColors, cPixels);
+	case DIBFMT_BGR24:	return PutPixels<PF_BGR24>(lpSurface, px, py, pColors, cPixels);
+	case DIBFMT_XRGB32:	return PutPixels<PF_XRGB32>(lpSurface, px, py, pColors, cPixels);
+	}
+
+	return 0;
+}
+
+#endif // PLOT_H
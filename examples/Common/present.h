@@ -0,0 +1,623 @@
+
+#ifndef PRESENT_H
+#define PRESENT_H
+
+// Presenting frames without a window.
+//
+// In the examples a frame ends up on the screen through GDI. To run the
+// same drawing code where there is no screen, a frame is handed to a
+// presenter instead. There are these:
+//
+//   null         Does nothing but count the bytes a blit of the changed
+//                rectangles would have copied. Use this to measure the
+//                drawing code by itself, under 'perf' for example.
+//   ppm:<file>   Appends every frame as a binary PPM image to a file,
+//   raw:<file>   or as raw scanlines in the format of the surface. Both
+//                can be played back with ffmpeg.
+//   shm:<name>   Copies every frame into a ring of frames in shared
+//                memory another process can read from, see
+//                'OpenSharedFrames'.
+//   stream:<file>      Writes only the tiles that changed, coded with
+//   tcp:<host>:<port>  framestream.h, to a file or to a viewer listening
+//                      on that port. TCP isn't there on Windows.
+//
+// 'CreatePresenter' makes one from such a string. 'FRAMESTATS' keeps
+// track of how long frames take and how many bytes were presented.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "convert.h"
+#include "framestream.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+//
+// Frame statistics.
+//
+
+typedef struct tagFRAMESTATS {
+	unsigned long long	cFrames;
+	unsigned long long	cbPresented;	// All frames together
+	double				dStartMs;		// When the current frame started
+	double				dLastMs;		// Time the last frame took
+	double				dMinMs;
+	double				dMaxMs;
+	double				dTotalMs;
+} FRAMESTATS, *LPFRAMESTATS;
+
+static inline double GetTimeMs()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void InitFrameStats(LPFRAMESTATS lpStats)
+{
+	ZeroMemory(lpStats, sizeof(FRAMESTATS));
+	lpStats->dStartMs = GetTimeMs();
+}
+
+// Ends a frame and starts the next one. A frame lasts from one call to
+// the next, so everything in between is counted: drawing as well as
+// presenting.
+static inline void EndFrame(LPFRAMESTATS lpStats, long long cbPresented)
+{
+	double dNow = GetTimeMs();
+	double dFrame = dNow - lpStats->dStartMs;
+
+	if(lpStats->cFrames == 0 || dFrame < lpStats->dMinMs) {
+		lpStats->dMinMs = dFrame;
+	}
+
+	if(dFrame > lpStats->dMaxMs) {
+		lpStats->dMaxMs = dFrame;
+	}
+
+	lpStats->cFrames++;
+	lpStats->cbPresented += cbPresented > 0 ? cbPresented : 0;
+	lpStats->dLastMs = dFrame;
+	lpStats->dTotalMs += dFrame;
+	lpStats->dStartMs = dNow;
+}
+
+//
+// Presenters.
+//
+
+class CPresenter {
+public:
+	virtual ~CPresenter()
+	{
+	}
+
+	// Presents 'lpSurface'. 'lpRects' are the 'cRects' parts of it that
+	// changed since the last frame; NULL means all of it. Returns the
+	// number of bytes presented or -1 if something went wrong.
+	virtual long long Present(const DIBSURFACE* lpSurface, const RECT* lpRects, int cRects) = 0;
+};
+
+class CNullPresenter : public CPresenter {
+public:
+	long long Present(const DIBSURFACE* lpSurface, const RECT* lpRects, int cRects)
+	{
+		long long cb = 0;
+		int iBytes = GetDIBFormatBytes(lpSurface->iFormat);
+
+		if(!lpRects) {
+			return (long long)lpSurface->cx * lpSurface->cy * iBytes;
+		}
+
+		for(int i = 0; i < cRects; i++) {
+			cb += (long long)(lpRects[i].right - lpRects[i].left) * (lpRects[i].bottom - lpRects[i].top) * iBytes;
+		}
+
+		return cb;
+	}
+};
+
+// Writes whole frames to a file, top scanline first. A PPM frame is
+// converted to 24 bit RGB, a raw frame is written as it is, just without
+// the padding at the end of every scanline.
+class CFilePresenter : public CPresenter {
+public:
+	CFilePresenter(LPCSTR lpszFilename, BOOL bPPM)
+		: m_bPPM(bPPM), m_pRow(NULL), m_cxRow(0)
+	{
+		m_pFile = fopen(lpszFilename, "wb");
+	}
+
+	~CFilePresenter()
+	{
+		if(m_pFile) {
+			fclose(m_pFile);
+		}
+
+		free(m_pRow);
+	}
+
+	BOOL IsOpen() const
+	{
+		return m_pFile != NULL;
+	}
+
+	long long Present(const DIBSURFACE* lpSurface, const RECT*, int)
+	{
+		int iRowBytes = m_bPPM ? lpSurface->cx * 3 : lpSurface->cx * GetDIBFormatBytes(lpSurface->iFormat);
+		long long cb = 0;
+
+		if(!m_pFile) {
+			return -1;
+		}
+
+		if(m_bPPM) {
+			// XRGB and RGB for a scanline, grown when a wider frame comes.
+			if(lpSurface->cx > m_cxRow) {
+				BYTE* pRow = (BYTE*)realloc(m_pRow, (size_t)lpSurface->cx * 7);
+
+				if(!pRow) {
+					return -1;
+				}
+
+				m_pRow = pRow;
+				m_cxRow = lpSurface->cx;
+			}
+
+			cb += fprintf(m_pFile, "P6\n%d %d\n255\n", lpSurface->cx, lpSurface->cy);
+		}
+
+		for(int y = 0; y < lpSurface->cy; y++) {
+			const BYTE* pRow = lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch;
+
+			if(m_bPPM) {
+				pRow = ToRGB(lpSurface, pRow);
+			}
+
+			if(fwrite(pRow, 1, iRowBytes, m_pFile) != (size_t)iRowBytes) {
+				return -1;
+			}
+
+			cb += iRowBytes;
+		}
+
+		return cb;
+	}
+
+protected:
+	// Converts a scanline to the red, green, blue bytes PPM wants, going
+	// through XRGB like every other conversion.
+	const BYTE* ToRGB(const DIBSURFACE* lpSurface, const BYTE* pRow)
+	{
+		DWORD* pXRGB = (DWORD*)m_pRow;
+		BYTE* pRGB = m_pRow + lpSurface->cx * 4;
+		DWORD dwPalette[256];
+
+		if(lpSurface->iFormat == DIBFMT_XRGB32) {
+			pXRGB = (DWORD*)pRow;
+		}
+		else {
+			if(lpSurface->iFormat == DIBFMT_INDEX8) {
+				GetXRGBPalette(lpSurface->lpBmi, dwPalette);
+			}
+
+			GetToXRGBProc(lpSurface->iFormat, GetCPUFeatures())((BYTE*)pXRGB, pRow, lpSurface->cx, dwPalette);
+		}
+
+		for(int x = 0; x < lpSurface->cx; x++) {
+			pRGB[x * 3 + 0] = (BYTE)(pXRGB[x] >> 16);
+			pRGB[x * 3 + 1] = (BYTE)(pXRGB[x] >> 8);
+			pRGB[x * 3 + 2] = (BYTE)pXRGB[x];
+		}
+
+		return pRGB;
+	}
+
+	FILE*	m_pFile;
+	BOOL	m_bPPM;
+	BYTE*	m_pRow;
+	int		m_cxRow;		// Pixels 'm_pRow' has room for
+};
+
+//
+// Shared memory ring.
+//
+// The shared memory starts with a SHAREDRING header, followed by
+// 'cSlots' slots of 'cbSlot' bytes each. A slot starts with its own
+// sequence number and then holds one frame, top scanline first, without
+// padding, in the format of the surface.
+//
+// Frame n (counting from 1) goes into slot (n - 1) % cSlots. While it is
+// being written the sequence number of the slot is 2n - 1, once it is
+// complete it becomes 2n, and then 'uFrames' in the header becomes n. A
+// reader picks the newest frame from 'uFrames', copies it and checks that
+// the sequence number of the slot was 2n before and after copying. If
+// not, the writer lapped it and it tries again. Nobody ever waits for
+// anybody.
+//
+
+#define SHAREDRING_MAGIC	0x474E5253	// 'SRNG'
+
+typedef struct tagSHAREDRING {
+	DWORD								dwMagic;
+	LONG								cx;
+	LONG								cy;
+	LONG								iFormat;
+	LONG								iRowBytes;
+	LONG								cSlots;
+	LONG								cbSlot;
+	LONG								lReserved;
+	std::atomic<unsigned long long>		uFrames;		// Frames written so far
+} SHAREDRING, *LPSHAREDRING;
+
+typedef struct tagSHAREDSLOT {
+	std::atomic<unsigned long long>		uSequence;
+} SHAREDSLOT, *LPSHAREDSLOT;
+
+#define SHAREDRING_HEADER	64		// Bytes before the first slot, and before the frame in a slot
+
+// A mapping of the ring, for both the writer and the readers.
+typedef struct tagSHAREDFRAMES {
+	LPSHAREDRING	lpRing;
+	size_t			cbMapping;
+	BOOL			bOwner;
+#ifdef _WIN32
+	HANDLE			hMapping;
+#else
+	char			szName[256];
+#endif
+} SHAREDFRAMES, *LPSHAREDFRAMES;
+
+static inline LPSHAREDSLOT GetSharedSlot(LPSHAREDRING lpRing, unsigned long long uFrame)
+{
+	return (LPSHAREDSLOT)((BYTE*)lpRing + SHAREDRING_HEADER + (size_t)((uFrame - 1) % lpRing->cSlots) * lpRing->cbSlot);
+}
+
+// Maps 'cb' bytes of the named shared memory, creating it if 'bCreate'.
+// Passing 0 for 'cb' maps all of it.
+static inline BOOL MapSharedFrames(LPSHAREDFRAMES lpFrames, LPCSTR lpszName, size_t cb, BOOL bCreate)
+{
+	ZeroMemory(lpFrames, sizeof(SHAREDFRAMES));
+
+#ifdef _WIN32
+	if(bCreate) {
+		lpFrames->hMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)cb >> 32), (DWORD)cb, lpszName);
+	}
+	else {
+		lpFrames->hMapping = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, lpszName);
+	}
+
+	if(!lpFrames->hMapping) {
+		return FALSE;
+	}
+
+	if((lpFrames->lpRing = (LPSHAREDRING)MapViewOfFile(lpFrames->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, cb)) == NULL) {
+		CloseHandle(lpFrames->hMapping);
+		return FALSE;
+	}
+#else
+	int fd;
+
+	// POSIX wants the name to start with a slash.
+	snprintf(lpFrames->szName, sizeof(lpFrames->szName), "/%s", lpszName);
+
+	if((fd = shm_open(lpFrames->szName, bCreate ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600)) < 0) {
+		return FALSE;
+	}
+
+	if(bCreate && ftruncate(fd, (off_t)cb) != 0) {
+		close(fd);
+		shm_unlink(lpFrames->szName);
+		return FALSE;
+	}
+
+	if(!cb) {
+		off_t cbFile = lseek(fd, 0, SEEK_END);
+		cb = cbFile > 0 ? (size_t)cbFile : 0;
+	}
+
+	void* pMapping = cb ? mmap(NULL, cb, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+	close(fd);
+
+	if(pMapping == MAP_FAILED) {
+		if(bCreate) {
+			shm_unlink(lpFrames->szName);
+		}
+
+		return FALSE;
+	}
+
+	lpFrames->lpRing = (LPSHAREDRING)pMapping;
+#endif
+
+	lpFrames->cbMapping = cb;
+	lpFrames->bOwner = bCreate;
+	return TRUE;
+}
+
+static inline void CloseSharedFrames(LPSHAREDFRAMES lpFrames)
+{
+	if(!lpFrames->lpRing) {
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(lpFrames->lpRing);
+	CloseHandle(lpFrames->hMapping);
+#else
+	munmap(lpFrames->lpRing, lpFrames->cbMapping);
+
+	// Readers that have it mapped keep it until they let go.
+	if(lpFrames->bOwner) {
+		shm_unlink(lpFrames->szName);
+	}
+#endif
+
+	ZeroMemory(lpFrames, sizeof(SHAREDFRAMES));
+}
+
+// Attaches to a ring another process presents to.
+static inline BOOL OpenSharedFrames(LPSHAREDFRAMES lpFrames, LPCSTR lpszName)
+{
+	if(!MapSharedFrames(lpFrames, lpszName, 0, FALSE)) {
+		return FALSE;
+	}
+
+	if(lpFrames->lpRing->dwMagic != SHAREDRING_MAGIC) {
+		CloseSharedFrames(lpFrames);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Copies the newest complete frame to 'pDst', which must hold 'cy' times
+// 'iRowBytes' bytes. Returns its number, or 0 if nothing was presented
+// yet or the writer keeps overtaking us.
+static inline unsigned long long ReadSharedFrame(LPSHAREDFRAMES lpFrames, BYTE* pDst)
+{
+	LPSHAREDRING lpRing = lpFrames->lpRing;
+
+	for(int iTry = 0; iTry < 100; iTry++) {
+		unsigned long long uFrame = lpRing->uFrames.load(std::memory_order_acquire);
+
+		if(uFrame == 0) {
+			return 0;
+		}
+
+		LPSHAREDSLOT lpSlot = GetSharedSlot(lpRing, uFrame);
+
+		if(lpSlot->uSequence.load(std::memory_order_acquire) != uFrame * 2) {
+			continue;
+		}
+
+		memcpy(pDst, (BYTE*)lpSlot + SHAREDRING_HEADER, (size_t)lpRing->iRowBytes * lpRing->cy);
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if(lpSlot->uSequence.load(std::memory_order_relaxed) == uFrame * 2) {
+			return uFrame;
+		}
+	}
+
+	return 0;
+}
+
+class CSharedMemoryPresenter : public CPresenter {
+public:
+	CSharedMemoryPresenter(LPCSTR lpszName, int cSlots)
+		: m_cSlots(cSlots > 1 ? cSlots : 2)
+	{
+		ZeroMemory(&m_Frames, sizeof(m_Frames));
+		snprintf(m_szName, sizeof(m_szName), "%s", lpszName);
+	}
+
+	~CSharedMemoryPresenter()
+	{
+		CloseSharedFrames(&m_Frames);
+	}
+
+	long long Present(const DIBSURFACE* lpSurface, const RECT*, int)
+	{
+		LPSHAREDRING lpRing = m_Frames.lpRing;
+
+		// The ring is made on the first frame, when we know how big a frame is.
+		if(!lpRing) {
+			int iRowBytes = lpSurface->cx * GetDIBFormatBytes(lpSurface->iFormat);
+			long long cbSlot = (SHAREDRING_HEADER + (long long)iRowBytes * lpSurface->cy + 63) & ~63;
+
+			// The ring keeps the slot size in a LONG.
+			if(cbSlot > 0x7FFFFFFF || !MapSharedFrames(&m_Frames, m_szName, SHAREDRING_HEADER + (size_t)cbSlot * m_cSlots, TRUE)) {
+				return -1;
+			}
+
+			lpRing = m_Frames.lpRing;
+			lpRing->cx = lpSurface->cx;
+			lpRing->cy = lpSurface->cy;
+			lpRing->iFormat = lpSurface->iFormat;
+			lpRing->iRowBytes = iRowBytes;
+			lpRing->cSlots = m_cSlots;
+			lpRing->cbSlot = (LONG)cbSlot;
+			lpRing->uFrames.store(0, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			lpRing->dwMagic = SHAREDRING_MAGIC;
+		}
+
+		if(lpSurface->cx != lpRing->cx || lpSurface->cy != lpRing->cy || lpSurface->iFormat != lpRing->iFormat) {
+			return -1;
+		}
+
+		unsigned long long uFrame = lpRing->uFrames.load(std::memory_order_relaxed) + 1;
+		LPSHAREDSLOT lpSlot = GetSharedSlot(lpRing, uFrame);
+		BYTE* pDst = (BYTE*)lpSlot + SHAREDRING_HEADER;
+
+		lpSlot->uSequence.store(uFrame * 2 - 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for(int y = 0; y < lpSurface->cy; y++, pDst += lpRing->iRowBytes) {
+			memcpy(pDst, lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch, lpRing->iRowBytes);
+		}
+
+		lpSlot->uSequence.store(uFrame * 2, std::memory_order_release);
+		lpRing->uFrames.store(uFrame, std::memory_order_release);
+
+		return (long long)lpRing->iRowBytes * lpRing->cy;
+	}
+
+protected:
+	SHAREDFRAMES	m_Frames;
+	char			m_szName[200];
+	int				m_cSlots;
+};
+
+// Encodes every frame with a frame encoder and writes it to a file or a
+// connection. The first frame makes the encoder and writes the stream
+// header as well.
+class CStreamPresenter : public CPresenter {
+public:
+	CStreamPresenter(FILE* pFile)
+		: m_pFile(pFile), m_bStarted(FALSE), m_bFailed(FALSE)
+	{
+	}
+
+	~CStreamPresenter()
+	{
+		if(m_pFile) {
+			fclose(m_pFile);
+		}
+
+		if(m_bStarted) {
+			FreeFrameEncoder(&m_Encoder);
+		}
+	}
+
+	// Once a frame couldn't be presented the stream is no good: it may have
+	// no header, or half a frame in it, and the encoder's copy no longer
+	// matches what the viewer has. Every frame after that fails as well.
+	long long Present(const DIBSURFACE* lpSurface, const RECT* lpRects, int cRects)
+	{
+		long long cb;
+
+		if(!m_pFile || m_bFailed) {
+			return -1;
+		}
+
+		if((cb = PresentFrame(lpSurface, lpRects, cRects)) < 0) {
+			m_bFailed = TRUE;
+		}
+
+		return cb;
+	}
+
+protected:
+	long long PresentFrame(const DIBSURFACE* lpSurface, const RECT* lpRects, int cRects)
+	{
+		long long cb = 0;
+
+		if(!m_bStarted) {
+			m_bStarted = TRUE;
+
+			if(!CreateFrameEncoder(&m_Encoder, lpSurface) || fwrite(&m_Encoder.header, sizeof(FRAMESTREAMHEADER), 1, m_pFile) != 1) {
+				return -1;
+			}
+
+			cb += sizeof(FRAMESTREAMHEADER);
+			lpRects = NULL;
+		}
+
+		if(lpSurface->cx != m_Encoder.header.cx || lpSurface->cy != m_Encoder.header.cy || GetFrameStreamBpp(lpSurface->iFormat) != m_Encoder.header.iBpp) {
+			return -1;
+		}
+
+		size_t cbFrame = EncodeFrame(&m_Encoder, lpSurface, lpRects, cRects);
+
+		// A viewer wants every frame as soon as it is done.
+		if(fwrite(m_Encoder.pData, 1, cbFrame, m_pFile) != cbFrame || fflush(m_pFile) != 0) {
+			return -1;
+		}
+
+		return cb + cbFrame;
+	}
+
+	FILE*			m_pFile;
+	BOOL			m_bStarted;
+	BOOL			m_bFailed;
+	FRAMEENCODER	m_Encoder;
+};
+
+// Makes a presenter from "null", "ppm:<file>", "raw:<file>",
+// "shm:<name>[:<slots>]", "stream:<file>" or "tcp:<host>:<port>". Returns
+// NULL if the string makes no sense, or the file can't be created or
+// nobody listens on the port.
+static inline CPresenter* CreatePresenter(LPCSTR lpszSpec)
+{
+	if(strcmp(lpszSpec, "null") == 0) {
+		return new CNullPresenter();
+	}
+
+	if(strncmp(lpszSpec, "ppm:", 4) == 0 || strncmp(lpszSpec, "raw:", 4) == 0) {
+		CFilePresenter* lpPresenter = new CFilePresenter(lpszSpec + 4, lpszSpec[0] == 'p');
+
+		if(!lpPresenter->IsOpen()) {
+			delete lpPresenter;
+			return NULL;
+		}
+
+		return lpPresenter;
+	}
+
+	if(strncmp(lpszSpec, "shm:", 4) == 0) {
+		char szName[200];
+		int cSlots = 3;
+		const char* pColon = strchr(lpszSpec + 4, ':');
+		size_t cchName = pColon ? (size_t)(pColon - (lpszSpec + 4)) : strlen(lpszSpec + 4);
+
+		if(cchName == 0 || cchName >= sizeof(szName)) {
+			return NULL;
+		}
+
+		memcpy(szName, lpszSpec + 4, cchName);
+		szName[cchName] = '\0';
+
+		if(pColon) {
+			cSlots = atoi(pColon + 1);
+		}
+
+		return new CSharedMemoryPresenter(szName, cSlots);
+	}
+
+	if(strncmp(lpszSpec, "stream:", 7) == 0) {
+		FILE* pFile = fopen(lpszSpec + 7, "wb");
+
+		return pFile ? new CStreamPresenter(pFile) : NULL;
+	}
+
+#ifndef _WIN32
+	if(strncmp(lpszSpec, "tcp:", 4) == 0) {
+		char szHost[200];
+		const char* pColon = strrchr(lpszSpec + 4, ':');
+		size_t cchHost = pColon ? (size_t)(pColon - (lpszSpec + 4)) : 0;
+
+		if(cchHost == 0 || cchHost >= sizeof(szHost)) {
+			return NULL;
+		}
+
+		memcpy(szHost, lpszSpec + 4, cchHost);
+		szHost[cchHost] = '\0';
+
+		FILE* pFile = ConnectFrameStream(szHost, pColon + 1);
+
+		return pFile ? new CStreamPresenter(pFile) : NULL;
+	}
+#endif
+
+	return NULL;
+}
+
+#endif // PRESENT_H
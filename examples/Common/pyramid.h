@@ -0,0 +1,571 @@
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+// Image pyramids.
+//
+// Showing a big image zoomed out means scaling all of it down, on every
+// paint, however few pixels end up on the screen. A pyramid does that
+// work once: level 1 is the image at half the size, level 2 at a quarter
+// and so on, until the whole image fits in one tile. Every level is cut
+// into tiles of 'PYRAMID_TILE_SIZE' pixels square. To draw part of the
+// image at some scale, 'FindPyramidView' picks the smallest level that
+// still has at least as many pixels as the destination, and the tiles of
+// it that are needed. Whatever is left to scale is less than a factor of
+// two, and only for the pixels that are actually shown.
+//
+// Each level is made from the one above it, halving it with a 2 x 2 box
+// or a Lanczos filter with three lobes. The box is quick, Lanczos keeps
+// fine detail sharp without the aliasing picking pixels would give. All
+// the tiles of a level are made at the same time, one task per tile on a
+// thread pool.
+//
+// A pyramid can be saved next to the image, "image.bmp.pyr", as a pack of
+// its tiles (bmppack.h). Opening it again maps the file, so later views
+// skip building it and only read the tiles they draw. Level 0, the image
+// itself, is never in there.
+//
+// Like scale.h, filtering 8bpp surfaces treats the index as a gray level,
+// which is right for the grayscale color table 'CreateDIB' builds.
+
+#include "bmpcache.h"
+#include "bmppack.h"
+#include "convert.h"
+#include "scale.h"
+#include "threadpool.h"
+
+#include <math.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#define	PYRAMID_TILE_SHIFT	8
+#define	PYRAMID_TILE_SIZE	(1 << PYRAMID_TILE_SHIFT)
+#define	PYRAMID_MAX_LEVELS	32
+
+#define	PYRAMID_BOX			0
+#define	PYRAMID_LANCZOS		1
+
+// Lanczos with three lobes reaches 3 destination pixels either way, that
+// is 12 source pixels when halving.
+#define	PYRAMID_MAX_TAPS	12
+
+#define	PYRAMID_EXTENSION	".pyr"
+
+typedef struct tagPYRAMIDLEVEL {
+	int				cx;
+	int				cy;
+	int				cxTiles;
+	int				cyTiles;
+
+	// The whole level, when it was built here rather than opened. For
+	// level 0 that is the caller's image, which isn't ours to free.
+	DIBSURFACE		surface;
+
+	// 'cxTiles' * 'cyTiles' tiles, row by row. Built tiles point into the
+	// surface above and share its BITMAPINFO, so only the format and the
+	// color table of that are right for them. Level 0 has none.
+	LPDIBSURFACE	lpTiles;
+} PYRAMIDLEVEL;
+
+typedef struct tagPYRAMID {
+	int				cx;				// Of the image, level 0
+	int				cy;
+	int				iFormat;
+	int				cLevels;		// Including level 0
+	PYRAMIDLEVEL	levels[PYRAMID_MAX_LEVELS];
+	SURFACEPACK		pack;			// The file it was opened from, if it was
+} PYRAMID, *LPPYRAMID;
+
+// Which level, and which part of it, to draw for a view of the image.
+typedef struct tagPYRAMIDVIEW {
+	int				iLevel;
+	RECT			rcLevel;		// The part of the image asked for, in pixels of the level
+	RECT			rcTiles;		// The tiles that covers, in tiles
+} PYRAMIDVIEW, *LPPYRAMIDVIEW;
+
+static inline void FreePyramid(LPPYRAMID lpPyramid)
+{
+	for(int i = 1; i < lpPyramid->cLevels; i++) {
+		if(lpPyramid->levels[i].surface.lpBmi) {
+			FreeDIBSurface(&lpPyramid->levels[i].surface);
+		}
+
+		free(lpPyramid->levels[i].lpTiles);
+	}
+
+	if(lpPyramid->pack.pBase) {
+		CloseSurfacePack(&lpPyramid->pack);
+	}
+
+	ZeroMemory(lpPyramid, sizeof(PYRAMID));
+}
+
+// Works out the size of every level of a pyramid for an image, and makes
+// room for the tiles.
+static inline BOOL InitPyramid(LPPYRAMID lpPyramid, int cx, int cy, int iFormat)
+{
+	ZeroMemory(lpPyramid, sizeof(PYRAMID));
+
+	if(cx <= 0 || cy <= 0 || !GetDIBFormatBytes(iFormat)) {
+		return FALSE;
+	}
+
+	lpPyramid->cx = cx;
+	lpPyramid->cy = cy;
+	lpPyramid->iFormat = iFormat;
+
+	// Halve it, rounding up, until it fits in one tile.
+	for(int i = 0; i < PYRAMID_MAX_LEVELS; i++) {
+		PYRAMIDLEVEL* lpLevel = &lpPyramid->levels[i];
+
+		lpLevel->cx = cx;
+		lpLevel->cy = cy;
+		lpLevel->cxTiles = (cx + PYRAMID_TILE_SIZE - 1) >> PYRAMID_TILE_SHIFT;
+		lpLevel->cyTiles = (cy + PYRAMID_TILE_SIZE - 1) >> PYRAMID_TILE_SHIFT;
+		lpPyramid->cLevels++;
+
+		if(i > 0 && (lpLevel->lpTiles = (LPDIBSURFACE)calloc((size_t)lpLevel->cxTiles * lpLevel->cyTiles, sizeof(DIBSURFACE))) == NULL) {
+			FreePyramid(lpPyramid);
+			return FALSE;
+		}
+
+		if(cx <= PYRAMID_TILE_SIZE && cy <= PYRAMID_TILE_SIZE) {
+			break;
+		}
+
+		cx = (cx + 1) / 2;
+		cy = (cy + 1) / 2;
+	}
+
+	return TRUE;
+}
+
+static inline const DIBSURFACE* GetPyramidTile(const PYRAMID* lpPyramid, int iLevel, int tx, int ty)
+{
+	const PYRAMIDLEVEL* lpLevel = &lpPyramid->levels[iLevel];
+
+	return lpLevel->lpTiles ? &lpLevel->lpTiles[ty * lpLevel->cxTiles + tx] : NULL;
+}
+
+//
+// Building.
+//
+
+typedef struct tagPYRAMIDJOB {
+	const DIBSURFACE*	lpSrc;		// The level above
+	const PYRAMIDLEVEL*	lpLevel;	// The level being made
+	int					cTaps;
+	int					iOffset;	// First tap, relative to twice the destination pixel
+	short				wTaps[PYRAMID_MAX_TAPS];
+} PYRAMIDJOB;
+
+static inline double Sinc(double x)
+{
+	const double pi = 3.14159265358979323846;
+
+	return x == 0.0 ? 1.0 : sin(pi * x) / (pi * x);
+}
+
+// The taps for halving. A destination pixel covers two source pixels, its
+// center is between them.
+static inline void GetPyramidTaps(PYRAMIDJOB* lpJob, int iFilter)
+{
+	if(iFilter == PYRAMID_BOX) {
+		lpJob->cTaps = 2;
+		lpJob->iOffset = 0;
+		lpJob->wTaps[0] = 1 << (SCALE_BITS - 1);
+		lpJob->wTaps[1] = 1 << (SCALE_BITS - 1);
+		return;
+	}
+
+	double dWeights[PYRAMID_MAX_TAPS], dSum = 0.0;
+	int iSum = 0;
+
+	lpJob->cTaps = PYRAMID_MAX_TAPS;
+	lpJob->iOffset = -(PYRAMID_MAX_TAPS / 2 - 1);
+
+	// Distances from the center, in destination pixels: -2.75 up to 2.75.
+	for(int k = 0; k < PYRAMID_MAX_TAPS; k++) {
+		double d = (lpJob->iOffset + k - 0.5) / 2.0;
+
+		dWeights[k] = Sinc(d) * Sinc(d / 3.0);
+		dSum += dWeights[k];
+	}
+
+	for(int k = 0; k < PYRAMID_MAX_TAPS; k++) {
+		lpJob->wTaps[k] = (short)floor(dWeights[k] / dSum * (1 << SCALE_BITS) + 0.5);
+		iSum += lpJob->wTaps[k];
+	}
+
+	// Rounding may leave us a little off, the two middle taps take it.
+	lpJob->wTaps[PYRAMID_MAX_TAPS / 2 - 1] += (short)(((1 << SCALE_BITS) - iSum) / 2);
+	lpJob->wTaps[PYRAMID_MAX_TAPS / 2] += (short)((1 << SCALE_BITS) - iSum - ((1 << SCALE_BITS) - iSum) / 2);
+}
+
+static inline int ClampPyramid(int i, int n)
+{
+	return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+// Makes one tile of a level from the level above it. Filtered vertically
+// into a scanline of sums first, then horizontally into the tile, like
+// 'ScaleTileFiltered' does. Pixels past the edges repeat the edge.
+template<class FORMAT>
+static inline void PyramidTask(int iTask, int, void* lpParam)
+{
+	const PYRAMIDJOB* lpJob = (const PYRAMIDJOB*)lpParam;
+	const DIBSURFACE* lpSrc = lpJob->lpSrc;
+	const DIBSURFACE* lpDst = &lpJob->lpLevel->lpTiles[iTask];
+	const int iRound = 1 << (SCALE_BITS - 1);
+	int span[(PYRAMID_TILE_SIZE * 2 + PYRAMID_MAX_TAPS) * 3];
+	int x0 = (iTask % lpJob->lpLevel->cxTiles) << PYRAMID_TILE_SHIFT;
+	int y0 = (iTask / lpJob->lpLevel->cxTiles) << PYRAMID_TILE_SHIFT;
+
+	// The source columns this tile reads.
+	int sx0 = x0 * 2 + lpJob->iOffset;
+	int sx1 = (x0 + lpDst->cx - 1) * 2 + lpJob->iOffset + lpJob->cTaps;
+
+	for(int y = 0; y < lpDst->cy; y++) {
+		const BYTE* pRows[PYRAMID_MAX_TAPS];
+		int sy = (y0 + y) * 2 + lpJob->iOffset;
+
+		for(int k = 0; k < lpJob->cTaps; k++) {
+			pRows[k] = lpSrc->pTop + (ptrdiff_t)ClampPyramid(sy + k, lpSrc->cy) * lpSrc->iPitch;
+		}
+
+		// Vertical pass: three channels per source column.
+		for(int sx = sx0; sx < sx1; sx++) {
+			int x = ClampPyramid(sx, lpSrc->cx);
+			int r = 0, g = 0, b = 0;
+
+			for(int k = 0; k < lpJob->cTaps; k++) {
+				DWORD c = FetchXRGB<FORMAT>(pRows[k], x);
+
+				r += lpJob->wTaps[k] * (int)((c >> 16) & 0xFF);
+				g += lpJob->wTaps[k] * (int)((c >> 8) & 0xFF);
+				b += lpJob->wTaps[k] * (int)(c & 0xFF);
+			}
+
+			int* p = span + (sx - sx0) * 3;
+
+			p[0] = (r + iRound) >> SCALE_BITS;
+			p[1] = (g + iRound) >> SCALE_BITS;
+			p[2] = (b + iRound) >> SCALE_BITS;
+		}
+
+		// Horizontal pass, straight into the tile. Lanczos has negative
+		// taps, so the sums can end up outside 0 to 255.
+		BYTE* pDst = lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch;
+
+		for(int x = 0; x < lpDst->cx; x++) {
+			const int* p = span + x * 2 * 3;
+			int r = iRound, g = iRound, b = iRound;
+
+			for(int k = 0; k < lpJob->cTaps; k++, p += 3) {
+				r += lpJob->wTaps[k] * p[0];
+				g += lpJob->wTaps[k] * p[1];
+				b += lpJob->wTaps[k] * p[2];
+			}
+
+			r = ClampPyramid(r >> SCALE_BITS, 256);
+			g = ClampPyramid(g >> SCALE_BITS, 256);
+			b = ClampPyramid(b >> SCALE_BITS, 256);
+
+			FORMAT::Store(pDst, x, FORMAT::FromXRGB((DWORD)((r << 16) | (g << 8) | b)));
+		}
+	}
+}
+
+// Points the tiles of a level into its surface.
+static inline void SetPyramidTiles(PYRAMIDLEVEL* lpLevel, int iBytes)
+{
+	for(int ty = 0; ty < lpLevel->cyTiles; ty++) {
+		for(int tx = 0; tx < lpLevel->cxTiles; tx++) {
+			LPDIBSURFACE lpTile = &lpLevel->lpTiles[ty * lpLevel->cxTiles + tx];
+			int x = tx << PYRAMID_TILE_SHIFT;
+			int y = ty << PYRAMID_TILE_SHIFT;
+
+			*lpTile = lpLevel->surface;
+			lpTile->pTop = lpLevel->surface.pTop + (ptrdiff_t)y * lpLevel->surface.iPitch + x * iBytes;
+			lpTile->pBits = lpTile->pTop;
+			lpTile->cx = lpLevel->cx - x < PYRAMID_TILE_SIZE ? lpLevel->cx - x : PYRAMID_TILE_SIZE;
+			lpTile->cy = lpLevel->cy - y < PYRAMID_TILE_SIZE ? lpLevel->cy - y : PYRAMID_TILE_SIZE;
+			lpTile->lpDirty = NULL;
+		}
+	}
+}
+
+// Builds every level of the pyramid for 'lpSrc' with a filter,
+// PYRAMID_BOX or PYRAMID_LANCZOS. The tiles of a level are spread over
+// 'lpPool', or made on the calling thread if it is NULL. 'lpSrc' is level
+// 0 and has to stay around as long as the pyramid does.
+static inline BOOL BuildPyramid(LPPYRAMID lpPyramid, const DIBSURFACE* lpSrc, int iFilter, CThreadPool* lpPool)
+{
+	LPTASKPROC lpfnTask;
+	PYRAMIDJOB job;
+
+	switch(lpSrc->iFormat) {
+	case DIBFMT_INDEX8:	lpfnTask = PyramidTask<PF_INDEX8>;	break;
+	case DIBFMT_RGB555:	lpfnTask = PyramidTask<PF_RGB555>;	break;
+	case DIBFMT_RGB565:	lpfnTask = PyramidTask<PF_RGB565>;	break;
+	case DIBFMT_BGR24:	lpfnTask = PyramidTask<PF_BGR24>;	break;
+	case DIBFMT_XRGB32:	lpfnTask = PyramidTask<PF_XRGB32>;	break;
+	default:			return FALSE;
+	}
+
+	if(!InitPyramid(lpPyramid, lpSrc->cx, lpSrc->cy, lpSrc->iFormat)) {
+		return FALSE;
+	}
+
+	lpPyramid->levels[0].surface = *lpSrc;
+	GetPyramidTaps(&job, iFilter);
+
+	for(int i = 1; i < lpPyramid->cLevels; i++) {
+		PYRAMIDLEVEL* lpLevel = &lpPyramid->levels[i];
+
+		if(!CreateDIBSurface(&lpLevel->surface, lpLevel->cx, lpLevel->cy, GetCacheFormatBpp(lpSrc->iFormat), DIBALLOC_NOZERO)) {
+			FreePyramid(lpPyramid);
+			return FALSE;
+		}
+
+		if(lpSrc->iFormat == DIBFMT_INDEX8) {
+			memcpy(lpLevel->surface.lpBmi->bmiColors, lpSrc->lpBmi->bmiColors, sizeof(RGBQUAD) * 256);
+			lpLevel->surface.lpBmi->bmiHeader.biClrUsed = lpSrc->lpBmi->bmiHeader.biClrUsed;
+		}
+
+		SetPyramidTiles(lpLevel, GetDIBFormatBytes(lpSrc->iFormat));
+
+		// A level needs all of the one above, so only the tiles within a
+		// level run at the same time.
+		job.lpSrc = &lpPyramid->levels[i - 1].surface;
+		job.lpLevel = lpLevel;
+
+		int cTasks = lpLevel->cxTiles * lpLevel->cyTiles;
+
+		if(lpPool) {
+			lpPool->Run(cTasks, lpfnTask, &job);
+		}
+		else {
+			for(int t = 0; t < cTasks; t++) {
+				lpfnTask(t, 0, &job);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// Drawing.
+//
+
+// Finds the cheapest way to draw the part 'lprcSrc' of the image, in
+// pixels of the image, on 'cxDst' by 'cyDst' pixels: the smallest level
+// that is still at least that big, so what is left is scaling down by
+// less than two. Level 0 means the image itself.
+static inline void FindPyramidView(const PYRAMID* lpPyramid, const RECT* lprcSrc, int cxDst, int cyDst, LPPYRAMIDVIEW lpView)
+{
+	int cx = lprcSrc->right - lprcSrc->left;
+	int cy = lprcSrc->bottom - lprcSrc->top;
+	int iLevel = 0;
+
+	while(iLevel + 1 < lpPyramid->cLevels && (cx >> (iLevel + 1)) >= cxDst && (cy >> (iLevel + 1)) >= cyDst) {
+		iLevel++;
+	}
+
+	const PYRAMIDLEVEL* lpLevel = &lpPyramid->levels[iLevel];
+	int iScale = 1 << iLevel;
+
+	// Rounded outwards, and clipped to the level.
+	lpView->iLevel = iLevel;
+	lpView->rcLevel.left = ClampPyramid((int)(lprcSrc->left >> iLevel), lpLevel->cx + 1);
+	lpView->rcLevel.top = ClampPyramid((int)(lprcSrc->top >> iLevel), lpLevel->cy + 1);
+	lpView->rcLevel.right = ClampPyramid((int)((lprcSrc->right + iScale - 1) >> iLevel), lpLevel->cx + 1);
+	lpView->rcLevel.bottom = ClampPyramid((int)((lprcSrc->bottom + iScale - 1) >> iLevel), lpLevel->cy + 1);
+
+	if(lpView->rcLevel.left >= lpView->rcLevel.right || lpView->rcLevel.top >= lpView->rcLevel.bottom) {
+		ZeroMemory(&lpView->rcTiles, sizeof(RECT));
+		return;
+	}
+
+	lpView->rcTiles.left = lpView->rcLevel.left >> PYRAMID_TILE_SHIFT;
+	lpView->rcTiles.top = lpView->rcLevel.top >> PYRAMID_TILE_SHIFT;
+	lpView->rcTiles.right = ((lpView->rcLevel.right - 1) >> PYRAMID_TILE_SHIFT) + 1;
+	lpView->rcTiles.bottom = ((lpView->rcLevel.bottom - 1) >> PYRAMID_TILE_SHIFT) + 1;
+}
+
+// Copies the part of the level a view found onto the top left corner of
+// 'lpDst', converting it to the format of 'lpDst' if need be. Level 0 is
+// only there when the pyramid was built here. Returns FALSE if the level
+// isn't there or the formats can't be converted.
+static inline BOOL DrawPyramidView(const PYRAMID* lpPyramid, const PYRAMIDVIEW* lpView, LPDIBSURFACE lpDst)
+{
+	const PYRAMIDLEVEL* lpLevel = &lpPyramid->levels[lpView->iLevel];
+	CONVERTPROCS procs;
+	DWORD palette[256];
+
+	if((!lpLevel->lpTiles && !lpLevel->surface.pTop) || !GetConvertProcs(lpDst->iFormat, lpPyramid->iFormat, &procs)) {
+		return FALSE;
+	}
+
+	for(int ty = lpView->rcTiles.top; ty < lpView->rcTiles.bottom; ty++) {
+		for(int tx = lpView->rcTiles.left; tx < lpView->rcTiles.right; tx++) {
+			DIBSURFACE tile;
+
+			// Level 0 has no tiles, but the whole image will do as one.
+			if(lpLevel->lpTiles) {
+				tile = lpLevel->lpTiles[ty * lpLevel->cxTiles + tx];
+			}
+			else {
+				tile = lpLevel->surface;
+				tile.pTop += (ptrdiff_t)(ty << PYRAMID_TILE_SHIFT) * tile.iPitch + (tx << PYRAMID_TILE_SHIFT) * procs.iSrcBytes;
+				tile.cx = lpLevel->cx - (tx << PYRAMID_TILE_SHIFT) < PYRAMID_TILE_SIZE ? lpLevel->cx - (tx << PYRAMID_TILE_SHIFT) : PYRAMID_TILE_SIZE;
+				tile.cy = lpLevel->cy - (ty << PYRAMID_TILE_SHIFT) < PYRAMID_TILE_SIZE ? lpLevel->cy - (ty << PYRAMID_TILE_SHIFT) : PYRAMID_TILE_SIZE;
+			}
+
+			// The part of the tile inside the view, and where that goes.
+			int x0 = (tx << PYRAMID_TILE_SHIFT) < lpView->rcLevel.left ? lpView->rcLevel.left - (tx << PYRAMID_TILE_SHIFT) : 0;
+			int y0 = (ty << PYRAMID_TILE_SHIFT) < lpView->rcLevel.top ? lpView->rcLevel.top - (ty << PYRAMID_TILE_SHIFT) : 0;
+			int x1 = (tx << PYRAMID_TILE_SHIFT) + tile.cx > lpView->rcLevel.right ? lpView->rcLevel.right - (tx << PYRAMID_TILE_SHIFT) : tile.cx;
+			int y1 = (ty << PYRAMID_TILE_SHIFT) + tile.cy > lpView->rcLevel.bottom ? lpView->rcLevel.bottom - (ty << PYRAMID_TILE_SHIFT) : tile.cy;
+			int xDst = (tx << PYRAMID_TILE_SHIFT) + x0 - lpView->rcLevel.left;
+			int yDst = (ty << PYRAMID_TILE_SHIFT) + y0 - lpView->rcLevel.top;
+
+			if(x1 > x0 + lpDst->cx - xDst) x1 = x0 + lpDst->cx - xDst;
+			if(y1 > y0 + lpDst->cy - yDst) y1 = y0 + lpDst->cy - yDst;
+
+			if(x0 >= x1 || y0 >= y1) {
+				continue;
+			}
+
+			if(lpPyramid->iFormat == DIBFMT_INDEX8 && lpDst->iFormat != DIBFMT_INDEX8) {
+				GetXRGBPalette(tile.lpBmi, palette);
+			}
+
+			for(int y = y0; y < y1; y++) {
+				ConvertScanline(&procs, lpDst->pTop + (ptrdiff_t)(yDst + y - y0) * lpDst->iPitch + xDst * procs.iDstBytes, tile.pTop + (ptrdiff_t)y * tile.iPitch + x0 * procs.iSrcBytes, x1 - x0, palette);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// Saving and opening.
+//
+
+// Writes levels 1 and up to a pack, each tile named "level/row/column".
+static inline BOOL SavePyramid(const PYRAMID* lpPyramid, LPCSTR lpszFilename)
+{
+	PACKBUILDER builder;
+
+	if(!CreatePackBuilder(&builder, lpszFilename)) {
+		return FALSE;
+	}
+
+	for(int i = 1; i < lpPyramid->cLevels; i++) {
+		const PYRAMIDLEVEL* lpLevel = &lpPyramid->levels[i];
+
+		for(int ty = 0; ty < lpLevel->cyTiles; ty++) {
+			for(int tx = 0; tx < lpLevel->cxTiles; tx++) {
+				const DIBSURFACE* lpTile = &lpLevel->lpTiles[ty * lpLevel->cxTiles + tx];
+				char szName[64];
+
+				// A built tile shares the BITMAPINFO of its level, the
+				// pack gives it one of its own size.
+				snprintf(szName, sizeof(szName), "%d/%d/%d", i, ty, tx);
+
+				if(!AddPackSurface(&builder, szName, lpTile)) {
+					FinishPackBuilder(&builder);
+					remove(lpszFilename);
+					return FALSE;
+				}
+			}
+		}
+	}
+
+	if(!FinishPackBuilder(&builder)) {
+		remove(lpszFilename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Opens a pyramid saved by 'SavePyramid' for an image of 'cx' by 'cy'
+// pixels in 'iFormat', or in whatever format it was saved in for
+// DIBFMT_UNKNOWN. Nothing is read but the index, the tiles point into the
+// mapping. Returns FALSE if it isn't there or was made for some other
+// image.
+static inline BOOL OpenPyramid(LPPYRAMID lpPyramid, LPCSTR lpszFilename, int cx, int cy, int iFormat)
+{
+	SURFACEPACK pack;
+	DIBSURFACE first;
+
+	ZeroMemory(lpPyramid, sizeof(PYRAMID));
+
+	if(!OpenSurfacePack(lpszFilename, &pack)) {
+		return FALSE;
+	}
+
+	if(iFormat == DIBFMT_UNKNOWN && GetPackSurface(&pack, FindPackSurface(&pack, "1/0/0"), &first)) {
+		iFormat = first.iFormat;
+	}
+
+	if(!InitPyramid(lpPyramid, cx, cy, iFormat)) {
+		CloseSurfacePack(&pack);
+		return FALSE;
+	}
+
+	lpPyramid->pack = pack;
+
+	for(int i = 1; i < lpPyramid->cLevels; i++) {
+		PYRAMIDLEVEL* lpLevel = &lpPyramid->levels[i];
+
+		for(int ty = 0; ty < lpLevel->cyTiles; ty++) {
+			for(int tx = 0; tx < lpLevel->cxTiles; tx++) {
+				LPDIBSURFACE lpTile = &lpLevel->lpTiles[ty * lpLevel->cxTiles + tx];
+				char szName[64];
+
+				snprintf(szName, sizeof(szName), "%d/%d/%d", i, ty, tx);
+
+				if(!GetPackSurface(&lpPyramid->pack, FindPackSurface(&lpPyramid->pack, szName), lpTile) || lpTile->iFormat != iFormat ||
+					lpTile->cx != (lpLevel->cx - (tx << PYRAMID_TILE_SHIFT) < PYRAMID_TILE_SIZE ? lpLevel->cx - (tx << PYRAMID_TILE_SHIFT) : PYRAMID_TILE_SIZE) ||
+					lpTile->cy != (lpLevel->cy - (ty << PYRAMID_TILE_SHIFT) < PYRAMID_TILE_SIZE ? lpLevel->cy - (ty << PYRAMID_TILE_SHIFT) : PYRAMID_TILE_SIZE)) {
+					FreePyramid(lpPyramid);
+					return FALSE;
+				}
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+// Returns TRUE if the file 'lpszPyramid' was written after 'lpszImage' was
+// last changed, so it's a pyramid of what is in there now.
+static inline BOOL IsPyramidCurrent(LPCSTR lpszImage, LPCSTR lpszPyramid)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA image, pyramid;
+
+	if(!GetFileAttributesExA(lpszImage, GetFileExInfoStandard, &image) || !GetFileAttributesExA(lpszPyramid, GetFileExInfoStandard, &pyramid)) {
+		return FALSE;
+	}
+
+	return CompareFileTime(&pyramid.ftLastWriteTime, &image.ftLastWriteTime) >= 0;
+#else
+	struct stat image, pyramid;
+
+	if(stat(lpszImage, &image) != 0 || stat(lpszPyramid, &pyramid) != 0) {
+		return FALSE;
+	}
+
+	return pyramid.st_mtime >= image.st_mtime;
+#endif
+}
+
+#endif // PYRAMID_H
@@ -0,0 +1,855 @@
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+// Turning true color into 8bpp with a color table made for the image.
+//
+// Converting to 8bpp with 'ConvertDIBSurface' maps every color onto the
+// grayscale color table 'CreateDIB' builds. A quantizer instead picks the
+// 256 colors that represent the image best and maps every pixel onto the
+// closest of those. It works in four steps:
+//
+//   1. Every pixel is counted in a histogram of 32 x 32 x 32 cells, 5 bits
+//      per channel. Each cell also keeps the sum of the colors counted in
+//      it, so a cell stands for the exact average of its pixels.
+//   2. Median cut: all cells start out in one box. The box with the most
+//      error, the sum of squared distances of its pixels to their average,
+//      is split on the channel it varies most in, at the point that
+//      leaves the least error on both sides. Until there are enough boxes.
+//   3. The averages of the boxes are the colors. A few rounds of k-means
+//      over the cells then move every color to the average of the cells
+//      closest to it, which median cut alone doesn't guarantee.
+//   4. Every pixel is mapped onto its closest color. Looking for that is
+//      far too slow to do for every pixel, so the answer is cached in an
+//      inverse table with an entry for every color at 6 bits per channel.
+//      An entry is looked up the first time a pixel needs it and stays
+//      until the colors change, so mapping the next frame with the same
+//      colors is one table lookup per pixel.
+//
+// The closest color is found with the colors sorted on green: starting at
+// the colors with about the same amount of green, the search moves out
+// both ways and stops once the difference in green alone is more than the
+// best distance found so far. That still looks at a good part of the
+// colors, so the color space is also divided in 8 x 8 x 8 blocks and the
+// first lookup in a block makes a list of the colors that can be closest
+// to anything in it: those that are nearer to the block than the farthest
+// corner of the block is to some other color. Usually that's a handful,
+// and the rest of the lookups in the block only look at those.
+//
+// Mapping can do Floyd-Steinberg dithering: the difference between a
+// pixel and its color is spread over the neighbours to the right and
+// below, going left to right and right to left on alternate rows.
+//
+// Counting and mapping run over bands of rows on a thread pool. Each band
+// is dithered on its own, so the error doesn't carry over from one band to
+// the next. The bands are the same no matter how many threads there are,
+// so neither is the result.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "convert.h"
+#include "threadpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+
+#define QUANT_BAND			64		// Rows per task
+
+#define QUANT_HIST_BITS		5
+#define QUANT_HIST_SIZE		(1 << (3 * QUANT_HIST_BITS))
+
+#define QUANT_INVERSE_BITS	6
+#define QUANT_INVERSE_SIZE	(1 << (3 * QUANT_INVERSE_BITS))
+#define QUANT_EMPTY			0xFFFF
+
+#define QUANT_BLOCK_BITS	3
+#define QUANT_BLOCK_SHIFT	(8 - QUANT_BLOCK_BITS)
+#define QUANT_BLOCKS		(1 << (3 * QUANT_BLOCK_BITS))
+#define QUANT_BLOCK_EMPTY	0		// No list yet
+#define QUANT_BLOCK_BUSY	1		// A thread is making the list
+#define QUANT_BLOCK_READY	2
+
+// Rounds of k-means after median cut.
+#define QUANT_ITERATIONS	3
+
+typedef struct tagQUANTCELL {
+	unsigned long long	c;			// Pixels counted
+	unsigned long long	s[3];		// Sum of their red, green and blue
+} QUANTCELL;
+
+typedef struct tagQUANTIZER {
+	DWORD				dwColors[256];		// XRGB, sorted on green
+	int					cColors;
+	int					iFirstGreen[257];	// First color with at least this much green
+	std::atomic<WORD>*	pInverse;			// Closest color for every 6 bit color, or QUANT_EMPTY
+	std::atomic<int>*	pBlockStates;		// QUANT_BLOCK_... for every block
+	BYTE*				pBlockColors;		// Colors that can be closest, 256 for every block
+	WORD*				pBlockCounts;		// Number of those
+	QUANTCELL*			pHistograms;		// One for every thread
+	int					cHistograms;
+	int*				pErrors;			// Dithering errors, 'cErrors' for every thread
+	int					cErrors;
+	int					cThreads;
+} QUANTIZER, *LPQUANTIZER;
+
+static inline void FreeQuantizer(LPQUANTIZER lpQuant)
+{
+	delete [] lpQuant->pInverse;
+	delete [] lpQuant->pBlockStates;
+	free(lpQuant->pBlockColors);
+	free(lpQuant->pBlockCounts);
+	free(lpQuant->pHistograms);
+	free(lpQuant->pErrors);
+
+	lpQuant->pInverse = NULL;
+	lpQuant->pBlockStates = NULL;
+	lpQuant->pBlockColors = NULL;
+	lpQuant->pBlockCounts = NULL;
+	lpQuant->pHistograms = NULL;
+	lpQuant->pErrors = NULL;
+	lpQuant->cHistograms = 0;
+	lpQuant->cErrors = 0;
+	lpQuant->cColors = 0;
+}
+
+// A quantizer for use with 'lpPool', or on the calling thread only if it
+// is NULL.
+static inline BOOL CreateQuantizer(LPQUANTIZER lpQuant, CThreadPool* lpPool)
+{
+	lpQuant->cColors = 0;
+	lpQuant->cThreads = lpPool ? lpPool->Threads() : 1;
+	lpQuant->pHistograms = NULL;
+	lpQuant->cHistograms = 0;
+	lpQuant->pErrors = NULL;
+	lpQuant->cErrors = 0;
+	lpQuant->pInverse = new (std::nothrow) std::atomic<WORD>[QUANT_INVERSE_SIZE];
+	lpQuant->pBlockStates = new (std::nothrow) std::atomic<int>[QUANT_BLOCKS];
+	lpQuant->pBlockColors = (BYTE*)malloc(QUANT_BLOCKS * 256);
+	lpQuant->pBlockCounts = (WORD*)malloc(QUANT_BLOCKS * sizeof(WORD));
+
+	if(!lpQuant->pInverse || !lpQuant->pBlockStates || !lpQuant->pBlockColors || !lpQuant->pBlockCounts) {
+		FreeQuantizer(lpQuant);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//
+// Finding the closest color.
+//
+
+static inline int GetColorDistance(DWORD dwColor, int r, int g, int b)
+{
+	int dr = (int)(dwColor >> 16 & 0xFF) - r;
+	int dg = (int)(dwColor >> 8 & 0xFF) - g;
+	int db = (int)(dwColor & 0xFF) - b;
+
+	return dr * dr + dg * dg + db * db;
+}
+
+static inline int FindClosestColor(const QUANTIZER* lpQuant, int r, int g, int b)
+{
+	const DWORD* lpColors = lpQuant->dwColors;
+	int iUp = lpQuant->iFirstGreen[g];
+	int iDown = iUp - 1;
+	int iBest = iUp < lpQuant->cColors ? iUp : iDown;
+	int iBestDistance = 0x7FFFFFFF;
+
+	while(iUp < lpQuant->cColors || iDown >= 0) {
+		if(iUp < lpQuant->cColors) {
+			int dg = (int)(lpColors[iUp] >> 8 & 0xFF) - g;
+
+			if(dg * dg >= iBestDistance) {
+				iUp = lpQuant->cColors;
+			}
+			else {
+				int iDistance = GetColorDistance(lpColors[iUp], r, g, b);
+
+				if(iDistance < iBestDistance) {
+					iBestDistance = iDistance;
+					iBest = iUp;
+				}
+
+				iUp++;
+			}
+		}
+
+		if(iDown >= 0) {
+			int dg = g - (int)(lpColors[iDown] >> 8 & 0xFF);
+
+			if(dg * dg >= iBestDistance) {
+				iDown = -1;
+			}
+			else {
+				int iDistance = GetColorDistance(lpColors[iDown], r, g, b);
+
+				if(iDistance < iBestDistance) {
+					iBestDistance = iDistance;
+					iBest = iDown;
+				}
+
+				iDown--;
+			}
+		}
+	}
+
+	return iBest;
+}
+
+// The nearest and farthest a value can be from 'v' in 'lo' to 'hi', squared.
+static inline void GetSpanDistances(int v, int lo, int hi, int* lpNear, int* lpFar)
+{
+	int dLo = v - lo;
+	int dHi = hi - v;
+
+	*lpNear = dLo < 0 ? dLo * dLo : dHi < 0 ? dHi * dHi : 0;
+	*lpFar = dLo * dLo > dHi * dHi ? dLo * dLo : dHi * dHi;
+}
+
+// Lists the colors that can be closest to something in the block. A color
+// can't be if even the nearest point of the block is farther from it than
+// the farthest point of the block is from another color.
+static inline void BuildBlockColors(LPQUANTIZER lpQuant, int iBlock)
+{
+	int lo[3], hi[3];
+	int iNear[256];
+	int iMinFar = 0x7FFFFFFF;
+	BYTE* pList = lpQuant->pBlockColors + iBlock * 256;
+	int cList = 0;
+
+	for(int k = 0; k < 3; k++) {
+		lo[k] = (iBlock >> (QUANT_BLOCK_BITS * (2 - k)) & ((1 << QUANT_BLOCK_BITS) - 1)) << QUANT_BLOCK_SHIFT;
+		hi[k] = lo[k] + (1 << QUANT_BLOCK_SHIFT) - 1;
+	}
+
+	for(int i = 0; i < lpQuant->cColors; i++) {
+		DWORD c = lpQuant->dwColors[i];
+		int iFar = 0;
+
+		iNear[i] = 0;
+
+		for(int k = 0; k < 3; k++) {
+			int dNear, dFar;
+
+			GetSpanDistances(c >> (16 - 8 * k) & 0xFF, lo[k], hi[k], &dNear, &dFar);
+			iNear[i] += dNear;
+			iFar += dFar;
+		}
+
+		if(iFar < iMinFar) {
+			iMinFar = iFar;
+		}
+	}
+
+	for(int i = 0; i < lpQuant->cColors; i++) {
+		if(iNear[i] <= iMinFar) {
+			pList[cList++] = (BYTE)i;
+		}
+	}
+
+	lpQuant->pBlockCounts[iBlock] = (WORD)cList;
+}
+
+// The closest color to 'r', 'g', 'b' from the inverse table. Threads
+// looking up the same empty entry at the same time both work it out and
+// store the same answer, which is harmless. Only one thread makes the
+// list of a block; the others search all colors meanwhile.
+static inline int LookupColor(const QUANTIZER* lpQuant, int r, int g, int b)
+{
+	int i = (r >> 2) << 12 | (g >> 2) << 6 | (b >> 2);
+	int iColor = lpQuant->pInverse[i].load(std::memory_order_relaxed);
+
+	if(iColor != QUANT_EMPTY) {
+		return iColor;
+	}
+
+	// Whatever falls in this entry gets the color closest to its middle.
+	int rm = (r & ~3) | 2, gm = (g & ~3) | 2, bm = (b & ~3) | 2;
+	int iBlock = (r >> QUANT_BLOCK_SHIFT) << (2 * QUANT_BLOCK_BITS) | (g >> QUANT_BLOCK_SHIFT) << QUANT_BLOCK_BITS | (b >> QUANT_BLOCK_SHIFT);
+	int iState = lpQuant->pBlockStates[iBlock].load(std::memory_order_acquire);
+
+	if(iState == QUANT_BLOCK_EMPTY && lpQuant->pBlockStates[iBlock].compare_exchange_strong(iState, QUANT_BLOCK_BUSY, std::memory_order_acquire)) {
+		BuildBlockColors((LPQUANTIZER)lpQuant, iBlock);
+		lpQuant->pBlockStates[iBlock].store(QUANT_BLOCK_READY, std::memory_order_release);
+		iState = QUANT_BLOCK_READY;
+	}
+
+	if(iState == QUANT_BLOCK_READY) {
+		const BYTE* pList = lpQuant->pBlockColors + iBlock * 256;
+		int iBestDistance = 0x7FFFFFFF;
+
+		for(int j = 0; j < lpQuant->pBlockCounts[iBlock]; j++) {
+			int iDistance = GetColorDistance(lpQuant->dwColors[pList[j]], rm, gm, bm);
+
+			if(iDistance < iBestDistance) {
+				iBestDistance = iDistance;
+				iColor = pList[j];
+			}
+		}
+	}
+	else {
+		iColor = FindClosestColor(lpQuant, rm, gm, bm);
+	}
+
+	lpQuant->pInverse[i].store((WORD)iColor, std::memory_order_relaxed);
+
+	return iColor;
+}
+
+static inline int CompareGreen(const void* p1, const void* p2)
+{
+	int g1 = *(const DWORD*)p1 >> 8 & 0xFF;
+	int g2 = *(const DWORD*)p2 >> 8 & 0xFF;
+
+	return g1 - g2;
+}
+
+// Uses these colors from now on. They are sorted on green, so their order
+// in 'dwColors' can differ from 'lpColors'.
+static inline void SetQuantizerColors(LPQUANTIZER lpQuant, const DWORD* lpColors, int cColors)
+{
+	if(cColors > 256) {
+		cColors = 256;
+	}
+
+	memcpy(lpQuant->dwColors, lpColors, sizeof(DWORD) * cColors);
+	qsort(lpQuant->dwColors, cColors, sizeof(DWORD), CompareGreen);
+	lpQuant->cColors = cColors;
+
+	for(int g = 0, i = 0; g <= 256; g++) {
+		while(i < cColors && (int)(lpQuant->dwColors[i] >> 8 & 0xFF) < g) {
+			i++;
+		}
+
+		lpQuant->iFirstGreen[g] = i;
+	}
+
+	// Everything in the inverse table was for the old colors.
+	for(int i = 0; i < QUANT_INVERSE_SIZE; i++) {
+		lpQuant->pInverse[i].store(QUANT_EMPTY, std::memory_order_relaxed);
+	}
+
+	for(int i = 0; i < QUANT_BLOCKS; i++) {
+		lpQuant->pBlockStates[i].store(QUANT_BLOCK_EMPTY, std::memory_order_relaxed);
+	}
+}
+
+//
+// Building the color table.
+//
+
+typedef struct tagQUANTJOB {
+	LPQUANTIZER			lpQuant;
+	LPDIBSURFACE		lpDst;
+	const DIBSURFACE*	lpSrc;
+	LPCONVERTPROC		lpfnToXRGB;		// NULL if the source is XRGB already
+	DWORD				dwPalette[256];	// Color table of an 8bpp source
+	BOOL				bDither;
+} QUANTJOB;
+
+static inline void RunQuantizeTasks(CThreadPool* lpPool, int cTasks, LPTASKPROC lpfnTask, QUANTJOB* lpJob)
+{
+	if(lpPool) {
+		lpPool->Run(cTasks, lpfnTask, lpJob);
+	}
+	else {
+		for(int i = 0; i < cTasks; i++) {
+			lpfnTask(i, 0, lpJob);
+		}
+	}
+}
+
+// Returns 'n' pixels of a scanline of the source from 'x' on as XRGB,
+// converted into 'pBuffer' if they aren't XRGB already.
+static inline const DWORD* GetXRGBPixels(const QUANTJOB* lpJob, const BYTE* pRow, int x, int n, DWORD* pBuffer)
+{
+	if(!lpJob->lpfnToXRGB) {
+		return (const DWORD*)pRow + x;
+	}
+
+	lpJob->lpfnToXRGB((BYTE*)pBuffer, pRow + x * GetDIBFormatBytes(lpJob->lpSrc->iFormat), n, lpJob->dwPalette);
+	return pBuffer;
+}
+
+static inline void HistogramTask(int iTask, int iThread, void* lpParam)
+{
+	const QUANTJOB* lpJob = (const QUANTJOB*)lpParam;
+	const DIBSURFACE* lpSrc = lpJob->lpSrc;
+	QUANTCELL* lpCells = lpJob->lpQuant->pHistograms + (size_t)iThread * QUANT_HIST_SIZE;
+	DWORD buffer[CONVERT_CHUNK];
+	int yEnd = (iTask + 1) * QUANT_BAND < lpSrc->cy ? (iTask + 1) * QUANT_BAND : lpSrc->cy;
+
+	for(int y = iTask * QUANT_BAND; y < yEnd; y++) {
+		const BYTE* pRow = lpSrc->pTop + (ptrdiff_t)y * lpSrc->iPitch;
+
+		for(int x = 0; x < lpSrc->cx; x += CONVERT_CHUNK) {
+			int n = lpSrc->cx - x < CONVERT_CHUNK ? lpSrc->cx - x : CONVERT_CHUNK;
+			const DWORD* p = GetXRGBPixels(lpJob, pRow, x, n, buffer);
+
+			for(int i = 0; i < n; i++) {
+				DWORD c = p[i];
+				QUANTCELL* lpCell = &lpCells[(c >> 9 & 0x7C00) | (c >> 6 & 0x3E0) | (c >> 3 & 0x1F)];
+
+				lpCell->c++;
+				lpCell->s[0] += c >> 16 & 0xFF;
+				lpCell->s[1] += c >> 8 & 0xFF;
+				lpCell->s[2] += c & 0xFF;
+			}
+		}
+	}
+}
+
+// A cell of the histogram that was used, as its number of pixels and
+// their average color. Median cut and k-means only look at these.
+typedef struct tagQUANTBIN {
+	double	c;
+	double	m[3];
+} QUANTBIN;
+
+// A box of median cut: a range of the bins, which are kept in order so
+// every box is a contiguous part of them.
+typedef struct tagQUANTBOX {
+	int		iFirst;
+	int		iLast;			// One past the last bin
+	double	dError;			// 0 if it can't be split
+	int		iChannel;		// Channel to split on
+} QUANTBOX;
+
+static inline void AnalyzeBox(const QUANTBIN* lpBins, QUANTBOX* lpBox)
+{
+	double n = 0, s[3] = { 0, 0, 0 }, q[3] = { 0, 0, 0 };
+
+	for(int i = lpBox->iFirst; i < lpBox->iLast; i++) {
+		const QUANTBIN* lpBin = &lpBins[i];
+
+		n += lpBin->c;
+
+		for(int k = 0; k < 3; k++) {
+			s[k] += lpBin->m[k] * lpBin->c;
+			q[k] += lpBin->m[k] * lpBin->m[k] * lpBin->c;
+		}
+	}
+
+	lpBox->dError = 0;
+	lpBox->iChannel = 0;
+
+	if(lpBox->iLast - lpBox->iFirst < 2) {
+		return;
+	}
+
+	double dMax = -1;
+
+	for(int k = 0; k < 3; k++) {
+		double dVariance = q[k] - s[k] * s[k] / n;
+
+		lpBox->dError += dVariance;
+
+		if(dVariance > dMax) {
+			dMax = dVariance;
+			lpBox->iChannel = k;
+		}
+	}
+}
+
+// Sorts the bins of a box on one channel and splits it where the error
+// along that channel is least on both sides together. Returns where the
+// second box starts.
+static inline int SplitBox(QUANTBIN* lpBins, QUANTBIN* lpScratch, const QUANTBOX* lpBox)
+{
+	int iChannel = lpBox->iChannel;
+	int cCount[257];
+	double n[256], s[256], q[256];
+
+	// Counting sort on the channel, stable so ties keep their order.
+	memset(cCount, 0, sizeof(cCount));
+	memset(n, 0, sizeof(n));
+	memset(s, 0, sizeof(s));
+	memset(q, 0, sizeof(q));
+
+	for(int i = lpBox->iFirst; i < lpBox->iLast; i++) {
+		const QUANTBIN* lpBin = &lpBins[i];
+		int m = (int)(lpBin->m[iChannel] + 0.5);
+
+		cCount[m + 1]++;
+		n[m] += lpBin->c;
+		s[m] += lpBin->m[iChannel] * lpBin->c;
+		q[m] += lpBin->m[iChannel] * lpBin->m[iChannel] * lpBin->c;
+	}
+
+	for(int m = 0; m < 256; m++) {
+		cCount[m + 1] += cCount[m];
+	}
+
+	for(int i = lpBox->iFirst; i < lpBox->iLast; i++) {
+		lpScratch[cCount[(int)(lpBins[i].m[iChannel] + 0.5)]++] = lpBins[i];
+	}
+
+	memcpy(lpBins + lpBox->iFirst, lpScratch, sizeof(QUANTBIN) * (lpBox->iLast - lpBox->iFirst));
+
+	// 'cCount[m]' is now one past the last bin at 'm'. Try every place
+	// between two values that are in the box.
+	double nTotal = 0, sTotal = 0, qTotal = 0;
+
+	for(int m = 0; m < 256; m++) {
+		nTotal += n[m];
+		sTotal += s[m];
+		qTotal += q[m];
+	}
+
+	double nLeft = 0, sLeft = 0, qLeft = 0;
+	double dBest = -1;
+	int iSplit = lpBox->iFirst + 1;
+
+	for(int m = 0; m < 255; m++) {
+		nLeft += n[m];
+		sLeft += s[m];
+		qLeft += q[m];
+
+		double nRight = nTotal - nLeft;
+
+		if(n[m] == 0 || nRight == 0) {
+			continue;
+		}
+
+		double sRight = sTotal - sLeft;
+		double dError = (qLeft - sLeft * sLeft / nLeft) + ((qTotal - qLeft) - sRight * sRight / nRight);
+
+		if(dBest < 0 || dError < dBest) {
+			dBest = dError;
+			iSplit = lpBox->iFirst + cCount[m];
+		}
+	}
+
+	return iSplit;
+}
+
+// Moves every color to the average of the bins closest to it. Colors no
+// bin is closest to stay where they are.
+static inline void RefineColors(LPQUANTIZER lpQuant, const QUANTBIN* lpBins, int cBins)
+{
+	double sums[256][4];
+	DWORD dwColors[256];
+
+	memset(sums, 0, sizeof(sums));
+
+	for(int i = 0; i < cBins; i++) {
+		const QUANTBIN* lpBin = &lpBins[i];
+		int iColor = LookupColor(lpQuant, (int)(lpBin->m[0] + 0.5), (int)(lpBin->m[1] + 0.5), (int)(lpBin->m[2] + 0.5));
+
+		sums[iColor][0] += lpBin->c;
+		sums[iColor][1] += lpBin->m[0] * lpBin->c;
+		sums[iColor][2] += lpBin->m[1] * lpBin->c;
+		sums[iColor][3] += lpBin->m[2] * lpBin->c;
+	}
+
+	for(int i = 0; i < lpQuant->cColors; i++) {
+		if(sums[i][0] == 0) {
+			dwColors[i] = lpQuant->dwColors[i];
+			continue;
+		}
+
+		int r = (int)(sums[i][1] / sums[i][0] + 0.5);
+		int g = (int)(sums[i][2] / sums[i][0] + 0.5);
+		int b = (int)(sums[i][3] / sums[i][0] + 0.5);
+
+		dwColors[i] = (r << 16) | (g << 8) | b;
+	}
+
+	SetQuantizerColors(lpQuant, dwColors, lpQuant->cColors);
+}
+
+// Builds a color table of at most 'cColors' colors for 'lpSrc', which can
+// be in any format. Images with fewer colors than that get exactly their
+// own colors, provided no two of them fall in the same histogram cell.
+static inline BOOL BuildQuantizerColors(LPQUANTIZER lpQuant, const DIBSURFACE* lpSrc, int cColors, CThreadPool* lpPool)
+{
+	QUANTJOB job;
+	int cThreads = lpPool ? lpPool->Threads() : 1;
+
+	if(cColors < 1 || cColors > 256 || cThreads > lpQuant->cThreads) {
+		return FALSE;
+	}
+
+	if(lpQuant->cHistograms < cThreads) {
+		free(lpQuant->pHistograms);
+
+		if((lpQuant->pHistograms = (QUANTCELL*)malloc(sizeof(QUANTCELL) * QUANT_HIST_SIZE * cThreads)) == NULL) {
+			lpQuant->cHistograms = 0;
+			return FALSE;
+		}
+
+		lpQuant->cHistograms = cThreads;
+	}
+
+	memset(lpQuant->pHistograms, 0, sizeof(QUANTCELL) * QUANT_HIST_SIZE * cThreads);
+
+	job.lpQuant = lpQuant;
+	job.lpDst = NULL;
+	job.lpSrc = lpSrc;
+	job.lpfnToXRGB = lpSrc->iFormat == DIBFMT_XRGB32 ? NULL : GetToXRGBProc(lpSrc->iFormat, GetCPUFeatures());
+	job.bDither = FALSE;
+
+	if(lpSrc->iFormat == DIBFMT_INDEX8) {
+		GetXRGBPalette(lpSrc->lpBmi, job.dwPalette);
+	}
+
+	RunQuantizeTasks(lpPool, (lpSrc->cy + QUANT_BAND - 1) / QUANT_BAND, HistogramTask, &job);
+
+	// Add up the histograms of the threads and make a bin of every cell
+	// that was used. The second half is scratch space for sorting.
+	QUANTBIN* lpBins;
+	int cBins = 0;
+
+	if((lpBins = (QUANTBIN*)malloc(sizeof(QUANTBIN) * QUANT_HIST_SIZE * 2)) == NULL) {
+		return FALSE;
+	}
+
+	for(int i = 0; i < QUANT_HIST_SIZE; i++) {
+		QUANTCELL cell = lpQuant->pHistograms[i];
+
+		for(int t = 1; t < cThreads; t++) {
+			const QUANTCELL* lpCell = &lpQuant->pHistograms[(size_t)t * QUANT_HIST_SIZE + i];
+
+			cell.c += lpCell->c;
+			cell.s[0] += lpCell->s[0];
+			cell.s[1] += lpCell->s[1];
+			cell.s[2] += lpCell->s[2];
+		}
+
+		if(cell.c) {
+			QUANTBIN* lpBin = &lpBins[cBins++];
+
+			lpBin->c = (double)cell.c;
+			lpBin->m[0] = (double)cell.s[0] / lpBin->c;
+			lpBin->m[1] = (double)cell.s[1] / lpBin->c;
+			lpBin->m[2] = (double)cell.s[2] / lpBin->c;
+		}
+	}
+
+	if(cBins == 0) {
+		DWORD dwBlack = 0;
+
+		SetQuantizerColors(lpQuant, &dwBlack, 1);
+		free(lpBins);
+		return TRUE;
+	}
+
+	// Median cut.
+	QUANTBOX boxes[256];
+	int cBoxes = 1;
+
+	boxes[0].iFirst = 0;
+	boxes[0].iLast = cBins;
+	AnalyzeBox(lpBins, &boxes[0]);
+
+	while(cBoxes < cColors) {
+		int iBox = 0;
+
+		for(int i = 1; i < cBoxes; i++) {
+			if(boxes[i].dError > boxes[iBox].dError) {
+				iBox = i;
+			}
+		}
+
+		if(boxes[iBox].dError <= 0) {
+			break;
+		}
+
+		int iSplit = SplitBox(lpBins, lpBins + QUANT_HIST_SIZE, &boxes[iBox]);
+
+		boxes[cBoxes].iFirst = iSplit;
+		boxes[cBoxes].iLast = boxes[iBox].iLast;
+		boxes[iBox].iLast = iSplit;
+
+		AnalyzeBox(lpBins, &boxes[iBox]);
+		AnalyzeBox(lpBins, &boxes[cBoxes]);
+		cBoxes++;
+	}
+
+	// The average of every box is a color.
+	DWORD dwColors[256];
+
+	for(int i = 0; i < cBoxes; i++) {
+		double c = 0, s[3] = { 0, 0, 0 };
+
+		for(int j = boxes[i].iFirst; j < boxes[i].iLast; j++) {
+			c += lpBins[j].c;
+			s[0] += lpBins[j].m[0] * lpBins[j].c;
+			s[1] += lpBins[j].m[1] * lpBins[j].c;
+			s[2] += lpBins[j].m[2] * lpBins[j].c;
+		}
+
+		dwColors[i] = (int)(s[0] / c + 0.5) << 16 | (int)(s[1] / c + 0.5) << 8 | (int)(s[2] / c + 0.5);
+	}
+
+	SetQuantizerColors(lpQuant, dwColors, cBoxes);
+
+	for(int i = 0; i < QUANT_ITERATIONS; i++) {
+		RefineColors(lpQuant, lpBins, cBins);
+	}
+
+	free(lpBins);
+
+	return TRUE;
+}
+
+//
+// Mapping.
+//
+
+static inline void MapTask(int iTask, int, void* lpParam)
+{
+	const QUANTJOB* lpJob = (const QUANTJOB*)lpParam;
+	const QUANTIZER* lpQuant = lpJob->lpQuant;
+	const DIBSURFACE* lpSrc = lpJob->lpSrc;
+	DWORD buffer[CONVERT_CHUNK];
+	int yEnd = (iTask + 1) * QUANT_BAND < lpSrc->cy ? (iTask + 1) * QUANT_BAND : lpSrc->cy;
+
+	for(int y = iTask * QUANT_BAND; y < yEnd; y++) {
+		const BYTE* pRow = lpSrc->pTop + (ptrdiff_t)y * lpSrc->iPitch;
+		BYTE* pDst = lpJob->lpDst->pTop + (ptrdiff_t)y * lpJob->lpDst->iPitch;
+
+		for(int x = 0; x < lpSrc->cx; x += CONVERT_CHUNK) {
+			int n = lpSrc->cx - x < CONVERT_CHUNK ? lpSrc->cx - x : CONVERT_CHUNK;
+			const DWORD* p = GetXRGBPixels(lpJob, pRow, x, n, buffer);
+
+			for(int i = 0; i < n; i++) {
+				DWORD c = p[i];
+				int iColor = lpQuant->pInverse[(c >> 6 & 0x3F000) | (c >> 4 & 0xFC0) | (c >> 2 & 0x3F)].load(std::memory_order_relaxed);
+
+				if(iColor == QUANT_EMPTY) {
+					iColor = LookupColor(lpQuant, c >> 16 & 0xFF, c >> 8 & 0xFF, c & 0xFF);
+				}
+
+				pDst[x + i] = (BYTE)iColor;
+			}
+		}
+	}
+}
+
+static inline int ClampColor(int i)
+{
+	return i < 0 ? 0 : i > 255 ? 255 : i;
+}
+
+// Floyd-Steinberg. The errors are kept in sixteenths, three per pixel,
+// for the row being mapped and the row below it. Both have an extra pixel
+// on either side so the edges need no special cases.
+static inline void DitherTask(int iTask, int iThread, void* lpParam)
+{
+	const QUANTJOB* lpJob = (const QUANTJOB*)lpParam;
+	const QUANTIZER* lpQuant = lpJob->lpQuant;
+	const DIBSURFACE* lpSrc = lpJob->lpSrc;
+	int cx = lpSrc->cx;
+	int* pThis = lpQuant->pErrors + (size_t)iThread * lpQuant->cErrors;
+	int* pNext = pThis + (cx + 2) * 3;
+	DWORD buffer[CONVERT_CHUNK];
+	int yEnd = (iTask + 1) * QUANT_BAND < lpSrc->cy ? (iTask + 1) * QUANT_BAND : lpSrc->cy;
+
+	memset(pThis, 0, sizeof(int) * (cx + 2) * 3 * 2);
+
+	for(int y = iTask * QUANT_BAND; y < yEnd; y++) {
+		const BYTE* pRow = lpSrc->pTop + (ptrdiff_t)y * lpSrc->iPitch;
+		BYTE* pDst = lpJob->lpDst->pTop + (ptrdiff_t)y * lpJob->lpDst->iPitch;
+		BOOL bReverse = y & 1;
+		int iStep = bReverse ? -1 : 1;
+
+		for(int x0 = 0; x0 < cx; x0 += CONVERT_CHUNK) {
+			// Going right to left the chunks are taken from the right.
+			int n = cx - x0 < CONVERT_CHUNK ? cx - x0 : CONVERT_CHUNK;
+			int xFirst = bReverse ? cx - x0 - n : x0;
+			const DWORD* p = GetXRGBPixels(lpJob, pRow, xFirst, n, buffer);
+
+			for(int j = 0; j < n; j++) {
+				int i = bReverse ? n - 1 - j : j;
+				int x = xFirst + i;
+				int* e = pThis + (x + 1) * 3;
+				DWORD c = p[i];
+
+				int r = ClampColor((int)(c >> 16 & 0xFF) + ((e[0] + 8) >> 4));
+				int g = ClampColor((int)(c >> 8 & 0xFF) + ((e[1] + 8) >> 4));
+				int b = ClampColor((int)(c & 0xFF) + ((e[2] + 8) >> 4));
+				int iColor = LookupColor(lpQuant, r, g, b);
+				DWORD dwColor = lpQuant->dwColors[iColor];
+
+				pDst[x] = (BYTE)iColor;
+
+				int d[3] = { r - (int)(dwColor >> 16 & 0xFF), g - (int)(dwColor >> 8 & 0xFF), b - (int)(dwColor & 0xFF) };
+				int* eAhead = e + iStep * 3;
+				int* eBelow = pNext + (x + 1) * 3;
+
+				for(int k = 0; k < 3; k++) {
+					eAhead[k] += d[k] * 7;
+					eBelow[k - iStep * 3] += d[k] * 3;
+					eBelow[k] += d[k] * 5;
+					eBelow[k + iStep * 3] += d[k];
+				}
+			}
+		}
+
+		int* pSwap = pThis;
+
+		pThis = pNext;
+		pNext = pSwap;
+		memset(pNext, 0, sizeof(int) * (cx + 2) * 3);
+	}
+}
+
+// Maps 'lpSrc' onto the colors of the quantizer into 'lpDst', an 8bpp
+// surface of the same size, and puts the colors in its color table.
+static inline BOOL QuantizeDIBSurface(LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc, LPQUANTIZER lpQuant, BOOL bDither, CThreadPool* lpPool)
+{
+	QUANTJOB job;
+	int cThreads = lpPool ? lpPool->Threads() : 1;
+	LPBITMAPINFO lpBmi = lpDst->lpBmi;
+
+	if(lpDst->iFormat != DIBFMT_INDEX8 || lpDst->cx != lpSrc->cx || lpDst->cy != lpSrc->cy || !lpQuant->cColors || cThreads > lpQuant->cThreads) {
+		return FALSE;
+	}
+
+	if(GetDIBFormatBytes(lpSrc->iFormat) == 0) {
+		return FALSE;
+	}
+
+	if(bDither && lpQuant->cErrors < (lpSrc->cx + 2) * 3 * 2) {
+		free(lpQuant->pErrors);
+
+		lpQuant->cErrors = (lpSrc->cx + 2) * 3 * 2;
+
+		if((lpQuant->pErrors = (int*)malloc(sizeof(int) * lpQuant->cErrors * lpQuant->cThreads)) == NULL) {
+			lpQuant->cErrors = 0;
+			return FALSE;
+		}
+	}
+
+	job.lpQuant = lpQuant;
+	job.lpDst = lpDst;
+	job.lpSrc = lpSrc;
+	job.lpfnToXRGB = lpSrc->iFormat == DIBFMT_XRGB32 ? NULL : GetToXRGBProc(lpSrc->iFormat, GetCPUFeatures());
+	job.bDither = bDither;
+
+	if(lpSrc->iFormat == DIBFMT_INDEX8) {
+		GetXRGBPalette(lpSrc->lpBmi, job.dwPalette);
+	}
+
+	RunQuantizeTasks(lpPool, (lpSrc->cy + QUANT_BAND - 1) / QUANT_BAND, bDither ? DitherTask : MapTask, &job);
+
+	ZeroMemory(lpBmi->bmiColors, sizeof(RGBQUAD) * 256);
+
+	for(int i = 0; i < lpQuant->cColors; i++) {
+		DWORD dwColor = lpQuant->dwColors[i];
+
+		lpBmi->bmiColors[i].rgbRed = (BYTE)(dwColor >> 16);
+		lpBmi->bmiColors[i].rgbGreen = (BYTE)(dwColor >> 8);
+		lpBmi->bmiColors[i].rgbBlue = (BYTE)dwColor;
+	}
+
+	lpBmi->bmiHeader.biClrUsed = lpQuant->cColors;
+
+	return TRUE;
+}
+
+#endif // QUANTIZE_H
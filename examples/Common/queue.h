@@ -0,0 +1,141 @@
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+// A bounded queue between threads.
+//
+// Pipelines hand work from one stage to the next through these. A queue
+// holds at most 'Capacity()' items: a producer that gets ahead has to
+// wait in 'Push' until the consumer catches up, so a fast stage can never
+// pile up more work (and more memory) than the queue allows. Once the
+// producers are done they 'Close' the queue; the consumers get whatever
+// is still in it and then 'Pop' returns false.
+//
+// The queue also keeps count of how full it was and how long its threads
+// had to wait. Time spent waiting in 'Push' means the stage after it is
+// the bottleneck, time spent waiting in 'Pop' means the one before it is.
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+typedef struct tagQUEUESTATS {
+	long long	cPushes;		// Items that went through
+	long long	cDepthTotal;	// Sum of the depth seen by every push, for the average
+	int			cMaxDepth;		// Fullest it has been
+	double		dPushWaitNs;	// Time producers spent waiting for room
+	double		dPopWaitNs;		// Time consumers spent waiting for items
+} QUEUESTATS, *LPQUEUESTATS;
+
+template<class T>
+class CBoundedQueue {
+public:
+	CBoundedQueue(int cCapacity)
+		: m_items(cCapacity > 0 ? cCapacity : 1), m_iHead(0), m_cItems(0), m_bClosed(false), m_stats()
+	{
+	}
+
+	int Capacity() const
+	{
+		return (int)m_items.size();
+	}
+
+	// Number of items in the queue right now.
+	int Depth()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_cItems;
+	}
+
+	// Adds an item, waiting for room if the queue is full. Returns false,
+	// without adding it, if the queue has been closed.
+	bool Push(const T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		if(m_cItems == (int)m_items.size() && !m_bClosed) {
+			auto start = std::chrono::steady_clock::now();
+
+			m_notFull.wait(lock, [this] { return m_cItems < (int)m_items.size() || m_bClosed; });
+			m_stats.dPushWaitNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		if(m_bClosed) {
+			return false;
+		}
+
+		m_items[(m_iHead + m_cItems) % m_items.size()] = item;
+		m_cItems++;
+
+		m_stats.cPushes++;
+		m_stats.cDepthTotal += m_cItems;
+
+		if(m_cItems > m_stats.cMaxDepth) {
+			m_stats.cMaxDepth = m_cItems;
+		}
+
+		lock.unlock();
+		m_notEmpty.notify_one();
+
+		return true;
+	}
+
+	// Takes the oldest item, waiting for one if the queue is empty. Returns
+	// false once the queue is closed and empty.
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		if(m_cItems == 0 && !m_bClosed) {
+			auto start = std::chrono::steady_clock::now();
+
+			m_notEmpty.wait(lock, [this] { return m_cItems > 0 || m_bClosed; });
+			m_stats.dPopWaitNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		if(m_cItems == 0) {
+			return false;
+		}
+
+		item = m_items[m_iHead];
+		m_iHead = (m_iHead + 1) % m_items.size();
+		m_cItems--;
+
+		lock.unlock();
+		m_notFull.notify_one();
+
+		return true;
+	}
+
+	// No more items are coming. Waiting consumers drain what is left,
+	// waiting producers give up.
+	void Close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_bClosed = true;
+		}
+
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+	void GetStats(LPQUEUESTATS lpStats)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		*lpStats = m_stats;
+	}
+
+private:
+	std::mutex				m_lock;
+	std::condition_variable	m_notEmpty;
+	std::condition_variable	m_notFull;
+	std::vector<T>			m_items;
+	size_t					m_iHead;
+	int						m_cItems;
+	bool					m_bClosed;
+	QUEUESTATS				m_stats;
+};
+
+#endif // QUEUE_H
@@ -0,0 +1,563 @@
+
+#ifndef RASTER_H
+#define RASTER_H
+
+// Drawing spans, lines, rectangles and blits.
+//
+// Everything bigger than a pixel drawn with 'PutPixel' costs a call and a
+// store per pixel. The routines here work on whole scanlines instead. Like
+// 'CSurface' they are templates over the pixel format, so each format gets
+// its own switch-free version, and they take colors already packed with
+// 'FORMAT::Pack'. The 'DIB' versions at the end pick the format at runtime
+// and take XRGB colors, like 'PutDIBPixels'.
+//
+// Filling is where the time goes. 8bpp is filled with 'memset'. For the
+// other formats a packed pixel is repeated into a pattern of 96 bytes,
+// which is a whole number of pixels in every format, 24bpp included, and
+// a whole number of SSE2 and AVX2 registers. A span is then written a
+// register at a time straight from that pattern. The AVX2 version first
+// writes up to the next 32 byte boundary, so the stores in the middle
+// never straddle two cache lines.
+//
+// A line is drawn with Bresenham's algorithm, both ends included. It is
+// clipped by working out which steps of it are on the surface, so a line
+// that is mostly off the surface costs no more than the part that's on
+// it, and the pixels that are drawn are exactly the ones the whole line
+// would have drawn. The ends can be anywhere within 2^28 pixels of the
+// surface.
+//
+// Blits copy a rectangle between two surfaces of the same format, clipped
+// against both. A colorkey blit skips the source pixels that are equal to
+// the key; with AVX2 it compares 32 bytes at a time and blends.
+//
+// Rectangles are right and bottom exclusive, like a RECT. Everything is
+// clipped to the surface and marked in its dirty region, if it has one.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "cpu.h"
+
+#include <string.h>
+
+// Bytes in a fill pattern.
+#define RASTER_PATTERN		96
+
+// Spans of fewer bytes than this are written pixel by pixel, making the
+// pattern would take longer.
+#define RASTER_SIMD_MIN		64
+
+typedef void (*LPFILLBYTESPROC)(BYTE* p, int cb, const BYTE* pPattern);
+
+// Repeats a pixel into a pattern. It is made twice as long as needed so
+// a fill can start anywhere in the first half. It is written a DWORD at a
+// time: a DWORD holds four, two or one pixel, and three DWORDs hold four
+// 24bpp pixels.
+template<class FORMAT>
+static inline void MakeFillPattern(BYTE* pPattern, typename FORMAT::PIXEL c)
+{
+	DWORD d[3];
+
+	switch((int)FORMAT::BYTES) {
+	case 1: d[0] = d[1] = d[2] = (DWORD)c * 0x01010101; break;
+	case 2: d[0] = d[1] = d[2] = (DWORD)c * 0x00010001; break;
+	case 4: d[0] = d[1] = d[2] = (DWORD)c; break;
+	case 3:
+		d[0] = (DWORD)c | (DWORD)c << 24;
+		d[1] = (DWORD)c >> 8 | (DWORD)c << 16;
+		d[2] = (DWORD)c >> 16 | (DWORD)c << 8;
+		break;
+	}
+
+	for(int i = 0; i < RASTER_PATTERN * 2; i += 12) {
+		memcpy(pPattern + i, d, 12);
+	}
+}
+
+#ifdef CPU_X86
+
+CPU_TARGET("sse2") static void FillBytes_SSE2(BYTE* p, int cb, const BYTE* pPattern)
+{
+	__m128i a = _mm_loadu_si128((const __m128i*)pPattern);
+	__m128i b = _mm_loadu_si128((const __m128i*)(pPattern + 16));
+	__m128i c = _mm_loadu_si128((const __m128i*)(pPattern + 32));
+	__m128i d = _mm_loadu_si128((const __m128i*)(pPattern + 48));
+	__m128i e = _mm_loadu_si128((const __m128i*)(pPattern + 64));
+	__m128i f = _mm_loadu_si128((const __m128i*)(pPattern + 80));
+	int i = 0;
+
+	for(; i + RASTER_PATTERN <= cb; i += RASTER_PATTERN) {
+		_mm_storeu_si128((__m128i*)(p + i), a);
+		_mm_storeu_si128((__m128i*)(p + i + 16), b);
+		_mm_storeu_si128((__m128i*)(p + i + 32), c);
+		_mm_storeu_si128((__m128i*)(p + i + 48), d);
+		_mm_storeu_si128((__m128i*)(p + i + 64), e);
+		_mm_storeu_si128((__m128i*)(p + i + 80), f);
+	}
+
+	// Less than a pattern to go, which lines up with the start of it.
+	int j = 0;
+
+	for(; i + 16 <= cb; i += 16, j += 16) {
+		_mm_storeu_si128((__m128i*)(p + i), _mm_loadu_si128((const __m128i*)(pPattern + j)));
+	}
+
+	memcpy(p + i, pPattern + j, cb - i);
+}
+
+CPU_TARGET("avx2") static void FillBytes_AVX2(BYTE* p, int cb, const BYTE* pPattern)
+{
+	// Up to the first 32 byte boundary. From there the pattern starts
+	// that many bytes in, which is why it's twice as long.
+	int iHead = (int)(-(size_t)p & 31);
+
+	if(iHead > cb) {
+		iHead = cb;
+	}
+
+	memcpy(p, pPattern, iHead);
+	pPattern += iHead;
+	p += iHead;
+	cb -= iHead;
+
+	__m256i a = _mm256_loadu_si256((const __m256i*)pPattern);
+	__m256i b = _mm256_loadu_si256((const __m256i*)(pPattern + 32));
+	__m256i c = _mm256_loadu_si256((const __m256i*)(pPattern + 64));
+	int i = 0;
+
+	for(; i + RASTER_PATTERN <= cb; i += RASTER_PATTERN) {
+		_mm256_store_si256((__m256i*)(p + i), a);
+		_mm256_store_si256((__m256i*)(p + i + 32), b);
+		_mm256_store_si256((__m256i*)(p + i + 64), c);
+	}
+
+	int j = 0;
+
+	for(; i + 32 <= cb; i += 32, j += 32) {
+		_mm256_store_si256((__m256i*)(p + i), _mm256_loadu_si256((const __m256i*)(pPattern + j)));
+	}
+
+	memcpy(p + i, pPattern + j, cb - i);
+}
+
+#endif // CPU_X86
+
+// The fastest fill this processor can do, or NULL to store pixel by pixel.
+static inline LPFILLBYTESPROC GetFillBytesProc()
+{
+#ifdef CPU_X86
+	DWORD dwFeatures = GetCPUFeatures();
+
+	if(dwFeatures & CPU_AVX2) {
+		return FillBytes_AVX2;
+	}
+
+	if(dwFeatures & CPU_SSE2) {
+		return FillBytes_SSE2;
+	}
+#endif
+
+	return NULL;
+}
+
+// Fills 'n' pixels of a scanline from 'x' on. The pattern is made the
+// first time a row is long enough to need it, '*lpbPattern' says if it
+// has been.
+template<class FORMAT>
+static inline void FillRow(BYTE* pRow, int x, int n, typename FORMAT::PIXEL c, LPFILLBYTESPROC lpfnFill, BYTE* pPattern, BOOL* lpbPattern)
+{
+	// For 8bpp that's what 'memset' does, and the C library's is as fast
+	// as it gets.
+	if(FORMAT::BYTES == 1) {
+		memset(pRow + x, (BYTE)c, n);
+		return;
+	}
+
+	if(lpfnFill && n * FORMAT::BYTES >= RASTER_SIMD_MIN) {
+		if(!*lpbPattern) {
+			MakeFillPattern<FORMAT>(pPattern, c);
+			*lpbPattern = TRUE;
+		}
+
+		lpfnFill(pRow + x * FORMAT::BYTES, n * FORMAT::BYTES, pPattern);
+		return;
+	}
+
+	for(int i = 0; i < n; i++) {
+		FORMAT::Store(pRow, x + i, c);
+	}
+}
+
+// Fills the rectangle from 'left', 'top' to 'right', 'bottom'.
+template<class FORMAT>
+static inline void FillSurfaceRect(LPDIBSURFACE lpSurface, int left, int top, int right, int bottom, typename FORMAT::PIXEL c)
+{
+	BYTE pattern[RASTER_PATTERN * 2];
+	BOOL bPattern = FALSE;
+	LPFILLBYTESPROC lpfnFill = GetFillBytesProc();
+
+	if(left < 0) left = 0;
+	if(top < 0) top = 0;
+	if(right > lpSurface->cx) right = lpSurface->cx;
+	if(bottom > lpSurface->cy) bottom = lpSurface->cy;
+
+	if(left >= right || top >= bottom) {
+		return;
+	}
+
+	for(int y = top; y < bottom; y++) {
+		FillRow<FORMAT>(lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch, left, right - left, c, lpfnFill, pattern, &bPattern);
+	}
+
+	if(lpSurface->lpDirty) {
+		MarkDirtyRect(lpSurface->lpDirty, left, top, right, bottom);
+	}
+}
+
+// Fills scanline 'y' from 'x0' up to but not including 'x1'.
+template<class FORMAT>
+static inline void FillSpan(LPDIBSURFACE lpSurface, int x0, int x1, int y, typename FORMAT::PIXEL c)
+{
+	FillSurfaceRect<FORMAT>(lpSurface, x0, y, x1, y + 1, c);
+}
+
+// 'a' / 'b' rounded up, for 'b' > 0.
+static inline long long CeilDiv(long long a, long long b)
+{
+	return a >= 0 ? (a + b - 1) / b : -(-a / b);
+}
+
+// Draws a line from 'x0', 'y0' to 'x1', 'y1', both ends included. The
+// coordinates must be between -(1 << 28) and (1 << 28).
+template<class FORMAT>
+static inline void DrawLine(LPDIBSURFACE lpSurface, int x0, int y0, int x1, int y1, typename FORMAT::PIXEL c)
+{
+	if(y0 == y1) {
+		FillSpan<FORMAT>(lpSurface, x0 < x1 ? x0 : x1, (x0 < x1 ? x1 : x0) + 1, y0, c);
+		return;
+	}
+
+	long long dx = x1 > x0 ? (long long)x1 - x0 : (long long)x0 - x1;
+	long long dy = y1 > y0 ? (long long)y1 - y0 : (long long)y0 - y1;
+	int sx = x1 > x0 ? 1 : -1;
+	int sy = y1 > y0 ? 1 : -1;
+	BOOL bSteep = dy > dx;
+
+	// From here on the line goes along the major axis one pixel per step,
+	// and along the minor axis 'q' pixels after step 'i', where
+	// q = floor((2 * i * dMinor + dMajor) / (2 * dMajor)).
+	long long dMajor = bSteep ? dy : dx;
+	long long dMinor = bSteep ? dx : dy;
+	int m0 = bSteep ? y0 : x0, sm = bSteep ? sy : sx, cMajor = bSteep ? lpSurface->cy : lpSurface->cx;
+	int n0 = bSteep ? x0 : y0, sn = bSteep ? sx : sy, cMinor = bSteep ? lpSurface->cx : lpSurface->cy;
+
+	// The steps that are on the surface along the major axis...
+	long long iFirst = 0, iLast = dMajor;
+
+	if(sm > 0) {
+		if(-m0 > iFirst) iFirst = -m0;
+		if(cMajor - 1 - m0 < iLast) iLast = cMajor - 1 - m0;
+	}
+	else {
+		if(m0 - (cMajor - 1) > iFirst) iFirst = m0 - (cMajor - 1);
+		if(m0 < iLast) iLast = m0;
+	}
+
+	// ... and along the minor one, where 'q' has to stay in 'qLow' to
+	// 'qHigh'. 'q' only goes up, so that's a range of steps as well.
+	long long qLow = sn > 0 ? -n0 : n0 - (cMinor - 1);
+	long long qHigh = sn > 0 ? cMinor - 1 - n0 : n0;
+
+	if(dMinor == 0) {
+		if(qLow > 0 || qHigh < 0) {
+			return;
+		}
+	}
+	else {
+		long long iLow = CeilDiv(2 * dMajor * qLow - dMajor, 2 * dMinor);
+		long long iHigh = CeilDiv(2 * dMajor * (qHigh + 1) - dMajor, 2 * dMinor) - 1;
+
+		if(iLow > iFirst) iFirst = iLow;
+		if(iHigh < iLast) iLast = iHigh;
+	}
+
+	if(iFirst > iLast) {
+		return;
+	}
+
+	long long e = 2 * iFirst * dMinor + dMajor;
+	int q = (int)(e / (2 * dMajor));
+	int iError = (int)(e % (2 * dMajor));
+	int m = m0 + sm * (int)iFirst;
+	int n = n0 + sn * q;
+	int x = bSteep ? n : m, y = bSteep ? m : n;
+	int xMajor = bSteep ? 0 : sx, yMajor = bSteep ? sy : 0;
+	int xMinor = bSteep ? sx : 0, yMinor = bSteep ? 0 : sy;
+	BYTE* pRow = lpSurface->pTop + (ptrdiff_t)y * lpSurface->iPitch;
+	int iPitchMajor = yMajor * lpSurface->iPitch, iPitchMinor = yMinor * lpSurface->iPitch;
+	LPDIRTYREGION lpDirty = lpSurface->lpDirty;
+
+	for(long long i = iFirst; i <= iLast; i++) {
+		FORMAT::Store(pRow, x, c);
+
+		if(lpDirty) {
+			MarkDirtyPixel(lpDirty, x, y);
+		}
+
+		x += xMajor;
+		y += yMajor;
+		pRow += iPitchMajor;
+		iError += (int)(2 * dMinor);
+
+		if(iError >= 2 * dMajor) {
+			iError -= (int)(2 * dMajor);
+			x += xMinor;
+			y += yMinor;
+			pRow += iPitchMinor;
+		}
+	}
+}
+
+// Clips a blit of 'lprcSrc' in 'lpSrc', the whole surface if NULL, to
+// 'x', 'y' in 'lpDst'. Returns FALSE if nothing is left of it.
+static inline BOOL ClipBlit(const DIBSURFACE* lpDst, int* lpx, int* lpy, const DIBSURFACE* lpSrc, const RECT* lprcSrc, RECT* lprc)
+{
+	RECT rc = { 0, 0, lpSrc->cx, lpSrc->cy };
+
+	if(lprcSrc) {
+		rc = *lprcSrc;
+	}
+
+	// Against the source, moving the destination along.
+	if(rc.left < 0) { *lpx -= rc.left; rc.left = 0; }
+	if(rc.top < 0) { *lpy -= rc.top; rc.top = 0; }
+	if(rc.right > lpSrc->cx) rc.right = lpSrc->cx;
+	if(rc.bottom > lpSrc->cy) rc.bottom = lpSrc->cy;
+
+	// Against the destination.
+	if(*lpx < 0) { rc.left -= *lpx; *lpx = 0; }
+	if(*lpy < 0) { rc.top -= *lpy; *lpy = 0; }
+	if(*lpx + (rc.right - rc.left) > lpDst->cx) rc.right = rc.left + lpDst->cx - *lpx;
+	if(*lpy + (rc.bottom - rc.top) > lpDst->cy) rc.bottom = rc.top + lpDst->cy - *lpy;
+
+	*lprc = rc;
+
+	return rc.left < rc.right && rc.top < rc.bottom;
+}
+
+// Copies 'lprcSrc' of 'lpSrc', all of it if NULL, to 'x', 'y' in 'lpDst'.
+// Both must be in this format. They can be the same surface, the areas
+// can overlap.
+template<class FORMAT>
+static inline void Blit(LPDIBSURFACE lpDst, int x, int y, const DIBSURFACE* lpSrc, const RECT* lprcSrc)
+{
+	RECT rc;
+
+	if(!ClipBlit(lpDst, &x, &y, lpSrc, lprcSrc, &rc)) {
+		return;
+	}
+
+	int cb = (rc.right - rc.left) * FORMAT::BYTES;
+	int cy = rc.bottom - rc.top;
+	const BYTE* pSrc = lpSrc->pTop + (ptrdiff_t)rc.top * lpSrc->iPitch + rc.left * FORMAT::BYTES;
+	BYTE* pDst = lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch + x * FORMAT::BYTES;
+
+	// Moving down on the same surface, start at the bottom so no row is
+	// overwritten before it is copied.
+	if(lpDst->pBits == lpSrc->pBits && y > rc.top) {
+		for(int i = cy - 1; i >= 0; i--) {
+			memmove(pDst + (ptrdiff_t)i * lpDst->iPitch, pSrc + (ptrdiff_t)i * lpSrc->iPitch, cb);
+		}
+	}
+	else {
+		for(int i = 0; i < cy; i++) {
+			memmove(pDst + (ptrdiff_t)i * lpDst->iPitch, pSrc + (ptrdiff_t)i * lpSrc->iPitch, cb);
+		}
+	}
+
+	if(lpDst->lpDirty) {
+		MarkDirtyRect(lpDst->lpDirty, x, y, x + rc.right - rc.left, y + cy);
+	}
+}
+
+template<class FORMAT>
+static inline void ColorKeyRow_C(BYTE* pDst, const BYTE* pSrc, int n, typename FORMAT::PIXEL key)
+{
+	for(int i = 0; i < n; i++) {
+		typename FORMAT::PIXEL c = FORMAT::Load(pSrc, i);
+
+		if(c != key) {
+			FORMAT::Store(pDst, i, c);
+		}
+	}
+}
+
+#ifdef CPU_X86
+
+// The key in every pixel of a register, and which pixels equal it, for
+// the formats with a power of two bytes per pixel.
+template<int BYTES>
+CPU_TARGET("avx2") static inline __m256i SetKey_AVX2(DWORD key);
+
+template<>
+CPU_TARGET("avx2") inline __m256i SetKey_AVX2<1>(DWORD key)
+{
+	return _mm256_set1_epi8((char)key);
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i SetKey_AVX2<2>(DWORD key)
+{
+	return _mm256_set1_epi16((short)key);
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i SetKey_AVX2<4>(DWORD key)
+{
+	return _mm256_set1_epi32((int)key);
+}
+
+template<int BYTES>
+CPU_TARGET("avx2") static inline __m256i CompareKey_AVX2(__m256i c, __m256i key);
+
+template<>
+CPU_TARGET("avx2") inline __m256i CompareKey_AVX2<1>(__m256i c, __m256i key)
+{
+	return _mm256_cmpeq_epi8(c, key);
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i CompareKey_AVX2<2>(__m256i c, __m256i key)
+{
+	return _mm256_cmpeq_epi16(c, key);
+}
+
+template<>
+CPU_TARGET("avx2") inline __m256i CompareKey_AVX2<4>(__m256i c, __m256i key)
+{
+	return _mm256_cmpeq_epi32(c, key);
+}
+
+// Keeps the destination where the source equals the key. Every byte of
+// the destination is written, the ones that are kept with what was there.
+template<class FORMAT>
+CPU_TARGET("avx2") static void ColorKeyRow_AVX2(BYTE* pDst, const BYTE* pSrc, int n, typename FORMAT::PIXEL key)
+{
+	__m256i k = SetKey_AVX2<FORMAT::BYTES>(key);
+	int cb = n * FORMAT::BYTES;
+	int i = 0;
+
+	for(; i + 32 <= cb; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(pSrc + i));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(pDst + i));
+
+		_mm256_storeu_si256((__m256i*)(pDst + i), _mm256_blendv_epi8(s, d, CompareKey_AVX2<FORMAT::BYTES>(s, k)));
+	}
+
+	ColorKeyRow_C<FORMAT>(pDst + i, pSrc + i, (cb - i) / FORMAT::BYTES, key);
+}
+
+// 24bpp pixels don't fit a register evenly, that format always uses the
+// C version.
+template<>
+CPU_TARGET("avx2") void ColorKeyRow_AVX2<PF_BGR24>(BYTE* pDst, const BYTE* pSrc, int n, PF_BGR24::PIXEL key)
+{
+	ColorKeyRow_C<PF_BGR24>(pDst, pSrc, n, key);
+}
+
+#endif // CPU_X86
+
+// Picks the row function for a colorkey blit.
+template<class FORMAT>
+static inline void (*GetColorKeyRowProc())(BYTE*, const BYTE*, int, typename FORMAT::PIXEL)
+{
+#ifdef CPU_X86
+	if(GetCPUFeatures() & CPU_AVX2) {
+		return ColorKeyRow_AVX2<FORMAT>;
+	}
+#endif
+
+	return ColorKeyRow_C<FORMAT>;
+}
+
+// Like 'Blit', but leaves the destination alone where the source is
+// 'key'. The two areas must not overlap.
+template<class FORMAT>
+static inline void ColorKeyBlit(LPDIBSURFACE lpDst, int x, int y, const DIBSURFACE* lpSrc, const RECT* lprcSrc, typename FORMAT::PIXEL key)
+{
+	RECT rc;
+
+	if(!ClipBlit(lpDst, &x, &y, lpSrc, lprcSrc, &rc)) {
+		return;
+	}
+
+	void (*lpfnRow)(BYTE*, const BYTE*, int, typename FORMAT::PIXEL) = GetColorKeyRowProc<FORMAT>();
+	int cx = rc.right - rc.left;
+	int cy = rc.bottom - rc.top;
+	const BYTE* pSrc = lpSrc->pTop + (ptrdiff_t)rc.top * lpSrc->iPitch + rc.left * FORMAT::BYTES;
+	BYTE* pDst = lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch + x * FORMAT::BYTES;
+
+	for(int i = 0; i < cy; i++) {
+		lpfnRow(pDst + (ptrdiff_t)i * lpDst->iPitch, pSrc + (ptrdiff_t)i * lpSrc->iPitch, cx, key);
+	}
+
+	if(lpDst->lpDirty) {
+		MarkDirtyRect(lpDst->lpDirty, x, y, x + cx, y + cy);
+	}
+}
+
+//
+// The same for a surface of which the format is only known at runtime.
+// Colors are XRGB and packed into the format of the surface; for 8bpp
+// that is the gray level, as with 'PutDIBPixels'.
+//
+
+#define RASTER_DISPATCH(iFormat, CALL) \
+	switch(iFormat) { \
+	case DIBFMT_INDEX8:	{ typedef PF_INDEX8 FORMAT; CALL; } break; \
+	case DIBFMT_RGB555:	{ typedef PF_RGB555 FORMAT; CALL; } break; \
+	case DIBFMT_RGB565:	{ typedef PF_RGB565 FORMAT; CALL; } break; \
+	case DIBFMT_BGR24:	{ typedef PF_BGR24 FORMAT; CALL; } break; \
+	case DIBFMT_XRGB32:	{ typedef PF_XRGB32 FORMAT; CALL; } break; \
+	}
+
+static inline void FillDIBSpan(LPDIBSURFACE lpSurface, int x0, int x1, int y, DWORD dwColor)
+{
+	RASTER_DISPATCH(lpSurface->iFormat, FillSpan<FORMAT>(lpSurface, x0, x1, y, FORMAT::FromXRGB(dwColor)));
+}
+
+static inline void FillDIBRect(LPDIBSURFACE lpSurface, int left, int top, int right, int bottom, DWORD dwColor)
+{
+	RASTER_DISPATCH(lpSurface->iFormat, FillSurfaceRect<FORMAT>(lpSurface, left, top, right, bottom, FORMAT::FromXRGB(dwColor)));
+}
+
+static inline void DrawDIBLine(LPDIBSURFACE lpSurface, int x0, int y0, int x1, int y1, DWORD dwColor)
+{
+	RASTER_DISPATCH(lpSurface->iFormat, DrawLine<FORMAT>(lpSurface, x0, y0, x1, y1, FORMAT::FromXRGB(dwColor)));
+}
+
+// Returns FALSE if the surfaces are in different formats.
+static inline BOOL BlitDIB(LPDIBSURFACE lpDst, int x, int y, const DIBSURFACE* lpSrc, const RECT* lprcSrc)
+{
+	if(lpDst->iFormat != lpSrc->iFormat) {
+		return FALSE;
+	}
+
+	RASTER_DISPATCH(lpDst->iFormat, Blit<FORMAT>(lpDst, x, y, lpSrc, lprcSrc));
+
+	return TRUE;
+}
+
+static inline BOOL ColorKeyBlitDIB(LPDIBSURFACE lpDst, int x, int y, const DIBSURFACE* lpSrc, const RECT* lprcSrc, DWORD dwKey)
+{
+	if(lpDst->iFormat != lpSrc->iFormat) {
+		return FALSE;
+	}
+
+	RASTER_DISPATCH(lpDst->iFormat, ColorKeyBlit<FORMAT>(lpDst, x, y, lpSrc, lprcSrc, FORMAT::FromXRGB(dwKey)));
+
+	return TRUE;
+}
+
+#undef RASTER_DISPATCH
+
+#endif // RASTER_H
@@ -0,0 +1,594 @@
+
+#ifndef RLE_H
+#define RLE_H
+
+// RLE compressed bitmaps.
+//
+// An 8bpp bitmap with large areas of the same color, which is what most
+// palettized artwork is, can be stored a lot smaller with BI_RLE8 (or
+// BI_RLE4 for 16 colors). The pixel data is then a stream of codes, read
+// from the bottom scanline up:
+//
+//   n, c          A run of 'n' pixels of color 'c'. For RLE4 'c' holds two
+//                 colors, the pixels take turns using the high and the
+//                 low nibble.
+//   0, 0          End of the scanline, the rest of it is left alone.
+//   0, 1          End of the bitmap.
+//   0, 2, dx, dy  Move 'dx' pixels right and 'dy' scanlines up.
+//   0, n, ...     'n' (3 or more) pixels stored as they are, padded to a
+//                 WORD boundary.
+//
+// The decoder below takes that stream in chunks of any size, so it can be
+// fed straight from a file or a socket, and writes into an 8bpp surface.
+// Nothing in the stream is trusted: runs, literals and moves that go past
+// the edge of the surface are clipped, and codes cut off at the end of a
+// chunk are kept until the next one comes in. Pixels the stream skips
+// over are color 0.
+//
+// The encoder works out, for every scanline, the sequence of runs and
+// literals that takes the fewest bytes.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "dib.h"
+#include "bmpmap.h"
+#include "bmpwrite.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RLESTATE_CODE		0	// Expecting the next code
+#define RLESTATE_LITERAL	1	// Somewhere inside the pixels of a literal
+#define RLESTATE_PAD		2	// Skipping the pad byte after a literal
+#define RLESTATE_DONE		3	// End of bitmap, or moved past the top
+
+typedef struct tagRLEDECODER {
+	LPDIBSURFACE	lpDst;
+	int				iBits;		// 8 for BI_RLE8, 4 for BI_RLE4
+	int				x;
+	int				y;			// Scanline in stream order, 0 is the bottom one
+	int				iState;
+	int				cLiteral;	// Pixels of the literal still to come
+	BOOL			bPad;		// Literal is followed by a pad byte
+	BYTE			code[4];	// Code that was cut off at the end of a chunk
+	int				cCode;
+} RLEDECODER, *LPRLEDECODER;
+
+static inline BYTE* GetRLEScanline(const RLEDECODER* lpDecoder)
+{
+	const DIBSURFACE* lpDst = lpDecoder->lpDst;
+	return lpDst->pTop + (size_t)(lpDst->cy - 1 - lpDecoder->y) * lpDst->iPitch;
+}
+
+// Moves 'n' pixels to the right. Anything past the right edge is clipped
+// anyway, so 'x' never needs to go further than that.
+static inline void SkipRLEPixels(LPRLEDECODER lpDecoder, int n)
+{
+	lpDecoder->x = n < lpDecoder->lpDst->cx - lpDecoder->x ? lpDecoder->x + n : lpDecoder->lpDst->cx;
+}
+
+// Number of the 'n' pixels from 'x' on that are inside the surface.
+static inline int ClipRLEPixels(const RLEDECODER* lpDecoder, int n)
+{
+	int cLeft = lpDecoder->lpDst->cx - lpDecoder->x;
+	return n < cLeft ? n : cLeft;
+}
+
+static inline void DecodeRLERun(LPRLEDECODER lpDecoder, int n, BYTE c)
+{
+	BYTE* pDst = GetRLEScanline(lpDecoder) + lpDecoder->x;
+	int m = ClipRLEPixels(lpDecoder, n);
+
+	if(lpDecoder->iBits == 8 || (c >> 4) == (c & 0x0F)) {
+		memset(pDst, lpDecoder->iBits == 8 ? c : c & 0x0F, m);
+	}
+	else {
+		BYTE c0 = c >> 4, c1 = c & 0x0F;
+		int i;
+
+		for(i = 0; i + 1 < m; i += 2) {
+			pDst[i] = c0;
+			pDst[i + 1] = c1;
+		}
+
+		if(i < m) {
+			pDst[i] = c0;
+		}
+	}
+
+	SkipRLEPixels(lpDecoder, n);
+}
+
+// Copies the literal pixels held by 'cb' bytes of the stream.
+static inline void DecodeRLELiteral(LPRLEDECODER lpDecoder, const BYTE* pSrc, int cb)
+{
+	BYTE* pDst = GetRLEScanline(lpDecoder) + lpDecoder->x;
+
+	if(lpDecoder->iBits == 8) {
+		memcpy(pDst, pSrc, ClipRLEPixels(lpDecoder, cb));
+		SkipRLEPixels(lpDecoder, cb);
+		lpDecoder->cLiteral -= cb;
+		return;
+	}
+
+	// Two pixels per byte, except maybe for the last one.
+	int n = cb * 2 < lpDecoder->cLiteral ? cb * 2 : lpDecoder->cLiteral;
+	int m = ClipRLEPixels(lpDecoder, n);
+
+	for(int i = 0; i < m; i++) {
+		pDst[i] = (i & 1) ? pSrc[i >> 1] & 0x0F : pSrc[i >> 1] >> 4;
+	}
+
+	SkipRLEPixels(lpDecoder, n);
+	lpDecoder->cLiteral -= n;
+}
+
+// Carries out one complete code, 2 or 4 bytes.
+static inline void DecodeRLECode(LPRLEDECODER lpDecoder, const BYTE* pCode)
+{
+	if(pCode[0]) {
+		DecodeRLERun(lpDecoder, pCode[0], pCode[1]);
+		return;
+	}
+
+	switch(pCode[1]) {
+	case 0:
+		lpDecoder->x = 0;
+		lpDecoder->y++;
+		break;
+
+	case 1:
+		lpDecoder->iState = RLESTATE_DONE;
+		return;
+
+	case 2:
+		SkipRLEPixels(lpDecoder, pCode[2]);
+		lpDecoder->y += pCode[3];
+		break;
+
+	default:
+		lpDecoder->cLiteral = pCode[1];
+		lpDecoder->bPad = ((lpDecoder->iBits == 8 ? pCode[1] : (pCode[1] + 1) / 2) & 1) != 0;
+		lpDecoder->iState = RLESTATE_LITERAL;
+		break;
+	}
+
+	if(lpDecoder->y >= lpDecoder->lpDst->cy) {
+		lpDecoder->iState = RLESTATE_DONE;
+	}
+}
+
+// Gets ready to decode an RLE stream into 'lpDst', which must be an 8bpp
+// surface of the size of the bitmap. 'iBits' is 8 for BI_RLE8 and 4 for
+// BI_RLE4. The surface is cleared to color 0.
+static inline BOOL BeginRLEDecode(LPRLEDECODER lpDecoder, LPDIBSURFACE lpDst, int iBits)
+{
+	ZeroMemory(lpDecoder, sizeof(RLEDECODER));
+
+	if(lpDst->iFormat != DIBFMT_INDEX8 || (iBits != 8 && iBits != 4)) {
+		return FALSE;
+	}
+
+	lpDecoder->lpDst = lpDst;
+	lpDecoder->iBits = iBits;
+
+	for(int y = 0; y < lpDst->cy; y++) {
+		ZeroMemory(lpDst->pTop + (size_t)y * lpDst->iPitch, lpDst->cx);
+	}
+
+	return TRUE;
+}
+
+// Decodes the next 'cb' bytes of the stream. Chunks can be split anywhere,
+// even in the middle of a code. Returns FALSE once the end of the bitmap
+// has been reached, everything after that is ignored.
+static inline BOOL DecodeRLEChunk(LPRLEDECODER lpDecoder, const BYTE* pData, size_t cb)
+{
+	const BYTE* p = pData;
+	const BYTE* pEnd = pData + cb;
+
+	while(p < pEnd && lpDecoder->iState != RLESTATE_DONE) {
+		if(lpDecoder->iState == RLESTATE_LITERAL) {
+			int cbLiteral = lpDecoder->iBits == 8 ? lpDecoder->cLiteral : (lpDecoder->cLiteral + 1) / 2;
+
+			if((size_t)cbLiteral > (size_t)(pEnd - p)) {
+				cbLiteral = (int)(pEnd - p);
+			}
+
+			DecodeRLELiteral(lpDecoder, p, cbLiteral);
+			p += cbLiteral;
+
+			if(lpDecoder->cLiteral == 0) {
+				lpDecoder->iState = lpDecoder->bPad ? RLESTATE_PAD : RLESTATE_CODE;
+			}
+			continue;
+		}
+
+		if(lpDecoder->iState == RLESTATE_PAD) {
+			p++;
+			lpDecoder->iState = RLESTATE_CODE;
+			continue;
+		}
+
+		// Most of the time the whole code is right here and is used in
+		// place. Otherwise collect it in the decoder first.
+		if(lpDecoder->cCode == 0 && pEnd - p >= 4) {
+			const BYTE* pCode = p;
+
+			p += pCode[0] == 0 && pCode[1] == 2 ? 4 : 2;
+			DecodeRLECode(lpDecoder, pCode);
+			continue;
+		}
+
+		while(lpDecoder->cCode < 2 && p < pEnd) {
+			lpDecoder->code[lpDecoder->cCode++] = *p++;
+		}
+
+		int cNeed = lpDecoder->code[0] == 0 && lpDecoder->code[1] == 2 ? 4 : 2;
+
+		while(lpDecoder->cCode < cNeed && p < pEnd) {
+			lpDecoder->code[lpDecoder->cCode++] = *p++;
+		}
+
+		if(lpDecoder->cCode < cNeed) {
+			break;
+		}
+
+		lpDecoder->cCode = 0;
+		DecodeRLECode(lpDecoder, lpDecoder->code);
+	}
+
+	return lpDecoder->iState != RLESTATE_DONE;
+}
+
+// Call after the last chunk. Returns FALSE if the stream was cut off in
+// the middle of a code or a literal. A stream without an end of bitmap
+// is fine, plenty of writers leave it out.
+static inline BOOL EndRLEDecode(LPRLEDECODER lpDecoder)
+{
+	return lpDecoder->iState == RLESTATE_DONE || (lpDecoder->iState == RLESTATE_CODE && lpDecoder->cCode == 0);
+}
+
+// Decodes the pixels of an RLE compressed bitmap view into 'lpDst', an
+// 8bpp surface as big as the bitmap.
+static inline BOOL DecodeRLEBitmap(const BITMAPVIEW* lpView, LPDIBSURFACE lpDst)
+{
+	RLEDECODER decoder;
+	int iBits = lpView->bih.biCompression == BI_RLE8 ? 8 : lpView->bih.biCompression == BI_RLE4 ? 4 : 0;
+
+	if(lpDst->cx != lpView->cx || lpDst->cy != lpView->cy || !BeginRLEDecode(&decoder, lpDst, iBits)) {
+		return FALSE;
+	}
+
+	DecodeRLEChunk(&decoder, lpView->pBits, lpView->cbBits);
+	return EndRLEDecode(&decoder);
+}
+
+// Creates an 8bpp surface with the color table of an RLE compressed
+// bitmap view and decodes the bitmap into it.
+static inline BOOL CreateRLEDIBSurface(const BITMAPVIEW* lpView, LPDIBSURFACE lpSurface)
+{
+	if(!CreateDIBSurface(lpSurface, lpView->cx, lpView->cy, 8, DIBALLOC_NOZERO)) {
+		return FALSE;
+	}
+
+	LPBITMAPINFO lpBmi = lpSurface->lpBmi;
+
+	ZeroMemory(lpBmi->bmiColors, sizeof(RGBQUAD) * 256);
+	memcpy(lpBmi->bmiColors, lpView->lpPalette, sizeof(RGBQUAD) * lpView->iColors);
+	lpBmi->bmiHeader.biClrUsed = lpView->iColors;
+
+	if(!DecodeRLEBitmap(lpView, lpSurface)) {
+		FreeDIBSurface(lpSurface);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//
+// Encoding.
+//
+
+#define RLESEG_RUN		0
+#define RLESEG_LITERAL	1
+
+// The most bytes 'EncodeRLE' can produce for a bitmap of this size.
+static inline size_t GetRLEBound(int cx, int cy)
+{
+	return (size_t)cy * ((size_t)cx + 4 * ((size_t)cx / 255 + 2) + 2) + 2;
+}
+
+// Scratch memory for encoding scanlines of up to 'cx' pixels.
+typedef struct tagRLESCRATCH {
+	int*	pCost;		// Fewest bytes for the first i pixels
+	int*	pFrom;		// Where the last segment of that starts
+	BYTE*	pType;		// And what it is
+	int*	pQueues;	// Sliding window minimum per group, see below
+	int*	pKeys;		// The value each queue is ordered by
+} RLESCRATCH;
+
+// Artwork often has whole scanlines where every color lasts at least two
+// pixels for RLE8, or four for RLE4. A literal over such pixels is never
+// smaller than the runs it would replace, each run piece inside it costs
+// the literal at least two bytes, so those scanlines are written as plain
+// runs without going through the search. Returns 0 if the scanline isn't
+// like that.
+static inline size_t EncodeRLERuns(const BYTE* pRow, int cx, int iBits, BYTE* pDst)
+{
+	const int cMin = iBits == 8 ? 2 : 4;
+	BYTE* pOut = pDst;
+
+	for(int x = 0; x < cx; ) {
+		int n = 1;
+
+		while(x + n < cx && pRow[x + n] == pRow[x]) {
+			n++;
+		}
+
+		if(n < cMin && n < cx) {
+			return 0;
+		}
+
+		for(int k = 0; k < n; k += 255) {
+			*pOut++ = (BYTE)(n - k < 255 ? n - k : 255);
+			*pOut++ = iBits == 8 ? pRow[x] : (BYTE)((pRow[x] << 4) | pRow[x]);
+		}
+
+		x += n;
+	}
+
+	return pOut - pDst;
+}
+
+// Finds the cheapest way to encode one scanline and writes it out. Every
+// prefix of the scanline gets the fewest bytes it can be encoded in, ending
+// either in a run or in a literal:
+//
+//   - A run costs 2 bytes for up to 255 pixels. Encoding fewer pixels never
+//     costs more, so the longest run that ends here is always the best one.
+//   - A literal of 3 to 255 pixels costs 2 bytes plus its pixels, padded to
+//     a WORD: 2 + 2 * ceil(n / G) with G = 2 for RLE8 and G = 4 for RLE4.
+//     With i = G * a + r and j = G * b + s that is 2 + 2 * (a - b) plus 2
+//     more if r > s, so per remainder s we only need the smallest
+//     'cost[j] - 2 * b' in the window, which a monotone queue gives us in
+//     constant time. G is a power of two, so the divisions are shifts.
+//
+// Returns the number of bytes written.
+static inline size_t EncodeRLEScanline(const BYTE* pRow, int cx, int iBits, RLESCRATCH* lpScratch, BYTE* pDst)
+{
+	const int G = iBits == 8 ? 2 : 4;
+	const int iShift = iBits == 8 ? 1 : 2;
+	int* pCost = lpScratch->pCost;
+	int* pFrom = lpScratch->pFrom;
+	BYTE* pType = lpScratch->pType;
+	int* pKeys = lpScratch->pKeys;
+	int iHead[4], iTail[4];
+	int cRun = 0;
+
+	size_t cbRuns = EncodeRLERuns(pRow, cx, iBits, pDst);
+
+	if(cbRuns) {
+		return cbRuns;
+	}
+
+	for(int s = 0; s < G; s++) {
+		iHead[s] = iTail[s] = 0;
+	}
+
+	pCost[0] = 0;
+
+	for(int i = 1; i <= cx; i++) {
+		int p = i - 1;
+
+		// Length of the run that ends with pixel 'p'. For RLE4 a run is any
+		// stretch where every pixel equals the one two places back.
+		if(iBits == 8) {
+			cRun = p > 0 && pRow[p] == pRow[p - 1] ? cRun + 1 : 1;
+		}
+		else {
+			cRun = p > 1 && pRow[p] == pRow[p - 2] ? cRun + 1 : (p > 0 ? 2 : 1);
+		}
+
+		int cLen = cRun < 255 ? cRun : 255;
+
+		pCost[i] = pCost[i - cLen] + 2;
+		pFrom[i] = i - cLen;
+		pType[i] = RLESEG_RUN;
+
+		// The literal window is j = i - 255 up to i - 3. Each step one 'j'
+		// comes in and at most one, 'i - 256', drops out.
+		int j = i - 3;
+
+		if(j >= 0) {
+			int s = j & (G - 1);
+			int iKey = pCost[j] - 2 * (j >> iShift);
+			int* pQueue = lpScratch->pQueues + s * (cx + 1);
+			int* pKey = pKeys + s * (cx + 1);
+
+			while(iTail[s] > iHead[s] && pKey[iTail[s] - 1] >= iKey) {
+				iTail[s]--;
+			}
+
+			pQueue[iTail[s]] = j;
+			pKey[iTail[s]++] = iKey;
+		}
+
+		if(i >= 256) {
+			int s = (i - 256) & (G - 1);
+
+			if(iTail[s] > iHead[s] && lpScratch->pQueues[s * (cx + 1) + iHead[s]] == i - 256) {
+				iHead[s]++;
+			}
+		}
+
+		int iBase = 2 + 2 * (i >> iShift);
+
+		for(int s = 0; s < G; s++) {
+			if(iTail[s] > iHead[s]) {
+				int iCost = pKeys[s * (cx + 1) + iHead[s]] + iBase + ((i & (G - 1)) > s ? 2 : 0);
+
+				if(iCost < pCost[i]) {
+					pCost[i] = iCost;
+					pFrom[i] = lpScratch->pQueues[s * (cx + 1) + iHead[s]];
+					pType[i] = RLESEG_LITERAL;
+				}
+			}
+		}
+	}
+
+	// Walk back from the end to find the segments, remembering where each
+	// one starts in 'pCost', which we don't need anymore.
+	int cSegments = 0;
+
+	for(int i = cx; i > 0; i = pFrom[i]) {
+		pCost[cSegments++] = i;
+	}
+
+	BYTE* pOut = pDst;
+
+	while(cSegments--) {
+		int i = pCost[cSegments];
+		int j = pFrom[i];
+		int n = i - j;
+
+		if(pType[i] == RLESEG_RUN) {
+			*pOut++ = (BYTE)n;
+			*pOut++ = iBits == 8 ? pRow[j] : (BYTE)((pRow[j] << 4) | pRow[n > 1 ? j + 1 : j]);
+		}
+		else
+		if(iBits == 8) {
+			*pOut++ = 0;
+			*pOut++ = (BYTE)n;
+			memcpy(pOut, pRow + j, n);
+			pOut += n;
+
+			if(n & 1) {
+				*pOut++ = 0;
+			}
+		}
+		else {
+			int cb = (n + 1) / 2;
+
+			*pOut++ = 0;
+			*pOut++ = (BYTE)n;
+
+			for(int k = 0; k < n; k += 2) {
+				*pOut++ = (BYTE)((pRow[j + k] << 4) | (k + 1 < n ? pRow[j + k + 1] : 0));
+			}
+
+			if(cb & 1) {
+				*pOut++ = 0;
+			}
+		}
+	}
+
+	return pOut - pDst;
+}
+
+// Encodes an 8bpp surface as BI_RLE8 ('iBits' = 8) or BI_RLE4 (4) into
+// 'pDst', which should be 'GetRLEBound' bytes. For RLE4 every pixel must
+// be below 16. Returns the size of the encoded data, or 0 if it didn't
+// fit or the pixels can't be encoded.
+static inline size_t EncodeRLE(const DIBSURFACE* lpSrc, int iBits, BYTE* pDst, size_t cbDst)
+{
+	RLESCRATCH scratch;
+	size_t cbRow = GetRLEBound(lpSrc->cx, 1) - 2;
+	size_t cb = 0;
+	int cx = lpSrc->cx;
+	void* pScratch;
+
+	if(lpSrc->iFormat != DIBFMT_INDEX8 || (iBits != 8 && iBits != 4)) {
+		return 0;
+	}
+
+	if((pScratch = malloc((sizeof(int) * 10 + 1) * (cx + 1))) == NULL) {
+		return 0;
+	}
+
+	scratch.pCost = (int*)pScratch;
+	scratch.pFrom = scratch.pCost + (cx + 1);
+	scratch.pQueues = scratch.pFrom + (cx + 1);
+	scratch.pKeys = scratch.pQueues + 4 * (cx + 1);
+	scratch.pType = (BYTE*)(scratch.pKeys + 4 * (cx + 1));
+
+	// RLE bitmaps are bottom-up, so start with the bottom scanline.
+	for(int y = lpSrc->cy - 1; y >= 0; y--) {
+		const BYTE* pRow = lpSrc->pTop + (size_t)y * lpSrc->iPitch;
+
+		if(cbDst - cb < cbRow) {
+			cb = 0;
+			break;
+		}
+
+		if(iBits == 4) {
+			BYTE bOr = 0;
+
+			for(int x = 0; x < cx; x++) {
+				bOr |= pRow[x];
+			}
+
+			if(bOr > 15) {
+				cb = 0;
+				break;
+			}
+		}
+
+		cb += EncodeRLEScanline(pRow, cx, iBits, &scratch, pDst + cb);
+
+		// End of line, or end of bitmap after the top one.
+		pDst[cb++] = 0;
+		pDst[cb++] = y ? 0 : 1;
+	}
+
+	free(pScratch);
+
+	return cb;
+}
+
+// Writes an 8bpp surface to an RLE compressed bitmap file, with the color
+// table of the surface. 'lpcbData' receives the size of the compressed
+// pixel data if it isn't NULL.
+static inline BOOL WriteRLEBitmapFile(LPCSTR lpszFilename, const DIBSURFACE* lpSrc, int iBits, size_t* lpcbData)
+{
+	const BITMAPINFOHEADER* lpbihSrc = &lpSrc->lpBmi->bmiHeader;
+	BITMAPINFOHEADER bih;
+	BYTE* pData;
+	size_t cbData;
+	int iColors = lpbihSrc->biClrUsed ? (int)lpbihSrc->biClrUsed : 256;
+	BOOL bResult;
+
+	if(iColors > (1 << iBits)) {
+		iColors = 1 << iBits;
+	}
+
+	if((pData = (BYTE*)malloc(GetRLEBound(lpSrc->cx, lpSrc->cy))) == NULL) {
+		return FALSE;
+	}
+
+	if((cbData = EncodeRLE(lpSrc, iBits, pData, GetRLEBound(lpSrc->cx, lpSrc->cy))) == 0 || cbData > 0xFFFFFFFF) {
+		free(pData);
+		return FALSE;
+	}
+
+	ZeroMemory(&bih, sizeof(bih));
+	bih.biSize = sizeof(BITMAPINFOHEADER);
+	bih.biWidth = lpSrc->cx;
+	bih.biHeight = lpSrc->cy;
+	bih.biPlanes = 1;
+	bih.biBitCount = (WORD)iBits;
+	bih.biCompression = iBits == 8 ? BI_RLE8 : BI_RLE4;
+	bih.biSizeImage = (DWORD)cbData;
+
+	bResult = WriteBitmapBits(lpszFilename, &bih, NULL, lpSrc->lpBmi->bmiColors, iColors, pData);
+
+	if(lpcbData) {
+		*lpcbData = cbData;
+	}
+
+	free(pData);
+
+	return bResult;
+}
+
+#endif // RLE_H
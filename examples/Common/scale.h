@@ -0,0 +1,639 @@
+
+#ifndef SCALE_H
+#define SCALE_H
+
+// Scaling DIB surfaces in software.
+//
+// This does what 'StretchDIBits' does for us in Examples 3 and 4, without
+// needing GDI and on as many cores as we have. Scaling is split in two
+// steps:
+//
+// 1. 'CreateScalePlan' works out, once for every source and destination
+//    size, which source columns and rows every destination pixel is made
+//    of and with what weights. It also cuts the destination into tiles
+//    that fit in the cache.
+//
+// 2. 'ScaleDIBSurface' runs the plan. Every tile is a task on a thread
+//    pool. A tile filters every source scanline it needs horizontally
+//    once, into a small cache of rows with 16 bits per channel, and then
+//    blends the cached rows of every destination scanline vertically.
+//    When scaling up, several destination scanlines share their source
+//    scanlines. Both passes run on SSE2 where there is one.
+//    'ScaleDIBSurfaceRect' does the same for only the tiles that touch a
+//    rectangle.
+//
+// Nearest neighbour does not filter at all; it copies pixels through a
+// table of source byte offsets and copies whole scanlines when several
+// destination scanlines come from the same source scanline, which is what
+// happens all the time when scaling up.
+//
+// Both surfaces must be in the same format. For 8bpp the filtered modes
+// treat the index as a gray level, which is right for the grayscale color
+// table 'CreateDIB' builds.
+
+#include "cpu.h"
+#include "dibtypes.h"
+#include "surface.h"
+#include "threadpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SCALE_NEAREST	0
+#define SCALE_BILINEAR	1
+#define SCALE_BOX		2
+
+// Destination tile size in pixels. 128 x 64 pixels at 32bpp is 32K.
+#define SCALE_TILE_CX	128
+#define SCALE_TILE_CY	64
+
+// Weights are fixed point with this many fraction bits.
+#define SCALE_BITS		14
+
+// The cached rows keep this many fraction bits of every channel, which
+// still leaves room in a short.
+#define SCALE_ROW_BITS	6
+
+// The source pixels one destination column (or row) is made of.
+typedef struct tagSCALETAPS {
+	int		iFirst;		// First source column or row
+	int		cTaps;		// Number of source columns or rows
+	int		iWeights;	// Index of the first weight in 'pWeights'
+} SCALETAPS;
+
+typedef struct tagSCALEAXIS {
+	SCALETAPS*	pTaps;		// One per destination column or row
+	short*		pWeights;	// 'cTaps' weights per destination column or row, summing up to 1 << SCALE_BITS
+	int			cMaxTaps;
+} SCALEAXIS;
+
+typedef struct tagSCALEPLAN {
+	int			iMode;
+	int			cxSrc, cySrc;
+	int			cxDst, cyDst;
+	SCALEAXIS	x;
+	SCALEAXIS	y;
+	int*		pOffsets;		// Nearest: source byte offset of every destination column
+	DWORD		dwFeatures;		// Filtered: the CPU_ features the kernels may use
+	int			cxTiles;
+	int			cyTiles;
+	int			cbScratch;		// Scratch bytes a filtering task needs
+	int			cScratch;		// Number of scratch buffers allocated
+	BYTE*		pScratch;
+} SCALEPLAN, *LPSCALEPLAN;
+
+// Builds the taps for one axis. 'cSrc' source pixels are scaled to 'cDst'
+// destination pixels.
+static inline BOOL BuildScaleAxis(SCALEAXIS* lpAxis, int cSrc, int cDst, int iMode)
+{
+	double dScale = (double)cSrc / cDst;
+	int cMaxTaps;
+
+	switch(iMode) {
+	case SCALE_NEAREST:		cMaxTaps = 1; break;
+	case SCALE_BILINEAR:	cMaxTaps = 2; break;
+	default:				cMaxTaps = (int)ceil(dScale) + 2; break;
+	}
+
+	lpAxis->cMaxTaps = cMaxTaps;
+	lpAxis->pTaps = (SCALETAPS*)malloc(sizeof(SCALETAPS) * cDst);
+	lpAxis->pWeights = (short*)malloc(sizeof(short) * cMaxTaps * cDst);
+
+	if(!lpAxis->pTaps || !lpAxis->pWeights) {
+		return FALSE;
+	}
+
+	for(int i = 0; i < cDst; i++) {
+		SCALETAPS* t = &lpAxis->pTaps[i];
+		short* w = lpAxis->pWeights + i * cMaxTaps;
+		double dCenter = (i + 0.5) * dScale;
+
+		t->iWeights = i * cMaxTaps;
+
+		if(iMode == SCALE_NEAREST) {
+			t->iFirst = (int)dCenter;
+			t->cTaps = 1;
+			w[0] = 1 << SCALE_BITS;
+		}
+		else
+		if(iMode == SCALE_BILINEAR) {
+			double dPos = dCenter - 0.5;
+			int iLeft = (int)floor(dPos);
+			int iFrac = (int)((dPos - iLeft) * (1 << SCALE_BITS) + 0.5);
+
+			// At the edges both taps land on the same pixel.
+			if(iLeft < 0) {
+				iLeft = 0;
+				iFrac = 0;
+			}
+
+			if(iLeft >= cSrc - 1) {
+				iLeft = cSrc - 1;
+				iFrac = 0;
+			}
+
+			t->iFirst = iLeft;
+			t->cTaps = iFrac ? 2 : 1;
+			w[0] = (short)((1 << SCALE_BITS) - iFrac);
+			w[1] = (short)iFrac;
+		}
+		else {
+			// A box covers [i, i + 1) in destination pixels, which is
+			// [i * scale, (i + 1) * scale) in source pixels. Every source
+			// pixel weighs in with how much of it is covered.
+			double dStart = i * dScale;
+			double dEnd = (i + 1) * dScale;
+			int iFirst = (int)floor(dStart);
+			int iLast = (int)ceil(dEnd) - 1;
+			int iSum = 0, iMax = 0;
+
+			if(iLast >= cSrc) {
+				iLast = cSrc - 1;
+			}
+
+			t->iFirst = iFirst;
+			t->cTaps = iLast - iFirst + 1;
+
+			for(int j = 0; j < t->cTaps; j++) {
+				double dLeft = iFirst + j < dStart ? dStart : iFirst + j;
+				double dRight = iFirst + j + 1 > dEnd ? dEnd : iFirst + j + 1;
+
+				w[j] = (short)((dRight - dLeft) / dScale * (1 << SCALE_BITS) + 0.5);
+				iSum += w[j];
+
+				if(w[j] > w[iMax]) {
+					iMax = j;
+				}
+			}
+
+			// Rounding may leave us a little off, the biggest weight takes it.
+			w[iMax] += (short)((1 << SCALE_BITS) - iSum);
+		}
+	}
+
+	return TRUE;
+}
+
+static inline void FreeScalePlan(LPSCALEPLAN lpPlan)
+{
+	free(lpPlan->x.pTaps);
+	free(lpPlan->x.pWeights);
+	free(lpPlan->y.pTaps);
+	free(lpPlan->y.pWeights);
+	free(lpPlan->pOffsets);
+	free(lpPlan->pScratch);
+
+	ZeroMemory(lpPlan, sizeof(SCALEPLAN));
+}
+
+// Works out everything that only depends on the sizes and the mode. Do
+// this again whenever one of them changes, not for every frame.
+static inline BOOL CreateScalePlan(LPSCALEPLAN lpPlan, int cxSrc, int cySrc, int cxDst, int cyDst, int iMode, int iBytesPerPixel)
+{
+	ZeroMemory(lpPlan, sizeof(SCALEPLAN));
+
+	if(cxSrc <= 0 || cySrc <= 0 || cxDst <= 0 || cyDst <= 0) {
+		return FALSE;
+	}
+
+	lpPlan->iMode = iMode;
+	lpPlan->cxSrc = cxSrc;
+	lpPlan->cySrc = cySrc;
+	lpPlan->cxDst = cxDst;
+	lpPlan->cyDst = cyDst;
+	lpPlan->cxTiles = (cxDst + SCALE_TILE_CX - 1) / SCALE_TILE_CX;
+	lpPlan->cyTiles = (cyDst + SCALE_TILE_CY - 1) / SCALE_TILE_CY;
+
+	if(!BuildScaleAxis(&lpPlan->x, cxSrc, cxDst, iMode) || !BuildScaleAxis(&lpPlan->y, cySrc, cyDst, iMode)) {
+		FreeScalePlan(lpPlan);
+		return FALSE;
+	}
+
+	if(iMode == SCALE_NEAREST) {
+		if((lpPlan->pOffsets = (int*)malloc(sizeof(int) * cxDst)) == NULL) {
+			FreeScalePlan(lpPlan);
+			return FALSE;
+		}
+
+		for(int x = 0; x < cxDst; x++) {
+			lpPlan->pOffsets[x] = lpPlan->x.pTaps[x].iFirst * iBytesPerPixel;
+		}
+	}
+	else {
+		// A filtering task caches as many rows as one destination scanline
+		// reads, and needs a scanline of XRGB and the taps of one scanline.
+		int cRows = lpPlan->y.cMaxTaps;
+
+		lpPlan->dwFeatures = GetCPUFeatures();
+		lpPlan->cbScratch = (int)((cRows * SCALE_TILE_CX * 4 * sizeof(short) + SCALE_TILE_CX * sizeof(DWORD) + (cRows + 1) * (sizeof(short*) + sizeof(short)) + 63) & ~63);
+	}
+
+	return TRUE;
+}
+
+//
+// Nearest neighbour.
+//
+
+template<int BYTES>
+static inline void CopyPixel(BYTE* pDst, const BYTE* pSrc)
+{
+	switch(BYTES) {
+	case 1: *pDst = *pSrc; break;
+	case 2: *(WORD*)pDst = *(const WORD*)pSrc; break;
+	case 3: pDst[0] = pSrc[0]; pDst[1] = pSrc[1]; pDst[2] = pSrc[2]; break;
+	case 4: *(DWORD*)pDst = *(const DWORD*)pSrc; break;
+	}
+}
+
+template<int BYTES>
+static inline void ScaleTileNearest(const SCALEPLAN* lpPlan, LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc, int x0, int y0, int x1, int y1)
+{
+	const int* pOffsets = lpPlan->pOffsets;
+	BYTE* pPrevious = NULL;
+	int iPrevious = -1;
+
+	for(int y = y0; y < y1; y++) {
+		int iSrcRow = lpPlan->y.pTaps[y].iFirst;
+		BYTE* pDst = lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch + x0 * BYTES;
+
+		// Same source scanline as the one above, just copy that one.
+		if(iSrcRow == iPrevious) {
+			memcpy(pDst, pPrevious, (x1 - x0) * BYTES);
+			continue;
+		}
+
+		const BYTE* pSrc = lpSrc->pTop + (ptrdiff_t)iSrcRow * lpSrc->iPitch;
+
+		for(int x = x0; x < x1; x++) {
+			CopyPixel<BYTES>(pDst + (x - x0) * BYTES, pSrc + pOffsets[x]);
+		}
+
+		pPrevious = pDst;
+		iPrevious = iSrcRow;
+	}
+}
+
+//
+// Filtered modes.
+//
+
+// Source pixel as XRGB. 8bpp is taken as a gray level.
+template<class FORMAT>
+static inline DWORD FetchXRGB(const BYTE* pRow, int x)
+{
+	return FORMAT::ToXRGB(FORMAT::Load(pRow, x));
+}
+
+template<>
+inline DWORD FetchXRGB<PF_INDEX8>(const BYTE* pRow, int x)
+{
+	return pRow[x] * 0x00010101;
+}
+
+// Filters the source columns of destination columns 'x0' up to 'x1' of one
+// source scanline into a cached row, four shorts per pixel: blue, green,
+// red and 0, with SCALE_ROW_BITS fraction bits.
+template<class FORMAT>
+static inline void FilterScaleRow_C(const SCALEPLAN* lpPlan, short* pRow, const BYTE* pSrc, int x0, int x1)
+{
+	const int iRound = 1 << (SCALE_BITS - SCALE_ROW_BITS - 1);
+
+	for(int x = x0; x < x1; x++, pRow += 4) {
+		const SCALETAPS* tx = &lpPlan->x.pTaps[x];
+		const short* wx = lpPlan->x.pWeights + tx->iWeights;
+		int r = iRound, g = iRound, b = iRound;
+
+		for(int k = 0; k < tx->cTaps; k++) {
+			DWORD c = FetchXRGB<FORMAT>(pSrc, tx->iFirst + k);
+
+			r += wx[k] * (int)((c >> 16) & 0xFF);
+			g += wx[k] * (int)((c >> 8) & 0xFF);
+			b += wx[k] * (int)(c & 0xFF);
+		}
+
+		pRow[0] = (short)(b >> (SCALE_BITS - SCALE_ROW_BITS));
+		pRow[1] = (short)(g >> (SCALE_BITS - SCALE_ROW_BITS));
+		pRow[2] = (short)(r >> (SCALE_BITS - SCALE_ROW_BITS));
+		pRow[3] = 0;
+	}
+}
+
+// Blends the 'cTaps' cached rows in 'pRows' with the weights in 'w' into
+// 'cx' XRGB pixels. 'pRows' and 'w' have one more entry with weight 0, so
+// the taps can be taken two at a time.
+static inline DWORD BlendScalePixel(const short* const* pRows, const short* w, int cTaps, int i)
+{
+	const int iRound = 1 << (SCALE_BITS + SCALE_ROW_BITS - 1);
+	int b = iRound, g = iRound, r = iRound;
+
+	for(int k = 0; k < cTaps; k++) {
+		b += w[k] * pRows[k][i];
+		g += w[k] * pRows[k][i + 1];
+		r += w[k] * pRows[k][i + 2];
+	}
+
+	b >>= SCALE_BITS + SCALE_ROW_BITS;
+	g >>= SCALE_BITS + SCALE_ROW_BITS;
+	r >>= SCALE_BITS + SCALE_ROW_BITS;
+
+	return (DWORD)((r << 16) | (g << 8) | b);
+}
+
+static inline void BlendScaleRows_C(DWORD* pDst, const short* const* pRows, const short* w, int cTaps, int cx)
+{
+	for(int x = 0; x < cx; x++) {
+		pDst[x] = BlendScalePixel(pRows, w, cTaps, x * 4);
+	}
+}
+
+#ifdef CPU_X86
+
+// Both passes take two taps at a time with 'pmaddwd', on the channels of
+// two pixels or two rows interleaved. The channels are at most 255 << 6
+// and the weights of a pixel add up to 1 << 14, so the sums fit. They
+// give the same results as the C versions.
+template<class FORMAT>
+CPU_TARGET("sse2") static inline void FilterScaleRow_SSE2(const SCALEPLAN* lpPlan, short* pRow, const BYTE* pSrc, int x0, int x1)
+{
+	const __m128i round = _mm_set1_epi32(1 << (SCALE_BITS - SCALE_ROW_BITS - 1));
+	const __m128i zero = _mm_setzero_si128();
+
+	for(int x = x0; x < x1; x++, pRow += 4) {
+		const SCALETAPS* tx = &lpPlan->x.pTaps[x];
+		const short* wx = lpPlan->x.pWeights + tx->iWeights;
+		__m128i sum = round;
+		int k = 0;
+
+		for(; k + 2 <= tx->cTaps; k += 2) {
+			__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(FetchXRGB<FORMAT>(pSrc, tx->iFirst + k) & 0x00FFFFFF), zero);
+			__m128i b = _mm_unpacklo_epi8(_mm_cvtsi32_si128(FetchXRGB<FORMAT>(pSrc, tx->iFirst + k + 1) & 0x00FFFFFF), zero);
+
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), _mm_set1_epi32((WORD)wx[k] | ((DWORD)(WORD)wx[k + 1] << 16))));
+		}
+
+		if(k < tx->cTaps) {
+			__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(FetchXRGB<FORMAT>(pSrc, tx->iFirst + k) & 0x00FFFFFF), zero);
+
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), _mm_set1_epi32((WORD)wx[k])));
+		}
+
+		sum = _mm_srai_epi32(sum, SCALE_BITS - SCALE_ROW_BITS);
+		_mm_storel_epi64((__m128i*)pRow, _mm_packs_epi32(sum, sum));
+	}
+}
+
+// Two pixels at a time.
+CPU_TARGET("sse2") static void BlendScaleRows_SSE2(DWORD* pDst, const short* const* pRows, const short* w, int cTaps, int cx)
+{
+	const __m128i round = _mm_set1_epi32(1 << (SCALE_BITS + SCALE_ROW_BITS - 1));
+	int x = 0;
+
+	for(; x + 2 <= cx; x += 2) {
+		__m128i lo = round, hi = round;
+
+		for(int k = 0; k < cTaps; k += 2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(pRows[k] + x * 4));
+			__m128i b = _mm_loadu_si128((const __m128i*)(pRows[k + 1] + x * 4));
+			__m128i wab = _mm_set1_epi32((WORD)w[k] | ((DWORD)(WORD)w[k + 1] << 16));
+
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wab));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wab));
+		}
+
+		lo = _mm_srai_epi32(lo, SCALE_BITS + SCALE_ROW_BITS);
+		hi = _mm_srai_epi32(hi, SCALE_BITS + SCALE_ROW_BITS);
+
+		__m128i p = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i*)(pDst + x), _mm_packus_epi16(p, p));
+	}
+
+	if(x < cx) {
+		pDst[x] = BlendScalePixel(pRows, w, cTaps, x * 4);
+	}
+}
+
+#endif // CPU_X86
+
+template<class FORMAT>
+static inline void FilterScaleRow(const SCALEPLAN* lpPlan, short* pRow, const BYTE* pSrc, int x0, int x1)
+{
+#ifdef CPU_X86
+	if(lpPlan->dwFeatures & CPU_SSE2) {
+		FilterScaleRow_SSE2<FORMAT>(lpPlan, pRow, pSrc, x0, x1);
+		return;
+	}
+#endif
+
+	FilterScaleRow_C<FORMAT>(lpPlan, pRow, pSrc, x0, x1);
+}
+
+static inline void BlendScaleRows(const SCALEPLAN* lpPlan, DWORD* pDst, const short* const* pRows, const short* w, int cTaps, int cx)
+{
+#ifdef CPU_X86
+	if(lpPlan->dwFeatures & CPU_SSE2) {
+		BlendScaleRows_SSE2(pDst, pRows, w, cTaps, cx);
+		return;
+	}
+#endif
+
+	BlendScaleRows_C(pDst, pRows, w, cTaps, cx);
+}
+
+template<class FORMAT>
+static inline void ScaleTileFiltered(const SCALEPLAN* lpPlan, LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc, int x0, int y0, int x1, int y1, BYTE* pScratch)
+{
+	const SCALETAPS* pyTaps = lpPlan->y.pTaps;
+	const int cRows = lpPlan->y.cMaxTaps;
+	const int cbRow = SCALE_TILE_CX * 4 * sizeof(short);
+
+	// The scratch buffer holds the cached rows, a scanline of XRGB and
+	// the rows and weights of the scanline being blended.
+	BYTE* pCache = pScratch;
+	DWORD* pXRGB = (DWORD*)(pCache + (size_t)cRows * cbRow);
+	const short** pRows = (const short**)(pXRGB + SCALE_TILE_CX);
+	short* w = (short*)(pRows + cRows + 1);
+
+	// Source row 'sy' is cached in row 'sy % cRows'. The taps only move
+	// down and a scanline never reads more than 'cRows' source rows, so a
+	// row is filtered once and stays cached for as long as it is needed.
+	int sNext = pyTaps[y0].iFirst;
+
+	for(int y = y0; y < y1; y++) {
+		const SCALETAPS* ty = &pyTaps[y];
+		const short* wy = lpPlan->y.pWeights + ty->iWeights;
+
+		if(sNext < ty->iFirst) {
+			sNext = ty->iFirst;
+		}
+
+		for(; sNext < ty->iFirst + ty->cTaps; sNext++) {
+			FilterScaleRow<FORMAT>(lpPlan, (short*)(pCache + (size_t)(sNext % cRows) * cbRow), lpSrc->pTop + (ptrdiff_t)sNext * lpSrc->iPitch, x0, x1);
+		}
+
+		for(int k = 0; k < ty->cTaps; k++) {
+			pRows[k] = (const short*)(pCache + (size_t)((ty->iFirst + k) % cRows) * cbRow);
+			w[k] = wy[k];
+		}
+
+		pRows[ty->cTaps] = pRows[0];
+		w[ty->cTaps] = 0;
+
+		// 32bpp is blended straight into the destination.
+		BYTE* pDst = lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch;
+
+		if(FORMAT::BYTES == 4) {
+			BlendScaleRows(lpPlan, (DWORD*)pDst + x0, pRows, w, ty->cTaps, x1 - x0);
+		}
+		else {
+			BlendScaleRows(lpPlan, pXRGB, pRows, w, ty->cTaps, x1 - x0);
+
+			for(int x = x0; x < x1; x++) {
+				FORMAT::Store(pDst, x, FORMAT::FromXRGB(pXRGB[x - x0]));
+			}
+		}
+	}
+}
+
+typedef struct tagSCALEJOB {
+	const SCALEPLAN*	lpPlan;
+	LPDIBSURFACE		lpDst;
+	const DIBSURFACE*	lpSrc;
+	RECT				rcDst;		// The part of the destination to scale
+	int					txFirst;	// First tile column and row touching 'rcDst'
+	int					tyFirst;
+	int					cxTiles;	// Number of tile columns touching 'rcDst'
+} SCALEJOB;
+
+template<class FORMAT>
+static inline void ScaleTask(int iTask, int iThread, void* lpParam)
+{
+	const SCALEJOB* lpJob = (const SCALEJOB*)lpParam;
+	const SCALEPLAN* lpPlan = lpJob->lpPlan;
+	int x0 = (lpJob->txFirst + iTask % lpJob->cxTiles) * SCALE_TILE_CX;
+	int y0 = (lpJob->tyFirst + iTask / lpJob->cxTiles) * SCALE_TILE_CY;
+	int x1 = x0 + SCALE_TILE_CX;
+	int y1 = y0 + SCALE_TILE_CY;
+
+	// Tiles at the edges of the rectangle are only scaled partly.
+	if(x0 < lpJob->rcDst.left) x0 = lpJob->rcDst.left;
+	if(y0 < lpJob->rcDst.top) y0 = lpJob->rcDst.top;
+	if(x1 > lpJob->rcDst.right) x1 = lpJob->rcDst.right;
+	if(y1 > lpJob->rcDst.bottom) y1 = lpJob->rcDst.bottom;
+
+	if(lpPlan->iMode == SCALE_NEAREST) {
+		ScaleTileNearest<FORMAT::BYTES>(lpPlan, lpJob->lpDst, lpJob->lpSrc, x0, y0, x1, y1);
+	}
+	else {
+		BYTE* pScratch = (BYTE*)(((size_t)lpPlan->pScratch + 63) & ~(size_t)63);
+		ScaleTileFiltered<FORMAT>(lpPlan, lpJob->lpDst, lpJob->lpSrc, x0, y0, x1, y1, pScratch + (size_t)iThread * lpPlan->cbScratch);
+	}
+}
+
+// Scales the part 'lprcDst' of the destination only, NULL means all of
+// it. The tiles are spread over 'lpPool', or run on the calling thread if
+// it is NULL.
+static inline BOOL ScaleDIBSurfaceRect(LPSCALEPLAN lpPlan, LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc, CThreadPool* lpPool, const RECT* lprcDst)
+{
+	LPTASKPROC lpfnTask;
+	SCALEJOB job;
+	int cThreads = lpPool ? lpPool->Threads() : 1;
+
+	if(lpDst->iFormat != lpSrc->iFormat || lpDst->cx != lpPlan->cxDst || lpDst->cy != lpPlan->cyDst || lpSrc->cx != lpPlan->cxSrc || lpSrc->cy != lpPlan->cySrc) {
+		return FALSE;
+	}
+
+	switch(lpSrc->iFormat) {
+	case DIBFMT_INDEX8:	lpfnTask = ScaleTask<PF_INDEX8>;	break;
+	case DIBFMT_RGB555:	lpfnTask = ScaleTask<PF_RGB555>;	break;
+	case DIBFMT_RGB565:	lpfnTask = ScaleTask<PF_RGB565>;	break;
+	case DIBFMT_BGR24:	lpfnTask = ScaleTask<PF_BGR24>;		break;
+	case DIBFMT_XRGB32:	lpfnTask = ScaleTask<PF_XRGB32>;	break;
+	default:			return FALSE;
+	}
+
+	job.rcDst.left = 0;
+	job.rcDst.top = 0;
+	job.rcDst.right = lpPlan->cxDst;
+	job.rcDst.bottom = lpPlan->cyDst;
+
+	if(lprcDst) {
+		if(lprcDst->left > job.rcDst.left) job.rcDst.left = lprcDst->left;
+		if(lprcDst->top > job.rcDst.top) job.rcDst.top = lprcDst->top;
+		if(lprcDst->right < job.rcDst.right) job.rcDst.right = lprcDst->right;
+		if(lprcDst->bottom < job.rcDst.bottom) job.rcDst.bottom = lprcDst->bottom;
+
+		if(job.rcDst.left >= job.rcDst.right || job.rcDst.top >= job.rcDst.bottom) {
+			return TRUE;
+		}
+	}
+
+	// One scratch buffer per worker, aligned so workers don't share
+	// cache lines.
+	if(lpPlan->cbScratch && lpPlan->cScratch < cThreads) {
+		free(lpPlan->pScratch);
+
+		if((lpPlan->pScratch = (BYTE*)malloc((size_t)lpPlan->cbScratch * cThreads + 64)) == NULL) {
+			lpPlan->cScratch = 0;
+			return FALSE;
+		}
+
+		lpPlan->cScratch = cThreads;
+	}
+
+	job.lpPlan = lpPlan;
+	job.lpDst = lpDst;
+	job.lpSrc = lpSrc;
+	job.txFirst = job.rcDst.left / SCALE_TILE_CX;
+	job.tyFirst = job.rcDst.top / SCALE_TILE_CY;
+	job.cxTiles = (job.rcDst.right - 1) / SCALE_TILE_CX - job.txFirst + 1;
+
+	int cTasks = job.cxTiles * ((job.rcDst.bottom - 1) / SCALE_TILE_CY - job.tyFirst + 1);
+
+	if(lpPool) {
+		lpPool->Run(cTasks, lpfnTask, &job);
+	}
+	else {
+		for(int i = 0; i < cTasks; i++) {
+			lpfnTask(i, 0, &job);
+		}
+	}
+
+	return TRUE;
+}
+
+// Scales 'lpSrc' into 'lpDst' using a plan made for their sizes.
+static inline BOOL ScaleDIBSurface(LPSCALEPLAN lpPlan, LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc, CThreadPool* lpPool)
+{
+	return ScaleDIBSurfaceRect(lpPlan, lpDst, lpSrc, lpPool, NULL);
+}
+
+// Finds the destination pixels 'i0' up to 'i1' that read any of the
+// source pixels 's0' up to 's1'. The taps only ever move right, so we
+// can stop looking as soon as we're past them.
+static inline void GetScaledSpan(const SCALEAXIS* lpAxis, int cDst, int s0, int s1, LONG* lpi0, LONG* lpi1)
+{
+	int i0 = 0, i1;
+
+	while(i0 < cDst && lpAxis->pTaps[i0].iFirst + lpAxis->pTaps[i0].cTaps <= s0) {
+		i0++;
+	}
+
+	for(i1 = i0; i1 < cDst && lpAxis->pTaps[i1].iFirst < s1; i1++) {
+	}
+
+	*lpi0 = i0;
+	*lpi1 = i1;
+}
+
+// Works out which part of the destination changes when the part 'lprcSrc'
+// of the source changes. Handy for turning the dirty rectangles of a
+// source surface into those of the destination.
+static inline void GetScaledRect(const SCALEPLAN* lpPlan, const RECT* lprcSrc, LPRECT lprcDst)
+{
+	GetScaledSpan(&lpPlan->x, lpPlan->cxDst, lprcSrc->left, lprcSrc->right, &lprcDst->left, &lprcDst->right);
+	GetScaledSpan(&lpPlan->y, lpPlan->cyDst, lprcSrc->top, lprcSrc->bottom, &lprcDst->top, &lprcDst->bottom);
+}
+
+#endif // SCALE_H
@@ -0,0 +1,387 @@
+
+#ifndef SURFACE_H
+#define SURFACE_H
+
+// Typed access to a DIB surface.
+//
+// A 'PutPixel' that takes a BITMAPINFO has to look at 'biBitCount' for
+// every pixel it writes and has to work out the scanline offset again
+// every time. The pixel format of a surface never changes though, so we
+// can just as well decide on it once. Each format below is a small trait
+// that knows how to pack a color and where a pixel lives in a scanline.
+// 'CSurface' is a template over such a trait; the compiler generates a
+// separate, switch-free version of every drawing routine for each format.
+// The only runtime decision left is picking the right instantiation when
+// the surface is created, see 'GetDIBFormat'.
+
+#include "dibtypes.h"
+#include "dirty.h"
+
+#include <stddef.h>
+
+// The pixel formats 'CreateDIB' can make.
+#define DIBFMT_UNKNOWN	0
+#define DIBFMT_INDEX8	1		// 8bpp, index into the color table
+#define DIBFMT_RGB555	2		// 16bpp, masks 0x7C00, 0x03E0, 0x001F
+#define DIBFMT_RGB565	3		// 16bpp, masks 0xF800, 0x07E0, 0x001F
+#define DIBFMT_BGR24	4		// 24bpp, bytes stored blue, green, red
+#define DIBFMT_XRGB32	5		// 32bpp, masks 0xFF0000, 0xFF00, 0xFF
+
+// 8bpp. The color table 'CreateDIB' builds is a grayscale ramp, so an RGB
+// color is packed into the index of its luminance, 0.3 red, 0.59 green and
+// 0.11 blue. The old 'PutPixel' in Example 4 wrote just the red channel,
+// so 8bpp frames come out a little different than they used to. Use 'Plot'
+// to write an index directly.
+struct PF_INDEX8 {
+	typedef BYTE PIXEL;
+
+	enum { FORMAT = DIBFMT_INDEX8, BPP = 8, BYTES = 1 };
+
+	static constexpr PIXEL Pack(BYTE r, BYTE g, BYTE b)
+	{
+		return (PIXEL)((r * 77 + g * 150 + b * 29) >> 8);
+	}
+
+	static inline void Store(BYTE* pRow, int x, PIXEL c)
+	{
+		pRow[x] = c;
+	}
+
+	static inline PIXEL Load(const BYTE* pRow, int x)
+	{
+		return pRow[x];
+	}
+
+	static constexpr PIXEL FromXRGB(DWORD c)
+	{
+		return Pack((BYTE)(c >> 16), (BYTE)(c >> 8), (BYTE)c);
+	}
+};
+
+// 15bpp stored in 16 bits, the highest bit is not used.
+struct PF_RGB555 {
+	typedef WORD PIXEL;
+
+	enum { FORMAT = DIBFMT_RGB555, BPP = 16, BYTES = 2 };
+
+	static constexpr DWORD RMASK = 0x00007C00;
+	static constexpr DWORD GMASK = 0x000003E0;
+	static constexpr DWORD BMASK = 0x0000001F;
+
+	static constexpr PIXEL Pack(BYTE r, BYTE g, BYTE b)
+	{
+		return (PIXEL)(((r & 0xF8) << 7) | ((g & 0xF8) << 2) | (b >> 3));
+	}
+
+	static constexpr PIXEL FromXRGB(DWORD c)
+	{
+		return (PIXEL)(((c >> 9) & 0x7C00) | ((c >> 6) & 0x03E0) | ((c >> 3) & 0x001F));
+	}
+
+	// Expands to 8 bits per component by repeating the top bits in the
+	// bottom ones, so full intensity stays full intensity.
+	static constexpr DWORD ToXRGB(PIXEL c)
+	{
+		return ((c & 0x7C00) << 9) | ((c & 0x7000) << 4) | ((c & 0x03E0) << 6) | ((c & 0x0380) << 1) | ((c & 0x001F) << 3) | ((c & 0x001C) >> 2);
+	}
+
+	static inline void Store(BYTE* pRow, int x, PIXEL c)
+	{
+		((WORD*)pRow)[x] = c;
+	}
+
+	static inline PIXEL Load(const BYTE* pRow, int x)
+	{
+		return ((const WORD*)pRow)[x];
+	}
+};
+
+// 16bpp, green gets the extra bit.
+struct PF_RGB565 {
+	typedef WORD PIXEL;
+
+	enum { FORMAT = DIBFMT_RGB565, BPP = 16, BYTES = 2 };
+
+	static constexpr DWORD RMASK = 0x0000F800;
+	static constexpr DWORD GMASK = 0x000007E0;
+	static constexpr DWORD BMASK = 0x0000001F;
+
+	static constexpr PIXEL Pack(BYTE r, BYTE g, BYTE b)
+	{
+		return (PIXEL)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
+	}
+
+	static constexpr PIXEL FromXRGB(DWORD c)
+	{
+		return (PIXEL)(((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F));
+	}
+
+	static constexpr DWORD ToXRGB(PIXEL c)
+	{
+		return ((c & 0xF800) << 8) | ((c & 0xE000) << 3) | ((c & 0x07E0) << 5) | ((c & 0x0600) >> 1) | ((c & 0x001F) << 3) | ((c & 0x001C) >> 2);
+	}
+
+	static inline void Store(BYTE* pRow, int x, PIXEL c)
+	{
+		((WORD*)pRow)[x] = c;
+	}
+
+	static inline PIXEL Load(const BYTE* pRow, int x)
+	{
+		return ((const WORD*)pRow)[x];
+	}
+};
+
+// 24bpp. There is no 24 bit integer type, so a pixel is passed around as
+// a DWORD in the same 0x00RRGGBB layout as the 32bpp format and stored as
+// three bytes in the order Windows expects them: blue, green, red.
+struct PF_BGR24 {
+	typedef DWORD PIXEL;
+
+	enum { FORMAT = DIBFMT_BGR24, BPP = 24, BYTES = 3 };
+
+	static constexpr DWORD RMASK = 0x00FF0000;
+	static constexpr DWORD GMASK = 0x0000FF00;
+	static constexpr DWORD BMASK = 0x000000FF;
+
+	static constexpr PIXEL Pack(BYTE r, BYTE g, BYTE b)
+	{
+		return (PIXEL)((r << 16) | (g << 8) | b);
+	}
+
+	static constexpr PIXEL FromXRGB(DWORD c)
+	{
+		return c & 0x00FFFFFF;
+	}
+
+	static constexpr DWORD ToXRGB(PIXEL c)
+	{
+		return c;
+	}
+
+	static inline void Store(BYTE* pRow, int x, PIXEL c)
+	{
+		BYTE* p = pRow + x * 3;
+
+		p[0] = (BYTE)c;
+		p[1] = (BYTE)(c >> 8);
+		p[2] = (BYTE)(c >> 16);
+	}
+
+	static inline PIXEL Load(const BYTE* pRow, int x)
+	{
+		const BYTE* p = pRow + x * 3;
+
+		return (PIXEL)(p[0] | (p[1] << 8) | (p[2] << 16));
+	}
+};
+
+// 32bpp, the highest byte is not used.
+struct PF_XRGB32 {
+	typedef DWORD PIXEL;
+
+	enum { FORMAT = DIBFMT_XRGB32, BPP = 32, BYTES = 4 };
+
+	static constexpr DWORD RMASK = 0x00FF0000;
+	static constexpr DWORD GMASK = 0x0000FF00;
+	static constexpr DWORD BMASK = 0x000000FF;
+
+	static constexpr PIXEL Pack(BYTE r, BYTE g, BYTE b)
+	{
+		return (PIXEL)((r << 16) | (g << 8) | b);
+	}
+
+	static constexpr PIXEL FromXRGB(DWORD c)
+	{
+		return c & 0x00FFFFFF;
+	}
+
+	static constexpr DWORD ToXRGB(PIXEL c)
+	{
+		return c;
+	}
+
+	static inline void Store(BYTE* pRow, int x, PIXEL c)
+	{
+		((DWORD*)pRow)[x] = c;
+	}
+
+	static inline PIXEL Load(const BYTE* pRow, int x)
+	{
+		return ((const DWORD*)pRow)[x];
+	}
+};
+
+// Works out which of the formats above a DIB is in. For 16bpp it is the
+// masks that tell 555 from 565, not 'biBitCount': 'CreateDIB' stores both
+// as 16. A 16bpp DIB without BI_BITFIELDS is 555, that's what Windows
+// assumes for it.
+static inline int GetDIBFormat(const BITMAPINFO* lpBmi)
+{
+	const BITMAPINFOHEADER* lpbih = &lpBmi->bmiHeader;
+	const DWORD* pMasks = (const DWORD*)lpBmi->bmiColors;
+	BOOL bBitfields = (lpbih->biCompression & BI_BITFIELDS) == BI_BITFIELDS;
+
+	switch(lpbih->biBitCount) {
+	case 8:
+		return DIBFMT_INDEX8;
+
+	case 16:
+		if(!bBitfields || (pMasks[0] == PF_RGB555::RMASK && pMasks[1] == PF_RGB555::GMASK && pMasks[2] == PF_RGB555::BMASK)) {
+			return DIBFMT_RGB555;
+		}
+
+		if(pMasks[0] == PF_RGB565::RMASK && pMasks[1] == PF_RGB565::GMASK && pMasks[2] == PF_RGB565::BMASK) {
+			return DIBFMT_RGB565;
+		}
+		break;
+
+	case 24:
+		return DIBFMT_BGR24;
+
+	case 32:
+		if(!bBitfields || (pMasks[0] == PF_XRGB32::RMASK && pMasks[1] == PF_XRGB32::GMASK && pMasks[2] == PF_XRGB32::BMASK)) {
+			return DIBFMT_XRGB32;
+		}
+		break;
+	}
+
+	return DIBFMT_UNKNOWN;
+}
+
+// Bytes per pixel of one of the formats above.
+static inline int GetDIBFormatBytes(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return 1;
+	case DIBFMT_RGB555:	return 2;
+	case DIBFMT_RGB565:	return 2;
+	case DIBFMT_BGR24:	return 3;
+	case DIBFMT_XRGB32:	return 4;
+	}
+
+	return 0;
+}
+
+// Everything we need to know about a DIB surface to draw on it, worked
+// out once. 'pTop' always points at the top scanline and 'iPitch' is the
+// distance to the next one down, which is negative for a bottom-up DIB.
+// If 'lpDirty' is set, everything drawn through 'CSurface' is marked in
+// it; see dirty.h.
+typedef struct tagDIBSURFACE {
+	LPBITMAPINFO	lpBmi;
+	BYTE*			pBits;
+	BYTE*			pTop;
+	int				iPitch;
+	int				cx;
+	int				cy;
+	int				iFormat;
+	LPDIRTYREGION	lpDirty;
+} DIBSURFACE, *LPDIBSURFACE;
+
+static inline BOOL InitDIBSurface(LPDIBSURFACE lpSurface, LPBITMAPINFO lpBmi, void* pBits)
+{
+	const BITMAPINFOHEADER* lpbih = &lpBmi->bmiHeader;
+	int iStride = DIB_STRIDE(lpbih->biWidth, lpbih->biBitCount);
+
+	ZeroMemory(lpSurface, sizeof(DIBSURFACE));
+
+	if((lpSurface->iFormat = GetDIBFormat(lpBmi)) == DIBFMT_UNKNOWN) {
+		return FALSE;
+	}
+
+	lpSurface->lpBmi = lpBmi;
+	lpSurface->pBits = (BYTE*)pBits;
+	lpSurface->cx = lpbih->biWidth;
+
+	if(lpbih->biHeight < 0) {
+		lpSurface->cy = -lpbih->biHeight;
+		lpSurface->pTop = lpSurface->pBits;
+		lpSurface->iPitch = iStride;
+	}
+	else {
+		lpSurface->cy = lpbih->biHeight;
+		lpSurface->pTop = lpSurface->pBits + (ptrdiff_t)(lpSurface->cy - 1) * iStride;
+		lpSurface->iPitch = -iStride;
+	}
+
+	return TRUE;
+}
+
+// Typed view on a DIB surface. It is only a couple of pointers big, so
+// make one wherever you need it. The format must match the surface, which
+// is what 'GetDIBFormat' is for.
+template<class FORMAT>
+class CSurface {
+public:
+	typedef typename FORMAT::PIXEL PIXEL;
+
+	CSurface(LPDIBSURFACE lpSurface)
+		: m_lpSurface(lpSurface), m_pTop(lpSurface->pTop), m_iPitch(lpSurface->iPitch), m_cx(lpSurface->cx), m_cy(lpSurface->cy), m_lpDirty(lpSurface->lpDirty)
+	{
+	}
+
+	int Width() const
+	{
+		return m_cx;
+	}
+
+	int Height() const
+	{
+		return m_cy;
+	}
+
+	BYTE* Scanline(int y) const
+	{
+		return m_pTop + (ptrdiff_t)y * m_iPitch;
+	}
+
+	static constexpr PIXEL Pack(BYTE r, BYTE g, BYTE b)
+	{
+		return FORMAT::Pack(r, g, b);
+	}
+
+	// Writes an already packed pixel. No clipping is done.
+	void Plot(int x, int y, PIXEL c)
+	{
+		FORMAT::Store(Scanline(y), x, c);
+
+		if(m_lpDirty) {
+			MarkDirtyPixel(m_lpDirty, x, y);
+		}
+	}
+
+	void PutPixel(int x, int y, BYTE r, BYTE g, BYTE b)
+	{
+		Plot(x, y, FORMAT::Pack(r, g, b));
+	}
+
+	// For code that writes to 'Scanline' itself: tells the dirty region,
+	// if there is one, what was drawn on.
+	void MarkDirty(int left, int top, int right, int bottom)
+	{
+		if(m_lpDirty) {
+			MarkDirtyRect(m_lpDirty, left, top, right, bottom);
+		}
+	}
+
+	PIXEL GetPixel(int x, int y) const
+	{
+		return FORMAT::Load(Scanline(y), x);
+	}
+
+	LPDIBSURFACE Surface() const
+	{
+		return m_lpSurface;
+	}
+
+protected:
+	LPDIBSURFACE	m_lpSurface;
+	BYTE*			m_pTop;
+	int				m_iPitch;
+	int				m_cx;
+	int				m_cy;
+	LPDIRTYREGION	m_lpDirty;
+};
+
+#endif // SURFACE_H
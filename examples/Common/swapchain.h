@@ -0,0 +1,583 @@
+
+#ifndef SWAPCHAIN_H
+#define SWAPCHAIN_H
+
+// Drawing and presenting on different threads.
+//
+// With a single DIB the thread that draws and the one that shows the
+// result have to take turns: nothing can be drawn while a frame is being
+// presented, and whatever is drawn during it shows up half done. A swap
+// chain has two to four DIBs instead. The render thread draws on a free
+// one and submits it, a present thread of its own hands it to a
+// presenter and gives it back. Frames change hands through atomics only;
+// a lock is taken just to go to sleep when there is nothing to do.
+//
+// There are two ways to hand frames over:
+//
+//   SWAP_FIFO      Every frame is presented, in order. Once all DIBs are
+//                  waiting to be presented the render thread waits for
+//                  one to come back, so it can get ahead of the presenter
+//                  by a few frames but no more.
+//   SWAP_MAILBOX   Only the newest frame is presented. A frame submitted
+//                  while the one before it is still waiting replaces it,
+//                  and the one it replaces is dropped. With three or more
+//                  DIBs the render thread never waits.
+//
+// Drawing is incremental, every frame starts out as the one before it.
+// When the render thread gets a DIB it last drew on a few frames ago, the
+// tiles that changed since are first copied over from the newest frame;
+// the dirty regions of the frames submitted in between say which those
+// are. The presenter in turn is told what changed since the frame it
+// presented last, including anything drawn in frames that were dropped.
+//
+// Like a display, the present thread can be given an interval: it then
+// presents at most once every interval, on a fixed grid, as if it waited
+// for vsync. 'GetStats' tells how evenly frames came out and how many
+// never made it.
+
+#include "dibtypes.h"
+#include "surface.h"
+#include "dirty.h"
+#include "dib.h"
+#include "present.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define SWAP_FIFO			0
+#define SWAP_MAILBOX		1
+
+#define SWAP_MAX_BUFFERS	4		// Must be a power of two
+#define SWAP_MAX_RECTS		32		// Rectangles per present, see 'GetDirtyRects'
+
+// Pacing is measured over at most this many presents.
+#define SWAP_MAX_SAMPLES	(1 << 20)
+
+typedef struct tagSWAPSTATS {
+	unsigned long long	cSubmitted;		// Frames the render thread finished
+	unsigned long long	cPresented;
+	unsigned long long	cDropped;		// Replaced before they were presented
+	unsigned long long	cbPresented;
+	double				dWaitMs;		// Render thread time spent waiting for a free DIB
+	double				dPresentMs;		// Present thread time spent in the presenter
+	double				dIntervalMs;	// Time from one present to the next: average,
+	double				dIntervalDevMs;	// standard deviation,
+	double				dIntervalP99Ms;	// 99th percentile
+	double				dIntervalMaxMs;	// and longest
+	double				dLatencyMs;		// Time from submit to present, average
+	double				dLatencyP99Ms;	// and 99th percentile
+} SWAPSTATS, *LPSWAPSTATS;
+
+// Copies the tiles marked in 'lpRegion' from one surface to another of the
+// same size and format.
+static inline void CopyDirtyTiles(LPDIBSURFACE lpDst, const DIBSURFACE* lpSrc, const DIRTYREGION* lpRegion)
+{
+	int iBytes = GetDIBFormatBytes(lpDst->iFormat);
+
+	for(int ty = 0; ty < lpRegion->cyTiles; ty++) {
+		int y0 = ty << DIRTY_TILE_SHIFT;
+		int y1 = std::min(y0 + DIRTY_TILE_SIZE, lpDst->cy);
+		int tx = 0;
+
+		while(tx < lpRegion->cxTiles) {
+			if(!IsTileDirty(lpRegion, tx, ty)) {
+				tx++;
+				continue;
+			}
+
+			int tx0 = tx;
+
+			while(tx < lpRegion->cxTiles && IsTileDirty(lpRegion, tx, ty)) {
+				tx++;
+			}
+
+			int x0 = tx0 << DIRTY_TILE_SHIFT;
+			int x1 = std::min(tx << DIRTY_TILE_SHIFT, lpDst->cx);
+
+			for(int y = y0; y < y1; y++) {
+				memcpy(lpDst->pTop + (ptrdiff_t)y * lpDst->iPitch + x0 * iBytes, lpSrc->pTop + (ptrdiff_t)y * lpSrc->iPitch + x0 * iBytes, (x1 - x0) * iBytes);
+			}
+		}
+	}
+}
+
+class CSwapChain {
+public:
+	CSwapChain()
+		: m_cBuffers(0), m_iMode(SWAP_FIFO), m_lpPresenter(NULL), m_dIntervalMs(0), m_iBack(-1), m_iNewest(-1), m_cSpare(0),
+		  m_uFrame(0), m_cSubmitted(0), m_cDropped(0), m_dWaitMs(0), m_iPending(-1), m_bStop(false)
+	{
+		ZeroMemory(m_buffers, sizeof(m_buffers));
+		ZeroMemory(&m_carry, sizeof(m_carry));
+		ZeroMemory(&m_stats, sizeof(m_stats));
+	}
+
+	~CSwapChain()
+	{
+		Destroy();
+	}
+
+	// Creates 'cBuffers' DIBs and starts the present thread, which hands
+	// frames to 'lpPresenter'. An 'dIntervalMs' above 0 paces it like a
+	// display with that refresh interval.
+	BOOL Create(int cx, int cy, int iBpp, int cBuffers, int iMode, CPresenter* lpPresenter, double dIntervalMs = 0)
+	{
+		if(cBuffers < 2 || cBuffers > SWAP_MAX_BUFFERS || m_cBuffers) {
+			return FALSE;
+		}
+
+		for(int i = 0; i < cBuffers; i++) {
+			if(!CreateDIBSurface(&m_buffers[i].surface, cx, cy, iBpp) || !CreateDirtyRegion(&m_buffers[i].stale, cx, cy) || !CreateDirtyRegion(&m_buffers[i].changed, cx, cy)) {
+				m_cBuffers = i + 1;
+				Destroy();
+				return FALSE;
+			}
+		}
+
+		if(!CreateDirtyRegion(&m_carry, cx, cy)) {
+			m_cBuffers = cBuffers;
+			Destroy();
+			return FALSE;
+		}
+
+		m_cBuffers = cBuffers;
+		m_iMode = iMode;
+		m_lpPresenter = lpPresenter;
+		m_dIntervalMs = dIntervalMs;
+
+		// The chain may have been created and destroyed before, so nothing
+		// of that one can be left over, 'Stop' least of all.
+		while(m_queue.Pop() >= 0) {
+		}
+
+		while(m_free.Pop() >= 0) {
+		}
+
+		m_iBack = m_iNewest = -1;
+		m_cSpare = 0;
+		m_uFrame = m_cSubmitted = m_cDropped = 0;
+		m_dWaitMs = 0;
+		m_iPending.store(-1);
+		m_bStop.store(false);
+
+		ZeroMemory(&m_stats, sizeof(m_stats));
+		m_intervals.clear();
+		m_latencies.clear();
+
+		// All DIBs start out black, so they all hold the same frame.
+		for(int i = 0; i < cBuffers; i++) {
+			m_free.Push(i);
+		}
+
+		m_thread = std::thread(&CSwapChain::PresentThread, this);
+
+		return TRUE;
+	}
+
+	// Waits for the present thread to present what was submitted and
+	// stops it. In FIFO mode that is every frame still waiting.
+	void Stop()
+	{
+		if(!m_thread.joinable()) {
+			return;
+		}
+
+		m_bStop.store(true);
+		m_frameReady.Notify();
+		m_thread.join();
+	}
+
+	void Destroy()
+	{
+		Stop();
+
+		for(int i = 0; i < m_cBuffers; i++) {
+			FreeDirtyRegion(&m_buffers[i].changed);
+			FreeDirtyRegion(&m_buffers[i].stale);
+
+			if(m_buffers[i].surface.lpBmi) {
+				FreeDIBSurface(&m_buffers[i].surface);
+			}
+		}
+
+		FreeDirtyRegion(&m_carry);
+		m_cBuffers = 0;
+	}
+
+	// Everything from here on is for the render thread only.
+
+	// Returns the DIB to draw the next frame on, which already holds the
+	// frame submitted last. Waits for one to come back from the present
+	// thread if none is free.
+	LPDIBSURFACE Acquire()
+	{
+		int i;
+
+		if(m_iBack >= 0) {
+			return &m_buffers[m_iBack].surface;
+		}
+
+		if(m_cSpare) {
+			i = m_iSpare[--m_cSpare];
+		}
+		else
+		if((i = m_free.Pop()) < 0) {
+			double dStart = GetTimeMs();
+
+			for(;;) {
+				if((i = m_free.Pop()) >= 0) {
+					break;
+				}
+
+				// A mailbox with only two DIBs runs out when one is being
+				// presented and the other is waiting to be. Take the
+				// waiting one back and draw on, it is dropped.
+				if(m_iMode == SWAP_MAILBOX && (i = m_iPending.exchange(-1)) >= 0) {
+					AddDirtyRegion(&m_carry, &m_buffers[i].changed);
+					m_cDropped++;
+					break;
+				}
+
+				m_bufferFree.Wait([this] { return !m_free.IsEmpty() || (m_iMode == SWAP_MAILBOX && m_iPending.load() >= 0); });
+			}
+
+			m_dWaitMs += GetTimeMs() - dStart;
+		}
+
+		SWAPBUFFER* lpBuffer = &m_buffers[i];
+
+		// Bring it up to date with the newest frame.
+		if(lpBuffer->stale.bDirty) {
+			CopyDirtyTiles(&lpBuffer->surface, &m_buffers[m_iNewest].surface, &lpBuffer->stale);
+			ClearDirtyRegion(&lpBuffer->stale);
+		}
+
+		m_iBack = i;
+		return &lpBuffer->surface;
+	}
+
+	// Hands the frame drawn on the DIB from 'Acquire' to the present
+	// thread. 'lpDirty' is what was drawn on it, NULL means all of it.
+	void Submit(const DIRTYREGION* lpDirty)
+	{
+		int i = m_iBack;
+
+		if(i < 0) {
+			return;
+		}
+
+		SWAPBUFFER* lpBuffer = &m_buffers[i];
+
+		m_iBack = -1;
+
+		// All other DIBs are now one more frame behind.
+		for(int j = 0; j < m_cBuffers; j++) {
+			if(j != i) {
+				MarkChanged(&m_buffers[j].stale, lpDirty);
+			}
+		}
+
+		// The presenter has to update what changed in this frame and in
+		// any frame before it that was dropped. The first frame it gets
+		// is new altogether.
+		ClearDirtyRegion(&lpBuffer->changed);
+		MarkChanged(&lpBuffer->changed, m_uFrame ? lpDirty : NULL);
+		AddDirtyRegion(&lpBuffer->changed, &m_carry);
+		ClearDirtyRegion(&m_carry);
+
+		lpBuffer->dSubmitMs = GetTimeMs();
+
+		m_uFrame++;
+		m_cSubmitted++;
+		m_iNewest = i;
+
+		if(m_iMode == SWAP_FIFO) {
+			m_queue.Push(i);
+		}
+		else {
+			int iOld = m_iPending.exchange(-1);
+
+			// The present thread didn't get to the frame before this one,
+			// it is replaced. Only the present thread takes frames out of
+			// the mailbox, so it is still empty when this one goes in.
+			if(iOld >= 0) {
+				AddDirtyRegion(&lpBuffer->changed, &m_buffers[iOld].changed);
+				m_iSpare[m_cSpare++] = iOld;
+				m_cDropped++;
+			}
+
+			m_iPending.store(i);
+		}
+
+		m_frameReady.Notify();
+	}
+
+	// Call from the render thread, or after 'Stop'.
+	void GetStats(LPSWAPSTATS lpStats)
+	{
+		std::lock_guard<std::mutex> lock(m_statsLock);
+
+		*lpStats = m_stats;
+
+		lpStats->cSubmitted = m_cSubmitted;
+		lpStats->cDropped = m_cDropped;
+		lpStats->dWaitMs = m_dWaitMs;
+
+		if(m_intervals.size()) {
+			double dTotal = 0, dSquares = 0;
+
+			for(size_t i = 0; i < m_intervals.size(); i++) {
+				dTotal += m_intervals[i];
+				dSquares += m_intervals[i] * m_intervals[i];
+			}
+
+			lpStats->dIntervalMs = dTotal / m_intervals.size();
+			lpStats->dIntervalDevMs = sqrt(std::max(0.0, dSquares / m_intervals.size() - lpStats->dIntervalMs * lpStats->dIntervalMs));
+			lpStats->dIntervalP99Ms = GetPercentile(m_intervals, 0.99);
+			lpStats->dIntervalMaxMs = *std::max_element(m_intervals.begin(), m_intervals.end());
+		}
+
+		if(m_latencies.size()) {
+			double dTotal = 0;
+
+			for(size_t i = 0; i < m_latencies.size(); i++) {
+				dTotal += m_latencies[i];
+			}
+
+			lpStats->dLatencyMs = dTotal / m_latencies.size();
+			lpStats->dLatencyP99Ms = GetPercentile(m_latencies, 0.99);
+		}
+	}
+
+private:
+	typedef struct tagSWAPBUFFER {
+		DIBSURFACE		surface;
+		DIRTYREGION		stale;		// What changed since this DIB was drawn on, render thread only
+		DIRTYREGION		changed;	// What changed since the frame presented last
+		double			dSubmitMs;
+	} SWAPBUFFER;
+
+	// Buffer numbers going from one thread to one other thread. There is
+	// room for all buffers, so it can't fill up.
+	class CRing {
+	public:
+		CRing()
+			: m_uHead(0), m_uTail(0)
+		{
+		}
+
+		void Push(int i)
+		{
+			unsigned u = m_uTail.load(std::memory_order_relaxed);
+
+			m_items[u & (SWAP_MAX_BUFFERS - 1)] = i;
+			m_uTail.store(u + 1, std::memory_order_release);
+		}
+
+		// Returns -1 if it is empty.
+		int Pop()
+		{
+			unsigned u = m_uHead.load(std::memory_order_relaxed);
+
+			if(u == m_uTail.load(std::memory_order_acquire)) {
+				return -1;
+			}
+
+			int i = m_items[u & (SWAP_MAX_BUFFERS - 1)];
+
+			m_uHead.store(u + 1, std::memory_order_relaxed);
+			return i;
+		}
+
+		bool IsEmpty() const
+		{
+			return m_uHead.load(std::memory_order_relaxed) == m_uTail.load(std::memory_order_acquire);
+		}
+
+	private:
+		int						m_items[SWAP_MAX_BUFFERS];
+		std::atomic<unsigned>	m_uHead;
+		std::atomic<unsigned>	m_uTail;
+	};
+
+	// Lets a thread sleep until another one changed something. 'Notify'
+	// only takes the lock when somebody is actually waiting, so handing
+	// frames over stays lock-free while both threads are busy.
+	class CSignal {
+	public:
+		CSignal()
+			: m_cWaiters(0)
+		{
+		}
+
+		template<class PRED>
+		void Wait(PRED pred)
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+
+			// Either 'pred' sees the change, or 'Notify' sees the waiter.
+			m_cWaiters.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			while(!pred()) {
+				m_wake.wait(lock);
+			}
+
+			m_cWaiters.fetch_sub(1);
+		}
+
+		void Notify()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			if(m_cWaiters.load() > 0) {
+				// Taking the lock makes sure the waiter is really asleep.
+				m_lock.lock();
+				m_lock.unlock();
+				m_wake.notify_all();
+			}
+		}
+
+	private:
+		std::mutex				m_lock;
+		std::condition_variable	m_wake;
+		std::atomic<int>		m_cWaiters;
+	};
+
+	static void MarkChanged(LPDIRTYREGION lpRegion, const DIRTYREGION* lpDirty)
+	{
+		if(lpDirty) {
+			AddDirtyRegion(lpRegion, lpDirty);
+		}
+		else {
+			MarkAllDirty(lpRegion);
+		}
+	}
+
+	static double GetPercentile(std::vector<double> samples, double dFraction)
+	{
+		size_t n = (size_t)(dFraction * (samples.size() - 1));
+
+		std::nth_element(samples.begin(), samples.begin() + n, samples.end());
+		return samples[n];
+	}
+
+	bool HasFrame()
+	{
+		return m_iMode == SWAP_FIFO ? !m_queue.IsEmpty() : m_iPending.load() >= 0;
+	}
+
+	int TakeFrame()
+	{
+		return m_iMode == SWAP_FIFO ? m_queue.Pop() : m_iPending.exchange(-1);
+	}
+
+	void PresentThread()
+	{
+		double dNextMs = 0;
+		double dLastMs = 0;
+
+		for(;;) {
+			m_frameReady.Wait([this] { return HasFrame() || m_bStop.load(); });
+
+			if(!HasFrame()) {
+				break;
+			}
+
+			// Wait for the next tick of the display. A frame that misses
+			// one waits for the one after.
+			if(m_dIntervalMs > 0) {
+				double dNow = GetTimeMs();
+
+				if(dNextMs == 0) {
+					dNextMs = dNow;
+				}
+				else
+				if(dNextMs < dNow) {
+					dNextMs += ceil((dNow - dNextMs) / m_dIntervalMs) * m_dIntervalMs;
+				}
+
+				std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(dNextMs - dNow));
+				dNextMs += m_dIntervalMs;
+			}
+
+			// In a mailbox the render thread may have taken the frame
+			// back in the meantime.
+			int i = TakeFrame();
+
+			if(i < 0) {
+				continue;
+			}
+
+			SWAPBUFFER* lpBuffer = &m_buffers[i];
+			RECT rcDirty[SWAP_MAX_RECTS];
+			int cDirty = GetDirtyRects(&lpBuffer->changed, rcDirty, SWAP_MAX_RECTS);
+
+			double dStart = GetTimeMs();
+			long long cbPresented = m_lpPresenter->Present(&lpBuffer->surface, rcDirty, cDirty);
+			double dEnd = GetTimeMs();
+
+			{
+				std::lock_guard<std::mutex> lock(m_statsLock);
+
+				if(m_stats.cPresented && m_intervals.size() < SWAP_MAX_SAMPLES) {
+					m_intervals.push_back(dStart - dLastMs);
+				}
+
+				if(m_latencies.size() < SWAP_MAX_SAMPLES) {
+					m_latencies.push_back(dStart - lpBuffer->dSubmitMs);
+				}
+
+				m_stats.cPresented++;
+				m_stats.cbPresented += cbPresented > 0 ? cbPresented : 0;
+				m_stats.dPresentMs += dEnd - dStart;
+			}
+
+			dLastMs = dStart;
+
+			m_free.Push(i);
+			m_bufferFree.Notify();
+		}
+	}
+
+	SWAPBUFFER			m_buffers[SWAP_MAX_BUFFERS];
+	int					m_cBuffers;
+	int					m_iMode;
+	CPresenter*			m_lpPresenter;
+	double				m_dIntervalMs;
+
+	// Render thread only.
+	int					m_iBack;		// DIB being drawn on, -1 if none
+	int					m_iNewest;		// DIB with the frame submitted last
+	int					m_iSpare[SWAP_MAX_BUFFERS];
+	int					m_cSpare;		// Dropped DIBs, free again
+	DIRTYREGION			m_carry;		// What changed in frames taken back from the mailbox
+	unsigned long long	m_uFrame;
+	unsigned long long	m_cSubmitted;
+	unsigned long long	m_cDropped;
+	double				m_dWaitMs;
+
+	// Between the two threads.
+	CRing				m_queue;		// Submitted frames in FIFO mode
+	std::atomic<int>	m_iPending;		// The submitted frame in mailbox mode, -1 if none
+	CRing				m_free;			// DIBs done presenting
+	CSignal				m_frameReady;
+	CSignal				m_bufferFree;
+	std::atomic<bool>	m_bStop;
+	std::thread			m_thread;
+
+	// Present thread, read by 'GetStats'.
+	std::mutex			m_statsLock;
+	SWAPSTATS			m_stats;
+	std::vector<double>	m_intervals;
+	std::vector<double>	m_latencies;
+};
+
+#endif // SWAPCHAIN_H
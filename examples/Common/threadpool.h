@@ -0,0 +1,188 @@
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// A small work-stealing thread pool.
+//
+// 'Run' hands out a number of tasks, numbered 0 up to 'cTasks', and comes
+// back when all of them are done. Every worker gets its own queue with a
+// contiguous range of tasks, so neighbouring tiles of an image tend to end
+// up on the same core. A worker that runs out of work steals from the far
+// end of somebody else's queue instead of going to sleep. The calling
+// thread works along as worker 0, so a pool of one thread has no threads
+// of its own and just runs everything in the caller.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Called for every task. 'iThread' is the worker running it, somewhere
+// between 0 and 'Threads()', which is handy for per-thread scratch memory.
+typedef void (*LPTASKPROC)(int iTask, int iThread, void* lpParam);
+
+class CThreadPool {
+public:
+	// 'cThreads' is the number of workers including the caller, 0 means one
+	// for every core.
+	CThreadPool(int cThreads = 0)
+		: m_lpfnTask(NULL), m_lpParam(NULL), m_cPending(0), m_uGeneration(0), m_bQuit(false)
+	{
+		if(cThreads <= 0) {
+			cThreads = (int)std::thread::hardware_concurrency();
+		}
+
+		if(cThreads <= 0) {
+			cThreads = 1;
+		}
+
+		m_cWorkers = cThreads;
+		m_pQueues = new QUEUE[cThreads];
+
+		for(int i = 1; i < cThreads; i++) {
+			m_threads.push_back(std::thread(&CThreadPool::WorkerThread, this, i));
+		}
+	}
+
+	~CThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_bQuit = true;
+		}
+
+		m_wake.notify_all();
+
+		for(size_t i = 0; i < m_threads.size(); i++) {
+			m_threads[i].join();
+		}
+
+		delete[] m_pQueues;
+	}
+
+	int Threads() const
+	{
+		return m_cWorkers;
+	}
+
+	// Runs 'lpfnTask' for tasks 0 up to 'cTasks' and waits for all of them.
+	// Only one thread may call this at a time.
+	void Run(int cTasks, LPTASKPROC lpfnTask, void* lpParam)
+	{
+		if(cTasks <= 0) {
+			return;
+		}
+
+		m_lpfnTask = lpfnTask;
+		m_lpParam = lpParam;
+		m_cPending.store(cTasks);
+
+		// Deal the tasks out in contiguous ranges.
+		for(int i = 0; i < m_cWorkers; i++) {
+			std::lock_guard<std::mutex> lock(m_pQueues[i].lock);
+
+			for(int iTask = (int)((long long)cTasks * i / m_cWorkers); iTask < (int)((long long)cTasks * (i + 1) / m_cWorkers); iTask++) {
+				m_pQueues[i].tasks.push_back(iTask);
+			}
+		}
+
+		if(m_cWorkers > 1) {
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_uGeneration++;
+			}
+
+			m_wake.notify_all();
+		}
+
+		DoWork(0);
+
+		// Somebody may still be busy with a task they stole from us.
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_done.wait(lock, [this] { return m_cPending.load() == 0; });
+	}
+
+private:
+	struct QUEUE {
+		std::mutex		lock;
+		std::deque<int>	tasks;
+	};
+
+	// Takes the next task from our own queue, or steals one from the back
+	// of another queue. Returns -1 when there is nothing left anywhere.
+	int NextTask(int iWorker)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_pQueues[iWorker].lock);
+
+			if(!m_pQueues[iWorker].tasks.empty()) {
+				int iTask = m_pQueues[iWorker].tasks.front();
+				m_pQueues[iWorker].tasks.pop_front();
+				return iTask;
+			}
+		}
+
+		for(int i = 1; i < m_cWorkers; i++) {
+			QUEUE& victim = m_pQueues[(iWorker + i) % m_cWorkers];
+			std::lock_guard<std::mutex> lock(victim.lock);
+
+			if(!victim.tasks.empty()) {
+				int iTask = victim.tasks.back();
+				victim.tasks.pop_back();
+				return iTask;
+			}
+		}
+
+		return -1;
+	}
+
+	void DoWork(int iWorker)
+	{
+		int iTask;
+
+		while((iTask = NextTask(iWorker)) >= 0) {
+			m_lpfnTask(iTask, iWorker, m_lpParam);
+
+			if(m_cPending.fetch_sub(1) == 1) {
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_done.notify_all();
+			}
+		}
+	}
+
+	void WorkerThread(int iWorker)
+	{
+		unsigned uSeen = 0;
+
+		for(;;) {
+			{
+				std::unique_lock<std::mutex> lock(m_lock);
+				m_wake.wait(lock, [&] { return m_bQuit || m_uGeneration != uSeen; });
+
+				if(m_bQuit) {
+					return;
+				}
+
+				uSeen = m_uGeneration;
+			}
+
+			DoWork(iWorker);
+		}
+	}
+
+	int							m_cWorkers;
+	QUEUE*						m_pQueues;
+	std::vector<std::thread>	m_threads;
+	std::mutex					m_lock;
+	std::condition_variable		m_wake;
+	std::condition_variable		m_done;
+	LPTASKPROC					m_lpfnTask;
+	void*						m_lpParam;
+	std::atomic<int>			m_cPending;
+	unsigned					m_uGeneration;
+	bool						m_bQuit;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,818 @@
+
+#ifndef TRACING_H
+#define TRACING_H
+
+// Tracing that is cheap enough to leave on.
+//
+// The old 'TRACE' formatted its message with 'vsprintf' on the calling
+// thread and handed it to 'OutputDebugString' right there, which takes
+// longer than drawing a whole frame. Here a trace call formats nothing.
+// It copies the address of its format string, a time stamp and its
+// arguments into a ring buffer that belongs to the calling thread, and
+// returns. No locks, no allocations, no system calls. Between
+// 'TraceStart' and 'TraceStop' a background thread, the drainer, empties
+// the rings every few milliseconds, formats the messages and writes them
+// to the debugger (stderr on other systems) and, if 'TraceStart' was
+// given a file name, to a Chrome trace file. Load that file in
+// chrome://tracing or ui.perfetto.dev to see a timeline of every thread.
+//
+// Outside of that nothing is recorded. Spans and thread names are
+// ignored, and messages are formatted and written on the calling thread,
+// the way the old 'TRACE' did, so errors still show up.
+//
+//   TRACE_ERROR(fmt, ...)      Messages at one of four levels. Anything
+//   TRACE_WARNING(fmt, ...)    above TRACE_LEVEL is removed completely by
+//   TRACE_INFO(fmt, ...)       the preprocessor, arguments and all. The
+//   TRACE_VERBOSE(fmt, ...)    default level is TRACE_LEVEL_INFO.
+//   TRACE_SPAN(name)           Times the rest of the enclosing scope and
+//                              shows up as a bar on the timeline.
+//
+// The format string and span names must be string literals: only their
+// address is stored and they are read long after the call. Arguments are
+// captured by value, up to TRACE_MAX_ARGS of them; strings are copied,
+// but only the first few dozen characters. The usual printf conversions
+// work, length modifiers are not needed ('%d' prints a long long fine).
+//
+// When a ring is full, events are dropped rather than waiting for the
+// drainer; their number is reported when tracing stops.
+
+#include "dibtypes.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define TRACE_LEVEL_NONE	0
+#define TRACE_LEVEL_ERROR	1
+#define TRACE_LEVEL_WARNING	2
+#define TRACE_LEVEL_INFO	3
+#define TRACE_LEVEL_VERBOSE	4
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL			TRACE_LEVEL_INFO
+#endif
+
+// Events per thread. Must be a power of two.
+#define TRACE_BUFFER_EVENTS	2048
+
+#define TRACE_MAX_ARGS		6
+#define TRACE_STRING_BYTES	40
+
+// How often the drainer empties the rings, in milliseconds.
+#define TRACE_DRAIN_MS		10
+
+#define TRACEEVENT_MESSAGE	0
+#define TRACEEVENT_SPAN		1
+#define TRACEEVENT_NAME		2
+
+#define TRACEARG_INT		0
+#define TRACEARG_UINT		1
+#define TRACEARG_DOUBLE		2
+#define TRACEARG_POINTER	3
+#define TRACEARG_STRING		4
+
+// One event, two cache lines. For a message 'lpszText' is the format
+// string, for a span its name. String arguments live in 'szStrings', the
+// argument holds their offset there.
+typedef struct tagTRACEEVENT {
+	const char*		lpszText;
+	long long		llTime;
+	long long		llDuration;
+	BYTE			iType;
+	BYTE			iLevel;
+	BYTE			cArgs;
+	BYTE			cbStrings;
+	BYTE			iArgTypes[TRACE_MAX_ARGS];
+	union {
+		long long			i;
+		unsigned long long	u;
+		double				d;
+		const void*			p;
+	}				args[TRACE_MAX_ARGS];
+	char			szStrings[TRACE_STRING_BYTES];
+} TRACEEVENT, *LPTRACEEVENT;
+
+// The ring of one thread. Only that thread moves 'uHead' and only the
+// drainer moves 'uTail', so neither needs a lock. They are kept on cache
+// lines of their own, so the two don't slow each other down.
+struct TRACEBUFFER {
+	std::atomic<unsigned>	uHead;
+	char					padHead[64 - sizeof(unsigned)];
+	std::atomic<unsigned>	uTail;
+	char					padTail[64 - sizeof(unsigned)];
+	std::atomic<unsigned>	cDropped;
+	std::atomic<int>		bRetired;
+	int						iThread;
+	TRACEBUFFER*			lpNext;
+	unsigned				uDrainTail;	// Only used by the drainer
+	unsigned				uDrainHead;
+	TRACEEVENT				events[TRACE_BUFFER_EVENTS];
+};
+
+typedef TRACEBUFFER* LPTRACEBUFFER;
+
+static inline long long GetTraceTime()
+{
+	return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//
+// The drainer.
+//
+
+struct TRACESTATE {
+	std::atomic<LPTRACEBUFFER>	lpBuffers;
+	std::atomic<int>			cThreads;
+	std::atomic<bool>			bRunning;
+
+	std::mutex					lock;		// Held while draining and by start and stop
+	std::mutex					wakeLock;
+	std::condition_variable		wake;
+	std::thread					drainer;
+	bool						bStop;
+
+	std::vector<LPTRACEBUFFER>	draining;
+
+	FILE*						fpJson;
+	bool						bFirstJson;
+	long long					llStart;
+	unsigned long long			cDropped;
+
+	TRACESTATE()
+		: lpBuffers(NULL), cThreads(0), bRunning(false), bStop(false), fpJson(NULL), bFirstJson(true), llStart(GetTraceTime()), cDropped(0)
+	{
+	}
+
+	~TRACESTATE();
+};
+
+static inline TRACESTATE* GetTraceState()
+{
+	static TRACESTATE state;
+	return &state;
+}
+
+// Writes 's' as the contents of a JSON string.
+static inline void WriteTraceJSONString(FILE* fp, const char* s)
+{
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\') {
+			fputc('\\', fp);
+			fputc(*s, fp);
+		}
+		else
+		if(*s == '\n') {
+			fputs("\\n", fp);
+		}
+		else
+		if((unsigned char)*s < 0x20) {
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		}
+		else {
+			fputc(*s, fp);
+		}
+	}
+}
+
+// Formats a message event the way 'sprintf' would have formatted it at
+// the time of the call. Every conversion is handed to 'snprintf' by
+// itself, with the length modifier replaced by one that matches the type
+// the argument was captured as.
+static inline void FormatTraceMessage(const TRACEEVENT* lpEvent, char* pBuffer, size_t cbBuffer)
+{
+	const char* s = lpEvent->lpszText;
+	size_t cb = 0;
+	int iArg = 0;
+
+	pBuffer[0] = '\0';
+
+	while(*s && cb + 1 < cbBuffer) {
+		char szSpec[32];
+		int cchSpec = 0, n;
+
+		if(*s != '%') {
+			pBuffer[cb++] = *s++;
+			pBuffer[cb] = '\0';
+			continue;
+		}
+
+		if(s[1] == '%') {
+			pBuffer[cb++] = '%';
+			pBuffer[cb] = '\0';
+			s += 2;
+			continue;
+		}
+
+		// Flags, width and precision are kept, length modifiers dropped.
+		szSpec[cchSpec++] = *s++;
+
+		while(*s && strchr("-+ #0123456789.", *s) && cchSpec < 20) {
+			szSpec[cchSpec++] = *s++;
+		}
+
+		while(*s && strchr("hlLqjzt", *s)) {
+			s++;
+		}
+
+		if(!*s) {
+			break;
+		}
+
+		char cConversion = *s++;
+
+		if(iArg >= lpEvent->cArgs) {
+			n = snprintf(pBuffer + cb, cbBuffer - cb, "%s", "(missing)");
+		}
+		else
+		if(cConversion == 's') {
+			szSpec[cchSpec++] = 's';
+			szSpec[cchSpec] = '\0';
+
+			if(lpEvent->iArgTypes[iArg] == TRACEARG_STRING) {
+				const char* lpsz = lpEvent->args[iArg].u == (unsigned long long)-1 ? "(null)" : lpEvent->szStrings + lpEvent->args[iArg].u;
+				n = snprintf(pBuffer + cb, cbBuffer - cb, szSpec, lpsz);
+			}
+			else {
+				n = snprintf(pBuffer + cb, cbBuffer - cb, "%s", "(?)");
+			}
+		}
+		else
+		if(cConversion == 'p') {
+			szSpec[cchSpec++] = 'p';
+			szSpec[cchSpec] = '\0';
+			n = snprintf(pBuffer + cb, cbBuffer - cb, szSpec, lpEvent->args[iArg].p);
+		}
+		else
+		if(strchr("eEfFgGaA", cConversion)) {
+			double d = lpEvent->args[iArg].d;
+
+			if(lpEvent->iArgTypes[iArg] == TRACEARG_INT) {
+				d = (double)lpEvent->args[iArg].i;
+			}
+			else
+			if(lpEvent->iArgTypes[iArg] == TRACEARG_UINT) {
+				d = (double)lpEvent->args[iArg].u;
+			}
+
+			szSpec[cchSpec++] = cConversion;
+			szSpec[cchSpec] = '\0';
+			n = snprintf(pBuffer + cb, cbBuffer - cb, szSpec, d);
+		}
+		else
+		if(cConversion == 'c') {
+			szSpec[cchSpec++] = 'c';
+			szSpec[cchSpec] = '\0';
+			n = snprintf(pBuffer + cb, cbBuffer - cb, szSpec, (int)lpEvent->args[iArg].i);
+		}
+		else
+		if(strchr("diouxX", cConversion)) {
+			long long i = lpEvent->args[iArg].i;
+
+			if(lpEvent->iArgTypes[iArg] == TRACEARG_DOUBLE) {
+				i = (long long)lpEvent->args[iArg].d;
+			}
+
+			szSpec[cchSpec++] = 'l';
+			szSpec[cchSpec++] = 'l';
+			szSpec[cchSpec++] = cConversion;
+			szSpec[cchSpec] = '\0';
+			n = snprintf(pBuffer + cb, cbBuffer - cb, szSpec, i);
+		}
+		else {
+			// Something we don't know, '%n' for one. Leave it out.
+			n = 0;
+		}
+
+		iArg++;
+
+		if(n < 0) {
+			break;
+		}
+
+		cb += (size_t)n < cbBuffer - cb ? (size_t)n : cbBuffer - cb - 1;
+	}
+}
+
+static inline void WriteTraceText(const char* lpszText)
+{
+#ifdef _WIN32
+	OutputDebugStringA(lpszText);
+#else
+	fputs(lpszText, stderr);
+#endif
+}
+
+static inline void BeginTraceJSON(TRACESTATE* lpState, const char* lpszPhase, const char* lpszName, int iThread, long long llTime)
+{
+	FILE* fp = lpState->fpJson;
+
+	fprintf(fp, "%s\n{\"ph\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"", lpState->bFirstJson ? "" : ",", lpszPhase, iThread, (llTime - lpState->llStart) / 1000.0);
+	WriteTraceJSONString(fp, lpszName);
+	fputc('"', fp);
+
+	lpState->bFirstJson = false;
+}
+
+static inline void WriteTraceEvent(TRACESTATE* lpState, const TRACEBUFFER* lpBuffer, const TRACEEVENT* lpEvent)
+{
+	static const char* lpszLevels[] = { "none", "error", "warning", "info", "verbose" };
+	char szText[1024];
+
+	switch(lpEvent->iType) {
+	case TRACEEVENT_MESSAGE:
+		FormatTraceMessage(lpEvent, szText, sizeof(szText));
+		WriteTraceText(szText);
+
+		if(lpState->fpJson) {
+			// Instant events, with the message as their name, show up as
+			// small arrows on the thread they came from.
+			size_t cch = strlen(szText);
+
+			while(cch && szText[cch - 1] == '\n') {
+				szText[--cch] = '\0';
+			}
+
+			BeginTraceJSON(lpState, "i", szText, lpBuffer->iThread, lpEvent->llTime);
+			fprintf(lpState->fpJson, ",\"s\":\"t\",\"args\":{\"level\":\"%s\"}}", lpszLevels[lpEvent->iLevel <= TRACE_LEVEL_VERBOSE ? lpEvent->iLevel : 0]);
+		}
+		break;
+
+	case TRACEEVENT_SPAN:
+		if(lpState->fpJson) {
+			BeginTraceJSON(lpState, "X", lpEvent->lpszText, lpBuffer->iThread, lpEvent->llTime);
+			fprintf(lpState->fpJson, ",\"dur\":%.3f}", lpEvent->llDuration / 1000.0);
+		}
+		break;
+
+	case TRACEEVENT_NAME:
+		if(lpState->fpJson) {
+			BeginTraceJSON(lpState, "M", "thread_name", lpBuffer->iThread, lpEvent->llTime);
+			fputs(",\"args\":{\"name\":\"", lpState->fpJson);
+			WriteTraceJSONString(lpState->fpJson, lpEvent->szStrings);
+			fputs("\"}}", lpState->fpJson);
+		}
+		break;
+	}
+}
+
+// Empties every ring. Events of different threads are written in the
+// order they happened, so messages from several threads come out the way
+// they would have with the old 'TRACE'. The caller holds 'lpState->lock'.
+static inline void DrainTraceBuffers(TRACESTATE* lpState)
+{
+	std::vector<LPTRACEBUFFER>& draining = lpState->draining;
+
+	draining.clear();
+
+	for(LPTRACEBUFFER lpBuffer = lpState->lpBuffers.load(std::memory_order_acquire); lpBuffer; lpBuffer = lpBuffer->lpNext) {
+		lpBuffer->uDrainTail = lpBuffer->uTail.load(std::memory_order_relaxed);
+		lpBuffer->uDrainHead = lpBuffer->uHead.load(std::memory_order_acquire);
+
+		if(lpBuffer->uDrainTail != lpBuffer->uDrainHead) {
+			draining.push_back(lpBuffer);
+		}
+
+		lpState->cDropped += lpBuffer->cDropped.exchange(0, std::memory_order_relaxed);
+	}
+
+	while(!draining.empty()) {
+		size_t iNext = 0;
+
+		for(size_t i = 1; i < draining.size(); i++) {
+			if(draining[i]->events[draining[i]->uDrainTail & (TRACE_BUFFER_EVENTS - 1)].llTime < draining[iNext]->events[draining[iNext]->uDrainTail & (TRACE_BUFFER_EVENTS - 1)].llTime) {
+				iNext = i;
+			}
+		}
+
+		LPTRACEBUFFER lpBuffer = draining[iNext];
+
+		WriteTraceEvent(lpState, lpBuffer, &lpBuffer->events[lpBuffer->uDrainTail++ & (TRACE_BUFFER_EVENTS - 1)]);
+
+		if(lpBuffer->uDrainTail == lpBuffer->uDrainHead) {
+			// Only now may the thread write over these events.
+			lpBuffer->uTail.store(lpBuffer->uDrainTail, std::memory_order_release);
+			draining[iNext] = draining.back();
+			draining.pop_back();
+		}
+	}
+
+	if(lpState->fpJson) {
+		fflush(lpState->fpJson);
+	}
+}
+
+static inline void TraceDrainer(TRACESTATE* lpState)
+{
+	std::unique_lock<std::mutex> wakeLock(lpState->wakeLock);
+
+	while(!lpState->bStop) {
+		lpState->wake.wait_for(wakeLock, std::chrono::milliseconds(TRACE_DRAIN_MS));
+
+		std::lock_guard<std::mutex> lock(lpState->lock);
+		DrainTraceBuffers(lpState);
+	}
+}
+
+// Starts the drainer if it isn't running yet.
+static inline void StartTraceDrainer(TRACESTATE* lpState)
+{
+	std::lock_guard<std::mutex> lock(lpState->lock);
+
+	if(!lpState->bRunning.load()) {
+		lpState->bStop = false;
+		lpState->drainer = std::thread(TraceDrainer, lpState);
+		lpState->bRunning.store(true);
+	}
+}
+
+// Starts tracing and, if 'lpszFilename' isn't NULL, writes everything from
+// here on to a Chrome trace file as well. Returns FALSE if the file could
+// not be created.
+static inline BOOL TraceStart(const char* lpszFilename)
+{
+	TRACESTATE* lpState = GetTraceState();
+
+	if(lpszFilename && *lpszFilename) {
+		FILE* fp = fopen(lpszFilename, "w");
+
+		if(!fp) {
+			return FALSE;
+		}
+
+		std::lock_guard<std::mutex> lock(lpState->lock);
+
+		if(lpState->fpJson) {
+			fputs("\n]}\n", lpState->fpJson);
+			fclose(lpState->fpJson);
+		}
+
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+		lpState->fpJson = fp;
+		lpState->bFirstJson = true;
+	}
+
+	StartTraceDrainer(lpState);
+	return TRUE;
+}
+
+static inline void StopTraceDrainer(TRACESTATE* lpState)
+{
+	if(lpState->bRunning.load()) {
+		{
+			std::lock_guard<std::mutex> wakeLock(lpState->wakeLock);
+			lpState->bStop = true;
+		}
+
+		lpState->wake.notify_one();
+		lpState->drainer.join();
+		lpState->bRunning.store(false);
+	}
+
+	std::lock_guard<std::mutex> lock(lpState->lock);
+
+	DrainTraceBuffers(lpState);
+
+	if(lpState->cDropped) {
+		char szText[64];
+
+		snprintf(szText, sizeof(szText), "tracing: %llu events dropped\n", lpState->cDropped);
+		WriteTraceText(szText);
+		lpState->cDropped = 0;
+	}
+
+	if(lpState->fpJson) {
+		fputs("\n]}\n", lpState->fpJson);
+		fclose(lpState->fpJson);
+		lpState->fpJson = NULL;
+	}
+}
+
+// Stops the drainer, writes out whatever is left and closes the trace
+// file. From here on nothing is recorded until the next 'TraceStart'.
+static inline void TraceStop()
+{
+	StopTraceDrainer(GetTraceState());
+}
+
+// Whether we are between 'TraceStart' and 'TraceStop'.
+static inline BOOL IsTracing()
+{
+	return GetTraceState()->bRunning.load(std::memory_order_relaxed);
+}
+
+inline TRACESTATE::~TRACESTATE()
+{
+	LPTRACEBUFFER lpBuffer = lpBuffers.load();
+
+	StopTraceDrainer(this);
+
+	while(lpBuffer) {
+		LPTRACEBUFFER lpNext = lpBuffer->lpNext;
+		delete lpBuffer;
+		lpBuffer = lpNext;
+	}
+}
+
+//
+// Writing events.
+//
+
+// Hands the ring back when its thread ends, so the next thread can have
+// it once the drainer has emptied it.
+class CTraceThread {
+public:
+	LPTRACEBUFFER m_lpBuffer;
+
+	CTraceThread()
+		: m_lpBuffer(NULL)
+	{
+	}
+
+	~CTraceThread()
+	{
+		if(m_lpBuffer) {
+			m_lpBuffer->bRetired.store(1, std::memory_order_release);
+		}
+	}
+};
+
+static inline LPTRACEBUFFER CreateTraceBuffer()
+{
+	TRACESTATE* lpState = GetTraceState();
+	LPTRACEBUFFER lpBuffer;
+
+	// Take over the ring of a thread that has ended, if it is empty.
+	for(lpBuffer = lpState->lpBuffers.load(std::memory_order_acquire); lpBuffer; lpBuffer = lpBuffer->lpNext) {
+		int bRetired = 1;
+
+		if(lpBuffer->uHead.load(std::memory_order_acquire) == lpBuffer->uTail.load(std::memory_order_acquire) && lpBuffer->bRetired.compare_exchange_strong(bRetired, 0)) {
+			lpBuffer->iThread = ++lpState->cThreads;
+			return lpBuffer;
+		}
+	}
+
+	lpBuffer = new TRACEBUFFER;
+	lpBuffer->uHead.store(0, std::memory_order_relaxed);
+	lpBuffer->uTail.store(0, std::memory_order_relaxed);
+	lpBuffer->cDropped.store(0, std::memory_order_relaxed);
+	lpBuffer->bRetired.store(0, std::memory_order_relaxed);
+	lpBuffer->iThread = ++lpState->cThreads;
+	lpBuffer->lpNext = lpState->lpBuffers.load(std::memory_order_relaxed);
+
+	while(!lpState->lpBuffers.compare_exchange_weak(lpBuffer->lpNext, lpBuffer, std::memory_order_release, std::memory_order_relaxed)) {
+	}
+
+	return lpBuffer;
+}
+
+static inline LPTRACEBUFFER GetTraceBuffer()
+{
+	static thread_local CTraceThread thread;
+
+	if(!thread.m_lpBuffer) {
+		thread.m_lpBuffer = CreateTraceBuffer();
+	}
+
+	return thread.m_lpBuffer;
+}
+
+// Returns the next free event of this thread's ring, or NULL if the ring
+// is full. The event is only seen by the drainer after 'CommitTraceEvent'.
+static inline LPTRACEEVENT BeginTraceEvent(LPTRACEBUFFER lpBuffer, int iType)
+{
+	unsigned uHead = lpBuffer->uHead.load(std::memory_order_relaxed);
+	LPTRACEEVENT lpEvent;
+
+	if(uHead - lpBuffer->uTail.load(std::memory_order_acquire) >= TRACE_BUFFER_EVENTS) {
+		lpBuffer->cDropped.fetch_add(1, std::memory_order_relaxed);
+		return NULL;
+	}
+
+	lpEvent = &lpBuffer->events[uHead & (TRACE_BUFFER_EVENTS - 1)];
+	lpEvent->iType = (BYTE)iType;
+	lpEvent->cArgs = 0;
+	lpEvent->cbStrings = 0;
+
+	return lpEvent;
+}
+
+static inline void CommitTraceEvent(LPTRACEBUFFER lpBuffer)
+{
+	lpBuffer->uHead.store(lpBuffer->uHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Argument capture. Every argument is stored as one of four types, picked
+// at compile time; strings are copied into the event.
+template<class T>
+struct TRACEARGTYPE {
+	typedef typename std::conditional<std::is_floating_point<T>::value, double,
+			typename std::conditional<std::is_pointer<T>::value, const void*,
+			typename std::conditional<std::is_signed<T>::value, long long, unsigned long long>::type>::type>::type TYPE;
+};
+
+static inline void SetTraceArg(LPTRACEEVENT lpEvent, int i, long long v)
+{
+	lpEvent->iArgTypes[i] = TRACEARG_INT;
+	lpEvent->args[i].i = v;
+}
+
+static inline void SetTraceArg(LPTRACEEVENT lpEvent, int i, unsigned long long v)
+{
+	lpEvent->iArgTypes[i] = TRACEARG_UINT;
+	lpEvent->args[i].u = v;
+}
+
+static inline void SetTraceArg(LPTRACEEVENT lpEvent, int i, double v)
+{
+	lpEvent->iArgTypes[i] = TRACEARG_DOUBLE;
+	lpEvent->args[i].d = v;
+}
+
+static inline void SetTraceArg(LPTRACEEVENT lpEvent, int i, const void* v)
+{
+	lpEvent->iArgTypes[i] = TRACEARG_POINTER;
+	lpEvent->args[i].p = v;
+}
+
+template<class T>
+static inline void TraceArg(LPTRACEEVENT lpEvent, int i, T v)
+{
+	SetTraceArg(lpEvent, i, (typename TRACEARGTYPE<T>::TYPE)v);
+}
+
+static inline void TraceArg(LPTRACEEVENT lpEvent, int i, const char* lpsz)
+{
+	lpEvent->iArgTypes[i] = TRACEARG_STRING;
+
+	if(!lpsz) {
+		lpEvent->args[i].u = (unsigned long long)-1;
+		return;
+	}
+
+	// Copy as much as fits, the last byte is always the terminator.
+	int cb = lpEvent->cbStrings;
+	int cch = 0;
+
+	while(lpsz[cch] && cb + cch < TRACE_STRING_BYTES - 1) {
+		lpEvent->szStrings[cb + cch] = lpsz[cch];
+		cch++;
+	}
+
+	lpEvent->szStrings[cb + cch] = '\0';
+	lpEvent->args[i].u = (unsigned long long)cb;
+	lpEvent->cbStrings = (BYTE)(cb + cch + 1 < TRACE_STRING_BYTES ? cb + cch + 1 : TRACE_STRING_BYTES - 1);
+}
+
+static inline void TraceArg(LPTRACEEVENT lpEvent, int i, char* lpsz)
+{
+	TraceArg(lpEvent, i, (const char*)lpsz);
+}
+
+static inline void TraceArgs(LPTRACEEVENT lpEvent, int i)
+{
+	lpEvent->cArgs = (BYTE)i;
+}
+
+template<class T, class... ARGS>
+static inline void TraceArgs(LPTRACEEVENT lpEvent, int i, T v, ARGS... args)
+{
+	TraceArg(lpEvent, i, v);
+	TraceArgs(lpEvent, i + 1, args...);
+}
+
+template<class... ARGS>
+static inline void TraceMessage(int iLevel, const char* lpszFormat, ARGS... args)
+{
+	static_assert(sizeof...(ARGS) <= TRACE_MAX_ARGS, "too many arguments for a trace message");
+
+	LPTRACEBUFFER lpBuffer;
+	LPTRACEEVENT lpEvent;
+
+	// Without a drainer the message is written right away.
+	if(!IsTracing()) {
+		TRACEEVENT event;
+		char szText[1024];
+
+		event.iType = TRACEEVENT_MESSAGE;
+		event.lpszText = lpszFormat;
+		event.cbStrings = 0;
+		TraceArgs(&event, 0, args...);
+
+		FormatTraceMessage(&event, szText, sizeof(szText));
+		WriteTraceText(szText);
+		return;
+	}
+
+	lpBuffer = GetTraceBuffer();
+
+	if((lpEvent = BeginTraceEvent(lpBuffer, TRACEEVENT_MESSAGE)) == NULL) {
+		return;
+	}
+
+	lpEvent->lpszText = lpszFormat;
+	lpEvent->llTime = GetTraceTime();
+	lpEvent->iLevel = (BYTE)iLevel;
+	TraceArgs(lpEvent, 0, args...);
+
+	CommitTraceEvent(lpBuffer);
+}
+
+// Names the calling thread on the timeline, once tracing has started.
+// The name is copied.
+static inline void TraceThreadName(const char* lpszName)
+{
+	LPTRACEBUFFER lpBuffer;
+	LPTRACEEVENT lpEvent;
+
+	if(!IsTracing()) {
+		return;
+	}
+
+	lpBuffer = GetTraceBuffer();
+
+	if((lpEvent = BeginTraceEvent(lpBuffer, TRACEEVENT_NAME)) == NULL) {
+		return;
+	}
+
+	lpEvent->lpszText = "";
+	lpEvent->llTime = GetTraceTime();
+	TraceArg(lpEvent, 0, lpszName);
+
+	CommitTraceEvent(lpBuffer);
+}
+
+// Records one span when it goes out of scope; use 'TRACE_SPAN'.
+class CTraceSpan {
+public:
+	CTraceSpan(const char* lpszName)
+		: m_lpszName(lpszName), m_llStart(GetTraceTime())
+	{
+	}
+
+	~CTraceSpan()
+	{
+		LPTRACEBUFFER lpBuffer;
+		LPTRACEEVENT lpEvent;
+
+		if(!IsTracing()) {
+			return;
+		}
+
+		lpBuffer = GetTraceBuffer();
+
+		if((lpEvent = BeginTraceEvent(lpBuffer, TRACEEVENT_SPAN)) == NULL) {
+			return;
+		}
+
+		lpEvent->lpszText = m_lpszName;
+		lpEvent->llTime = m_llStart;
+		lpEvent->llDuration = GetTraceTime() - m_llStart;
+
+		CommitTraceEvent(lpBuffer);
+	}
+
+private:
+	const char*	m_lpszName;
+	long long	m_llStart;
+};
+
+//
+// The macros. Levels above TRACE_LEVEL expand to nothing.
+//
+
+#define TRACE_CONCAT_(a, b)		a##b
+#define TRACE_CONCAT(a, b)		TRACE_CONCAT_(a, b)
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(...)		TraceMessage(TRACE_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define TRACE_ERROR(...)		((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_WARNING
+#define TRACE_WARNING(...)		TraceMessage(TRACE_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define TRACE_WARNING(...)		((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(...)			TraceMessage(TRACE_LEVEL_INFO, __VA_ARGS__)
+#define TRACE_SPAN(name)		CTraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#else
+#define TRACE_INFO(...)			((void)0)
+#define TRACE_SPAN(name)		((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_VERBOSE
+#define TRACE_VERBOSE(...)		TraceMessage(TRACE_LEVEL_VERBOSE, __VA_ARGS__)
+#else
+#define TRACE_VERBOSE(...)		((void)0)
+#endif
+
+#endif // TRACING_H
@@ -4,99 +4,344 @@
 #include <windows.h>
 #include <windowsx.h>
 
-#include <io.h>
-#include <fcntl.h>
 #include <stdio.h>
 
 #include "trace.h"
-#include "resource\resource.h"
+#include "..\Common\bmpcache.h"
+#include "..\Common\bmpmap.h"
+#include "..\Common\bmppack.h"
+#include "..\Common\bmpregion.h"
+#include "..\Common\pyramid.h"
+#include "..\Common\rle.h"
 
 static char g_szAppName[] = "Example2";
 static char g_szAppTitle[] = "Example 2";
+static char g_szFilename[] = "Resources\\pic24.bmp";
 
-HBITMAP g_hBitmap;
+BITMAPVIEW g_View;
 
-void SaveBitmap(HBITMAP hBitmap, LPCTSTR lpszFilename)
+// The info header in the mapping sits at offset 14, and can be a V4 or V5
+// header with the masks inside it. GDI gets a DWORD aligned copy instead,
+// a plain BITMAPINFOHEADER followed by the masks or the color table.
+struct {
+	BITMAPINFOHEADER	bmiHeader;
+	RGBQUAD				bmiColors[256];
+} g_ViewInfo;
+
+// RLE compressed bitmaps can't be shown straight from the file, those are
+// decoded into this surface first. So are bitmaps with channel masks GDI
+// doesn't take, or with an alpha mask, which end up as 32bpp.
+DIBSURFACE g_Decoded;
+
+// Or the bitmap comes from a pack, "assets.pak" for its first surface or
+// "assets.pak:ui/title.bmp" for that one. Then 'g_Decoded' points into
+// the pack.
+SURFACEPACK g_Pack;
+
+// Bitmaps bigger than this many pixels aren't mapped, only the part that
+// fits in the window is read from the file. The arrow keys move around,
+// '-' and '+' zoom out and in by skipping pixels. If the bitmap has a
+// pyramid next to it, "map.bmp.pyr", zooming out draws from that instead,
+// filtered rather than skipped and without going near the bitmap.
+#define	VIEWPORT_MIN_PIXELS	(64 << 20)
+#define	VIEWPORT_MAX_STEP	64
+
+BITMAPREADER g_Reader;
+PYRAMID g_Pyramid;
+DIBSURFACE g_Viewport;
+POINT g_ptViewport;		// Top left of the window in the bitmap
+int g_iStep = 1;		// Every how many pixels one is shown
+
+// Finds the bitmap shown when none is given on the command line. It lives
+// in "Resources" next to the examples, so it's looked for from the folder
+// of the executable up rather than from wherever we were started.
+BOOL FindDefaultBitmap(LPSTR lpszPath, size_t cchPath)
+{
+	char szFolder[MAX_PATH];
+	DWORD cch = GetModuleFileNameA(NULL, szFolder, sizeof(szFolder));
+
+	if(!cch || cch >= sizeof(szFolder)) {
+		return FALSE;
+	}
+
+	for(int i = 0; i < 3; i++) {
+		char* pSlash = strrchr(szFolder, '\\');
+
+		if(!pSlash) {
+			break;
+		}
+
+		*pSlash = 0;
+
+		if(snprintf(lpszPath, cchPath, "%s\\%s", szFolder, g_szFilename) < (int)cchPath && GetFileAttributesA(lpszPath) != INVALID_FILE_ATTRIBUTES) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+// Copies the info header and the masks or the color table of 'g_View'
+// into 'g_ViewInfo'.
+void CopyViewInfo()
 {
-	RGBQUAD rgbPalette[256];
-	DIBSECTION ds;
-
-	// Get the DIB section information of the bitmap.
-	GetObject(hBitmap, sizeof(DIBSECTION), &ds);
-
-	// Select the bitmap into a DC so we can retrieve
-	// it's palette and calculate the number of colors
-	// used.
-	HDC hDC = CreateCompatibleDC(NULL);
-	HBITMAP hOldBitmap = (HBITMAP)SelectObject(hDC, (HBITMAP)hBitmap);
-	int iUsedColors = GetDIBColorTable(hDC, 0, ds.dsBmih.biClrUsed, &rgbPalette[0]);
-	SelectObject(hDC, hOldBitmap);
-	DeleteDC(hDC);
-
-	// Create a bitmap file header and load it up with
-	// the right information about our bitmap.
-	BITMAPFILEHEADER bh;
-	bh.bfSize = sizeof(BITMAPFILEHEADER);
-	bh.bfType = ((WORD) ('M' << 8) | 'B');
-	bh.bfOffBits = (DWORD)(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + (sizeof(RGBQUAD) * iUsedColors));
-	bh.bfReserved1 = 0;
-	bh.bfReserved2 = 0;
-
-	// Write the bitmap data to disk.
-	int hFile = _open(lpszFilename, _O_CREAT | _O_BINARY | _O_WRONLY);
-	_write(hFile, &bh, sizeof(BITMAPFILEHEADER));
-	_write(hFile, &ds.dsBmih, sizeof(BITMAPINFOHEADER));
-	_write(hFile, &rgbPalette, sizeof(RGBQUAD) * iUsedColors);
-	_write(hFile, ds.dsBm.bmBits, ds.dsBm.bmWidth * ds.dsBm.bmHeight * (ds.dsBm.bmBitsPixel / 8));
-	_close(hFile);
+	ZeroMemory(&g_ViewInfo, sizeof(g_ViewInfo));
+
+	g_ViewInfo.bmiHeader = g_View.bih;
+	g_ViewInfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	g_ViewInfo.bmiHeader.biClrUsed = g_View.iColors;
+
+	if(g_View.bih.biCompression == BI_BITFIELDS) {
+		memcpy(g_ViewInfo.bmiColors, g_View.dwMasks, sizeof(DWORD) * 3);
+	}
+	else
+	if(g_View.iColors) {
+		memcpy(g_ViewInfo.bmiColors, g_View.lpPalette, sizeof(RGBQUAD) * g_View.iColors);
+	}
+}
+
+// Opens the pack named in 'lpszPath', which is "pack" or "pack:name", and
+// sets 'g_Decoded' up on the surface in it.
+BOOL OpenPackedBitmap(LPCSTR lpszPath)
+{
+	char szPack[MAX_PATH];
+	LPCSTR lpszName = strstr(lpszPath, ".pak:");
+	size_t cchPack = lpszName ? (size_t)(lpszName - lpszPath) + 4 : strlen(lpszPath);
+	int iEntry = 0;
+
+	if(cchPack >= sizeof(szPack)) {
+		return FALSE;
+	}
+
+	memcpy(szPack, lpszPath, cchPack);
+	szPack[cchPack] = 0;
+
+	if(!OpenSurfacePack(szPack, &g_Pack)) {
+		return FALSE;
+	}
+
+	if(lpszName) {
+		iEntry = FindPackSurface(&g_Pack, lpszName + 5);
+	}
+
+	// The surface goes straight to 'SetDIBitsToDevice', so its BITMAPINFO
+	// has to agree with the index.
+	return CheckPackSurfaceInfo(&g_Pack, iEntry) && GetPackSurface(&g_Pack, iEntry, &g_Decoded);
+}
+
+BOOL IsPackName(LPCSTR lpszPath)
+{
+	size_t cch = strlen(lpszPath);
+
+	return strstr(lpszPath, ".pak:") != NULL || (cch > 4 && strcmp(lpszPath + cch - 4, ".pak") == 0);
+}
+
+// Reads the part of the bitmap that is in the window.
+void UpdateViewport(HWND hWnd)
+{
+	RECT rc;
+
+	if(!g_Viewport.lpBmi) {
+		return;
+	}
+
+	// Keep the window inside the bitmap, as far as it fits.
+	int cx = g_Viewport.cx * g_iStep;
+	int cy = g_Viewport.cy * g_iStep;
+
+	if(g_ptViewport.x > g_Reader.view.cx - cx) g_ptViewport.x = g_Reader.view.cx - cx;
+	if(g_ptViewport.y > g_Reader.view.cy - cy) g_ptViewport.y = g_Reader.view.cy - cy;
+	if(g_ptViewport.x < 0) g_ptViewport.x = 0;
+	if(g_ptViewport.y < 0) g_ptViewport.y = 0;
+
+	SetRect(&rc, g_ptViewport.x, g_ptViewport.y, g_ptViewport.x + cx, g_ptViewport.y + cy);
+
+	// Whatever the bitmap doesn't cover stays white.
+	memset(g_Viewport.pBits, 0xFF, (size_t)g_Viewport.iPitch * g_Viewport.cy);
+
+	// The steps are powers of two, and so are the levels of the pyramid.
+	// Past its last level it's back to skipping pixels.
+	if(g_Pyramid.cLevels && g_iStep > 1) {
+		PYRAMIDVIEW view;
+
+		FindPyramidView(&g_Pyramid, &rc, g_Viewport.cx, g_Viewport.cy, &view);
+
+		if((1 << view.iLevel) == g_iStep && DrawPyramidView(&g_Pyramid, &view, &g_Viewport)) {
+			InvalidateRect(hWnd, NULL, FALSE);
+			return;
+		}
+	}
+
+	if(!ReadBitmapRegion(&g_Reader, &rc, g_iStep, &g_Viewport)) {
+		TRACE_ERROR("Error reading bitmap\n");
+	}
+
+	InvalidateRect(hWnd, NULL, FALSE);
 }
 
 BOOL OnCreate(HWND hWnd, CREATESTRUCT FAR* lpCreateStruct)
 {
-	// Load a bitmap from the resource and store the
-	// handle in 'g_hBitmap' which is a global handle.
-	g_hBitmap = (HBITMAP)LoadImage(lpCreateStruct->hInstance, MAKEINTRESOURCE(IDB_BITMAP), IMAGE_BITMAP, 0, 0, LR_CREATEDIBSECTION);
- 
-	// If 'g_hBitmap' equals NULL then the bitmap failed
-	// to load. Return FALSE to quit the program.
-	if(!g_hBitmap) {
+	// The name of the bitmap file is passed to us by 'WinMain'.
+	LPCSTR lpszFilename = (LPCSTR)lpCreateStruct->lpCreateParams;
+
+	// A pack holds its surfaces ready to show, there is nothing to decode.
+	if(IsPackName(lpszFilename)) {
+		if(!OpenPackedBitmap(lpszFilename)) {
+			TRACE_ERROR("Error opening '%s'\n", lpszFilename);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	// A huge bitmap is read a window full at a time, see 'OnSize'.
+	if(OpenBitmapReader(lpszFilename, &g_Reader)) {
+		if((long long)g_Reader.view.cx * g_Reader.view.cy >= VIEWPORT_MIN_PIXELS) {
+			char szPyramid[MAX_PATH];
+
+			// A pyramid older than the bitmap is of some other picture.
+			snprintf(szPyramid, sizeof(szPyramid), "%s%s", lpszFilename, PYRAMID_EXTENSION);
+
+			if(IsPyramidCurrent(lpszFilename, szPyramid)) {
+				OpenPyramid(&g_Pyramid, szPyramid, g_Reader.view.cx, g_Reader.view.cy, DIBFMT_UNKNOWN);
+			}
+
+			return TRUE;
+		}
+
+		CloseBitmapReader(&g_Reader);
+	}
+
+	// Map the bitmap file into memory. Unlike 'LoadImage' this doesn't
+	// copy the pixels anywhere, 'g_View' just points into the file.
+	if(!MapBitmapFile(lpszFilename, &g_View)) {
+		TRACE_ERROR("Error mapping bitmap file '%s'\n", lpszFilename);
 		return FALSE;
 	}
 
+	if(g_View.bih.biCompression == BI_RLE8 || g_View.bih.biCompression == BI_RLE4) {
+		if(!CreateRLEDIBSurface(&g_View, &g_Decoded)) {
+			TRACE_ERROR("Error decoding bitmap file '%s'\n", lpszFilename);
+			return FALSE;
+		}
+	}
+	else
+	if(g_View.bih.biCompression == BI_BITFIELDS || g_View.bih.biCompression == BI_ALPHABITFIELDS) {
+		// GDI only draws the 555 and 565 masks at 16bpp and 888 at 32bpp,
+		// and BI_ALPHABITFIELDS not at all.
+		if(g_View.bih.biCompression == BI_ALPHABITFIELDS || GetBitmapViewFormat(&g_View) == DIBFMT_UNKNOWN || g_View.dwMasks[3]) {
+			if(!CreateViewDIBSurface(&g_View, &g_Decoded, DIBFMT_UNKNOWN)) {
+				TRACE_ERROR("Error decoding bitmap file '%s'\n", lpszFilename);
+				return FALSE;
+			}
+		}
+	}
+
+	CopyViewInfo();
+
 	return TRUE;
 }
 
 void OnDestroy(HWND hWnd)
 {
-	// If the handle is valid then destroy the bitmap.
-	if(g_hBitmap) {
-		DeleteObject(g_hBitmap);
+	// Unmap the bitmap file, or the pack.
+	UnmapBitmapFile(&g_View);
+
+	CloseBitmapReader(&g_Reader);
+	FreePyramid(&g_Pyramid);
+
+	if(g_Viewport.lpBmi) {
+		FreeDIBSurface(&g_Viewport);
+	}
+
+	if(g_Pack.pBase) {
+		CloseSurfacePack(&g_Pack);
+	}
+	else
+	if(g_Decoded.lpBmi) {
+		FreeDIBSurface(&g_Decoded);
 	}
 
 	PostQuitMessage(0);
 }
 
+void OnSize(HWND hWnd, UINT state, int cx, int cy)
+{
+	if(!g_Reader.view.cx || cx <= 0 || cy <= 0) {
+		return;
+	}
+
+	if(g_Viewport.lpBmi) {
+		FreeDIBSurface(&g_Viewport);
+	}
+
+	if(!CreateDIBSurface(&g_Viewport, cx, cy, 32, DIBALLOC_NOZERO)) {
+		TRACE_ERROR("Error creating DIB!\n");
+		return;
+	}
+
+	UpdateViewport(hWnd);
+}
+
+void OnKey(HWND hWnd, UINT vk, BOOL fDown, int cRepeat, UINT flags)
+{
+	// A quarter of the window at a time.
+	int dx = g_Viewport.cx * g_iStep / 4;
+	int dy = g_Viewport.cy * g_iStep / 4;
+
+	if(!g_Viewport.lpBmi) {
+		return;
+	}
+
+	switch(vk) {
+	case VK_LEFT:	g_ptViewport.x -= dx; break;
+	case VK_RIGHT:	g_ptViewport.x += dx; break;
+	case VK_UP:		g_ptViewport.y -= dy; break;
+	case VK_DOWN:	g_ptViewport.y += dy; break;
+
+	// Zoom around the middle of the window.
+	case VK_SUBTRACT:
+	case VK_OEM_MINUS:
+	case VK_ADD:
+	case VK_OEM_PLUS: {
+		int iStep = (vk == VK_SUBTRACT || vk == VK_OEM_MINUS) ? g_iStep * 2 : g_iStep / 2;
+
+		if(iStep < 1 || iStep > VIEWPORT_MAX_STEP) {
+			return;
+		}
+
+		g_ptViewport.x += g_Viewport.cx * (g_iStep - iStep) / 2;
+		g_ptViewport.y += g_Viewport.cy * (g_iStep - iStep) / 2;
+		g_iStep = iStep;
+		break;
+	}
+
+	default:
+		return;
+	}
+
+	UpdateViewport(hWnd);
+}
+
 void OnPaint(HWND hWnd)
 {
 	PAINTSTRUCT ps;
-	HDC hDC, hBitmapDC;
-	HBITMAP hOldBitmap;
-	BITMAP bm;
+	HDC hDC;
 
 	hDC = BeginPaint(hWnd, &ps);
 
-	// Create a DC for the bitmap and select it
-	// into the created DC.
-	hBitmapDC = CreateCompatibleDC(hDC);
-	hOldBitmap = (HBITMAP)SelectObject(hBitmapDC, (HBITMAP)g_hBitmap);
-
-	// Display the bitmap into window
-	GetObject((HBITMAP)g_hBitmap, sizeof(BITMAP), &bm);	
-	BitBlt(hDC, 0, 0, bm.bmWidth, bm.bmHeight, hBitmapDC, 0, 0, SRCCOPY);
-
-	// Delete the temporary bitmap DC
-	SelectObject(hBitmapDC, hOldBitmap);
-	DeleteDC(hBitmapDC);
+	// Display the bitmap straight from the mapped file. We don't need a
+	// bitmap DC for this, 'SetDIBitsToDevice' reads the DIB directly.
+	if(g_Viewport.lpBmi) {
+		SetDIBitsToDevice(hDC, 0, 0, g_Viewport.cx, g_Viewport.cy, 0, 0, 0, g_Viewport.cy, g_Viewport.pBits, g_Viewport.lpBmi, DIB_RGB_COLORS);
+	}
+	else
+	if(g_Decoded.lpBmi) {
+		SetDIBitsToDevice(hDC, 0, 0, g_Decoded.cx, g_Decoded.cy, 0, 0, 0, g_Decoded.cy, g_Decoded.pBits, g_Decoded.lpBmi, DIB_RGB_COLORS);
+	}
+	else {
+		SetDIBitsToDevice(hDC, 0, 0, g_View.cx, g_View.cy, 0, 0, 0, g_View.cy, g_View.pBits, (const BITMAPINFO*)&g_ViewInfo, DIB_RGB_COLORS);
+	}
 
 	EndPaint(hWnd, &ps);
 }
@@ -107,6 +352,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT iMsg, WPARAM wParam, LPARAM lParam)
 		HANDLE_MSG(hWnd, WM_CREATE, OnCreate);
 		HANDLE_MSG(hWnd, WM_DESTROY, OnDestroy);
 		HANDLE_MSG(hWnd, WM_PAINT, OnPaint);
+		HANDLE_MSG(hWnd, WM_SIZE, OnSize);
+		HANDLE_MSG(hWnd, WM_KEYDOWN, OnKey);
 	}
 
 	return DefWindowProc(hWnd, iMsg, wParam, lParam);	
@@ -117,6 +364,13 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR szCmdLine,
 	MSG msg;
 	HWND hWnd;
 	WNDCLASSEX wc;
+	char szFilename[MAX_PATH];
+
+	// Without a bitmap on the command line we show our own.
+	if(!szCmdLine[0] && !FindDefaultBitmap(szFilename, sizeof(szFilename))) {
+		TRACE_ERROR("Can't find '%s', pass a bitmap on the command line\n", g_szFilename);
+		return 0;
+	}
 
 	wc.cbSize = sizeof(wc);
 	wc.style = CS_VREDRAW | CS_HREDRAW;
@@ -145,7 +399,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR szCmdLine,
 		NULL,
 		NULL,
 		hInstance,
-		NULL
+		(LPVOID)(szCmdLine[0] ? szCmdLine : szFilename)
 	);
 
 	ShowWindow(hWnd, iCmdShow);
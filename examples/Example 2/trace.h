@@ -2,15 +2,9 @@
 #define WIN32_LEAN_AND_MEAN
 
 #include <windows.h>
-#include <stdio.h>
 
-static void __cdecl TRACE(const char *szString, ...)
-{
-	char szDebugString[1024];
-	va_list varList;
+#include "..\Common\tracing.h"
 
-	va_start(varList, szString);
-
-	vsprintf(szDebugString, szString, varList);
-	OutputDebugString(szDebugString);
-}
+// 'TRACE' is an informational message, see tracing.h for the other
+// levels and for timing spans.
+#define TRACE TRACE_INFO
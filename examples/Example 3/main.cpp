@@ -6,6 +6,9 @@
 #include <stdlib.h>
 
 #include "trace.h"
+#include "..\Common\dib.h"
+#include "..\Common\raster.h"
+#include "..\Common\scale.h"
 
 static char g_szAppName[] = "Example3";
 static char g_szAppTitle[] = "Example 3";
@@ -15,182 +18,87 @@ static char g_szAppTitle[] = "Example 3";
 
 BYTE* g_pBits = NULL;
 LPBITMAPINFO g_lpBmi = NULL;
+DIBSURFACE g_Surface;
 
-LPBITMAPINFO CreateDIB(int cx, int cy, int iBpp, BYTE* &pBits)
+// The DIB scaled to the size of the window. The DIB never changes after
+// it is made, so it is scaled once every time the window changes size,
+// nearest neighbour like StretchDIBits does, and WM_PAINT only copies.
+BYTE* g_pWindowBits = NULL;
+LPBITMAPINFO g_lpWindowBmi = NULL;
+DIBSURFACE g_WindowSurface;
+CThreadPool* g_lpPool = NULL;
+
+BOOL OnCreate(HWND hWnd, CREATESTRUCT FAR* lpCreateStruct)
 {
-	LPBITMAPINFO lpBmi;
-	int iBmiSize;
-	int iSurfaceSize;
-
-	// Calculate the size of the bitmap info header.
-	switch(iBpp) {
-	case 8:		// 8 bpp
-		iBmiSize = sizeof(BITMAPINFO) + sizeof(RGBQUAD) * 256;
-		iSurfaceSize = cx * cy * sizeof(BYTE);
-		break;
-	
-	case 15:	// 15/16 bpp
-	case 16:
-		iBmiSize = sizeof(BITMAPINFO) + sizeof(DWORD) * 4;
-		iSurfaceSize = cx * cy * sizeof(WORD);
-		break;
-
-	case 24:	// 24 bpp
-		iBmiSize = sizeof(BITMAPINFO);
-		iSurfaceSize = cx * cy * (sizeof(BYTE) * 3);
-		break;
-
-	case 32:	// 32 bpp
-		iBmiSize = sizeof(BITMAPINFO) + sizeof(DWORD) * 4;
-		iSurfaceSize = cx * cy * sizeof(DWORD);
-		break;
+	// Create a new 32bpp DIB
+	if((g_lpBmi = CreateDIB(DIB_WIDTH, DIB_HEIGHT, 32, g_pBits)) == NULL) {
+		TRACE_ERROR("Error creating DIB!\n");
+		return FALSE;
 	}
 
-	// Allocate memory for the bitmap info header.
-	if((lpBmi = (LPBITMAPINFO)malloc(iBmiSize)) == NULL) {
-		TRACE("Error allocating BitmapInfo!\n");
-		return NULL;
+	// Write a white pixel in the middle of the DIB surface. This works
+	// for any bit count, raster.h packs the color into the right format.
+	if(!InitDIBSurface(&g_Surface, g_lpBmi, g_pBits)) {
+		TRACE_ERROR("Unsupported DIB format!\n");
+		return FALSE;
 	}
 
-	ZeroMemory(lpBmi, iBmiSize);
+	FillDIBRect(&g_Surface, DIB_WIDTH / 2, DIB_HEIGHT / 2, DIB_WIDTH / 2 + 1, DIB_HEIGHT / 2 + 1, 0x00FFFFFF);
 
-	// Allocate memory for the DIB surface.
-	if((pBits = (BYTE*)malloc(iSurfaceSize)) == NULL) {
-		TRACE("Error allocating memory for bitmap bits\n");
-		return NULL;
-	}
+	// One worker for every core to scale with.
+	g_lpPool = new CThreadPool();
 
-	ZeroMemory(pBits, iSurfaceSize);
-
-	// Initialize bitmap info header
-	lpBmi->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-	lpBmi->bmiHeader.biWidth = cx;
-	lpBmi->bmiHeader.biHeight = -(signed)cy;		// <-- NEGATIVE MEANS TOP DOWN!!!
-	lpBmi->bmiHeader.biPlanes = 1;
-	lpBmi->bmiHeader.biSizeImage = 0;
-	lpBmi->bmiHeader.biXPelsPerMeter = 0;
-	lpBmi->bmiHeader.biYPelsPerMeter = 0;
-	lpBmi->bmiHeader.biClrUsed = 0;
-	lpBmi->bmiHeader.biClrImportant = 0;
-	lpBmi->bmiHeader.biCompression = BI_RGB;
-
-	// After initializing the bitmap info header we need to store some
-	// more information depending on the bpp of the bitmap.
-	switch(iBpp) {
-	case 8:
-		{
-			// For the 8bpp DIB we will create a simple grayscale palette.
-			for(int i = 0; i < 256; i++) {
-				lpBmi->bmiColors[i].rgbRed      = (BYTE)i;
-				lpBmi->bmiColors[i].rgbGreen    = (BYTE)i;
-				lpBmi->bmiColors[i].rgbBlue     = (BYTE)i;
-				lpBmi->bmiColors[i].rgbReserved = (BYTE)0;
-			}
-
-			// Set the bpp for this DIB to 8bpp.
-			lpBmi->bmiHeader.biBitCount = 8;
-		}
-		break;
-	
-	case 15:
-		{
-			// This is where we will tell the DIB what bits represent what
-			// data. This may look confusing at first but the representation
-			// of the RGB data can be different on different devices. For
-			// example you can have for Hicolor a 565 format. Meaning 5 bits
-			// for red, 6 bits for green and 5 bits for blue or better stated
-			// like RGB. But, the pixel data can also be the other way around,
-			// for example BGR meaning, 5 bits for blue, 6 bits for green and
-			// 5 bits for red. This piece of information will tell the bitmap
-			// info header how the pixel data will be stored. In this case in
-			// RGB format in 555 because this is a 15bpp DIB so the highest
-			// bit (bit 15) will not be used.
-			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
-
-			pBmi[0] = 0x00007C00;	// Red mask
-			pBmi[1] = 0x000003E0;	// Green mask
-			pBmi[2] = 0x0000001F;	// Blue mask
-			pBmi[3] = 0x00000000;	// Not used
-
-			// 15bpp DIB also use 16 bits to store a pixel.
-			lpBmi->bmiHeader.biBitCount = 16;
-			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
-		}
-		break;
-
-	case 16:
-		{
-			// Take a look at the remarks written by 15bpp. For this format
-			// it's the same thing, except in this case the mask's will be
-			// different because our format will be 565 (RGB).
-			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
-
-			pBmi[0] = 0x0000F800;	// Red mask
-			pBmi[1] = 0x000007E0;	// Green mask
-			pBmi[2] = 0x0000001F;	// Blue mask
-			pBmi[3] = 0x00000000;	// Not used
-
-			lpBmi->bmiHeader.biBitCount = 16;
-			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
-		}
-		break;
-
-	case 24:
-		{
-			// This is a 1:1 situation. There is no need to set any extra
-			// information.
-			lpBmi->bmiHeader.biBitCount = 24;
-		}
-		break;
-
-	case 32:
-		{
-			// This may speak for it's self. In this case where using 32bpp.
-			// The format will be ARGB. the Alpha (A) portion of the format
-			// will not be used. The other mask's tell us where the bytes
-			// for the R, G and B data will be stored in the DWORD.
-			//
-			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
-
-			pBmi[0] = 0x00FF0000;	// Red mask
-			pBmi[1] = 0x0000FF00;	// Green mask
-			pBmi[2] = 0x000000FF;	// Blue mask
-			pBmi[3] = 0x00000000;	// Not used (Alpha?)
-
-			lpBmi->bmiHeader.biBitCount = 32;
-			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
-		}
-		break;
-	}
+	return TRUE;
+}
+
+void FreeWindowDIB()
+{
+	FreeDIB(g_lpWindowBmi);
 
-	return lpBmi;
+	g_lpWindowBmi = NULL;
+	g_pWindowBits = NULL;
 }
 
-BOOL OnCreate(HWND hWnd, CREATESTRUCT FAR* lpCreateStruct)
+void OnDestroy(HWND hWnd)
 {
-	// Create a new 32bpp DIB
-	if((g_lpBmi = CreateDIB(DIB_WIDTH, DIB_HEIGHT, 32, g_pBits)) == NULL) {
-		return FALSE;
+	FreeWindowDIB();
+
+	if(g_lpPool) {
+		delete g_lpPool;
 	}
 
-	// Write a pixel to the DIB surface.
-	// !!!!WARNING!!!! THE FOLLOWING CODE ONLY WORKS FOR 32 BITS PER PIXEL !!!!WARNING!!!!
-	memset((DWORD*)g_pBits + (DIB_WIDTH / 2) + ((DIB_HEIGHT / 2) * DIB_WIDTH), 0x00FFFFFF, sizeof(DWORD));
+	// The bits live in the same block as the header, this frees both.
+	FreeDIB(g_lpBmi);
 
-	return TRUE;
+	PostQuitMessage(0);
 }
 
-void OnDestroy(HWND hWnd)
+void OnSize(HWND hWnd, UINT state, int cx, int cy)
 {
-	if(g_pBits) {
-		free(g_pBits);
+	SCALEPLAN plan;
+
+	FreeWindowDIB();
+
+	// Nothing to scale to while we're minimized.
+	if(cx <= 0 || cy <= 0) {
+		return;
 	}
 
-	if(g_lpBmi) {
-		free(g_lpBmi);
+	if((g_lpWindowBmi = CreateDIB(cx, cy, 32, g_pWindowBits)) == NULL) {
+		TRACE_ERROR("Error creating window DIB!\n");
+		return;
 	}
-	
-	PostQuitMessage(0);
+
+	InitDIBSurface(&g_WindowSurface, g_lpWindowBmi, g_pWindowBits);
+
+	if(!CreateScalePlan(&plan, DIB_WIDTH, DIB_HEIGHT, cx, cy, SCALE_NEAREST, GetDIBFormatBytes(g_Surface.iFormat))) {
+		TRACE_ERROR("Error creating scale plan!\n");
+		FreeWindowDIB();
+		return;
+	}
+
+	ScaleDIBSurface(&plan, &g_WindowSurface, &g_Surface, g_lpPool);
+	FreeScalePlan(&plan);
 }
 
 void OnPaint(HWND hWnd)
@@ -200,11 +108,11 @@ void OnPaint(HWND hWnd)
 
 	hDC = BeginPaint(hWnd, &ps);
 
-	RECT rc;
-	GetClientRect(hWnd, &rc);
-	StretchDIBits(hDC, 0, 0, rc.right - rc.left, rc.bottom - rc.top, 0, 0, DIB_WIDTH, DIB_HEIGHT, (BYTE*)g_pBits, g_lpBmi, DIB_RGB_COLORS, SRCCOPY);
-
-	//SetDIBitsToDevice(hDC, 0, 0, DIB_WIDTH, DIB_HEIGHT, 0, 0, 0, DIB_HEIGHT, (BYTE*)g_pBits, g_lpBmi, DIB_RGB_COLORS);
+	// The DIB was scaled to the window already in 'OnSize', this copies
+	// it 1:1. StretchDIBits would scale it all over again on every paint.
+	if(g_pWindowBits) {
+		SetDIBitsToDevice(hDC, 0, 0, g_WindowSurface.cx, g_WindowSurface.cy, 0, 0, 0, g_WindowSurface.cy, g_pWindowBits, g_lpWindowBmi, DIB_RGB_COLORS);
+	}
 
 	EndPaint(hWnd, &ps);
 }
@@ -219,6 +127,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT iMsg, WPARAM wParam, LPARAM lParam)
 	switch(iMsg) {
 		HANDLE_MSG(hWnd, WM_CREATE, OnCreate);
 		HANDLE_MSG(hWnd, WM_DESTROY, OnDestroy);
+		HANDLE_MSG(hWnd, WM_SIZE, OnSize);
 		HANDLE_MSG(hWnd, WM_PAINT, OnPaint);
 		HANDLE_MSG(hWnd, WM_ERASEBKGND, OnEraseBkgnd);
 	}
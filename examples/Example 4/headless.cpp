@@ -0,0 +1,415 @@
+
+// Example 4 without a window.
+//
+// Runs the same render loop as 'main.cpp', as fast as it can, and hands
+// every frame to a presenter instead of GDI. Doesn't need 'windows.h', so
+// it builds and runs anywhere, for example:
+//
+//   g++ -O2 -std=c++11 -pthread headless.cpp -o headless -lrt
+//   perf record ./headless -f 100000 null
+//
+// Usage: headless [-w width] [-h height] [-b bpp] [-f frames]
+//                 [-n batches per frame] [-j threads] [-t trace file]
+//                 [-s fifo|mailbox] [-k buffers] [-i interval ms]
+//                 [-l latency ms] [-r max threads]
+//                 [-c max pixels per frame] [presenter]
+//
+// '-j' draws every frame on that many threads, 0 is one for every core.
+// It's 1 by default. '-r' doesn't present anything, it measures how fast
+// frames are drawn with 1 up to that many threads at 8, 16 and 32bpp and
+// prints a table of millions of pixels per second. Make the frames big
+// and full of pixels to give all the threads enough to do:
+//
+//   ./headless -w 1920 -h 1080 -n 1024 -f 200 -r 8
+//
+// '-c' doesn't present anything either, it checks what presenting only
+// the dirty rectangles saves. For 1, 4, 16 and so on up to that many
+// pixels per frame it presents every frame whole, the way it was done
+// before dirty.h, and as rectangles, and prints the bytes per frame both
+// take. The rectangles are also copied to a DIB of their own, which has
+// to end up the same as the frame, or the check fails with exit code 1:
+//
+//   ./headless -f 500 -c 65536
+//
+// With '-t' every frame is written to a Chrome trace, see tracing.h.
+//
+// Normally every frame is drawn and then presented on the same thread.
+// With '-s' frames go through a swap chain of '-k' DIBs (3 by default)
+// to a present thread, see swapchain.h. '-i' paces that thread like a
+// display refreshing every so many milliseconds, '-l' makes every present
+// take that long, like a slow blit would. Run with and without '-s' to
+// see how much a slow presenter holds up drawing, and with '-s' how evenly
+// frames are presented and how many are dropped:
+//
+//   ./headless -f 2000 -l 2
+//   ./headless -f 2000 -l 2 -s fifo
+//   ./headless -f 2000 -l 2 -s mailbox -i 16.667
+//
+// The presenter is "null" (the default), "ppm:<file>", "raw:<file>",
+// "shm:<name>[:<slots>]", "stream:<file>" or "tcp:<host>:<port>"; see
+// present.h. The last two send only what changed, 'receive.cpp' decodes
+// them on the other end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "render.h"
+#include "../Common/present.h"
+#include "../Common/raster.h"
+#include "../Common/swapchain.h"
+#include "../Common/tracing.h"
+
+#include <chrono>
+#include <thread>
+
+// Passes frames on to another presenter, but not before a while.
+class CSlowPresenter : public CPresenter {
+public:
+	CSlowPresenter(CPresenter* lpPresenter, double dLatencyMs)
+		: m_lpPresenter(lpPresenter), m_dLatencyMs(dLatencyMs)
+	{
+	}
+
+	~CSlowPresenter()
+	{
+		delete m_lpPresenter;
+	}
+
+	long long Present(const DIBSURFACE* lpSurface, const RECT* lpRects, int cRects)
+	{
+		std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(m_dLatencyMs));
+		return m_lpPresenter->Present(lpSurface, lpRects, cRects);
+	}
+
+private:
+	CPresenter*	m_lpPresenter;
+	double		m_dLatencyMs;
+};
+
+static void PrintSwapStats(const SWAPSTATS* lpStats, const FRAMESTATS* lpFrames)
+{
+	double dSeconds = lpFrames->dTotalMs / 1000.0;
+
+	printf("submitted:  %llu frames, %.1f per second, %.3f ms waiting for a free DIB\n", lpStats->cSubmitted, lpStats->cSubmitted / dSeconds, lpStats->dWaitMs);
+	printf("presented:  %llu frames, %llu dropped, %llu bytes, %.3f ms per present\n", lpStats->cPresented, lpStats->cDropped, lpStats->cbPresented, lpStats->cPresented ? lpStats->dPresentMs / lpStats->cPresented : 0.0);
+	printf("interval:   %.3f ms average, %.3f ms deviation, %.3f ms 99th percentile, %.3f ms max\n", lpStats->dIntervalMs, lpStats->dIntervalDevMs, lpStats->dIntervalP99Ms, lpStats->dIntervalMaxMs);
+	printf("latency:    %.3f ms average, %.3f ms 99th percentile\n", lpStats->dLatencyMs, lpStats->dLatencyP99Ms);
+}
+
+// Draws 'cFrames' frames with 'cThreads' threads and returns how many
+// pixels per second that came to.
+static double MeasureRender(LPRENDERER lpRenderer, int cPixels, int cFrames, int cThreads)
+{
+	CThreadPool pool(cThreads);
+	double dStartMs;
+
+	// One frame to get the threads going and the DIB in the cache.
+	RenderFrame(lpRenderer, cPixels, &pool);
+	ClearDirtyRegion(&lpRenderer->dirty);
+
+	dStartMs = GetTimeMs();
+
+	for(int iFrame = 0; iFrame < cFrames; iFrame++) {
+		RenderFrame(lpRenderer, cPixels, &pool);
+		ClearDirtyRegion(&lpRenderer->dirty);
+	}
+
+	return (double)cPixels * cFrames / ((GetTimeMs() - dStartMs) / 1000.0);
+}
+
+// Prints millions of pixels per second and how much faster that is than
+// one thread, for every number of threads and depth.
+static int RunScaling(int cx, int cy, int cPixels, int cFrames, int cMaxThreads)
+{
+	static const int iDepths[] = { 8, 16, 32 };
+	double dRates[3][64];
+
+	if(cMaxThreads > 64) {
+		cMaxThreads = 64;
+	}
+
+	for(int iDepth = 0; iDepth < 3; iDepth++) {
+		RENDERER renderer;
+
+		if(!CreateRenderer(&renderer, cx, cy, iDepths[iDepth])) {
+			fprintf(stderr, "Error creating a %dx%d %dbpp DIB\n", cx, cy, iDepths[iDepth]);
+			return 1;
+		}
+
+		for(int cThreads = 1; cThreads <= cMaxThreads; cThreads++) {
+			dRates[iDepth][cThreads - 1] = MeasureRender(&renderer, cPixels, cFrames, cThreads);
+			fprintf(stderr, "%dbpp, %d threads\r", iDepths[iDepth], cThreads);
+		}
+
+		FreeRenderer(&renderer);
+	}
+
+	printf("%dx%d, %d tiles, %d pixels per frame, %d frames, %u cores\n", cx, cy, ((cx + RENDER_TILE_SIZE - 1) >> RENDER_TILE_SHIFT) * ((cy + RENDER_TILE_SIZE - 1) >> RENDER_TILE_SHIFT), cPixels, cFrames, std::thread::hardware_concurrency());
+	printf("threads        8bpp            16bpp            32bpp\n");
+
+	for(int cThreads = 1; cThreads <= cMaxThreads; cThreads++) {
+		printf("%7d", cThreads);
+
+		for(int iDepth = 0; iDepth < 3; iDepth++) {
+			printf("  %8.1f %5.2fx", dRates[iDepth][cThreads - 1] / 1e6, dRates[iDepth][cThreads - 1] / dRates[iDepth][0]);
+		}
+
+		printf("\n");
+	}
+
+	return 0;
+}
+
+// Draws 'cFrames' frames and presents every one whole and as its dirty
+// rectangles. Returns FALSE if the rectangles missed something that was
+// drawn, which shows as a difference between the frame and 'lpShadow',
+// the DIB only the rectangles were copied to.
+static BOOL MeasurePresent(LPRENDERER lpRenderer, LPDIBSURFACE lpShadow, int cPixels, int cFrames, long long* lpcbFull, long long* lpcbDirty, long long* lpcRects)
+{
+	CNullPresenter presenter;
+	int cbRow = lpShadow->cx * GetDIBFormatBytes(lpShadow->iFormat);
+
+	*lpcbFull = *lpcbDirty = *lpcRects = 0;
+
+	for(int iFrame = 0; iFrame < cFrames; iFrame++) {
+		RECT rcDirty[MAX_DIRTY];
+		int cDirty;
+
+		RenderFrame(lpRenderer, cPixels);
+		cDirty = GetDirtyRects(&lpRenderer->dirty, rcDirty, MAX_DIRTY);
+
+		*lpcbFull += presenter.Present(&lpRenderer->surface, NULL, 0);
+		*lpcbDirty += presenter.Present(&lpRenderer->surface, rcDirty, cDirty);
+		*lpcRects += cDirty;
+
+		for(int i = 0; i < cDirty; i++) {
+			BlitDIB(lpShadow, rcDirty[i].left, rcDirty[i].top, &lpRenderer->surface, &rcDirty[i]);
+		}
+
+		ClearDirtyRegion(&lpRenderer->dirty);
+
+		for(int y = 0; y < lpShadow->cy; y++) {
+			if(memcmp(lpShadow->pTop + (ptrdiff_t)y * lpShadow->iPitch, lpRenderer->surface.pTop + (ptrdiff_t)y * lpRenderer->surface.iPitch, cbRow) != 0) {
+				fprintf(stderr, "Frame %d differs from the dirty rectangles in scanline %d\n", iFrame, y);
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+// Prints the bytes presented per frame, whole and as dirty rectangles,
+// for 1 up to 'cMaxPixels' pixels per frame.
+static int RunPresentCheck(int cx, int cy, int iBpp, int cFrames, int cMaxPixels)
+{
+	BOOL bPassed = TRUE;
+
+	printf("%dx%d at %dbpp, %d frames\n", cx, cy, iBpp, cFrames);
+	printf(" pixels   whole bytes   dirty bytes   rects   dirty/whole\n");
+
+	for(int cPixels = 1; cPixels <= cMaxPixels && bPassed; cPixels *= 4) {
+		RENDERER renderer;
+		DIBSURFACE shadow;
+		long long cbFull, cbDirty, cRects;
+
+		if(!CreateRenderer(&renderer, cx, cy, iBpp)) {
+			fprintf(stderr, "Error creating a %dx%d %dbpp DIB\n", cx, cy, iBpp);
+			return 1;
+		}
+
+		// Both start out the same, cleared.
+		if(!CreateDIBSurface(&shadow, cx, cy, iBpp)) {
+			fprintf(stderr, "Error creating a %dx%d %dbpp DIB\n", cx, cy, iBpp);
+			FreeRenderer(&renderer);
+			return 1;
+		}
+
+		bPassed = MeasurePresent(&renderer, &shadow, cPixels, cFrames, &cbFull, &cbDirty, &cRects);
+
+		if(bPassed) {
+			printf("%7d  %12.0f  %12.0f  %6.1f  %11.4f\n", cPixels, (double)cbFull / cFrames, (double)cbDirty / cFrames, (double)cRects / cFrames, (double)cbDirty / cbFull);
+		}
+
+		FreeDIBSurface(&shadow);
+		FreeRenderer(&renderer);
+	}
+
+	return bPassed ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+	RENDERER renderer;
+	FRAMESTATS stats;
+	CPresenter* lpPresenter;
+	CSwapChain* lpSwapChain = NULL;
+	CThreadPool* lpPool = NULL;
+	const char* lpszPresenter = "null";
+	const char* lpszTrace = NULL;
+	const char* lpszMode = NULL;
+	int cx = 320, cy = 240, iBpp = 32;
+	int cFrames = 1000, cBatches = 16;
+	int cBuffers = 3;
+	int cThreads = 1, cMaxThreads = 0;
+	int cMaxPixels = 0;
+	double dIntervalMs = 0, dLatencyMs = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+			int iValue = atoi(argv[++i]);
+
+			switch(argv[i - 1][1]) {
+			case 't': lpszTrace = argv[i]; break;
+			case 's': lpszMode = argv[i]; break;
+			case 'k': cBuffers = iValue; break;
+			case 'i': dIntervalMs = atof(argv[i]); break;
+			case 'l': dLatencyMs = atof(argv[i]); break;
+			case 'w': cx = iValue; break;
+			case 'h': cy = iValue; break;
+			case 'b': iBpp = iValue; break;
+			case 'f': cFrames = iValue; break;
+			case 'n': cBatches = iValue; break;
+			case 'j': cThreads = iValue; break;
+			case 'r': cMaxThreads = iValue; break;
+			case 'c': cMaxPixels = iValue; break;
+			default:
+				fprintf(stderr, "Unknown option %s\n", argv[i - 1]);
+				return 1;
+			}
+		}
+		else {
+			lpszPresenter = argv[i];
+		}
+	}
+
+	if(cMaxThreads > 0) {
+		return RunScaling(cx, cy, cBatches * RENDER_BATCH, cFrames, cMaxThreads);
+	}
+
+	if(cMaxPixels > 0) {
+		return RunPresentCheck(cx, cy, iBpp, cFrames, cMaxPixels);
+	}
+
+	if(lpszTrace && !TraceStart(lpszTrace)) {
+		fprintf(stderr, "Error creating trace file %s\n", lpszTrace);
+		return 1;
+	}
+
+	TraceThreadName("main");
+
+	if(!CreateRenderer(&renderer, cx, cy, iBpp)) {
+		fprintf(stderr, "Error creating a %dx%d %dbpp DIB\n", cx, cy, iBpp);
+		return 1;
+	}
+
+	if((lpPresenter = CreatePresenter(lpszPresenter)) == NULL) {
+		fprintf(stderr, "Error creating presenter %s\n", lpszPresenter);
+		FreeRenderer(&renderer);
+		return 1;
+	}
+
+	if(dLatencyMs > 0) {
+		lpPresenter = new CSlowPresenter(lpPresenter, dLatencyMs);
+	}
+
+	if(lpszMode) {
+		int iMode = strcmp(lpszMode, "mailbox") == 0 ? SWAP_MAILBOX : SWAP_FIFO;
+
+		lpSwapChain = new CSwapChain();
+
+		if((strcmp(lpszMode, "fifo") && iMode != SWAP_MAILBOX) || !lpSwapChain->Create(cx, cy, iBpp, cBuffers, iMode, lpPresenter, dIntervalMs)) {
+			fprintf(stderr, "Error creating a %s swap chain of %d DIBs\n", lpszMode, cBuffers);
+			delete lpSwapChain;
+			delete lpPresenter;
+			FreeRenderer(&renderer);
+			return 1;
+		}
+	}
+
+	// Without a pool everything is drawn on this thread.
+	if(cThreads != 1) {
+		lpPool = new CThreadPool(cThreads);
+	}
+
+	InitFrameStats(&stats);
+
+	for(int iFrame = 0; iFrame < cFrames; iFrame++) {
+		RECT rcDirty[MAX_DIRTY];
+		int cDirty;
+		long long cbPresented;
+
+		TRACE_SPAN("frame");
+
+		// With a swap chain the present thread takes it from here. All
+		// this thread has to do is get a DIB to draw on.
+		if(lpSwapChain) {
+			{
+				TRACE_SPAN("acquire");
+				SetRenderTarget(&renderer, lpSwapChain->Acquire());
+			}
+
+			{
+				TRACE_SPAN("render");
+				RenderFrame(&renderer, cBatches * RENDER_BATCH, lpPool);
+			}
+
+			lpSwapChain->Submit(&renderer.dirty);
+
+			ClearDirtyRegion(&renderer.dirty);
+			EndFrame(&stats, 0);
+			continue;
+		}
+
+		{
+			TRACE_SPAN("render");
+			RenderFrame(&renderer, cBatches * RENDER_BATCH, lpPool);
+		}
+
+		// Only what changed since the last frame is presented. The first
+		// frame has to be presented whole.
+		cDirty = GetDirtyRects(&renderer.dirty, rcDirty, MAX_DIRTY);
+
+		{
+			TRACE_SPAN("present");
+
+			if((cbPresented = lpPresenter->Present(&renderer.surface, iFrame ? rcDirty : NULL, cDirty)) < 0) {
+				fprintf(stderr, "Error presenting frame %d\n", iFrame);
+				break;
+			}
+		}
+
+		ClearDirtyRegion(&renderer.dirty);
+		EndFrame(&stats, cbPresented);
+	}
+
+	if(lpSwapChain) {
+		SWAPSTATS swap;
+
+		lpSwapChain->Stop();
+		lpSwapChain->GetStats(&swap);
+
+		if(stats.cFrames) {
+			printf("%llu frames of %dx%d at %dbpp, %d pixels per frame, %d threads, presenter %s, %s swap chain of %d DIBs\n", stats.cFrames, cx, cy, iBpp, cBatches * RENDER_BATCH, lpPool ? lpPool->Threads() : 1, lpszPresenter, lpszMode, cBuffers);
+			printf("frame time: %.4f ms average, %.4f ms min, %.4f ms max\n", stats.dTotalMs / stats.cFrames, stats.dMinMs, stats.dMaxMs);
+			PrintSwapStats(&swap, &stats);
+		}
+
+		delete lpSwapChain;
+	}
+	else
+	if(stats.cFrames) {
+		printf("%llu frames of %dx%d at %dbpp, %d pixels per frame, %d threads, presenter %s\n", stats.cFrames, cx, cy, iBpp, cBatches * RENDER_BATCH, lpPool ? lpPool->Threads() : 1, lpszPresenter);
+		printf("frame time: %.4f ms average, %.4f ms min, %.4f ms max\n", stats.dTotalMs / stats.cFrames, stats.dMinMs, stats.dMaxMs);
+		printf("presented:  %llu bytes, %.0f bytes per frame, %.1f MB/s\n", stats.cbPresented, (double)stats.cbPresented / stats.cFrames, stats.cbPresented / (stats.dTotalMs * 1000.0));
+	}
+
+	delete lpPresenter;
+	delete lpPool;
+	FreeRenderer(&renderer);
+
+	TraceStop();
+
+	return 0;
+}
@@ -6,6 +6,10 @@
 #include <stdlib.h>
 
 #include "trace.h"
+#include "render.h"
+#include "..\Common\scale.h"
+#include "..\Common\present.h"
+#include "..\Common\swapchain.h"
 
 static char g_szAppName[] = "Example4";
 static char g_szAppTitle[] = "Example 4";
@@ -14,253 +18,253 @@ static char g_szAppTitle[] = "Example 4";
 #define	DIB_WIDTH   320
 #define	DIB_HEIGHT  240
 
-BYTE* g_pBits = NULL;
-LPBITMAPINFO g_lpBmi = NULL;
-
-LPBITMAPINFO CreateDIB(int cx, int cy, int iBpp, BYTE* &pBits)
-{
-	LPBITMAPINFO lpBmi;
-	int iBmiSize;
-	int iSurfaceSize;
-
-	// Calculate the size of the bitmap info header.
-	switch(iBpp) {
-	case 8 :		// 8 bpp
-		iBmiSize = sizeof(BITMAPINFO) + sizeof(RGBQUAD) * 256;
-		iSurfaceSize = cx * cy * sizeof(BYTE);
-		break;
-	
-	case 15 :	// 15/16 bpp
-	case 16 :
-		iBmiSize = sizeof(BITMAPINFO) + sizeof(DWORD) * 4;
-		iSurfaceSize = cx * cy * sizeof(WORD);
-		break;
-
-	case 24 :	// 24 bpp
-		iBmiSize = sizeof(BITMAPINFO);
-		iSurfaceSize = cx * cy * (sizeof(BYTE) * 3);
-		break;
-
-	case 32 :	// 32 bpp
-		iBmiSize = sizeof(BITMAPINFO) + sizeof(DWORD) * 4;
-		iSurfaceSize = cx * cy * sizeof(DWORD);
-		break;
+// How the DIB is scaled up to the window: SCALE_NEAREST, SCALE_BILINEAR
+// or SCALE_BOX.
+#define	DIB_SCALE   SCALE_BILINEAR
+
+// Frames are shown at most once every this many milliseconds, like a
+// display refreshing at 60 Hz would.
+#define	FRAME_TIME  16
+
+// Batches of pixels drawn per frame, see 'RENDER_BATCH'.
+#define	FRAME_BATCHES   16
+
+// Threads drawing each frame, 0 for one for every core. See 'RenderFrame'.
+#define	RENDER_THREADS  0
+
+// Frames are drawn on the DIBs of a swap chain and a thread of its own
+// puts them in the window, see swapchain.h. In mailbox mode drawing never
+// waits for that thread: when it can't keep up it just shows the newest
+// frame and skips the rest.
+#define	SWAP_BUFFERS    3
+#define	SWAP_MODE       SWAP_MAILBOX
+
+RENDERER g_Renderer;
+CSwapChain g_SwapChain;
+FRAMESTATS g_Stats;
+CThreadPool* g_lpRenderPool = NULL;
+
+// The DIB scaled to the size of the window. This one is rebuilt, together
+// with the scale plan, every time the window changes size. The present
+// thread scales frames into it and WM_PAINT paints from it, the lock
+// keeps them from doing so while it is being rebuilt.
+BYTE* g_pWindowBits = NULL;
+LPBITMAPINFO g_lpWindowBmi = NULL;
+DIBSURFACE g_WindowSurface;
+SCALEPLAN g_ScalePlan;
+CThreadPool* g_lpPool = NULL;
+std::mutex g_WindowLock;
+BOOL g_bPresentAll = TRUE;		// The window DIB is out of date, scale all of the next frame
+
+// Runs on the present thread. Scales the parts of the frame that changed
+// into the window DIB and copies them to the window right away, without
+// going through WM_PAINT and the message loop.
+class CWindowPresenter : public CPresenter {
+public:
+	CWindowPresenter()
+		: m_hWnd(NULL)
+	{
 	}
 
-	// Allocate memory for the bitmap info header.
-	if((lpBmi = (LPBITMAPINFO)malloc(iBmiSize)) == NULL){
-		TRACE("Error allocating BitmapInfo!\n");
-		return NULL;
+	void SetWindow(HWND hWnd)
+	{
+		m_hWnd = hWnd;
 	}
 
-	ZeroMemory(lpBmi, iBmiSize);
-
-	// Allocate memory for the DIB surface.
-	if((pBits = (BYTE*)malloc(iSurfaceSize)) == NULL) {
-		TRACE("Error allocating memory for bitmap bits\n");
-		return NULL;
-	}
+	long long Present(const DIBSURFACE* lpSurface, const RECT* lpRects, int cRects)
+	{
+		std::lock_guard<std::mutex> lock(g_WindowLock);
+		long long cbPresented = 0;
+		HDC hDC;
 
-	ZeroMemory(pBits, iSurfaceSize);
-
-	// Initialize bitmap info header
-	lpBmi->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-	lpBmi->bmiHeader.biWidth = cx;
-	lpBmi->bmiHeader.biHeight = -(signed)cy;		// <-- NEGATIVE MEANS TOP DOWN!!!
-	lpBmi->bmiHeader.biPlanes = 1;
-	lpBmi->bmiHeader.biSizeImage = 0;
-	lpBmi->bmiHeader.biXPelsPerMeter = 0;
-	lpBmi->bmiHeader.biYPelsPerMeter = 0;
-	lpBmi->bmiHeader.biClrUsed = 0;
-	lpBmi->bmiHeader.biClrImportant = 0;
-	lpBmi->bmiHeader.biCompression = BI_RGB;
-
-	// After initializing the bitmap info header we need to store some
-	// more information depending on the bpp of the bitmap.
-	switch(iBpp) {
-	case 8:
-		{
-			// For the 8bpp DIB we will create a simple grayscale palette.
-			for(int i = 0; i < 256; i++) {
-				lpBmi->bmiColors[i].rgbRed			= (BYTE)i;
-				lpBmi->bmiColors[i].rgbGreen		= (BYTE)i;
-				lpBmi->bmiColors[i].rgbBlue		= (BYTE)i;
-				lpBmi->bmiColors[i].rgbReserved	= (BYTE)0;
-			}
+		TRACE_SPAN("present");
 
-			//-- Set the bpp for this DIB to 8bpp.
-			lpBmi->bmiHeader.biBitCount = 8;
-		}
-		break;
-	
-	case 15:
-		{
-			// This is where we will tell the DIB what bits represent what
-			// data. This may look confusing at first but the representation
-			// of the RGB data can be different on different devices. For
-			// example you can have for Hicolor a 565 format. Meaning 5 bits
-			// for red, 6 bits for green and 5 bits for blue or better stated
-			// like RGB. But, the pixel data can also be the other way around,
-			// for example BGR meaning, 5 bits for blue, 6 bits for green and
-			// 5 bits for red. This piece of information will tell the bitmap
-			// info header how the pixel data will be stored. In this case in
-			// RGB format in 555 because this is a 15bpp DIB so the highest
-			// bit (bit 15) will not be used.
-			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
-
-			pBmi[0] = 0x00007C00;	// Red mask
-			pBmi[1] = 0x000003E0;	// Green mask
-			pBmi[2] = 0x0000001F;	// Blue mask
-			pBmi[3] = 0x00000000;	// Not used
-
-			// 15bpp DIB also use 16 bits to store a pixel.
-			lpBmi->bmiHeader.biBitCount = 16;
-			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
+		if((hDC = GetDC(m_hWnd)) == NULL) {
+			return -1;
 		}
-		break;
-
-	case 16:
-		{
-			// Take a look at the remarks written by 15bpp. For this format
-			// it's the same thing, except in this case the mask's will be
-			// different because our format will be 565 (RGB).
-			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
-
-			pBmi[0] = 0x0000F800;	// Red mask
-			pBmi[1] = 0x000007E0;	// Green mask
-			pBmi[2] = 0x0000001F;	// Blue mask
-			pBmi[3] = 0x00000000;	// Not used
-
-			lpBmi->bmiHeader.biBitCount = 16;
-			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
-		}
-		break;
 
-	case 24:
-		{
-			// This is a 1:1 situation. There is no need to set any extra
-			// information.
-			lpBmi->bmiHeader.biBitCount = 24;
+		// If there is no window sized DIB, let StretchDIBits do the
+		// scaling like before.
+		if(!g_pWindowBits) {
+			RECT rc;
+			GetClientRect(m_hWnd, &rc);
+			StretchDIBits(hDC, 0, 0, rc.right - rc.left, rc.bottom - rc.top, 0, 0, DIB_WIDTH, DIB_HEIGHT, lpSurface->pBits, lpSurface->lpBmi, DIB_RGB_COLORS, SRCCOPY);
+			ReleaseDC(m_hWnd, hDC);
+
+			return (long long)(rc.right - rc.left) * (rc.bottom - rc.top) * GetDIBFormatBytes(lpSurface->iFormat);
 		}
-		break;
-
-	case 32:
-		{
-			// This may speak for it's self. In this case where using 32bpp.
-			// The format will be ARGB. the Alpha (A) portion of the format
-			// will not be used. The other mask's tell us where the bytes
-			// for the R, G and B data will be stored in the DWORD.
-			DWORD *pBmi = (DWORD*)lpBmi->bmiColors;
-
-			pBmi[0] = 0x00FF0000;	// Red mask
-			pBmi[1] = 0x0000FF00;	// Green mask
-			pBmi[2] = 0x000000FF;	// Blue mask
-			pBmi[3] = 0x00000000;	// Not used (Alpha?)
-
-			lpBmi->bmiHeader.biBitCount = 32;
-			lpBmi->bmiHeader.biCompression |= BI_BITFIELDS;
+
+		if(g_bPresentAll || !lpRects) {
+			lpRects = NULL;
+			cRects = 1;
+			g_bPresentAll = FALSE;
 		}
-		break;
-	}
 
-	return lpBmi;
-}
+		for(int i = 0; i < cRects; i++) {
+			RECT rc;
 
-void PutPixel(int x, int y, BYTE r, BYTE g, BYTE b, LPBITMAPINFO lpBmi, void* pBits)
-{
-	int iOffset = lpBmi->bmiHeader.biWidth * y + x;
-
-	switch(lpBmi->bmiHeader.biBitCount) {
-	case 8:
-		{
-			// Cast void* to a BYTE* and write pixel to surface
-			BYTE* p = (BYTE*)pBits;
-			p[iOffset] = (BYTE)r;
-		}
-		break;
+			// The window shows the DIB scaled, so the rectangles have to
+			// be scaled along.
+			if(lpRects) {
+				GetScaledRect(&g_ScalePlan, &lpRects[i], &rc);
+			}
+			else {
+				SetRect(&rc, 0, 0, g_WindowSurface.cx, g_WindowSurface.cy);
+			}
 
-	case 15:
-		{
-			// Cast void* to a WORD* and write pixel to surface
-			WORD* p = (WORD*)pBits;
-			p[iOffset] = (WORD)(((r & 0xF8) << 7) | ((g & 0xF8) << 2) | b >> 3);
-		}
-		break;
+			ScaleDIBSurfaceRect(&g_ScalePlan, &g_WindowSurface, lpSurface, g_lpPool, &rc);
 
-	case 16:
-		{
-			// Cast void* to a WORD* and write pixel to surface
-			WORD* p = (WORD*)pBits;
-			p[iOffset] = (WORD)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | b >> 3);
-		}
-		break;
-
-	case 24:
-		{
-			// Cast void* to a BYTE* and write pixel to surface
-			BYTE* p = (BYTE*)pBits;
-			p[iOffset * 3 + 0] = r;
-			p[iOffset * 3 + 1] = g;
-			p[iOffset * 3 + 2] = b;
-		}
-		break;
+			// Clipped to the rectangle, SetDIBitsToDevice only copies that
+			// part of the window DIB.
+			IntersectClipRect(hDC, rc.left, rc.top, rc.right, rc.bottom);
+			SetDIBitsToDevice(hDC, 0, 0, g_WindowSurface.cx, g_WindowSurface.cy, 0, 0, 0, g_WindowSurface.cy, g_pWindowBits, g_lpWindowBmi, DIB_RGB_COLORS);
+			SelectClipRgn(hDC, NULL);
 
-	case 32:
-		{
-			// Cast void* to a DWORD* and write pixel to surface
-			DWORD* p = (DWORD*)pBits;
-			p[iOffset] = (DWORD)((r << 16) | (g << 8) | b);
+			cbPresented += (long long)(rc.right - rc.left) * (rc.bottom - rc.top) * GetDIBFormatBytes(g_WindowSurface.iFormat);
 		}
-		break;
+
+		ReleaseDC(m_hWnd, hDC);
+
+		return cbPresented;
 	}
-}
 
-void Render(HWND hWnd, LPBITMAPINFO lpBmi, void* pBits)
+private:
+	HWND	m_hWnd;
+};
+
+CWindowPresenter g_WindowPresenter;
+
+// Draws a whole frame, on all the threads of the render pool, and hands it
+// over to be presented.
+void Draw()
 {
-	// Get a random x- and y-coordinate and plot pixel
-	int x = rand() % lpBmi->bmiHeader.biWidth;
-	int y = rand() % lpBmi->bmiHeader.biHeight;
+	SetRenderTarget(&g_Renderer, g_SwapChain.Acquire());
 
-	PutPixel(x, y, rand() % 256, rand() % 256, rand() % 256, lpBmi, pBits);
+	RenderFrame(&g_Renderer, FRAME_BATCHES * RENDER_BATCH, g_lpRenderPool);
 
-	// Make sure OnPaint gets called.
-	InvalidateRect(hWnd, NULL, FALSE);
+	g_SwapChain.Submit(&g_Renderer.dirty);
+	ClearDirtyRegion(&g_Renderer.dirty);
+	EndFrame(&g_Stats, 0);
 }
 
 BOOL OnCreate(HWND hWnd, CREATESTRUCT FAR* lpCreateStruct)
 {
-	// Create a new DIB
-	if((g_lpBmi = CreateDIB(DIB_WIDTH, DIB_HEIGHT, DIB_DEPTH, g_pBits)) == NULL) {
+	// Create a new DIB and everything needed to draw on it.
+	if(!CreateRenderer(&g_Renderer, DIB_WIDTH, DIB_HEIGHT, DIB_DEPTH)) {
+		TRACE_ERROR("Error creating DIB!\n");
 		return FALSE;
 	}
 
+	// One worker for every core, scaling runs on all of them. Drawing gets
+	// a pool of its own, the present thread scales while the next frame is
+	// being drawn and a pool only runs one job at a time.
+	g_lpPool = new CThreadPool();
+	g_lpRenderPool = new CThreadPool(RENDER_THREADS);
+
+	g_WindowPresenter.SetWindow(hWnd);
+
+	if(!g_SwapChain.Create(DIB_WIDTH, DIB_HEIGHT, DIB_DEPTH, SWAP_BUFFERS, SWAP_MODE, &g_WindowPresenter, FRAME_TIME)) {
+		TRACE_ERROR("Error creating swap chain!\n");
+		return FALSE;
+	}
+
+	InitFrameStats(&g_Stats);
+
 	return TRUE;
 }
 
+void FreeWindowDIB()
+{
+	FreeScalePlan(&g_ScalePlan);
+
+	FreeDIB(g_lpWindowBmi);
+
+	g_lpWindowBmi = NULL;
+	g_pWindowBits = NULL;
+}
+
 void OnDestroy(HWND hWnd)
 {
-	if(g_pBits) {
-		free(g_pBits);
+	SWAPSTATS swap;
+
+	// The present thread has to be done with the window before it goes.
+	g_SwapChain.Stop();
+	g_SwapChain.GetStats(&swap);
+
+	if(g_Stats.cFrames) {
+		TRACE("%llu frames, %.3f ms per frame (%.3f - %.3f)\n", g_Stats.cFrames, g_Stats.dTotalMs / g_Stats.cFrames, g_Stats.dMinMs, g_Stats.dMaxMs);
+		TRACE("%llu presented, %llu dropped, %.3f ms apart (%.3f deviation, %.3f max), %llu bytes presented\n", swap.cPresented, swap.cDropped, swap.dIntervalMs, swap.dIntervalDevMs, swap.dIntervalMaxMs, swap.cbPresented);
 	}
 
-	if(g_lpBmi) {
-		free(g_lpBmi);
+	g_SwapChain.Destroy();
+
+	FreeWindowDIB();
+
+	if(g_lpPool) {
+		delete g_lpPool;
 	}
 
+	if(g_lpRenderPool) {
+		delete g_lpRenderPool;
+	}
+
+	FreeRenderer(&g_Renderer);
+
 	PostQuitMessage(0);
 }
 
+void OnSize(HWND hWnd, UINT state, int cx, int cy)
+{
+	std::lock_guard<std::mutex> lock(g_WindowLock);
+
+	FreeWindowDIB();
+	g_bPresentAll = TRUE;
+
+	// Nothing to scale to while we're minimized.
+	if(cx <= 0 || cy <= 0) {
+		return;
+	}
+
+	// A DIB as big as the window, in the same format as ours. The scale
+	// plan holds everything that only depends on the two sizes, so
+	// painting doesn't have to work any of it out again.
+	if((g_lpWindowBmi = CreateDIB(cx, cy, DIB_DEPTH, g_pWindowBits)) == NULL) {
+		return;
+	}
+
+	InitDIBSurface(&g_WindowSurface, g_lpWindowBmi, g_pWindowBits);
+
+	if(!CreateScalePlan(&g_ScalePlan, DIB_WIDTH, DIB_HEIGHT, cx, cy, DIB_SCALE, GetDIBFormatBytes(g_Renderer.surface.iFormat))) {
+		TRACE_ERROR("Error creating scale plan!\n");
+		FreeWindowDIB();
+	}
+}
+
 void OnPaint(HWND hWnd)
 {
 	static PAINTSTRUCT ps;
 	static HDC hDC;
 
+	TRACE_SPAN("paint");
+
 	hDC = BeginPaint(hWnd, &ps);
 
-	// Use StretchDIBits to display the DIB in the window.
-	RECT rc;
-	GetClientRect(hWnd, &rc);
-	StretchDIBits(hDC, 0, 0, rc.right - rc.left, rc.bottom - rc.top, 0, 0, DIB_WIDTH, DIB_HEIGHT, (BYTE*)g_pBits, g_lpBmi, DIB_RGB_COLORS, SRCCOPY);
+	// Frames get to the window from the present thread. All there is to
+	// do here is put back what was covered up: the window DIB holds the
+	// frame presented last, already scaled. The DC BeginPaint gives us
+	// is clipped to the part that needs painting, so that is all
+	// SetDIBitsToDevice copies. The frames themselves aren't touched
+	// here, they could be in the middle of being drawn on.
+	{
+		std::lock_guard<std::mutex> lock(g_WindowLock);
+
+		if(g_pWindowBits && !g_bPresentAll) {
+			SetDIBitsToDevice(hDC, 0, 0, g_WindowSurface.cx, g_WindowSurface.cy, 0, 0, 0, g_WindowSurface.cy, g_pWindowBits, g_lpWindowBmi, DIB_RGB_COLORS);
+		}
+		else {
+			g_bPresentAll = TRUE;
+		}
+	}
 
 	EndPaint(hWnd, &ps);
 }
@@ -275,6 +279,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT iMsg, WPARAM wParam, LPARAM lParam)
 	switch(iMsg) {
 		HANDLE_MSG(hWnd, WM_CREATE, OnCreate);
 		HANDLE_MSG(hWnd, WM_DESTROY, OnDestroy);
+		HANDLE_MSG(hWnd, WM_SIZE, OnSize);
 		HANDLE_MSG(hWnd, WM_PAINT, OnPaint);
 		HANDLE_MSG(hWnd, WM_ERASEBKGND, OnEraseBkgnd);
 	}
@@ -288,6 +293,14 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR szCmdLine,
 	HWND hWnd;
 	WNDCLASSEX wc;
 
+	// Pass a file name on the command line to get a Chrome trace of the
+	// run, with every frame on a timeline.
+	if(!TraceStart(szCmdLine)) {
+		TRACE_ERROR("Error creating trace file '%s'\n", szCmdLine);
+	}
+
+	TraceThreadName("main");
+
 	wc.cbSize = sizeof(wc);
 	wc.style = CS_VREDRAW | CS_HREDRAW;
 	wc.lpfnWndProc = WndProc;
@@ -331,12 +344,14 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR szCmdLine,
 		}
 		else
 		if(TRUE) {
-			Render(hWnd, g_lpBmi, g_pBits);
+			Draw();
 		}
 		else {
 			WaitMessage();
 		}
 	}
 
+	TraceStop();
+
 	return msg.wParam;
 }
@@ -0,0 +1,133 @@
+// The other end of the "stream:" and "tcp:" presenters.
+//
+// Reads a frame stream (framestream.h) from a file, or waits for one to
+// connect to a TCP port, and decodes every frame into a DIB. Like
+// 'headless.cpp' it doesn't need 'windows.h':
+//
+//   g++ -O2 -std=c++11 -pthread receive.cpp -o receive
+//
+// Usage: receive [-o bitmap] file|port
+//
+// When the stream ends it prints how many frames came in, how many bytes
+// they took and how long decoding them took. '-o' writes the last frame
+// to a bitmap file. A stream that is damaged, or cut off in the middle of
+// a frame, is reported and the exit code is 1. To stream Example 4 at
+// 1080p over the loopback:
+//
+//   ./receive -o last.bmp 5000 &
+//   ./headless -w 1920 -h 1080 -f 1000 tcp:127.0.0.1:5000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "../Common/bmpwrite.h"
+#include "../Common/framestream.h"
+#include "../Common/present.h"
+
+int main(int argc, char* argv[])
+{
+	FRAMESTREAMHEADER header;
+	FRAMEHEADER frame;
+	FILE* pFile = NULL;
+	const char* lpszSource = NULL;
+	const char* lpszOutput = NULL;
+	std::vector<double> decodeMs;
+	unsigned long long cbFrames = 0;
+	double dStartMs = 0;
+	BOOL bDamaged = FALSE;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			lpszOutput = argv[++i];
+		}
+		else {
+			lpszSource = argv[i];
+		}
+	}
+
+	if(!lpszSource) {
+		fprintf(stderr, "Usage: receive [-o bitmap] file|port\n");
+		return 1;
+	}
+
+	// A number is a port to listen on, anything else a file.
+#ifndef _WIN32
+	if(strspn(lpszSource, "0123456789") == strlen(lpszSource)) {
+		pFile = AcceptFrameStream(lpszSource);
+	}
+	else
+#endif
+	{
+		pFile = fopen(lpszSource, "rb");
+	}
+
+	if(!pFile) {
+		fprintf(stderr, "Error opening %s\n", lpszSource);
+		return 1;
+	}
+
+	FRAMEDECODER* lpDecoder = (FRAMEDECODER*)malloc(sizeof(FRAMEDECODER));
+
+	if(!lpDecoder || !ReadFrameStreamHeader(pFile, &header) || !CreateFrameDecoder(lpDecoder, &header)) {
+		fprintf(stderr, "Error reading the stream header from %s\n", lpszSource);
+		free(lpDecoder);
+		fclose(pFile);
+		return 1;
+	}
+
+	for(;;) {
+		if(!ReadFrameData(lpDecoder, pFile, &frame)) {
+			if(!lpDecoder->bEnd) {
+				fprintf(stderr, "Frame %zu is damaged\n", decodeMs.size() + 1);
+				bDamaged = TRUE;
+			}
+
+			break;
+		}
+
+		// Only the decoding is timed, not waiting for the frame to come in.
+		double dDecodeMs = GetTimeMs();
+
+		if(!DecodeFrame(lpDecoder, &frame, lpDecoder->pData)) {
+			fprintf(stderr, "Frame %lu is damaged\n", (unsigned long)frame.dwFrame);
+			bDamaged = TRUE;
+			break;
+		}
+
+		decodeMs.push_back(GetTimeMs() - dDecodeMs);
+
+		if(decodeMs.size() == 1) {
+			dStartMs = GetTimeMs();
+		}
+
+		cbFrames += sizeof(FRAMEHEADER) + frame.cbData;
+	}
+
+	if(!decodeMs.empty()) {
+		double dSeconds = (GetTimeMs() - dStartMs) / 1000.0;
+		double dTotalMs = 0;
+
+		for(size_t i = 0; i < decodeMs.size(); i++) {
+			dTotalMs += decodeMs[i];
+		}
+
+		std::sort(decodeMs.begin(), decodeMs.end());
+
+		printf("%zu frames of %dx%d at %dbpp, %.1f per second\n", decodeMs.size(), (int)header.cx, (int)header.cy, (int)header.iBpp, dSeconds > 0 ? (decodeMs.size() - 1) / dSeconds : 0.0);
+		printf("received:   %llu bytes, %.0f bytes per frame, %.2f%% of the raw frames\n", cbFrames, (double)cbFrames / decodeMs.size(), 100.0 * cbFrames / ((double)lpDecoder->surface.cx * lpDecoder->surface.cy * lpDecoder->iBytes * decodeMs.size()));
+		printf("decode:     %.4f ms average, %.4f ms 99th percentile, %.4f ms max\n", dTotalMs / decodeMs.size(), decodeMs[(decodeMs.size() - 1) * 99 / 100], decodeMs.back());
+	}
+
+	if(lpszOutput && !WriteBitmapFile(lpszOutput, lpDecoder->lpBmi, lpDecoder->pBits)) {
+		fprintf(stderr, "Error writing %s\n", lpszOutput);
+	}
+
+	FreeFrameDecoder(lpDecoder);
+	free(lpDecoder);
+	fclose(pFile);
+
+	return bDamaged ? 1 : 0;
+}
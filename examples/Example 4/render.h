@@ -0,0 +1,263 @@
+
+#ifndef RENDER_H
+#define RENDER_H
+
+// Everything Example 4 does that doesn't need Windows: the DIB, keeping
+// track of what was drawn on it, and the drawing itself. 'main.cpp' shows
+// the result in a window, 'headless.cpp' hands it to a presenter so the
+// same loop runs on machines without a screen. Both can draw on the DIBs
+// of a swap chain instead, see swapchain.h.
+//
+// Each frame is cut up in tiles that the threads of a pool draw on at the
+// same time, see 'RenderFrame'. Then it is presented once, as a whole.
+
+#include "../Common/dib.h"
+#include "../Common/dirty.h"
+#include "../Common/plot.h"
+#include "../Common/threadpool.h"
+
+#include <stdlib.h>
+
+// The number of random pixels plotted in one go, see 'PutPixels'.
+#define	RENDER_BATCH 64
+
+// The maximum number of rectangles presented per frame. If the changes
+// take more than that, the closest ones are merged, see dirty.h.
+#define	MAX_DIRTY   32
+
+// Frames are drawn in tiles of this many pixels square, each by a single
+// worker. 128 pixels are 128 to 512 bytes, a whole number of cache lines
+// at every depth. The scanlines of the DIB are only DWORD aligned though,
+// Windows wants them exactly that far apart (see 'CreateDIB'), so unless
+// the pitch happens to be a whole number of cache lines, the first and
+// the last line of every tile row are shared with the tiles next to it.
+// A tile also covers exactly 8 x 8 cells of the dirty region, one bit
+// each in 'dwlDirty'.
+#define	RENDER_TILE_SHIFT	7
+#define	RENDER_TILE_SIZE	(1 << RENDER_TILE_SHIFT)
+#define	RENDER_TILE_CELLS	(RENDER_TILE_SIZE >> DIRTY_TILE_SHIFT)
+
+// Everything a worker touches while it draws a tile. Tiles are padded to
+// a cache line of their own so workers don't share those either.
+typedef struct tagRENDERTILE {
+	int				left, top;
+	int				cx, cy;
+	int				cPixels;		// Pixels to draw on it this frame
+	DWORD			dwRandom;		// Random number generator, see 'NextRandom'
+	unsigned long long	dwlDirty;	// Dirty cells, a bit for every 16 x 16 pixels
+} RENDERTILE, *LPRENDERTILE;
+
+#define	RENDER_TILE_STRIDE	DIB_ALIGN_UP(sizeof(RENDERTILE))
+
+typedef struct tagRENDERER {
+	LPBITMAPINFO	lpBmi;
+	BYTE*			pBits;
+	DIBSURFACE		surface;
+	DIRTYREGION		dirty;
+
+	BYTE*			pTileAlloc;
+	BYTE*			pTiles;			// 'cTiles' of them, 'RENDER_TILE_STRIDE' apart
+	int				cxTiles;
+	int				cyTiles;
+	int				cTiles;
+
+	// Draws a tile on 'surface', picked in 'CreateRenderer' for the
+	// format of the DIB.
+	void			(*lpfnRenderTile)(const DIBSURFACE* lpSurface, LPRENDERTILE lpTile);
+} RENDERER, *LPRENDERER;
+
+static inline LPRENDERTILE GetRenderTile(const RENDERER* lpRenderer, int iTile)
+{
+	return (LPRENDERTILE)(lpRenderer->pTiles + (size_t)iTile * RENDER_TILE_STRIDE);
+}
+
+// Xorshift, as good as 'rand' for random pixels and a lot faster. More to
+// the point, every tile has one of its own: 'rand' keeps its state in one
+// place for the whole program and would have the workers fight over it.
+static inline DWORD NextRandom(DWORD& dwState)
+{
+	DWORD x = dwState;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return dwState = x;
+}
+
+// A random number from 0 up to 'n', without a division.
+static inline int RandomBelow(DWORD& dwState, int n)
+{
+	return (int)(((unsigned long long)NextRandom(dwState) * (unsigned)n) >> 32);
+}
+
+template<class FORMAT>
+static inline void RenderTile(const DIBSURFACE* lpSurface, LPRENDERTILE lpTile)
+{
+	int x[RENDER_BATCH], y[RENDER_BATCH];
+	DWORD dwColors[RENDER_BATCH];
+	DIBSURFACE surface = *lpSurface;
+	DWORD dwRandom = lpTile->dwRandom;
+	unsigned long long dwlDirty = lpTile->dwlDirty;
+
+	// The dirty region is shared by all of the workers, so 'PutPixels'
+	// doesn't get to mark it. The cells of the tile are marked here and
+	// added to it once the whole frame is done.
+	surface.lpDirty = NULL;
+
+	for(int iPixel = 0; iPixel < lpTile->cPixels; iPixel += RENDER_BATCH) {
+		int cBatch = lpTile->cPixels - iPixel < RENDER_BATCH ? lpTile->cPixels - iPixel : RENDER_BATCH;
+
+		// Get a batch of random coordinates and colors in the tile and
+		// plot them all in one go.
+		for(int i = 0; i < cBatch; i++) {
+			int dx = RandomBelow(dwRandom, lpTile->cx);
+			int dy = RandomBelow(dwRandom, lpTile->cy);
+
+			x[i] = lpTile->left + dx;
+			y[i] = lpTile->top + dy;
+			dwColors[i] = NextRandom(dwRandom) & 0xFFFFFF;
+
+			dwlDirty |= 1ull << ((dy >> DIRTY_TILE_SHIFT) * RENDER_TILE_CELLS + (dx >> DIRTY_TILE_SHIFT));
+		}
+
+		PutPixels<FORMAT>(&surface, x, y, dwColors, cBatch);
+	}
+
+	lpTile->dwRandom = dwRandom;
+	lpTile->dwlDirty = dwlDirty;
+}
+
+static inline void FreeRenderer(LPRENDERER lpRenderer)
+{
+	FreeDirtyRegion(&lpRenderer->dirty);
+
+	// The bits live in the same block as the header, this frees both.
+	FreeDIB(lpRenderer->lpBmi);
+
+	free(lpRenderer->pTileAlloc);
+
+	ZeroMemory(lpRenderer, sizeof(RENDERER));
+}
+
+static inline BOOL CreateRenderer(LPRENDERER lpRenderer, int cx, int cy, int iBpp)
+{
+	ZeroMemory(lpRenderer, sizeof(RENDERER));
+
+	// Create a new DIB
+	if((lpRenderer->lpBmi = CreateDIB(cx, cy, iBpp, lpRenderer->pBits)) == NULL) {
+		return FALSE;
+	}
+
+	// Keep track of what we draw on the DIB, so we only have to show
+	// that part of it.
+	if(!InitDIBSurface(&lpRenderer->surface, lpRenderer->lpBmi, lpRenderer->pBits) || !CreateDirtyRegion(&lpRenderer->dirty, cx, cy)) {
+		FreeRenderer(lpRenderer);
+		return FALSE;
+	}
+
+	lpRenderer->surface.lpDirty = &lpRenderer->dirty;
+
+	// Cut the DIB up in tiles, each with a random number generator seeded
+	// differently. The same tiles draw the same pixels however many
+	// threads there are.
+	lpRenderer->cxTiles = (cx + RENDER_TILE_SIZE - 1) >> RENDER_TILE_SHIFT;
+	lpRenderer->cyTiles = (cy + RENDER_TILE_SIZE - 1) >> RENDER_TILE_SHIFT;
+	lpRenderer->cTiles = lpRenderer->cxTiles * lpRenderer->cyTiles;
+
+	if((lpRenderer->pTileAlloc = (BYTE*)malloc(lpRenderer->cTiles * RENDER_TILE_STRIDE + DIB_ALIGN)) == NULL) {
+		FreeRenderer(lpRenderer);
+		return FALSE;
+	}
+
+	lpRenderer->pTiles = (BYTE*)DIB_ALIGN_UP((size_t)lpRenderer->pTileAlloc);
+
+	for(int i = 0; i < lpRenderer->cTiles; i++) {
+		LPRENDERTILE lpTile = GetRenderTile(lpRenderer, i);
+
+		lpTile->left = (i % lpRenderer->cxTiles) << RENDER_TILE_SHIFT;
+		lpTile->top = (i / lpRenderer->cxTiles) << RENDER_TILE_SHIFT;
+		lpTile->cx = cx - lpTile->left < RENDER_TILE_SIZE ? cx - lpTile->left : RENDER_TILE_SIZE;
+		lpTile->cy = cy - lpTile->top < RENDER_TILE_SIZE ? cy - lpTile->top : RENDER_TILE_SIZE;
+		lpTile->cPixels = 0;
+		lpTile->dwRandom = 0x9E3779B9u * (DWORD)(i + 1);
+		lpTile->dwlDirty = 0;
+	}
+
+	// Decide on the pixel format once. From here on every pixel is
+	// written by code that was compiled for exactly this format.
+	switch(lpRenderer->surface.iFormat) {
+	case DIBFMT_INDEX8:	lpRenderer->lpfnRenderTile = RenderTile<PF_INDEX8>;		break;
+	case DIBFMT_RGB555:	lpRenderer->lpfnRenderTile = RenderTile<PF_RGB555>;		break;
+	case DIBFMT_RGB565:	lpRenderer->lpfnRenderTile = RenderTile<PF_RGB565>;		break;
+	case DIBFMT_BGR24:	lpRenderer->lpfnRenderTile = RenderTile<PF_BGR24>;		break;
+	case DIBFMT_XRGB32:	lpRenderer->lpfnRenderTile = RenderTile<PF_XRGB32>;		break;
+	}
+
+	return TRUE;
+}
+
+// Draws on another surface from now on, one of a swap chain for example.
+// It must be the same size and format as the renderer's own DIB. What is
+// drawn is still marked in the renderer's dirty region.
+static inline void SetRenderTarget(LPRENDERER lpRenderer, const DIBSURFACE* lpSurface)
+{
+	lpRenderer->surface = *lpSurface;
+	lpRenderer->surface.lpDirty = &lpRenderer->dirty;
+}
+
+static inline void RenderTileTask(int iTask, int, void* lpParam)
+{
+	LPRENDERER lpRenderer = (LPRENDERER)lpParam;
+
+	lpRenderer->lpfnRenderTile(&lpRenderer->surface, GetRenderTile(lpRenderer, iTask));
+}
+
+// Draws 'cPixels' random pixels on the frame, spread over the tiles by
+// their area, on all the threads of 'lpPool' or just this one if there is
+// no pool. Marks what was drawn in the dirty region afterwards.
+static inline void RenderFrame(LPRENDERER lpRenderer, int cPixels, CThreadPool* lpPool = NULL)
+{
+	long long cArea = (long long)lpRenderer->surface.cx * lpRenderer->surface.cy;
+	long long cBefore = 0;
+
+	for(int i = 0; i < lpRenderer->cTiles; i++) {
+		LPRENDERTILE lpTile = GetRenderTile(lpRenderer, i);
+		long long cAfter = cBefore + (long long)lpTile->cx * lpTile->cy;
+
+		lpTile->cPixels = (int)(cAfter * cPixels / cArea - cBefore * cPixels / cArea);
+		lpTile->dwlDirty = 0;
+
+		cBefore = cAfter;
+	}
+
+	if(lpPool) {
+		lpPool->Run(lpRenderer->cTiles, RenderTileTask, lpRenderer);
+	}
+	else {
+		for(int i = 0; i < lpRenderer->cTiles; i++) {
+			RenderTileTask(i, 0, lpRenderer);
+		}
+	}
+
+	// Back on one thread, the cells every tile drew on go in the dirty
+	// region.
+	for(int i = 0; i < lpRenderer->cTiles; i++) {
+		LPRENDERTILE lpTile = GetRenderTile(lpRenderer, i);
+
+		for(unsigned long long dwlDirty = lpTile->dwlDirty; dwlDirty; dwlDirty &= dwlDirty - 1) {
+			int iCell = 0;
+
+			while(!((dwlDirty >> iCell) & 1)) {
+				iCell++;
+			}
+
+			int x = lpTile->left + ((iCell % RENDER_TILE_CELLS) << DIRTY_TILE_SHIFT);
+			int y = lpTile->top + ((iCell / RENDER_TILE_CELLS) << DIRTY_TILE_SHIFT);
+
+			MarkDirtyPixel(&lpRenderer->dirty, x, y);
+		}
+	}
+}
+
+#endif // RENDER_H
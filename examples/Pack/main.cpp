@@ -0,0 +1,375 @@
+// Building packs of surfaces.
+//
+// Takes every .bmp file in a directory tree, decodes it, converts it to
+// the format the program draws in and writes all of them to one pack, see
+// bmppack.h. Each surface is named after its path under the directory,
+// with forward slashes: "ui/button.bmp". Like the benchmark it doesn't
+// need 'windows.h':
+//
+//   g++ -O2 -std=c++11 -pthread main.cpp -o pack
+//   ./pack -f xrgb32 assets assets.pak
+//   ./pack -l assets.pak
+//   ./pack -p map.bmp
+//
+// Usage: pack [-f format] input output
+//        pack -l pack
+//        pack -p [-f format] [-z filter] bitmap
+//
+//   -f   index8, rgb555, rgb565, bgr24 or xrgb32. Without it every file
+//        keeps its own format. Color converted to index8 gets the gray
+//        color table.
+//   -l   Lists what is in a pack.
+//   -p   Builds the pyramid of one bitmap and saves it next to it, as
+//        "map.bmp.pyr", see pyramid.h.
+//   -z   How the pyramid is filtered: box, the default, or lanczos.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../Common/bmpcache.h"
+#include "../Common/bmpmap.h"
+#include "../Common/bmppack.h"
+#include "../Common/dib.h"
+#include "../Common/pyramid.h"
+#include "../Common/threadpool.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+static const char* GetFormatName(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return "index8";
+	case DIBFMT_RGB555:	return "rgb555";
+	case DIBFMT_RGB565:	return "rgb565";
+	case DIBFMT_BGR24:	return "bgr24";
+	case DIBFMT_XRGB32:	return "xrgb32";
+	}
+
+	return "unknown";
+}
+
+static int ParseFormat(const char* lpszFormat)
+{
+	for(int iFormat = DIBFMT_INDEX8; iFormat <= DIBFMT_XRGB32; iFormat++) {
+		if(strcmp(lpszFormat, GetFormatName(iFormat)) == 0) {
+			return iFormat;
+		}
+	}
+
+	return DIBFMT_UNKNOWN;
+}
+
+//
+// Finding the files.
+//
+
+static BOOL IsBitmapName(const char* lpszName)
+{
+	size_t cch = strlen(lpszName);
+
+	return cch > 4 && (lpszName[cch - 4] == '.') &&
+		(lpszName[cch - 3] == 'b' || lpszName[cch - 3] == 'B') &&
+		(lpszName[cch - 2] == 'm' || lpszName[cch - 2] == 'M') &&
+		(lpszName[cch - 1] == 'p' || lpszName[cch - 1] == 'P');
+}
+
+// Returns 1 for a directory, 0 for a file and -1 if it isn't there.
+static int GetPathType(const std::string& strPath)
+{
+#ifdef _WIN32
+	DWORD dwAttributes = GetFileAttributesA(strPath.c_str());
+
+	if(dwAttributes == INVALID_FILE_ATTRIBUTES) {
+		return -1;
+	}
+
+	return (dwAttributes & FILE_ATTRIBUTE_DIRECTORY) ? 1 : 0;
+#else
+	struct stat st;
+
+	if(stat(strPath.c_str(), &st) != 0) {
+		return -1;
+	}
+
+	return S_ISDIR(st.st_mode) ? 1 : 0;
+#endif
+}
+
+// Adds every bitmap under 'strPath' to the list, with its name in the
+// pack: the path under the top directory, 'strPrefix' so far.
+static BOOL FindBitmaps(const std::string& strPath, const std::string& strPrefix, std::vector<std::string>& files, std::vector<std::string>& names)
+{
+	std::vector<std::string> entries;
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind = FindFirstFileA((strPath + "\\*").c_str(), &fd);
+
+	if(hFind == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Error reading directory %s\n", strPath.c_str());
+		return FALSE;
+	}
+
+	do {
+		entries.push_back(fd.cFileName);
+	} while(FindNextFileA(hFind, &fd));
+
+	FindClose(hFind);
+#else
+	DIR* lpDir = opendir(strPath.c_str());
+	struct dirent* lpEntry;
+
+	if(!lpDir) {
+		fprintf(stderr, "Error reading directory %s\n", strPath.c_str());
+		return FALSE;
+	}
+
+	while((lpEntry = readdir(lpDir)) != NULL) {
+		entries.push_back(lpEntry->d_name);
+	}
+
+	closedir(lpDir);
+#endif
+
+	// Same pack on every run and every system.
+	std::sort(entries.begin(), entries.end());
+
+	for(size_t i = 0; i < entries.size(); i++) {
+		std::string strFile = strPath + "/" + entries[i];
+
+		if(entries[i] == "." || entries[i] == "..") {
+			continue;
+		}
+
+		int iType = GetPathType(strFile);
+
+		if(iType == 1) {
+			if(!FindBitmaps(strFile, strPrefix + entries[i] + "/", files, names)) {
+				return FALSE;
+			}
+		}
+		else
+		if(iType == 0 && IsBitmapName(entries[i].c_str())) {
+			files.push_back(strFile);
+			names.push_back(strPrefix + entries[i]);
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// Building and listing.
+//
+
+static int BuildPack(const char* lpszInput, const char* lpszOutput, int iFormat)
+{
+	std::vector<std::string> files, names;
+	PACKBUILDER builder;
+	long long cbSurfaces = 0;
+	int cFailed = 0;
+
+	if(GetPathType(lpszInput) != 1) {
+		fprintf(stderr, "Can't find directory %s\n", lpszInput);
+		return 1;
+	}
+
+	if(!FindBitmaps(lpszInput, "", files, names)) {
+		return 1;
+	}
+
+	if(!CreatePackBuilder(&builder, lpszOutput)) {
+		fprintf(stderr, "Error creating %s\n", lpszOutput);
+		return 1;
+	}
+
+	for(size_t i = 0; i < files.size(); i++) {
+		BITMAPVIEW view;
+		DIBSURFACE surface;
+
+		if(!MapBitmapFile(files[i].c_str(), &view)) {
+			fprintf(stderr, "Error reading %s\n", files[i].c_str());
+			cFailed++;
+			continue;
+		}
+
+		if(!CreateViewDIBSurface(&view, &surface, iFormat)) {
+			fprintf(stderr, "Error decoding %s\n", files[i].c_str());
+			UnmapBitmapFile(&view);
+			cFailed++;
+			continue;
+		}
+
+		UnmapBitmapFile(&view);
+
+		BOOL bAdded = AddPackSurface(&builder, names[i].c_str(), &surface);
+
+		cbSurfaces += (long long)surface.iPitch * surface.cy;
+		FreeDIBSurface(&surface);
+
+		if(!bAdded) {
+			fprintf(stderr, "Error writing %s\n", lpszOutput);
+			FinishPackBuilder(&builder);
+			remove(lpszOutput);
+			return 1;
+		}
+	}
+
+	if(!FinishPackBuilder(&builder)) {
+		fprintf(stderr, "Error writing %s\n", lpszOutput);
+		remove(lpszOutput);
+		return 1;
+	}
+
+	printf("%d surfaces, %d failed, %.1f MB of pixels\n", (int)files.size() - cFailed, cFailed, cbSurfaces / 1048576.0);
+
+	return cFailed ? 1 : 0;
+}
+
+static int BuildPyramidFile(const char* lpszInput, int iFormat, int iFilter)
+{
+	std::string strOutput = std::string(lpszInput) + PYRAMID_EXTENSION;
+	BITMAPVIEW view;
+	DIBSURFACE surface;
+	PYRAMID pyramid;
+	CThreadPool pool;
+
+	if(!MapBitmapFile(lpszInput, &view)) {
+		fprintf(stderr, "Error reading %s\n", lpszInput);
+		return 1;
+	}
+
+	if(!CreateViewDIBSurface(&view, &surface, iFormat)) {
+		fprintf(stderr, "Error decoding %s\n", lpszInput);
+		UnmapBitmapFile(&view);
+		return 1;
+	}
+
+	UnmapBitmapFile(&view);
+
+	if(!BuildPyramid(&pyramid, &surface, iFilter, &pool)) {
+		fprintf(stderr, "Error building the pyramid of %s\n", lpszInput);
+		FreeDIBSurface(&surface);
+		return 1;
+	}
+
+	BOOL bSaved = SavePyramid(&pyramid, strOutput.c_str());
+	int cLevels = pyramid.cLevels;
+	int cTiles = 0;
+
+	for(int i = 1; i < pyramid.cLevels; i++) {
+		cTiles += pyramid.levels[i].cxTiles * pyramid.levels[i].cyTiles;
+	}
+
+	FreePyramid(&pyramid);
+	FreeDIBSurface(&surface);
+
+	if(!bSaved) {
+		fprintf(stderr, "Error writing %s\n", strOutput.c_str());
+		return 1;
+	}
+
+	printf("%d levels, %d tiles in %s\n", cLevels, cTiles, strOutput.c_str());
+
+	return 0;
+}
+
+static int ListPack(const char* lpszPack)
+{
+	SURFACEPACK pack;
+
+	if(!OpenSurfacePack(lpszPack, &pack)) {
+		fprintf(stderr, "Error opening %s\n", lpszPack);
+		return 1;
+	}
+
+	for(int i = 0; i < pack.cEntries; i++) {
+		const PACKENTRY* lpEntry = &pack.lpEntries[i];
+
+		printf("%5d x %-5d %-7s %12llu  %s\n", lpEntry->cx, lpEntry->cy, GetFormatName(lpEntry->iFormat), lpEntry->offBits, GetPackSurfaceName(&pack, i));
+	}
+
+	printf("%d surfaces, %.1f MB\n", pack.cEntries, pack.cbFile / 1048576.0);
+
+	CloseSurfacePack(&pack);
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* lpszInput = NULL;
+	const char* lpszOutput = NULL;
+	const char* lpszList = NULL;
+	const char* lpszPyramid = NULL;
+	int iFormat = DIBFMT_UNKNOWN;
+	int iFilter = PYRAMID_BOX;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			if((iFormat = ParseFormat(argv[++i])) == DIBFMT_UNKNOWN) {
+				fprintf(stderr, "Bad value for -f: %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else
+		if(strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			lpszList = argv[++i];
+		}
+		else
+		if(strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			lpszPyramid = argv[++i];
+		}
+		else
+		if(strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+			if(strcmp(argv[++i], "box") == 0) {
+				iFilter = PYRAMID_BOX;
+			}
+			else
+			if(strcmp(argv[i], "lanczos") == 0) {
+				iFilter = PYRAMID_LANCZOS;
+			}
+			else {
+				fprintf(stderr, "Bad value for -z: %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else
+		if(!lpszInput) {
+			lpszInput = argv[i];
+		}
+		else
+		if(!lpszOutput) {
+			lpszOutput = argv[i];
+		}
+		else {
+			fprintf(stderr, "Too many arguments\n");
+			return 1;
+		}
+	}
+
+	if(lpszList) {
+		return ListPack(lpszList);
+	}
+
+	if(lpszPyramid) {
+		return BuildPyramidFile(lpszPyramid, iFormat, iFilter);
+	}
+
+	if(!lpszInput || !lpszOutput) {
+		fprintf(stderr, "Usage: pack [-f format] input output\n");
+		fprintf(stderr, "       pack -l pack\n");
+		fprintf(stderr, "       pack -p [-f format] [-z filter] bitmap\n");
+		return 1;
+	}
+
+	return BuildPack(lpszInput, lpszOutput, iFormat);
+}
@@ -0,0 +1,1103 @@
+
+// Batch transcoding of bitmap files.
+//
+// Takes every .bmp file in a directory tree, converts it to another pixel
+// format and, if asked, another size, and writes the result to a second
+// directory tree with the same layout. Like the benchmark it doesn't need
+// 'windows.h':
+//
+//   g++ -O2 -std=c++11 -pthread main.cpp -o transcode
+//   ./transcode -f rgb565 -s 50% originals converted
+//
+// Usage: transcode [-f format] [-s size] [-m scale mode] [-c compression]
+//                  [-p palette] [-k cache MB] [-j workers] [-q queue depth]
+//                  [-t trace file] [-v] input output
+//
+//   -f   index8, rgb555, rgb565, bgr24 or xrgb32. Without it every file
+//        keeps its own format. Color converted to index8 gets a color
+//        table as set with -p.
+//   -s   "640x480", "640x0" or "0x480" to keep the aspect ratio, or "50%".
+//   -m   nearest, bilinear or box (the default), see scale.h.
+//   -c   rle8 stores index8 output RLE compressed, see rle.h.
+//   -p   gray uses the grayscale color table 'CreateDIB' builds, optimal
+//        (the default) 256 colors picked for every image, dither the same
+//        with Floyd-Steinberg dithering. See quantize.h.
+//   -k   Keep up to this many MB of transformed images and reuse them for
+//        files with the same contents, see bmpcache.h. Asset trees are
+//        full of copies; each is scaled and quantized only once.
+//   -j   Workers for every stage, or one count per stage: "2,4,4,4,2".
+//        Read and write get 2 by default, the others one per core.
+//   -q   How many files fit in each queue between stages, 4 by default.
+//   -t   Write a Chrome trace of every stage, see tracing.h.
+//   -v   Print the progress every second.
+//
+// Every file goes through five stages, each with its own threads:
+//
+//   read       reads the file into memory
+//   decode     checks the headers and unpacks the pixels into a surface
+//   transform  scales and converts to the output format
+//   encode     builds the output file in memory
+//   write      writes it to disk
+//
+// A file in flight is a JOB, which carries the file and every surface and
+// buffer the stages need. There is a fixed number of them and they go
+// round in a ring of bounded queues: the read stage takes a free job,
+// each stage hands it to the next, and the write stage puts it back on
+// the free queue. So at most that many files are ever in memory, and
+// since a job keeps its buffers, and only makes new surfaces when the
+// image size changes, the memory use stays flat no matter how many files
+// there are.
+//
+// At the end we print, for every stage, how many files went through and
+// how the time of its workers was spent: busy, starved (waiting for the
+// stage before it) or blocked (waiting for room in the queue after it),
+// plus how full each queue was. The stage that is busy while the others
+// are starved or blocked is the one to give more workers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../Common/bmpcache.h"
+#include "../Common/bmpmap.h"
+#include "../Common/bmpwrite.h"
+#include "../Common/dib.h"
+#include "../Common/convert.h"
+#include "../Common/scale.h"
+#include "../Common/rle.h"
+#include "../Common/quantize.h"
+#include "../Common/queue.h"
+#include "../Common/tracing.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define STAGE_READ		0
+#define STAGE_DECODE	1
+#define STAGE_TRANSFORM	2
+#define STAGE_ENCODE	3
+#define STAGE_WRITE		4
+#define STAGES			5
+
+static const char* g_lpszStages[STAGES] = { "read", "decode", "transform", "encode", "write" };
+
+// Color tables for color converted to index8.
+#define PALETTE_GRAY	0
+#define PALETTE_OPTIMAL	1
+#define PALETTE_DITHER	2
+
+typedef struct tagTRANSCODEOPTIONS {
+	int				iFormat;		// DIBFMT_UNKNOWN keeps the format of the file
+	int				cxScale;		// 0 for both means no scaling
+	int				cyScale;
+	int				iPercent;		// Scale by a percentage instead, 0 if not
+	int				iMode;
+	BOOL			bRLE;
+	int				iPalette;
+	int				cWorkers[STAGES];
+	int				cDepth;
+	BOOL			bVerbose;
+	int				cCacheMB;		// 0 for no cache
+} TRANSCODEOPTIONS;
+
+typedef struct tagJOB {
+	int					iFile;
+	std::vector<BYTE>	input;		// The file, only grows
+	size_t				cbInput;
+	DIBSURFACE			src;		// Pixels in the format of the file
+	DIBSURFACE			work;		// Converted before scaling, if needed
+	DIBSURFACE			scaled;
+	DIBSURFACE			dst;		// Converted to the output format
+	const DIBSURFACE*	lpResult;	// Whichever of the above gets encoded
+	BMPCACHEKEY			key;		// Contents of the file, with -k
+	const DIBSURFACE*	lpCached;	// Held from transform until encode is done
+	std::vector<BYTE>	output;		// The output file, only grows
+	size_t				iOutput;	// Where in 'output' the file starts
+	size_t				cbOutput;
+} JOB;
+
+// Per worker state.
+typedef struct tagWORKER {
+	int				iStage;
+	int				iWorker;
+	SCALEPLAN		plan;			// Last plan used, for the transform stage
+	BOOL			bPlan;
+	int				iPlanBytes;
+	QUANTIZER		quant;			// For the transform stage, made the first time it's needed
+	BOOL			bQuant;
+	BITMAPGATHER*	lpGather;		// For the write stage
+} WORKER;
+
+typedef struct tagSTAGE {
+	std::atomic<long long>	cItems;
+	std::atomic<long long>	cbIn;			// Bytes of the files that came in
+	std::atomic<long long>	llBusyNs;
+	std::atomic<int>		cRunning;
+	int						cWorkers;
+} STAGE;
+
+typedef struct tagPIPELINE {
+	TRANSCODEOPTIONS			options;
+	std::vector<std::string>	inputs;
+	std::vector<std::string>	outputs;
+	std::atomic<int>			iNextFile;
+	std::atomic<int>			cFinished;
+	std::atomic<int>			cFailed;
+	STAGE						stages[STAGES];
+	CBitmapCache*				lpCache;		// NULL without -k
+
+	// 'queues[i]' feeds stage 'i'. The read stage takes free jobs from
+	// 'queues[0]', the write stage puts them back there.
+	CBoundedQueue<JOB*>*		queues[STAGES];
+} PIPELINE;
+
+static double GetTimeNs()
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int GetFormatBpp(int iFormat)
+{
+	switch(iFormat) {
+	case DIBFMT_INDEX8:	return 8;
+	case DIBFMT_RGB555:	return 15;
+	case DIBFMT_RGB565:	return 16;
+	case DIBFMT_BGR24:	return 24;
+	case DIBFMT_XRGB32:	return 32;
+	}
+
+	return 0;
+}
+
+// Keeps the surface if it already has this size and format, otherwise
+// makes a new one. The pixels are left as they are.
+static BOOL PrepareSurface(LPDIBSURFACE lpSurface, int cx, int cy, int iFormat)
+{
+	if(lpSurface->lpBmi) {
+		if(lpSurface->cx == cx && lpSurface->cy == cy && lpSurface->iFormat == iFormat) {
+			return TRUE;
+		}
+
+		FreeDIBSurface(lpSurface);
+	}
+
+	if(!CreateDIBSurface(lpSurface, cx, cy, GetFormatBpp(iFormat), DIBALLOC_NOZERO)) {
+		ZeroMemory(lpSurface, sizeof(DIBSURFACE));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void FreeSurface(LPDIBSURFACE lpSurface)
+{
+	if(lpSurface->lpBmi) {
+		FreeDIBSurface(lpSurface);
+	}
+}
+
+// Copies the color table of an 8bpp surface.
+static void CopyColorTable(LPDIBSURFACE lpDst, const RGBQUAD* lpPalette, int iColors)
+{
+	LPBITMAPINFO lpBmi = lpDst->lpBmi;
+
+	ZeroMemory(lpBmi->bmiColors, sizeof(RGBQUAD) * 256);
+	memcpy(lpBmi->bmiColors, lpPalette, sizeof(RGBQUAD) * iColors);
+	lpBmi->bmiHeader.biClrUsed = iColors;
+}
+
+//
+// Finding the files.
+//
+
+static BOOL IsBitmapName(const char* lpszName)
+{
+	size_t cch = strlen(lpszName);
+
+	return cch > 4 && (lpszName[cch - 4] == '.') &&
+		(lpszName[cch - 3] == 'b' || lpszName[cch - 3] == 'B') &&
+		(lpszName[cch - 2] == 'm' || lpszName[cch - 2] == 'M') &&
+		(lpszName[cch - 1] == 'p' || lpszName[cch - 1] == 'P');
+}
+
+static BOOL MakeDirectory(const std::string& strPath)
+{
+#ifdef _WIN32
+	return CreateDirectoryA(strPath.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+	return mkdir(strPath.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Returns 1 for a directory, 0 for a file and -1 if it isn't there.
+static int GetPathType(const std::string& strPath)
+{
+#ifdef _WIN32
+	DWORD dwAttributes = GetFileAttributesA(strPath.c_str());
+
+	if(dwAttributes == INVALID_FILE_ATTRIBUTES) {
+		return -1;
+	}
+
+	return (dwAttributes & FILE_ATTRIBUTE_DIRECTORY) ? 1 : 0;
+#else
+	struct stat st;
+
+	if(stat(strPath.c_str(), &st) != 0) {
+		return -1;
+	}
+
+	return S_ISDIR(st.st_mode) ? 1 : 0;
+#endif
+}
+
+// Adds every bitmap under 'strInput' to the list and makes the matching
+// directories under 'strOutput' as we go.
+static BOOL FindBitmaps(PIPELINE* lpPipeline, const std::string& strInput, const std::string& strOutput)
+{
+	std::vector<std::string> names;
+
+	if(!MakeDirectory(strOutput)) {
+		fprintf(stderr, "Error creating directory %s\n", strOutput.c_str());
+		return FALSE;
+	}
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind = FindFirstFileA((strInput + "\\*").c_str(), &fd);
+
+	if(hFind == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Error reading directory %s\n", strInput.c_str());
+		return FALSE;
+	}
+
+	do {
+		names.push_back(fd.cFileName);
+	} while(FindNextFileA(hFind, &fd));
+
+	FindClose(hFind);
+#else
+	DIR* lpDir = opendir(strInput.c_str());
+	struct dirent* lpEntry;
+
+	if(!lpDir) {
+		fprintf(stderr, "Error reading directory %s\n", strInput.c_str());
+		return FALSE;
+	}
+
+	while((lpEntry = readdir(lpDir)) != NULL) {
+		names.push_back(lpEntry->d_name);
+	}
+
+	closedir(lpDir);
+#endif
+
+	// Same order on every run and every system.
+	std::sort(names.begin(), names.end());
+
+	for(size_t i = 0; i < names.size(); i++) {
+		std::string strIn = strInput + "/" + names[i];
+		std::string strOut = strOutput + "/" + names[i];
+
+		if(names[i] == "." || names[i] == "..") {
+			continue;
+		}
+
+		int iType = GetPathType(strIn);
+
+		if(iType == 1) {
+			if(!FindBitmaps(lpPipeline, strIn, strOut)) {
+				return FALSE;
+			}
+		}
+		else
+		if(iType == 0 && IsBitmapName(names[i].c_str())) {
+			lpPipeline->inputs.push_back(strIn);
+			lpPipeline->outputs.push_back(strOut);
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// The stages. Each one returns FALSE if the file can't be transcoded.
+//
+
+static BOOL ReadBitmap(PIPELINE* lpPipeline, JOB* lpJob, WORKER* lpWorker)
+{
+	const char* lpszFilename = lpPipeline->inputs[lpJob->iFile].c_str();
+	size_t cbFile;
+	BOOL bResult = TRUE;
+
+	(void)lpWorker;
+
+	lpJob->cbInput = 0;
+
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(lpszFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	LARGE_INTEGER llSize;
+
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	if(!GetFileSizeEx(hFile, &llSize) || llSize.QuadPart > 0x7FFFFFFF) {
+		CloseHandle(hFile);
+		return FALSE;
+	}
+
+	cbFile = (size_t)llSize.QuadPart;
+
+	if(lpJob->input.size() < cbFile) {
+		lpJob->input.resize(cbFile);
+	}
+
+	for(size_t cbDone = 0; bResult && cbDone < cbFile; ) {
+		DWORD dwRead;
+
+		if(!ReadFile(hFile, &lpJob->input[cbDone], (DWORD)(cbFile - cbDone), &dwRead, NULL) || dwRead == 0) {
+			bResult = FALSE;
+		}
+
+		cbDone += dwRead;
+	}
+
+	CloseHandle(hFile);
+#else
+	int hFile = open(lpszFilename, O_RDONLY);
+	struct stat st;
+
+	if(hFile < 0) {
+		return FALSE;
+	}
+
+	if(fstat(hFile, &st) != 0) {
+		close(hFile);
+		return FALSE;
+	}
+
+	cbFile = (size_t)st.st_size;
+
+	if(lpJob->input.size() < cbFile) {
+		lpJob->input.resize(cbFile);
+	}
+
+	for(size_t cbDone = 0; bResult && cbDone < cbFile; ) {
+		ssize_t cbRead = read(hFile, &lpJob->input[cbDone], cbFile - cbDone);
+
+		if(cbRead < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(cbRead <= 0) {
+			bResult = FALSE;
+		}
+		else {
+			cbDone += cbRead;
+		}
+	}
+
+	close(hFile);
+#endif
+
+	lpJob->cbInput = cbFile;
+
+	return bResult;
+}
+
+// The headers in the file are only 2-byte aligned, so the format is
+// worked out from the copies the view keeps.
+static int GetViewFormat(const BITMAPVIEW* lpView)
+{
+	struct {
+		BITMAPINFOHEADER	bih;
+		DWORD				dwMasks[3];
+	} info;
+
+	info.bih = lpView->bih;
+	memcpy(info.dwMasks, lpView->dwMasks, sizeof(info.dwMasks));
+
+	return GetDIBFormat((const BITMAPINFO*)&info);
+}
+
+static BOOL DecodeBitmap(PIPELINE* lpPipeline, JOB* lpJob, WORKER* lpWorker)
+{
+	BITMAPVIEW view;
+	int iFormat;
+
+	(void)lpWorker;
+
+	if(!ParseBitmapView(lpJob->input.data(), lpJob->cbInput, &view)) {
+		return FALSE;
+	}
+
+	// The options are the same for every file, so the contents are all
+	// the key needs.
+	if(lpPipeline->lpCache) {
+		GetContentCacheKey(lpJob->input.data(), lpJob->cbInput, lpPipeline->options.iFormat, 0, &lpJob->key);
+	}
+
+	if(view.bih.biCompression == BI_RLE8 || view.bih.biCompression == BI_RLE4) {
+		if(!PrepareSurface(&lpJob->src, view.cx, view.cy, DIBFMT_INDEX8)) {
+			return FALSE;
+		}
+
+		CopyColorTable(&lpJob->src, view.lpPalette, view.iColors);
+
+		return DecodeRLEBitmap(&view, &lpJob->src);
+	}
+
+	if((iFormat = GetViewFormat(&view)) == DIBFMT_UNKNOWN || !PrepareSurface(&lpJob->src, view.cx, view.cy, iFormat)) {
+		return FALSE;
+	}
+
+	if(iFormat == DIBFMT_INDEX8) {
+		CopyColorTable(&lpJob->src, view.lpPalette, view.iColors);
+	}
+
+	for(int y = 0; y < view.cy; y++) {
+		memcpy(lpJob->src.pTop + (size_t)y * lpJob->src.iPitch, GetViewScanline(&view, y), (size_t)view.cx * GetDIBFormatBytes(iFormat));
+	}
+
+	return TRUE;
+}
+
+// Works out the size a file ends up at.
+static void GetScaledSize(const TRANSCODEOPTIONS* lpOptions, int cx, int cy, int* lpcx, int* lpcy)
+{
+	if(lpOptions->iPercent) {
+		*lpcx = (int)((long long)cx * lpOptions->iPercent / 100);
+		*lpcy = (int)((long long)cy * lpOptions->iPercent / 100);
+	}
+	else
+	if(lpOptions->cxScale == 0) {
+		*lpcx = (int)((long long)cx * lpOptions->cyScale / cy);
+		*lpcy = lpOptions->cyScale;
+	}
+	else
+	if(lpOptions->cyScale == 0) {
+		*lpcx = lpOptions->cxScale;
+		*lpcy = (int)((long long)cy * lpOptions->cxScale / cx);
+	}
+	else {
+		*lpcx = lpOptions->cxScale;
+		*lpcy = lpOptions->cyScale;
+	}
+
+	if(*lpcx < 1) *lpcx = 1;
+	if(*lpcy < 1) *lpcy = 1;
+}
+
+// Scales first if the size changes, so the conversion after it only sees
+// the pixels we keep when scaling down. The filtered modes take 8bpp as a
+// gray level, so 8bpp is converted to a color format before those.
+static BOOL TransformSurface(PIPELINE* lpPipeline, JOB* lpJob, WORKER* lpWorker)
+{
+	const TRANSCODEOPTIONS* lpOptions = &lpPipeline->options;
+	const DIBSURFACE* lpSurface = &lpJob->src;
+	int iFormat = lpOptions->iFormat ? lpOptions->iFormat : lpSurface->iFormat;
+
+	if(lpOptions->iPercent || lpOptions->cxScale || lpOptions->cyScale) {
+		int cx, cy;
+
+		GetScaledSize(lpOptions, lpSurface->cx, lpSurface->cy, &cx, &cy);
+
+		if(lpSurface->iFormat == DIBFMT_INDEX8 && lpOptions->iMode != SCALE_NEAREST) {
+			int iWork = iFormat != DIBFMT_INDEX8 ? iFormat : DIBFMT_XRGB32;
+
+			if(!PrepareSurface(&lpJob->work, lpSurface->cx, lpSurface->cy, iWork) || !ConvertDIBSurface(&lpJob->work, lpSurface)) {
+				return FALSE;
+			}
+
+			lpSurface = &lpJob->work;
+		}
+
+		int iBytes = GetDIBFormatBytes(lpSurface->iFormat);
+		LPSCALEPLAN lpPlan = &lpWorker->plan;
+
+		if(!lpWorker->bPlan || lpPlan->cxSrc != lpSurface->cx || lpPlan->cySrc != lpSurface->cy || lpPlan->cxDst != cx || lpPlan->cyDst != cy || lpWorker->iPlanBytes != iBytes) {
+			if(lpWorker->bPlan) {
+				FreeScalePlan(lpPlan);
+			}
+
+			if(!(lpWorker->bPlan = CreateScalePlan(lpPlan, lpSurface->cx, lpSurface->cy, cx, cy, lpOptions->iMode, iBytes))) {
+				return FALSE;
+			}
+
+			lpWorker->iPlanBytes = iBytes;
+		}
+
+		if(!PrepareSurface(&lpJob->scaled, cx, cy, lpSurface->iFormat) || !ScaleDIBSurface(lpPlan, &lpJob->scaled, lpSurface, NULL)) {
+			return FALSE;
+		}
+
+		// Nearest neighbour keeps the indices, and with them the colors.
+		if(lpSurface->iFormat == DIBFMT_INDEX8) {
+			const BITMAPINFOHEADER* lpbih = &lpSurface->lpBmi->bmiHeader;
+
+			CopyColorTable(&lpJob->scaled, lpSurface->lpBmi->bmiColors, lpbih->biClrUsed ? (int)lpbih->biClrUsed : 256);
+		}
+
+		lpSurface = &lpJob->scaled;
+	}
+
+	if(lpSurface->iFormat != iFormat) {
+		if(!PrepareSurface(&lpJob->dst, lpSurface->cx, lpSurface->cy, iFormat)) {
+			return FALSE;
+		}
+
+		// The transform stage already runs one file per worker, so each
+		// worker quantizes on its own thread.
+		if(iFormat == DIBFMT_INDEX8 && lpOptions->iPalette != PALETTE_GRAY) {
+			if(!lpWorker->bQuant && !(lpWorker->bQuant = CreateQuantizer(&lpWorker->quant, NULL))) {
+				return FALSE;
+			}
+
+			if(!BuildQuantizerColors(&lpWorker->quant, lpSurface, 256, NULL) || !QuantizeDIBSurface(&lpJob->dst, lpSurface, &lpWorker->quant, lpOptions->iPalette == PALETTE_DITHER, NULL)) {
+				return FALSE;
+			}
+		}
+		else
+		if(!ConvertDIBSurface(&lpJob->dst, lpSurface)) {
+			return FALSE;
+		}
+
+		lpSurface = &lpJob->dst;
+	}
+
+	lpJob->lpResult = lpSurface;
+
+	return TRUE;
+}
+
+typedef struct tagTRANSFORMLOAD {
+	PIPELINE*	lpPipeline;
+	JOB*		lpJob;
+	WORKER*		lpWorker;
+} TRANSFORMLOAD;
+
+// Transforms the file of the job that missed and keeps a copy of the
+// result. The job's own surfaces get reused for the next file.
+static BOOL TransformLoadProc(LPDIBSURFACE lpSurface, const BMPCACHEKEY* lpKey, void* lpParam)
+{
+	TRANSFORMLOAD* lpLoad = (TRANSFORMLOAD*)lpParam;
+
+	(void)lpKey;
+
+	return TransformSurface(lpLoad->lpPipeline, lpLoad->lpJob, lpLoad->lpWorker) && CloneDIBSurface(lpSurface, lpLoad->lpJob->lpResult);
+}
+
+// With -k a file that has the same contents as one before it gets the
+// result of that one, or waits for it if it is being transformed right
+// now.
+static BOOL TransformBitmap(PIPELINE* lpPipeline, JOB* lpJob, WORKER* lpWorker)
+{
+	TRANSFORMLOAD load;
+
+	if(!lpPipeline->lpCache) {
+		return TransformSurface(lpPipeline, lpJob, lpWorker);
+	}
+
+	load.lpPipeline = lpPipeline;
+	load.lpJob = lpJob;
+	load.lpWorker = lpWorker;
+
+	if((lpJob->lpCached = lpPipeline->lpCache->Acquire(&lpJob->key, TransformLoadProc, &load)) == NULL) {
+		return FALSE;
+	}
+
+	lpJob->lpResult = lpJob->lpCached;
+
+	return TRUE;
+}
+
+// Builds the whole output file in 'output': the headers and then the
+// scanlines bottom-up, or the RLE data.
+static BOOL EncodeBitmap(PIPELINE* lpPipeline, JOB* lpJob, WORKER* lpWorker)
+{
+	const DIBSURFACE* lpSurface = lpJob->lpResult;
+	const BITMAPINFO* lpBmi = lpSurface->lpBmi;
+	BITMAPINFOHEADER bih = lpBmi->bmiHeader;
+	BYTE header[BMP_MAX_HEADER];
+	int iColors = 0;
+	size_t cbBits;
+	DWORD dwHeader;
+
+	(void)lpWorker;
+
+	bih.biHeight = lpSurface->cy;
+
+	if(bih.biBitCount <= 8) {
+		iColors = bih.biClrUsed ? (int)bih.biClrUsed : 256;
+	}
+
+	// The pixels go right behind the space for the biggest header, and the
+	// header we end up with right in front of them.
+	if(lpPipeline->options.bRLE && lpSurface->iFormat == DIBFMT_INDEX8) {
+		cbBits = GetRLEBound(lpSurface->cx, lpSurface->cy);
+
+		if(lpJob->output.size() < BMP_MAX_HEADER + cbBits) {
+			lpJob->output.resize(BMP_MAX_HEADER + cbBits);
+		}
+
+		if((cbBits = EncodeRLE(lpSurface, 8, &lpJob->output[BMP_MAX_HEADER], cbBits)) == 0 || cbBits > 0xFFFFFFFF) {
+			return FALSE;
+		}
+
+		bih.biCompression = BI_RLE8;
+		bih.biSizeImage = (DWORD)cbBits;
+	}
+	else {
+		int iStride = DIB_STRIDE(lpSurface->cx, bih.biBitCount);
+		int iUsed = lpSurface->cx * GetDIBFormatBytes(lpSurface->iFormat);
+
+		cbBits = (size_t)iStride * lpSurface->cy;
+
+		if(cbBits > 0xFFFFFFFF) {
+			return FALSE;
+		}
+
+		if(lpJob->output.size() < BMP_MAX_HEADER + cbBits) {
+			lpJob->output.resize(BMP_MAX_HEADER + cbBits);
+		}
+
+		BYTE* pRow = &lpJob->output[BMP_MAX_HEADER];
+
+		for(int y = lpSurface->cy - 1; y >= 0; y--, pRow += iStride) {
+			memcpy(pRow, lpSurface->pTop + (size_t)y * lpSurface->iPitch, iUsed);
+			ZeroMemory(pRow + iUsed, iStride - iUsed);
+		}
+	}
+
+	if((dwHeader = BuildBitmapHeader(header, &bih, (const DWORD*)lpBmi->bmiColors, lpBmi->bmiColors, iColors)) == 0) {
+		return FALSE;
+	}
+
+	lpJob->iOutput = BMP_MAX_HEADER - dwHeader;
+	lpJob->cbOutput = dwHeader + cbBits;
+	memcpy(&lpJob->output[lpJob->iOutput], header, dwHeader);
+
+	return TRUE;
+}
+
+static BOOL WriteBitmap(PIPELINE* lpPipeline, JOB* lpJob, WORKER* lpWorker)
+{
+	if(!GatherOpen(lpWorker->lpGather, lpPipeline->outputs[lpJob->iFile].c_str(), 1 << 20)) {
+		return FALSE;
+	}
+
+	BOOL bResult = GatherAdd(lpWorker->lpGather, &lpJob->output[lpJob->iOutput], lpJob->cbOutput);
+
+	return GatherClose(lpWorker->lpGather) && bResult;
+}
+
+typedef BOOL (*LPSTAGEPROC)(PIPELINE* lpPipeline, JOB* lpJob, WORKER* lpWorker);
+
+static const LPSTAGEPROC g_lpfnStages[STAGES] = { ReadBitmap, DecodeBitmap, TransformBitmap, EncodeBitmap, WriteBitmap };
+
+//
+// Running the pipeline.
+//
+
+// One worker thread of a stage. Takes jobs from the queue in front of the
+// stage and passes them on to the next one. A job that fails goes straight
+// back to the free queue. The last worker of a stage to finish closes the
+// queue after it, which is how the end ripples down the pipeline.
+static void StageThread(PIPELINE* lpPipeline, int iStage, int iWorker)
+{
+	STAGE* lpStage = &lpPipeline->stages[iStage];
+	CBoundedQueue<JOB*>* lpIn = lpPipeline->queues[iStage];
+	CBoundedQueue<JOB*>* lpOut = lpPipeline->queues[(iStage + 1) % STAGES];
+	WORKER worker;
+	char szName[32];
+	JOB* lpJob;
+
+	ZeroMemory(&worker, sizeof(worker));
+	worker.iStage = iStage;
+	worker.iWorker = iWorker;
+
+	if(iStage == STAGE_WRITE && (worker.lpGather = (BITMAPGATHER*)malloc(sizeof(BITMAPGATHER))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	snprintf(szName, sizeof(szName), "%s %d", g_lpszStages[iStage], iWorker);
+	TraceThreadName(szName);
+
+	for(;;) {
+		int iFile = 0;
+
+		// The read stage first picks a file, then waits for a free job.
+		if(iStage == STAGE_READ) {
+			if((iFile = lpPipeline->iNextFile++) >= (int)lpPipeline->inputs.size()) {
+				break;
+			}
+		}
+
+		if(!lpIn->Pop(lpJob)) {
+			break;
+		}
+
+		if(iStage == STAGE_READ) {
+			lpJob->iFile = iFile;
+		}
+
+		double dStart = GetTimeNs();
+		BOOL bResult;
+
+		{
+			TRACE_SPAN(g_lpszStages[iStage]);
+			bResult = g_lpfnStages[iStage](lpPipeline, lpJob, &worker);
+		}
+
+		// Nothing after encode looks at the surface.
+		if(lpJob->lpCached && (iStage == STAGE_ENCODE || !bResult)) {
+			lpPipeline->lpCache->Release(lpJob->lpCached);
+			lpJob->lpCached = NULL;
+		}
+
+		lpStage->llBusyNs += (long long)(GetTimeNs() - dStart);
+		lpStage->cbIn += (long long)lpJob->cbInput;
+		lpStage->cItems++;
+
+		if(!bResult) {
+			fprintf(stderr, "Error in %s: %s\n", g_lpszStages[iStage], lpPipeline->inputs[lpJob->iFile].c_str());
+			lpPipeline->cFailed++;
+			lpPipeline->cFinished++;
+			lpPipeline->queues[0]->Push(lpJob);
+			continue;
+		}
+
+		if(iStage == STAGE_WRITE) {
+			lpPipeline->cFinished++;
+		}
+
+		lpOut->Push(lpJob);
+	}
+
+	if(worker.bPlan) {
+		FreeScalePlan(&worker.plan);
+	}
+
+	if(worker.bQuant) {
+		FreeQuantizer(&worker.quant);
+	}
+
+	free(worker.lpGather);
+
+	if(--lpStage->cRunning == 0 && iStage != STAGE_WRITE) {
+		lpOut->Close();
+	}
+}
+
+static void PrintProgress(PIPELINE* lpPipeline, double dElapsedNs)
+{
+	fprintf(stderr, "%7.1f s  %d of %d files, %d failed, queues", dElapsedNs * 1e-9, lpPipeline->cFinished.load(), (int)lpPipeline->inputs.size(), lpPipeline->cFailed.load());
+
+	for(int i = 1; i < STAGES; i++) {
+		fprintf(stderr, " %d", lpPipeline->queues[i]->Depth());
+	}
+
+	fprintf(stderr, "\n");
+}
+
+static void PrintReport(PIPELINE* lpPipeline, double dElapsedNs)
+{
+	QUEUESTATS stats[STAGES];
+	double dSeconds = dElapsedNs * 1e-9;
+
+	for(int i = 0; i < STAGES; i++) {
+		lpPipeline->queues[i]->GetStats(&stats[i]);
+	}
+
+	printf("%d files, %d failed, %.2f s, %.1f files/s\n\n", (int)lpPipeline->inputs.size(), lpPipeline->cFailed.load(), dSeconds, lpPipeline->inputs.size() / dSeconds);
+	printf("stage      workers     files   files/s    MB/s   busy %%  starved %%  blocked %%\n");
+
+	for(int i = 0; i < STAGES; i++) {
+		STAGE* lpStage = &lpPipeline->stages[i];
+		double dWorkerNs = dElapsedNs * lpStage->cWorkers;
+
+		// Stage 'i' waits for jobs in 'queues[i]' and for room in the next
+		// one. The write stage never waits for room, its queue holds every
+		// job there is.
+		printf("%-10s %7d %9lld %9.1f %7.1f %8.1f %10.1f %10.1f\n", g_lpszStages[i], lpStage->cWorkers, lpStage->cItems.load(), lpStage->cItems.load() / dSeconds, lpStage->cbIn.load() / dSeconds * 1e-6,
+			100.0 * lpStage->llBusyNs.load() / dWorkerNs, 100.0 * stats[i].dPopWaitNs / dWorkerNs, i != STAGE_WRITE ? 100.0 * stats[i + 1].dPushWaitNs / dWorkerNs : 0.0);
+	}
+
+	printf("\nqueue                capacity   average   max\n");
+
+	for(int i = 1; i < STAGES; i++) {
+		char szName[32];
+
+		snprintf(szName, sizeof(szName), "%s > %s", g_lpszStages[i - 1], g_lpszStages[i]);
+		printf("%-20s %8d %9.2f %5d\n", szName, lpPipeline->queues[i]->Capacity(), stats[i].cPushes ? (double)stats[i].cDepthTotal / stats[i].cPushes : 0.0, stats[i].cMaxDepth);
+	}
+
+	if(lpPipeline->lpCache) {
+		BMPCACHESTATS cache;
+
+		lpPipeline->lpCache->GetStats(&cache);
+		printf("\ncache: %lld hits, %lld misses, %lld waited, %lld evictions, %.1f of %.1f MB at most\n", cache.cHits, cache.cMisses, cache.cWaits, cache.cEvictions, cache.cbPeak / 1048576.0, cache.cbBudget / 1048576.0);
+	}
+}
+
+//
+// Options.
+//
+
+static int ParseFormat(const char* lpszFormat)
+{
+	static const struct { const char* lpszName; int iFormat; } formats[] = {
+		{ "index8", DIBFMT_INDEX8 }, { "rgb555", DIBFMT_RGB555 }, { "rgb565", DIBFMT_RGB565 }, { "bgr24", DIBFMT_BGR24 }, { "xrgb32", DIBFMT_XRGB32 },
+	};
+
+	for(int i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+		if(strcmp(lpszFormat, formats[i].lpszName) == 0) {
+			return formats[i].iFormat;
+		}
+	}
+
+	return DIBFMT_UNKNOWN;
+}
+
+static BOOL ParseSize(const char* lpszSize, TRANSCODEOPTIONS* lpOptions)
+{
+	char chEnd;
+
+	if(sscanf(lpszSize, "%d%c", &lpOptions->iPercent, &chEnd) == 2 && chEnd == '%') {
+		return lpOptions->iPercent > 0;
+	}
+
+	lpOptions->iPercent = 0;
+
+	if(sscanf(lpszSize, "%dx%d", &lpOptions->cxScale, &lpOptions->cyScale) != 2) {
+		return FALSE;
+	}
+
+	return lpOptions->cxScale >= 0 && lpOptions->cyScale >= 0 && (lpOptions->cxScale || lpOptions->cyScale);
+}
+
+static BOOL ParseWorkers(const char* lpszWorkers, TRANSCODEOPTIONS* lpOptions)
+{
+	int c[STAGES];
+	int n = sscanf(lpszWorkers, "%d,%d,%d,%d,%d", &c[0], &c[1], &c[2], &c[3], &c[4]);
+
+	if(n != 1 && n != STAGES) {
+		return FALSE;
+	}
+
+	for(int i = 0; i < STAGES; i++) {
+		lpOptions->cWorkers[i] = n == 1 ? c[0] : c[i];
+
+		if(lpOptions->cWorkers[i] < 1) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+int main(int argc, char* argv[])
+{
+	PIPELINE* lpPipeline = new PIPELINE();
+	TRANSCODEOPTIONS* lpOptions = &lpPipeline->options;
+	const char* lpszInput = NULL;
+	const char* lpszOutput = NULL;
+	const char* lpszTrace = NULL;
+	int cCores = (int)std::thread::hardware_concurrency();
+
+	if(cCores < 1) {
+		cCores = 1;
+	}
+
+	lpOptions->iFormat = DIBFMT_UNKNOWN;
+	lpOptions->iMode = SCALE_BOX;
+	lpOptions->iPalette = PALETTE_OPTIMAL;
+	lpOptions->cDepth = 4;
+	lpOptions->cWorkers[STAGE_READ] = 2;
+	lpOptions->cWorkers[STAGE_DECODE] = cCores;
+	lpOptions->cWorkers[STAGE_TRANSFORM] = cCores;
+	lpOptions->cWorkers[STAGE_ENCODE] = cCores;
+	lpOptions->cWorkers[STAGE_WRITE] = 2;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-v") == 0) {
+			lpOptions->bVerbose = TRUE;
+		}
+		else
+		if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+			const char* lpszValue = argv[++i];
+			BOOL bValid = TRUE;
+
+			switch(argv[i - 1][1]) {
+			case 'f': bValid = (lpOptions->iFormat = ParseFormat(lpszValue)) != DIBFMT_UNKNOWN; break;
+			case 's': bValid = ParseSize(lpszValue, lpOptions); break;
+			case 'c': bValid = lpOptions->bRLE = strcmp(lpszValue, "rle8") == 0; break;
+			case 'j': bValid = ParseWorkers(lpszValue, lpOptions); break;
+			case 'q': bValid = (lpOptions->cDepth = atoi(lpszValue)) > 0; break;
+			case 'k': bValid = (lpOptions->cCacheMB = atoi(lpszValue)) > 0; break;
+			case 't': lpszTrace = lpszValue; break;
+			case 'm':
+				if(strcmp(lpszValue, "nearest") == 0) lpOptions->iMode = SCALE_NEAREST;
+				else if(strcmp(lpszValue, "bilinear") == 0) lpOptions->iMode = SCALE_BILINEAR;
+				else if(strcmp(lpszValue, "box") == 0) lpOptions->iMode = SCALE_BOX;
+				else bValid = FALSE;
+				break;
+			case 'p':
+				if(strcmp(lpszValue, "gray") == 0) lpOptions->iPalette = PALETTE_GRAY;
+				else if(strcmp(lpszValue, "optimal") == 0) lpOptions->iPalette = PALETTE_OPTIMAL;
+				else if(strcmp(lpszValue, "dither") == 0) lpOptions->iPalette = PALETTE_DITHER;
+				else bValid = FALSE;
+				break;
+			default:
+				fprintf(stderr, "Unknown option %s\n", argv[i - 1]);
+				return 1;
+			}
+
+			if(!bValid) {
+				fprintf(stderr, "Bad value for %s: %s\n", argv[i - 1], lpszValue);
+				return 1;
+			}
+		}
+		else
+		if(!lpszInput) {
+			lpszInput = argv[i];
+		}
+		else
+		if(!lpszOutput) {
+			lpszOutput = argv[i];
+		}
+		else {
+			fprintf(stderr, "Too many arguments\n");
+			return 1;
+		}
+	}
+
+	if(!lpszInput || !lpszOutput) {
+		fprintf(stderr, "Usage: transcode [-f format] [-s size] [-m scale mode] [-c compression]\n");
+		fprintf(stderr, "                 [-p palette] [-k cache MB] [-j workers] [-q queue depth]\n");
+		fprintf(stderr, "                 [-t trace file] [-v] input output\n");
+		return 1;
+	}
+
+	// A single file goes to a single file.
+	switch(GetPathType(lpszInput)) {
+	case 1:
+		if(!FindBitmaps(lpPipeline, lpszInput, lpszOutput)) {
+			return 1;
+		}
+		break;
+
+	case 0:
+		lpPipeline->inputs.push_back(lpszInput);
+		lpPipeline->outputs.push_back(lpszOutput);
+		break;
+
+	default:
+		fprintf(stderr, "Can't find %s\n", lpszInput);
+		return 1;
+	}
+
+	if(lpszTrace && !TraceStart(lpszTrace)) {
+		fprintf(stderr, "Error creating trace file %s\n", lpszTrace);
+		return 1;
+	}
+
+	TraceThreadName("main");
+
+	// Enough jobs to fill every queue and keep every worker busy, and not
+	// one more: this is what bounds the memory.
+	int cJobs = 0;
+
+	for(int i = 0; i < STAGES; i++) {
+		cJobs += lpOptions->cWorkers[i];
+	}
+
+	cJobs += lpOptions->cDepth * (STAGES - 1);
+
+	std::vector<JOB> jobs(cJobs);
+
+	if(lpOptions->cCacheMB) {
+		lpPipeline->lpCache = new CBitmapCache((size_t)lpOptions->cCacheMB << 20);
+	}
+
+	lpPipeline->queues[0] = new CBoundedQueue<JOB*>(cJobs);
+
+	for(int i = 1; i < STAGES; i++) {
+		lpPipeline->queues[i] = new CBoundedQueue<JOB*>(lpOptions->cDepth);
+	}
+
+	for(int i = 0; i < cJobs; i++) {
+		ZeroMemory(&jobs[i].src, sizeof(DIBSURFACE));
+		ZeroMemory(&jobs[i].work, sizeof(DIBSURFACE));
+		ZeroMemory(&jobs[i].scaled, sizeof(DIBSURFACE));
+		ZeroMemory(&jobs[i].dst, sizeof(DIBSURFACE));
+		jobs[i].cbInput = 0;
+		jobs[i].lpCached = NULL;
+		lpPipeline->queues[0]->Push(&jobs[i]);
+	}
+
+	std::vector<std::thread> threads;
+	double dStart = GetTimeNs();
+
+	for(int i = 0; i < STAGES; i++) {
+		lpPipeline->stages[i].cWorkers = lpOptions->cWorkers[i];
+		lpPipeline->stages[i].cRunning = lpOptions->cWorkers[i];
+
+		for(int j = 0; j < lpOptions->cWorkers[i]; j++) {
+			threads.push_back(std::thread(StageThread, lpPipeline, i, j));
+		}
+	}
+
+	if(lpOptions->bVerbose) {
+		double dNext = dStart + 1e9;
+
+		while(lpPipeline->cFinished.load() < (int)lpPipeline->inputs.size()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+			if(GetTimeNs() >= dNext) {
+				PrintProgress(lpPipeline, GetTimeNs() - dStart);
+				dNext += 1e9;
+			}
+		}
+	}
+
+	for(size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+
+	PrintReport(lpPipeline, GetTimeNs() - dStart);
+
+	for(int i = 0; i < cJobs; i++) {
+		FreeSurface(&jobs[i].src);
+		FreeSurface(&jobs[i].work);
+		FreeSurface(&jobs[i].scaled);
+		FreeSurface(&jobs[i].dst);
+	}
+
+	for(int i = 0; i < STAGES; i++) {
+		delete lpPipeline->queues[i];
+	}
+
+	delete lpPipeline->lpCache;
+
+	int iResult = lpPipeline->cFailed.load() ? 1 : 0;
+
+	delete lpPipeline;
+
+	TraceStop();
+
+	return iResult;
+}